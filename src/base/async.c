@@ -30,6 +30,15 @@
 #include <sys/syscall.h>
 #include <sys/uio.h>
 
+/* The positional I/O calls are named differently on some systems. */
+#ifdef SYS_pread64
+# define MM_SYS_PREAD	SYS_pread64
+# define MM_SYS_PWRITE	SYS_pwrite64
+#else
+# define MM_SYS_PREAD	SYS_pread
+# define MM_SYS_PWRITE	SYS_pwrite
+#endif
+
 /**********************************************************************
  * Asynchronous procedure call execution.
  **********************************************************************/
@@ -67,7 +76,9 @@ mm_async_handle_calls(struct mm_context *context)
 	// Execute requests.
 	struct mm_async_pack pack;
 	if (mm_async_receive(context, &pack)) {
-		// Enter the state that forbids a recursive fiber switch.
+		// Enter the state that forbids a recursive fiber switch. A call
+		// that yields gets here recursively and must not leave it.
+		const bool nested = (context->status == MM_CONTEXT_PENDING);
 		context->status = MM_CONTEXT_PENDING;
 
 		do {
@@ -78,7 +89,8 @@ mm_async_handle_calls(struct mm_context *context)
 		} while (mm_async_receive(context, &pack));
 
 		// Restore normal running state.
-		context->status = MM_CONTEXT_RUNNING;
+		if (!nested)
+			context->status = MM_CONTEXT_RUNNING;
 	}
 
 	LEAVE();
@@ -446,7 +458,6 @@ mm_async_syscall_3_handler(struct mm_context *context UNUSED, uintptr_t *argumen
 	mm_async_syscall_result(node, result);
 }
 
-#if 0
 static void
 mm_async_syscall_4_handler(struct mm_context *context UNUSED, uintptr_t *arguments)
 {
@@ -462,7 +473,6 @@ mm_async_syscall_4_handler(struct mm_context *context UNUSED, uintptr_t *argumen
 	struct mm_async_node *node = (struct mm_async_node *) arguments[0];
 	mm_async_syscall_result(node, result);
 }
-#endif
 
 /**********************************************************************
  * Asynchronous call helpers.
@@ -582,7 +592,6 @@ mm_async_syscall_3(const char *name, int n, uintptr_t a1, uintptr_t a2, uintptr_
 	return result;
 }
 
-#if 0
 static intptr_t NONNULL(1)
 mm_async_syscall_4(const char *name, int n, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4)
 {
@@ -604,7 +613,6 @@ mm_async_syscall_4(const char *name, int n, uintptr_t a1, uintptr_t a2, uintptr_
 	LEAVE();
 	return result;
 }
-#endif
 
 /**********************************************************************
  * Asynchronous system call routines.
@@ -634,6 +642,24 @@ mm_async_writev(int fd, const struct iovec *iov, int iovcnt)
 	return mm_async_syscall_3("writev", MM_SYSCALL_N(SYS_writev), fd, (uintptr_t) iov, iovcnt);
 }
 
+inline ssize_t
+mm_async_pread(int fd, void *buffer, size_t nbytes, off_t offset)
+{
+	return mm_async_syscall_4("pread", MM_SYSCALL_N(MM_SYS_PREAD), fd, (uintptr_t) buffer, nbytes, offset);
+}
+
+inline ssize_t
+mm_async_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset)
+{
+	return mm_async_syscall_4("pwrite", MM_SYSCALL_N(MM_SYS_PWRITE), fd, (uintptr_t) buffer, nbytes, offset);
+}
+
+inline ssize_t
+mm_async_fsync(int fd)
+{
+	return mm_async_syscall_1("fsync", MM_SYSCALL_N(SYS_fsync), fd);
+}
+
 inline ssize_t
 mm_async_close(int fd)
 {
@@ -144,6 +144,15 @@ mm_async_write(int fd, const void *buffer, size_t nbytes);
 ssize_t
 mm_async_writev(int fd, const struct iovec *iov, int iovcnt);
 
+ssize_t
+mm_async_pread(int fd, void *buffer, size_t nbytes, off_t offset);
+
+ssize_t
+mm_async_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset);
+
+ssize_t
+mm_async_fsync(int fd);
+
 ssize_t
 mm_async_close(int fd);
 
@@ -0,0 +1,233 @@
+/*
+ * base/compress.c - MainMemory fast data compression.
+ *
+ * Copyright (C) 2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "base/compress.h"
+#include "base/bytes.h"
+
+/*
+ * A block is a sequence of literal runs each followed by a match but
+ * the last one. A run starts with a token byte that has the literal
+ * count in the high half and the match length less the minimum in the
+ * low half. Either count that does not fit the half goes on in extra
+ * bytes of 255 each and a final smaller one. The match is given by a
+ * 16-bit back offset.
+ */
+
+#define MM_COMPRESS_MIN_MATCH		4
+#define MM_COMPRESS_MAX_OFFSET		65535
+
+/* The block end is always left to literals so that the decoder might
+   be simple. */
+#define MM_COMPRESS_LAST_LITERALS	5
+#define MM_COMPRESS_MATCH_LIMIT		12
+
+/* The number of misses before the search starts skipping data that
+   does not seem to compress. */
+#define MM_COMPRESS_SKIP_SHIFT		6
+
+/**********************************************************************
+ * Compression.
+ **********************************************************************/
+
+static inline uint32_t
+mm_compress_hash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - MM_COMPRESS_TABLE_BITS);
+}
+
+static inline uint8_t *
+mm_compress_put_length(uint8_t *op, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = length;
+	return op;
+}
+
+static inline uint8_t *
+mm_compress_put_literals(uint8_t *op, const uint8_t *literals, size_t length)
+{
+	uint8_t *token = op++;
+	if (length < 15) {
+		*token = length << 4;
+	} else {
+		*token = 15 << 4;
+		op = mm_compress_put_length(op, length - 15);
+	}
+	memcpy(op, literals, length);
+	return op + length;
+}
+
+static inline uint8_t *
+mm_compress_put_match(uint8_t *op, uint8_t *token, size_t offset, size_t length)
+{
+	*op++ = offset;
+	*op++ = offset >> 8;
+	if (length < 15) {
+		*token |= length;
+	} else {
+		*token |= 15;
+		op = mm_compress_put_length(op, length - 15);
+	}
+	return op;
+}
+
+size_t NONNULL(1, 3, 5)
+mm_compress(void *restrict dst, size_t dst_size, const void *restrict src, size_t src_size,
+	    struct mm_compress_table *table)
+{
+	const uint8_t *const base = src;
+	const uint8_t *const end = base + src_size;
+	const uint8_t *anchor = base;
+	uint8_t *op = dst;
+	uint8_t *const op_end = op + dst_size;
+
+	// The slots keep positions plus one, zero if none.
+	memset(table->slots, 0, sizeof table->slots);
+
+	if (src_size > MM_COMPRESS_MATCH_LIMIT) {
+		const uint8_t *const match_limit = end - MM_COMPRESS_MATCH_LIMIT;
+		const uint8_t *const copy_limit = end - MM_COMPRESS_LAST_LITERALS;
+
+		const uint8_t *ip = base;
+		uint32_t misses = 0;
+		while (ip < match_limit) {
+			uint32_t sequence = mm_load_h32(ip);
+			uint32_t *slot = &table->slots[mm_compress_hash(sequence)];
+			uint32_t pos = ip - base + 1;
+			uint32_t ref_pos = *slot;
+			*slot = pos;
+			if (ref_pos == 0 || (pos - ref_pos) > MM_COMPRESS_MAX_OFFSET
+			    || mm_load_h32(base + ref_pos - 1) != sequence) {
+				ip += 1 + (misses++ >> MM_COMPRESS_SKIP_SHIFT);
+				continue;
+			}
+			misses = 0;
+
+			// Extend the match both ways.
+			const uint8_t *ref = base + ref_pos - 1;
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *match_end = ip + MM_COMPRESS_MIN_MATCH;
+			ref += MM_COMPRESS_MIN_MATCH;
+			while (match_end < copy_limit && *match_end == *ref) {
+				match_end++;
+				ref++;
+			}
+
+			size_t literals = ip - anchor;
+			size_t length = match_end - ip - MM_COMPRESS_MIN_MATCH;
+			size_t room = 1 + literals / 255 + 1 + literals + 2 + length / 255 + 1;
+			if ((size_t) (op_end - op) < room)
+				return 0;
+
+			uint8_t *token = op;
+			op = mm_compress_put_literals(op, anchor, literals);
+			op = mm_compress_put_match(op, token, match_end - ref, length);
+			anchor = ip = match_end;
+
+			// Remember a position in the match just done as the data
+			// that follows is likely to repeat it.
+			if (ip < match_limit)
+				table->slots[mm_compress_hash(mm_load_h32(ip - 2))] = ip - 2 - base + 1;
+		}
+	}
+
+	size_t literals = end - anchor;
+	if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals)
+		return 0;
+	op = mm_compress_put_literals(op, anchor, literals);
+
+	return op - (uint8_t *) dst;
+}
+
+/**********************************************************************
+ * Decompression.
+ **********************************************************************/
+
+static inline bool
+mm_decompress_get_length(const uint8_t **ipp, const uint8_t *end, size_t *length)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t byte;
+	do {
+		if (ip == end)
+			return false;
+		byte = *ip++;
+		*length += byte;
+	} while (byte == 255);
+	*ipp = ip;
+	return true;
+}
+
+bool NONNULL(1, 3)
+mm_decompress(void *restrict dst, size_t dst_size, const void *restrict src, size_t src_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *const end = ip + src_size;
+	uint8_t *op = dst;
+	uint8_t *const op_end = op + dst_size;
+
+	for (;;) {
+		if (ip == end)
+			return false;
+		uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15 && !mm_decompress_get_length(&ip, end, &literals))
+			return false;
+		if ((size_t) (end - ip) < literals || (size_t) (op_end - op) < literals)
+			return false;
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+
+		// The last run has no match.
+		if (ip == end)
+			break;
+
+		if ((end - ip) < 2)
+			return false;
+		size_t offset = mm_load_le16(ip);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - (uint8_t *) dst))
+			return false;
+
+		size_t length = token & 15;
+		if (length == 15 && !mm_decompress_get_length(&ip, end, &length))
+			return false;
+		length += MM_COMPRESS_MIN_MATCH;
+		if ((size_t) (op_end - op) < length)
+			return false;
+
+		// A match might overlap the data it produces.
+		const uint8_t *ref = op - offset;
+		if (offset >= length) {
+			memcpy(op, ref, length);
+			op += length;
+		} else {
+			while (length--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op == op_end;
+}
@@ -0,0 +1,61 @@
+/*
+ * base/compress.h - MainMemory fast data compression.
+ *
+ * Copyright (C) 2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BASE_COMPRESS_H
+#define BASE_COMPRESS_H
+
+#include "common.h"
+
+/*
+ * A byte-oriented LZ77 block codec that follows the LZ4 block format.
+ * It trades the compression ratio for speed: a single hash probe per
+ * position, no entropy coding. A block is compressed and decompressed
+ * whole, the caller keeps the original size.
+ */
+
+/* The number of match table slots. */
+#define MM_COMPRESS_TABLE_BITS	(12)
+#define MM_COMPRESS_TABLE_SIZE	(1u << MM_COMPRESS_TABLE_BITS)
+
+/* The match table to compress with. It is not kept between calls but
+   it is too large for fiber stacks. */
+struct mm_compress_table
+{
+	uint32_t slots[MM_COMPRESS_TABLE_SIZE];
+};
+
+/* The largest compressed size for the given data size. */
+static inline size_t
+mm_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/* Compress a data block. Returns the compressed size or zero if it does
+   not fit the given room. */
+size_t NONNULL(1, 3, 5)
+mm_compress(void *restrict dst, size_t dst_size, const void *restrict src, size_t src_size,
+	    struct mm_compress_table *table);
+
+/* Decompress a data block. It fails unless the data is well-formed and
+   decompresses to exactly the given size. */
+bool NONNULL(1, 3)
+mm_decompress(void *restrict dst, size_t dst_size, const void *restrict src, size_t src_size);
+
+#endif /* BASE_COMPRESS_H */
@@ -194,6 +194,7 @@ mm_event_prepare_fd(struct mm_event_fd *sink, int fd, uint32_t flags, const stru
 	sink->task_stamp = 0;
 	sink->tasks = tasks;
 	sink->context = NULL;
+	sink->steer_context = NULL;
 	sink->input_fiber = NULL;
 	sink->output_fiber = NULL;
 	sink->destroy = destroy;
@@ -113,6 +113,9 @@ struct mm_event_fd
 
 	/* The context assigned to execute tasks. */
 	struct mm_context *context;
+	/* The context to assign when the sink is idle, if NULL then the
+	   context that polls the sink is assigned. */
+	struct mm_context *steer_context;
 
 	/* Fibers bound to perform I/O. */
 	struct mm_fiber *input_fiber;
@@ -262,6 +265,14 @@ mm_event_instant_io(void);
 void NONNULL(1, 4, 5)
 mm_event_prepare_fd(struct mm_event_fd *sink, int fd, uint32_t flags, const struct mm_event_io *tasks, void (*destroy)(struct mm_event_fd *));
 
+/* Prefer a context to execute the sink tasks. The sink moves there as
+   soon as it is found idle. */
+static inline void NONNULL(1)
+mm_event_steer_fd(struct mm_event_fd *sink, struct mm_context *context)
+{
+	mm_memory_store(sink->steer_context, context);
+}
+
 void NONNULL(1, 2)
 mm_event_register_fd(struct mm_event_fd *sink, struct mm_context *context);
 
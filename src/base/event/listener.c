@@ -75,8 +75,9 @@ mm_event_test_binding(struct mm_event_listener *listener, struct mm_event_fd *si
 	if (mm_event_active(sink))
 		return;
 
-	// Attach the sink to the poller.
-	sink->context = listener->context;
+	// Attach the sink to the poller unless another context is preferred.
+	struct mm_context *steer_context = mm_memory_load(sink->steer_context);
+	sink->context = steer_context != NULL ? steer_context : listener->context;
 }
 
 #endif
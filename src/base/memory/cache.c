@@ -473,6 +473,48 @@ mm_memory_prepare_heap(struct mm_memory_heap *const heap)
 	mm_memory_split_chunk(heap, 0, MM_MEMORY_CACHE_SIZES, MM_MEMORY_BLOCK_SIZES);
 }
 
+/* Move the active heap to the staging list and note the ranks of blocks
+   it has free chunks in. */
+static void
+mm_memory_cache_stage_active(struct mm_memory_cache *const cache)
+{
+	struct mm_memory_heap *const heap = cache->active;
+	heap->status = MM_MEMORY_HEAP_STAGING;
+	mm_list_insert(&cache->staging, &heap->staging_link);
+	for (uint32_t rank = 0; rank < MM_MEMORY_BLOCK_SIZES; rank++) {
+		if (heap->blocks[rank] != NULL)
+			cache->staging_blocks |= (uint64_t) 1 << rank;
+	}
+}
+
+/* Make active a staging heap that has free chunks in blocks of the given
+   rank. Otherwise the chunks freed in staging heaps would only be used
+   again when a large chunk happens to be found in the same heap. */
+static bool
+mm_memory_cache_activate_blocks(struct mm_memory_cache *const cache, const uint32_t rank)
+{
+	const uint64_t mask = (uint64_t) 1 << rank;
+	if ((cache->staging_blocks & mask) == 0)
+		return false;
+
+	struct mm_link *link = mm_list_head(&cache->staging);
+	while (link != mm_list_stub(&cache->staging)) {
+		struct mm_memory_heap *next = containerof(link, struct mm_memory_heap, staging_link);
+		if (next->blocks[rank] != NULL) {
+			next->status = MM_MEMORY_HEAP_ACTIVE;
+			mm_list_delete(link);
+			mm_memory_cache_stage_active(cache);
+			cache->active = next;
+			return true;
+		}
+		link = link->next;
+	}
+
+	// No staging heap has such blocks any more.
+	cache->staging_blocks &= ~mask;
+	return false;
+}
+
 static void *
 mm_memory_alloc_large(struct mm_memory_cache *const cache, const uint32_t required_rank, bool block)
 {
@@ -513,8 +555,7 @@ mm_memory_alloc_large(struct mm_memory_cache *const cache, const uint32_t requir
 			ASSERT(original_rank < MM_MEMORY_CACHE_SIZES);
 		}
 
-		cache->active->status = MM_MEMORY_HEAP_STAGING;
-		mm_list_insert(&cache->staging, &cache->active->staging_link);
+		mm_memory_cache_stage_active(cache);
 		cache->active = heap;
 	}
 
@@ -588,6 +629,14 @@ mm_memory_alloc_block(struct mm_memory_cache *const cache, const uint32_t rank)
 	return block;
 }
 
+/* Note that a staging heap has got free chunks in blocks of a rank. */
+static inline void
+mm_memory_cache_stage_block(struct mm_memory_heap *const heap, const uint32_t rank)
+{
+	if (heap->status == MM_MEMORY_HEAP_STAGING)
+		heap->base.cache->staging_blocks |= (uint64_t) 1 << rank;
+}
+
 static void
 mm_memory_cache_free_chunk(struct mm_memory_heap *const heap, void *const ptr)
 {
@@ -619,6 +668,7 @@ mm_memory_cache_free_chunk(struct mm_memory_heap *const heap, void *const ptr)
 		if (block->chunk_free == 0) {
 			block->next = heap->blocks[medium_rank];
 			heap->blocks[medium_rank] = block;
+			mm_memory_cache_stage_block(heap, medium_rank);
 		}
 		block->chunk_free |= mask;
 		return;
@@ -638,12 +688,14 @@ mm_memory_cache_free_chunk(struct mm_memory_heap *const heap, void *const ptr)
 		if (block->inner_free == 0) {
 			block->inner_next = heap->blocks[small_rank];
 			heap->blocks[small_rank] = block;
+			mm_memory_cache_stage_block(heap, small_rank);
 		}
 		block->inner_free |= mask;
 	} else {
 		if (block->chunk_free == 0) {
 			block->next = heap->blocks[medium_rank];
 			heap->blocks[medium_rank] = block;
+			mm_memory_cache_stage_block(heap, medium_rank);
 		}
 		block->chunk_free |= mask;
 
@@ -681,14 +733,45 @@ void NONNULL(1)
 mm_memory_cache_prepare(struct mm_memory_cache *const cache, struct mm_context *context)
 {
 	cache->context = context;
+	cache->source = NULL;
+	cache->footprint = 0;
 
 	mm_list_prepare(&cache->staging);
+	cache->staging_blocks = 0;
 
 	cache->active = (struct mm_memory_heap *) mm_memory_span_create_heap(cache);
 	MEMORY_VERIFY(cache->active, "failed to create an initial memory span");
 	mm_memory_prepare_heap(cache->active);
 }
 
+void NONNULL(1, 3)
+mm_memory_cache_prepare_source(struct mm_memory_cache *const cache, struct mm_context *context,
+			       struct mm_memory_span_source *source)
+{
+	cache->context = context;
+	cache->source = source;
+	cache->footprint = 0;
+
+	mm_list_prepare(&cache->staging);
+	cache->staging_blocks = 0;
+
+	cache->active = (struct mm_memory_heap *) mm_memory_span_create_heap(cache);
+	MEMORY_VERIFY(cache->active, "failed to create an initial memory span");
+	mm_memory_prepare_heap(cache->active);
+}
+
+/* Take over a cache that was set up by another process in a shared memory
+   mapped at the same address. Such a cache has no execution context. */
+void NONNULL(1, 2)
+mm_memory_cache_reattach(struct mm_memory_cache *const cache, struct mm_memory_span_source *source)
+{
+	VERIFY(cache->context == NULL);
+	cache->source = source;
+
+	// The spans of the previous process now count for this one.
+	mm_memory_span_adopt(cache);
+}
+
 void NONNULL(1)
 mm_memory_cache_cleanup(struct mm_memory_cache *const cache)
 {
@@ -735,6 +818,8 @@ mm_memory_cache_alloc(struct mm_memory_cache *const cache, const size_t size)
 
 		// Use a cached block if any.
 		struct mm_memory_block *block = cache->active->blocks[rank];
+		if (block == NULL && mm_memory_cache_activate_blocks(cache, rank))
+			block = cache->active->blocks[rank];
 		if (block != NULL) {
 			ASSERT(block->chunk_free);
 			const uint32_t shift = mm_ctz(block->chunk_free);
@@ -758,6 +843,10 @@ mm_memory_cache_alloc(struct mm_memory_cache *const cache, const size_t size)
 		// Use a cached inner block if any.
 		struct mm_memory_block *block = cache->active->blocks[rank];
 		const uint32_t medium_rank = rank + MM_MEMORY_SMALL_TO_MEDIUM;
+		if (block == NULL && cache->active->blocks[medium_rank] == NULL
+		    && (mm_memory_cache_activate_blocks(cache, rank)
+			|| mm_memory_cache_activate_blocks(cache, medium_rank)))
+			block = cache->active->blocks[rank];
 		if (block != NULL) {
 			ASSERT(block->inner_free);
 			const uint32_t shift = mm_ctz(block->inner_free);
@@ -996,3 +1085,15 @@ mm_memory_cache_chunk_size(const void *const ptr)
 	// Handle a small chunk.
 	return mm_memory_sizes[medium_rank - MM_MEMORY_SMALL_TO_MEDIUM];
 }
+
+size_t
+mm_memory_cache_round_size(const size_t size)
+{
+	const uint32_t rank = mm_memory_get_rank(size);
+	if (rank < MM_MEMORY_CACHE_SIZES)
+		return mm_memory_sizes[rank];
+
+	// Handle a huge chunk.
+	return mm_round_up(sizeof(union mm_memory_span_huge) + size, MM_PAGE_SIZE)
+		- sizeof(union mm_memory_span_huge);
+}
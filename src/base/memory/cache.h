@@ -21,10 +21,12 @@
 #define BASE_MEMORY_CACHE_H
 
 #include "common.h"
+#include "base/atomic.h"
 #include "base/list.h"
 
 /* Forward declaration. */
 struct mm_memory_span;
+struct mm_memory_span_source;
 
 /*
  * A memory allocation cache.
@@ -36,14 +38,29 @@ struct mm_memory_cache
 
 	/* The inactive spans to gather freed memory. */
 	struct mm_list staging;
+	/* The block ranks that inactive spans might have free chunks of. */
+	uint64_t staging_blocks;
 
 	/* The execution context the cache belongs to. */
 	struct mm_context *context;
+
+	/* The source of span memory, NULL for anonymous mmap() calls. */
+	struct mm_memory_span_source *source;
+
+	/* The memory taken by the spans of the cache. */
+	mm_atomic_uintptr_t footprint;
 };
 
 void NONNULL(1)
 mm_memory_cache_prepare(struct mm_memory_cache *cache, struct mm_context *context);
 
+void NONNULL(1, 3)
+mm_memory_cache_prepare_source(struct mm_memory_cache *cache, struct mm_context *context,
+			       struct mm_memory_span_source *source);
+
+void NONNULL(1, 2)
+mm_memory_cache_reattach(struct mm_memory_cache *cache, struct mm_memory_span_source *source);
+
 void NONNULL(1)
 mm_memory_cache_cleanup(struct mm_memory_cache *cache);
 
@@ -74,4 +91,14 @@ mm_memory_cache_remote_free(struct mm_memory_span *span, void *ptr);
 size_t
 mm_memory_cache_chunk_size(const void *ptr);
 
+/* The chunk size that a request of the given size would get. */
+size_t
+mm_memory_cache_round_size(size_t size);
+
+static inline size_t NONNULL(1)
+mm_memory_cache_footprint(struct mm_memory_cache *cache)
+{
+	return mm_memory_load(cache->footprint);
+}
+
 #endif /* BASE_MEMORY_CACHE_H */
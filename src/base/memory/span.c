@@ -25,6 +25,16 @@
 
 #include <sys/mman.h>
 
+// The memory taken by all the spans.
+static mm_atomic_uintptr_t mm_memory_span_total;
+
+static void
+mm_memory_span_account(struct mm_memory_cache *const cache, const size_t size)
+{
+	mm_atomic_uintptr_fetch_and_add(&cache->footprint, size);
+	mm_atomic_uintptr_fetch_and_add(&mm_memory_span_total, size);
+}
+
 static void
 mm_memory_free_space(void *const addr, const size_t size)
 {
@@ -67,16 +77,27 @@ mm_memory_alloc_space(const size_t size, const size_t addr_mask)
 	return addr;
 }
 
+static void *
+mm_memory_alloc_span_space(struct mm_memory_cache *const cache, const size_t size)
+{
+	struct mm_memory_span_source *const source = cache->source;
+	if (source != NULL)
+		return (source->alloc)(source, size, MM_MEMORY_SPAN_ALIGNMENT_MASK);
+	return mm_memory_alloc_space(size, MM_MEMORY_SPAN_ALIGNMENT_MASK);
+}
+
 struct mm_memory_span * NONNULL(1)
 mm_memory_span_create_heap(struct mm_memory_cache *const cache)
 {
-	struct mm_memory_span *span = mm_memory_alloc_space(MM_MEMORY_SPAN_HEAP_SIZE, MM_MEMORY_SPAN_ALIGNMENT_MASK);
+	struct mm_memory_span *span = mm_memory_alloc_span_space(cache, MM_MEMORY_SPAN_HEAP_SIZE);
 	if (likely(span != NULL)) {
 		span->tag_or_size = MM_MEMORY_SPAN_HEAP_TAG;
 		span->virtual_size = MM_MEMORY_SPAN_HEAP_SIZE;
 
 		span->cache = cache;
 		span->context = cache->context;
+
+		mm_memory_span_account(cache, MM_MEMORY_SPAN_HEAP_SIZE);
 	}
 	return span;
 }
@@ -91,13 +112,15 @@ mm_memory_span_create_huge(struct mm_memory_cache *const cache, const size_t siz
 		return NULL;
 	}
 
-	struct mm_memory_span *span = mm_memory_alloc_space(total_size, MM_MEMORY_SPAN_ALIGNMENT_MASK);
+	struct mm_memory_span *span = mm_memory_alloc_span_space(cache, total_size);
 	if (likely(span != NULL)) {
 		span->tag_or_size = total_size - sizeof(union mm_memory_span_huge);
 		span->virtual_size = total_size;
 
 		span->cache = cache;
 		span->context = cache->context;
+
+		mm_memory_span_account(cache, total_size);
 	}
 	return span;
 }
@@ -105,5 +128,22 @@ mm_memory_span_create_huge(struct mm_memory_cache *const cache, const size_t siz
 void NONNULL(1)
 mm_memory_span_destroy(struct mm_memory_span *const span)
 {
-	mm_memory_free_space(span, mm_memory_span_virtual_size(span));
+	struct mm_memory_span_source *const source = span->cache->source;
+	mm_memory_span_account(span->cache, -mm_memory_span_virtual_size(span));
+	if (source != NULL)
+		(source->free)(source, span, mm_memory_span_virtual_size(span));
+	else
+		mm_memory_free_space(span, mm_memory_span_virtual_size(span));
+}
+
+void NONNULL(1)
+mm_memory_span_adopt(struct mm_memory_cache *const cache)
+{
+	mm_atomic_uintptr_fetch_and_add(&mm_memory_span_total, mm_memory_cache_footprint(cache));
+}
+
+size_t
+mm_memory_span_footprint(void)
+{
+	return mm_memory_load(mm_memory_span_total);
 }
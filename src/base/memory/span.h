@@ -48,6 +48,14 @@
 /* The token value that tags heap spans. */
 #define MM_MEMORY_SPAN_HEAP_TAG		((size_t) 0)
 
+/* A source of span memory other than anonymous mmap() calls. The memory
+   it gives out must be aligned as requested and filled with zeros. */
+struct mm_memory_span_source
+{
+	void * (*alloc)(struct mm_memory_span_source *source, size_t size, size_t addr_mask);
+	void (*free)(struct mm_memory_span_source *source, void *addr, size_t size);
+};
+
 /* Span descriptor. */
 struct mm_memory_span
 {
@@ -121,4 +129,12 @@ mm_memory_span_create_huge(struct mm_memory_cache *cache, size_t size);
 void NONNULL(1)
 mm_memory_span_destroy(struct mm_memory_span *span);
 
+/* Count the spans of a cache set up by another process. */
+void NONNULL(1)
+mm_memory_span_adopt(struct mm_memory_cache *cache);
+
+/* The memory taken by all the spans of the process. */
+size_t
+mm_memory_span_footprint(void);
+
 #endif /* BASE_MEMORY_SPAN_H */
@@ -209,6 +209,12 @@ mm_net_submit_output(struct mm_net_socket *sock)
 	mm_event_submit_output(&sock->event);
 }
 
+static inline void NONNULL(1)
+mm_net_steer(struct mm_net_socket *sock, struct mm_context *context)
+{
+	mm_event_steer_fd(&sock->event, context);
+}
+
 static inline void NONNULL(1)
 mm_net_set_read_timeout(struct mm_net_socket *sock, mm_timeout_t timeout)
 {
@@ -276,6 +276,10 @@ mm_regular_call_thread_stop_hooks(void)
 static void
 mm_regular_boot_call_start_hooks(struct mm_strand *strand)
 {
+	// Wait until every strand has its context set up so that the start
+	// hooks might refer to the context of any thread.
+	mm_domain_barrier();
+
 	if (MM_STRAND_IS_PRIMARY(strand)) {
 		// Call the start hooks on the primary strand.
 		mm_regular_call_start_hooks();
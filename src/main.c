@@ -19,7 +19,6 @@
 
 #include "common.h"
 
-#include "base/bitset.h"
 #include "base/exit.h"
 #include "base/conf.h"
 #include "base/report.h"
@@ -82,16 +81,26 @@ mm_server_init(void)
 	uint32_t mbytes = mm_settings_get_uint32("memcache-memory", 64);
 	memcache_config.volume = mbytes * 1024 * 1024;
 	memcache_config.nparts = mm_settings_get_uint32("memcache-partitions", 8);
+	memcache_config.eviction = mm_settings_get("memcache-eviction", NULL);
+	memcache_config.access = mm_settings_get("memcache-access", NULL);
+	memcache_config.storage = mm_settings_get("memcache-storage", NULL);
+	memcache_config.crawl_budget = mm_settings_get_uint32("memcache-crawl-budget", MC_CRAWL_BUDGET_DEFAULT);
+	memcache_config.hotkeys_rate = mm_settings_get_uint32("memcache-hotkeys-rate", MC_HOTKEYS_RATE_DEFAULT);
+	memcache_config.replicas = mm_settings_get_uint32("memcache-replicas", 0);
+	memcache_config.compress_min = mm_settings_get_uint32("memcache-compress", 0);
+	const char *delimiter = mm_settings_get("memcache-namespace-delimiter", NULL);
+	memcache_config.namespace_delimiter = delimiter != NULL ? delimiter[0] : 0;
+	memcache_config.shm_path = mm_settings_get("memcache-shm", NULL);
+	memcache_config.disk_path = mm_settings_get("memcache-disk", NULL);
+	uint32_t disk_mbytes = mm_settings_get_uint32("memcache-disk-size", 1024);
+	memcache_config.disk_size = (size_t) disk_mbytes * 1024 * 1024;
+	memcache_config.snapshot_path = mm_settings_get("memcache-snapshot", NULL);
+	memcache_config.load_snapshot_path = mm_settings_get("memcache-load-snapshot", NULL);
 
 	memcache_config.batch_size = mm_settings_get_uint32("memcache-batch-size", 100);
 	memcache_config.rx_chunk_size = mm_settings_get_uint32("memcache-rx-chunk-size", 2000);
 	memcache_config.tx_chunk_size = mm_settings_get_uint32("memcache-tx-chunk-size", 0);
 
-#if ENABLE_MEMCACHE_DELEGATE
-	mm_bitset_prepare(&memcache_config.affinity, &mm_common_space.xarena, 8);
-	mm_bitset_set(&memcache_config.affinity, 6);
-	mm_bitset_set(&memcache_config.affinity, 7);
-#endif
 	mm_memcache_init(&memcache_config);
 
 	LEAVE();
@@ -123,9 +132,35 @@ static struct mm_args_info mm_args_info_tbl[] = {
 	{ "memcache-port", 'p', MM_ARGS_REQUIRED,
 	  "\n\t\tmemcache server TCP port" },
 	{ "memcache-memory", 'm', MM_ARGS_REQUIRED,
-	  "\n\t\tmemory for memcache items in megabytes" },
+	  "\n\t\tmemcache memory limit in megabytes" },
 	{ "memcache-partitions", 'M', MM_ARGS_REQUIRED,
 	  "\n\t\tnumber of memcache table partitions" },
+	{ "memcache-eviction", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tentry eviction policy (clock, slru, tinylfu)" },
+	{ "memcache-access", 0, MM_ARGS_REQUIRED,
+	  "\n\t\ttable access method (locking, combiner, delegate)" },
+	{ "memcache-storage", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tentry data storage method (heap, log)" },
+	{ "memcache-crawl-budget", 0, MM_ARGS_REQUIRED,
+	  "\n\t\texpiry crawler time per second in microseconds" },
+	{ "memcache-hotkeys-rate", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tsample one of this many lookups for hot keys, 0 to disable" },
+	{ "memcache-replicas", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tnumber of hot entries replicated by each thread, 0 to disable" },
+	{ "memcache-compress", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tstore values of this many bytes and longer compressed, 0 to disable" },
+	{ "memcache-namespace-delimiter", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tkey char that ends the namespace prefix for flush_namespace" },
+	{ "memcache-shm", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tshared memory file to keep the table across restarts" },
+	{ "memcache-disk", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tpath prefix of files to keep long values of evicted entries" },
+	{ "memcache-disk-size", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tdisk space for evicted values in megabytes" },
+	{ "memcache-snapshot", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tfile to write on the snapshot command" },
+	{ "memcache-load-snapshot", 0, MM_ARGS_REQUIRED,
+	  "\n\t\tsnapshot file to load on start" },
 	{ "memcache-batch-size", 0, MM_ARGS_REQUIRED,
 	  "\n\t\tmaximum command batch size" },
 	{ "memcache-rx-chunk-size", 0, MM_ARGS_REQUIRED,
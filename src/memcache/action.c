@@ -20,10 +20,16 @@
 #include "memcache/action.h"
 #include "memcache/entry.h"
 
+#include "base/async.h"
 #include "base/bitops.h"
 #include "base/report.h"
+#include "base/fiber/fiber.h"
 
-#define MC_TABLE_STRIDE		64
+/* The number of lock-free lookup attempts before taking the lock. */
+#define MC_ACTION_PEEK_ATTEMPTS	4
+
+/* The number of entries retired between reclamation epoch advances. */
+#define MC_ACTION_EPOCH_RETIRES	64
 
 /**********************************************************************
  * Entry expiration timer.
@@ -39,6 +45,17 @@ mc_action_get_exp_time(void)
  * Helper routines.
  **********************************************************************/
 
+static bool
+mc_action_is_flushed_namespace(struct mc_tpart *part, struct mc_entry *entry, uint64_t stamp)
+{
+	const char *key = mc_entry_getkey(entry);
+	const char *end = memchr(key, mc_table.namespace_delimiter, entry->key_len);
+	if (end == NULL)
+		return false;
+	uint32_t hash = mc_hash(key, end - key);
+	return stamp < mm_memory_load(part->namespace_stamps[hash % MC_TABLE_NAMESPACES]);
+}
+
 static bool
 mc_action_is_expired_entry(struct mc_tpart *part, struct mc_entry *entry, uint32_t time)
 {
@@ -46,27 +63,24 @@ mc_action_is_expired_entry(struct mc_tpart *part, struct mc_entry *entry, uint32
 		TRACE("expired entry");
 		return true;
 	}
-	if (entry->stamp < part->flush_stamp) {
+	uint64_t stamp = mc_entry_getstamp(entry);
+	if (stamp < part->flush_stamp) {
 		TRACE("flushed entry");
 		return true;
 	}
-	return false;
-}
-
-static bool
-mc_action_is_eviction_victim(struct mc_tpart *part, struct mc_entry *entry, uint32_t time)
-{
-	if (entry->state == MC_ENTRY_USED_MIN) {
-		TRACE("rarely used entry");
+	// Only the entries older than the last namespace flush need to
+	// have their namespace looked up.
+	if (stamp < mm_memory_load(part->namespace_stamp) && mc_action_is_flushed_namespace(part, entry, stamp)) {
+		TRACE("flushed namespace entry");
 		return true;
 	}
-	return mc_action_is_expired_entry(part, entry, time);
+	return false;
 }
 
 static void
 mc_action_ref_entry(struct mc_entry *entry)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
+#if ENABLE_SMP
 	uint16_t test = mm_atomic_uint16_inc_and_test(&entry->ref_count);
 #else
 	uint16_t test = ++(entry->ref_count);
@@ -76,10 +90,30 @@ mc_action_ref_entry(struct mc_entry *entry)
 		ABORT();
 }
 
+#if ENABLE_MEMCACHE_OPTIMISTIC
+static bool
+mc_action_try_ref_entry(struct mc_entry *entry)
+{
+	// Unlike the locked case the entry might be concurrently released.
+	// So the reference might be taken only if it is still alive.
+	uint16_t count = mm_memory_load(entry->ref_count);
+	while (count != 0) {
+		// Integer overflow check.
+		if (unlikely(count == UINT16_MAX))
+			ABORT();
+		uint16_t found = mm_atomic_uint16_cas(&entry->ref_count, count, count + 1);
+		if (found == count)
+			return true;
+		count = found;
+	}
+	return false;
+}
+#endif
+
 static bool
 mc_action_unref_entry(struct mc_entry *entry)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
+#if ENABLE_SMP
 	uint16_t test = mm_atomic_uint16_dec_and_test(&entry->ref_count);
 #else
 	uint16_t test = --(entry->ref_count);
@@ -95,77 +129,367 @@ mc_action_access_entry(struct mc_entry *entry)
 		mm_memory_store(entry->state, state + 1);
 }
 
+/* Get exclusive use of an entry to update it in place. Lock-free readers
+   never pin entries that have some slack, so a reference count held by
+   the table alone means that nobody else sees the entry. */
+static bool
+mc_action_claim_entry(struct mc_entry *entry)
+{
+	if (mc_entry_getslack(entry) == 0)
+		return false;
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Make concurrent lock-free readers fall back to the locked lookup.
+	return mm_atomic_uint16_cas(&entry->ref_count, 1, 0) == 1;
+#else
+	return entry->ref_count == 1;
+#endif
+}
+
+static void
+mc_action_unclaim_entry(struct mc_entry *entry UNUSED)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mm_memory_store_fence();
+	mm_memory_store(entry->ref_count, 1);
+#endif
+}
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
 static void
-mc_action_unlink_entry(struct mc_tpart *part, struct mm_slink *pred, struct mc_entry *entry)
+mc_action_access_entry_atomic(struct mc_entry *entry)
+{
+	// Use CAS so that a concurrently unlinked entry cannot come back.
+	uint8_t state = mm_memory_load(entry->state);
+	if (state >= MC_ENTRY_USED_MIN && state < MC_ENTRY_USED_MAX)
+		mm_atomic_uint8_cas((mm_atomic_uint8_t *) &entry->state, state, state + 1);
+}
+#endif
+
+/* The memory taken by an entry data block or value chunk. */
+static size_t
+mc_action_data_footprint(size_t size)
+{
+	if (mc_table.storage == MC_STORAGE_LOG)
+		return mc_log_record_footprint(size);
+	return mm_memory_cache_round_size(size);
+}
+
+/* The memory taken by an entry as the allocator sees it. It does not
+   change when the value is updated within the slack space. */
+static size_t
+mc_action_entry_volume(struct mc_entry *entry)
+{
+	size_t volume = sizeof(struct mc_entry);
+#if !ENABLE_MEMCACHE_COMPACT
+	if (entry->data != entry->inline_data)
+#endif
+		volume += mc_action_data_footprint(mc_entry_data_capacity(entry));
+	// The chunk list might be inline but the chunks never are.
+	if (mc_entry_is_chunked(entry)) {
+		uint32_t last = mc_entry_nchunks(entry) - 1;
+		volume += last * mc_action_data_footprint(MC_ENTRY_CHUNK_SIZE);
+		volume += mc_action_data_footprint(mc_entry_chunk_size(entry, last));
+	}
+	return volume;
+}
+
+static void
+mc_action_unlink_entry(struct mc_tpart *part, struct mc_entry *entry)
 {
 	ASSERT(entry->state >= MC_ENTRY_USED_MIN);
 	ASSERT(entry->state <= MC_ENTRY_USED_MAX);
-	ASSERT(pred->next == &entry->link);
-	mm_stack_remove_next(pred);
 	entry->state = MC_ENTRY_NOT_USED;
-	part->volume -= mc_entry_size(entry);
+	part->volume -= mc_action_entry_volume(entry);
+	mc_evict_remove(&part->evict, entry);
+	mc_table_replica_invalidate(part, entry->hash);
+}
+
+static void
+mc_action_unlink_slot(struct mc_tpart *part, struct mc_bucket *bucket, uint32_t slot, struct mc_entry *entry)
+{
+	ASSERT(bucket->slots[slot] == mc_table_entry_index(part, entry));
+	bucket->tags[slot] = 0;
+	mc_action_unlink_entry(part, entry);
+}
+
+static void
+mc_action_unlink_overflow(struct mc_tpart *part, mc_link_t *pred, struct mc_entry *entry)
+{
+	ASSERT(mc_table_link_entry(part, *pred) == entry);
+	*pred = entry->link;
+	mc_action_unlink_entry(part, entry);
+}
+
+static void
+mc_action_unlink_found(struct mc_tpart *part, struct mc_bucket *bucket, uint32_t slot, mc_link_t *pred, struct mc_entry *entry)
+{
+	if (slot < MC_BUCKET_SLOTS)
+		mc_action_unlink_slot(part, bucket, slot, entry);
+	else
+		mc_action_unlink_overflow(part, pred, entry);
 }
 
 static void
-mc_action_remove_entry(struct mc_tpart *part, struct mm_slink *pred, struct mc_entry *entry)
+mc_action_remove_entry(struct mc_tpart *part, struct mc_bucket *bucket, struct mc_entry *entry)
 {
-	while (likely(pred != NULL)) {
-		if (pred->next == &entry->link) {
-			mc_action_unlink_entry(part, pred, entry);
+	const uint32_t index = mc_table_entry_index(part, entry);
+	uint32_t mask = mc_bucket_match(bucket, mc_bucket_tag(entry->hash));
+	while (mask) {
+		uint32_t slot = mm_ctz(mask);
+		if (bucket->slots[slot] == index) {
+			mc_bucket_write_begin(bucket);
+			mc_action_unlink_slot(part, bucket, slot, entry);
+			mc_bucket_write_end(bucket);
+			return;
+		}
+		mask &= mask - 1;
+	}
+
+	mc_link_t *pred = &bucket->overflow.head;
+	while (likely(*pred != 0)) {
+		struct mc_entry *next = mc_table_link_entry(part, *pred);
+		if (next == entry) {
+			mc_bucket_write_begin(bucket);
+			mc_action_unlink_overflow(part, pred, entry);
+			mc_bucket_write_end(bucket);
 			return;
 		}
-		pred = pred->next;
+		pred = &next->link;
 	}
 	ABORT();
 }
 
+static void
+mc_action_place_entry(struct mc_tpart *part, struct mc_bucket *bucket, struct mc_entry *entry)
+{
+	uint32_t mask = mc_bucket_match(bucket, 0);
+	if (likely(mask)) {
+		uint32_t slot = mm_ctz(mask);
+		bucket->slots[slot] = mc_table_entry_index(part, entry);
+		bucket->tags[slot] = mc_bucket_tag(entry->hash);
+	} else {
+		mc_entry_list_insert(part, &bucket->overflow, entry);
+	}
+}
+
+/* Take all the entries out of a bucket. */
+static void
+mc_action_drain_bucket(struct mc_tpart *part, struct mc_bucket *bucket, struct mc_entry_list *entries)
+{
+	*entries = bucket->overflow;
+	for (uint32_t slot = 0; slot < MC_BUCKET_SLOTS; slot++) {
+		if (bucket->tags[slot]) {
+			struct mc_entry *entry = mc_table_entry(part, bucket->slots[slot]);
+			mc_entry_list_insert(part, entries, entry);
+		}
+	}
+	mc_bucket_prepare(bucket);
+}
+
 static void
 mc_action_free_entry(struct mc_tpart *part, struct mc_entry *entry)
 {
 	ASSERT(entry->state == MC_ENTRY_NOT_USED);
 	entry->state = MC_ENTRY_FREE;
-	mm_stack_insert(&part->free_list, &entry->link);
+	mc_entry_list_insert(part, &part->free_list, entry);
 	part->nentries_free++;
 }
 
+/* The epoch for the log storage, zero if there are no lock-free readers. */
+static uint32_t
+mc_action_log_epoch(void)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	return mm_memory_load(mc_table.epoch);
+#else
+	return 0;
+#endif
+}
+
+static char *
+mc_action_alloc_data(struct mc_tpart *part, struct mc_entry *entry, size_t size)
+{
+	size_t footprint = mm_memory_cache_footprint(&part->data_space);
+	char *data;
+	if (mc_table.storage == MC_STORAGE_LOG) {
+		uint32_t owner = mc_table_entry_index(part, entry) + 1;
+		data = mc_log_alloc(&part->log, &part->data_space, size, owner, mc_action_log_epoch());
+	} else {
+		data = mm_memory_cache_alloc(&part->data_space, size);
+	}
+	if (unlikely(data == NULL))
+		mm_fatal(errno, "error allocating %zu bytes of memory", size);
+	// Account for a new span right away rather than let the entries
+	// grow on until the next governor round.
+	if (mm_memory_cache_footprint(&part->data_space) > footprint && mm_memory_load(mc_table.memory_max))
+		mc_table_govern();
+	return data;
+}
+
+static void
+mc_action_free_data(struct mc_tpart *part, char *data)
+{
+	if (mc_table.storage == MC_STORAGE_LOG)
+		mc_log_free(&part->log, data, mc_action_log_epoch());
+	else
+		mm_memory_cache_local_free(&part->data_space, data);
+}
+
 static void
 mc_action_alloc_chunks(struct mc_tpart *part, struct mc_entry *entry)
 {
-	size_t size = entry->key_len + entry->value_len;
-	entry->data = mm_memory_cache_alloc(&part->data_space, size);
-	if (unlikely(entry->data == NULL))
-		mm_fatal(errno, "error allocating %zu bytes of memory", size);
+	// Short data is kept in the entry to save an allocation and a
+	// cache miss on access.
+#if !ENABLE_MEMCACHE_COMPACT
+	if (mc_entry_is_inline(entry))
+		entry->data = entry->inline_data;
+	else
+#endif
+		mc_entry_setdata(entry, mc_action_alloc_data(part, entry, mc_entry_data_size(entry)));
+
+	// Large values go to separate fixed-size chunks so that they do
+	// not need huge contiguous blocks.
+	if (mc_entry_is_chunked(entry)) {
+		char **chunks = mc_entry_getchunks(entry);
+		uint32_t nchunks = mc_entry_nchunks(entry);
+		for (uint32_t i = 0; i < nchunks; i++)
+			chunks[i] = mc_action_alloc_data(part, entry, mc_entry_chunk_size(entry, i));
+	}
 }
 
 static void
 mc_action_free_chunks(struct mc_tpart *part, struct mc_entry *entry)
 {
-	if (likely(entry->data != NULL)) {
-		mm_memory_cache_local_free(&part->data_space, entry->data);
-		entry->data = NULL;
+	char *data = mc_entry_getdata(entry);
+	if (likely(data != NULL)) {
+		if (mc_entry_is_disk(entry)) {
+			struct mc_disk_ref ref;
+			mc_disk_getref(entry, &ref);
+			mc_disk_free(&part->disk, &ref);
+		}
+		if (mc_entry_is_chunked(entry)) {
+			char **chunks = mc_entry_getchunks(entry);
+			uint32_t nchunks = mc_entry_nchunks(entry);
+			for (uint32_t i = 0; i < nchunks; i++)
+				mc_action_free_data(part, chunks[i]);
+		}
+#if !ENABLE_MEMCACHE_COMPACT
+		if (data != entry->inline_data)
+#endif
+			mc_action_free_data(part, data);
+		mc_entry_setdata(entry, NULL);
+	}
+}
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+
+static void
+mc_action_free_limbo(struct mc_tpart *part, struct mc_entry_list *limbo)
+{
+	while (!mc_entry_list_empty(limbo)) {
+		struct mc_entry *entry = mc_entry_list_remove(part, limbo);
+		mc_action_free_chunks(part, entry);
+		mc_action_free_entry(part, entry);
 	}
 }
 
+static bool
+mc_action_limbo_empty(struct mc_tpart *part)
+{
+	return mc_entry_list_empty(&part->limbo[0]) && mc_entry_list_empty(&part->limbo[1]);
+}
+
 static void
-mc_action_free_entries(struct mc_tpart *part, struct mm_stack *victims)
+mc_action_retire_entry(struct mc_tpart *part, struct mc_entry *entry)
 {
-	while (!mm_stack_empty(victims)) {
-		struct mm_slink *link = mm_stack_remove(victims);
-		struct mc_entry *entry = containerof(link, struct mc_entry, link);
-		if (mc_action_unref_entry(entry)) {
-			mc_action_free_chunks(part, entry);
-			mc_action_free_entry(part, entry);
-		}
+	uint32_t epoch = mm_memory_load(mc_table.epoch);
+	struct mc_entry_list *limbo = &part->limbo[(epoch >> 1) & 1];
+	uint32_t *limbo_epoch = &part->limbo_epoch[(epoch >> 1) & 1];
+	if (*limbo_epoch != epoch) {
+		// The list was filled two or more epochs ago.
+		mc_action_free_limbo(part, limbo);
+		*limbo_epoch = epoch;
+	}
+	mc_entry_list_insert(part, limbo, entry);
+
+	// Advancing the epoch takes a look at every thread so it is not
+	// done on each retirement.
+	if ((++part->nretired % MC_ACTION_EPOCH_RETIRES) == 0)
+		mc_table_epoch_advance();
+}
+
+static void
+mc_action_reclaim_entries(struct mc_tpart *part)
+{
+	if (mc_action_limbo_empty(part))
+		return;
+
+	// Free the entries retired before the previous epoch.
+	uint32_t epoch = mm_memory_load(mc_table.epoch);
+	for (uint32_t i = 0; i < 2; i++) {
+		uint32_t limbo_epoch = part->limbo_epoch[i];
+		if (limbo_epoch != epoch && limbo_epoch != epoch - 2)
+			mc_action_free_limbo(part, &part->limbo[i]);
+	}
+}
+
+#endif
+
+static void
+mc_action_release_entry(struct mc_tpart *part, struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Lock-free readers might still access the entry.
+	mc_action_retire_entry(part, entry);
+#else
+	mc_action_free_chunks(part, entry);
+	mc_action_free_entry(part, entry);
+#endif
+}
+
+static void
+mc_action_free_entries(struct mc_tpart *part, struct mc_entry_list *victims)
+{
+	while (!mc_entry_list_empty(victims)) {
+		struct mc_entry *entry = mc_entry_list_remove(part, victims);
+		if (mc_action_unref_entry(entry))
+			mc_action_release_entry(part, entry);
+	}
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mc_action_reclaim_entries(part);
+#endif
+}
+
+/* Get an unused entry without eviction. Must be called with the freelist
+   lock. */
+static struct mc_entry *
+mc_action_take_entry(struct mc_tpart *part)
+{
+	struct mc_entry *entry = NULL;
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mc_action_reclaim_entries(part);
+#endif
+	if (!mc_entry_list_empty(&part->free_list)) {
+		entry = mc_entry_list_remove(part, &part->free_list);
+		ASSERT(part->nentries_free);
+		part->nentries_free--;
+	} else if (part->nentries_void || mc_table_expand(part, mc_table.nentries_increment)) {
+		ASSERT(part->nentries_void);
+		entry = part->entries_end++;
+		part->nentries_void--;
 	}
+
+	return entry;
 }
 
 static bool
 mc_action_find_victims(struct mc_tpart *part,
-		       struct mm_stack *victims,
+		       struct mc_entry_list *victims,
 		       uint32_t nrequired)
 {
 	uint32_t nvictims = 0;
-	mm_stack_prepare(victims);
+	mc_entry_list_prepare(victims);
 
 	mm_timeval_t real_time = mm_context_getrealtime(mm_context_selfptr());
 	uint32_t time = real_time / 1000000; // useconds -> seconds.
@@ -184,14 +508,16 @@ mc_action_find_victims(struct mc_tpart *part,
 
 		uint8_t state = hand->state;
 		if (state >= MC_ENTRY_USED_MIN && state <= MC_ENTRY_USED_MAX) {
-			if (mc_action_is_eviction_victim(part, hand, time)) {
-				uint32_t index = mc_table_index(part, hand->hash);
-				struct mm_stack *bucket = &part->buckets[index];
-				mc_action_remove_entry(part, &bucket->head, hand);
-				mm_stack_insert(victims, &hand->link);
+			// Let the policy choose a victim unless the entry is
+			// already useless.
+			struct mc_entry *victim = hand;
+			if (!mc_action_is_expired_entry(part, hand, time))
+				victim = mc_evict_visit(&part->evict, hand);
+			if (victim != NULL) {
+				uint32_t index = mc_table_index(part, victim->hash);
+				mc_action_remove_entry(part, &part->buckets[index], victim);
+				mc_entry_list_insert(part, victims, victim);
 				++nvictims;
-			} else {
-				hand->state--;
 			}
 		}
 
@@ -211,147 +537,182 @@ mc_action_match_entry(struct mc_action *action, struct mc_entry *entry)
 	return !memcmp(action->key, mc_entry_getkey(entry), action->key_len);
 }
 
+static void
+mc_action_stamp_entry(struct mc_tpart *part, struct mc_entry *entry)
+{
+	mc_entry_setstamp(entry, part->stamp);
+	part->stamp += mc_table.nparts;
+	mc_table_replica_invalidate(part, entry->hash);
+}
+
 static void
 mc_action_bucket_insert(struct mc_action_storage *action,
-			struct mm_stack *bucket,
+			struct mc_bucket *bucket,
+			struct mc_entry *prev,
 			uint8_t state)
 {
 	ASSERT(action->new_entry->state == MC_ENTRY_NOT_USED);
 	ASSERT(state != MC_ENTRY_NOT_USED || state != MC_ENTRY_FREE);
 	action->new_entry->state = state;
-	action->new_entry->stamp = action->base.part->stamp;
-	mm_stack_insert(bucket, &action->new_entry->link);
-	action->base.part->stamp += mc_table.nparts;
-	action->base.part->volume += mc_entry_size(action->new_entry);
+	mc_action_stamp_entry(action->base.part, action->new_entry);
+	mc_action_place_entry(action->base.part, bucket, action->new_entry);
+	mc_evict_insert(&action->base.part->evict, action->new_entry, prev);
+	action->base.part->volume += mc_action_entry_volume(action->new_entry);
 
 	// Store stamp value needed for binary protocol response.
-	action->stamp = action->new_entry->stamp;
+	action->stamp = mc_entry_getstamp(action->new_entry);
 }
 
-static void
-mc_action_bucket_lookup(struct mc_action *action,
-			struct mm_stack *bucket,
-			struct mm_stack *freelist)
+static struct mc_entry *
+mc_action_bucket_search(struct mc_action *action,
+			struct mc_bucket *bucket,
+			struct mc_entry_list *freelist,
+			uint32_t *found_slot,
+			mc_link_t **found_pred)
 {
 	struct mc_tpart *part = action->part;
-	struct mm_slink *pred = &bucket->head;
 	uint32_t time = mc_action_get_exp_time();
 
-	while (!mm_stack_is_tail(pred)) {
-		struct mm_slink *link = pred->next;
-		struct mc_entry *entry = containerof(link, struct mc_entry, link);
+	// Check only the slots with matching tags.
+	uint32_t mask = mc_bucket_match(bucket, mc_bucket_tag(action->hash));
+	while (mask) {
+		uint32_t slot = mm_ctz(mask);
+		mask &= mask - 1;
+
+		struct mc_entry *entry = mc_table_entry(part, bucket->slots[slot]);
+		if (mc_action_is_expired_entry(part, entry, time)) {
+			mc_action_unlink_slot(part, bucket, slot, entry);
+			mc_entry_list_insert(part, freelist, entry);
+		} else if (mc_action_match_entry(action, entry)) {
+			*found_slot = slot;
+			*found_pred = NULL;
+			return entry;
+		}
+	}
+
+	// Fall back to the overflow chain.
+	mc_link_t *pred = &bucket->overflow.head;
+	while (*pred != 0) {
+		struct mc_entry *entry = mc_table_link_entry(part, *pred);
 		if (mc_action_is_expired_entry(part, entry, time)) {
-			mc_action_unlink_entry(part, pred, entry);
-			mm_stack_insert(freelist, &entry->link);
+			mc_action_unlink_overflow(part, pred, entry);
+			mc_entry_list_insert(part, freelist, entry);
 		} else {
 			if (mc_action_match_entry(action, entry)) {
-				ASSERT(entry->state >= MC_ENTRY_USED_MIN);
-				ASSERT(entry->state <= MC_ENTRY_USED_MAX);
-				action->old_entry = entry;
-				return;
+				*found_slot = MC_BUCKET_SLOTS;
+				*found_pred = pred;
+				return entry;
 			}
-			pred = link;
+			pred = &entry->link;
 		}
 	}
 
-	action->old_entry = NULL;
+	return NULL;
 }
 
 static void
-mc_action_bucket_delete(struct mc_action *action,
-			struct mm_stack *bucket,
-			struct mm_stack *freelist)
+mc_action_bucket_lookup(struct mc_action *action,
+			struct mc_bucket *bucket,
+			struct mc_entry_list *freelist)
 {
-	struct mc_tpart *part = action->part;
-	struct mm_slink *pred = &bucket->head;
-	uint32_t time = mc_action_get_exp_time();
+	uint32_t slot;
+	mc_link_t *pred;
+	struct mc_entry *entry = mc_action_bucket_search(action, bucket, freelist, &slot, &pred);
+	ASSERT(entry == NULL || entry->state >= MC_ENTRY_USED_MIN);
+	ASSERT(entry == NULL || entry->state <= MC_ENTRY_USED_MAX);
+	action->old_entry = entry;
+}
 
-	while (!mm_stack_is_tail(pred)) {
-		struct mm_slink *link = pred->next;
-		struct mc_entry *entry = containerof(link, struct mc_entry, link);
-		if (mc_action_is_expired_entry(part, entry, time)) {
-			mc_action_unlink_entry(part, pred, entry);
-			mm_stack_insert(freelist, &entry->link);
-		} else {
-			if (mc_action_match_entry(action, entry)) {
-				mc_action_unlink_entry(action->part, pred, entry);
-				mm_stack_insert(freelist, &entry->link);
-				action->old_entry = entry;
-				return;
-			}
-			pred = link;
-		}
+static void
+mc_action_bucket_delete(struct mc_action *action,
+			struct mc_bucket *bucket,
+			struct mc_entry_list *freelist)
+{
+	uint32_t slot;
+	mc_link_t *pred;
+	struct mc_entry *entry = mc_action_bucket_search(action, bucket, freelist, &slot, &pred);
+	if (entry != NULL) {
+		mc_action_unlink_found(action->part, bucket, slot, pred, entry);
+		mc_entry_list_insert(action->part, freelist, entry);
 	}
-
-	action->old_entry = NULL;
+	action->old_entry = entry;
 }
 
 static void
 mc_action_bucket_update(struct mc_action_storage *action,
-			struct mm_stack *bucket,
-			struct mm_stack *freelist)
+			struct mc_bucket *bucket,
+			struct mc_entry_list *freelist)
 {
-	struct mc_tpart *part = action->base.part;
-	struct mm_slink *pred = &bucket->head;
-	uint32_t time = mc_action_get_exp_time();
-
-	while (!mm_stack_is_tail(pred)) {
-		struct mm_slink *link = pred->next;
-		struct mc_entry *entry = containerof(link, struct mc_entry, link);
-		if (mc_action_is_expired_entry(part, entry, time)) {
-			mc_action_unlink_entry(part, pred, entry);
-			mm_stack_insert(freelist, &entry->link);
-		} else {
-			if (mc_action_match_entry(&action->base, entry)) {
-				action->base.old_entry = entry;
-				action->entry_match = (!action->stamp
-						       || action->stamp == entry->stamp);
-				if (action->entry_match) {
-					uint8_t state = entry->state;
-					mc_action_unlink_entry(action->base.part, pred, entry);
-					mm_stack_insert(freelist, &entry->link);
-					mc_action_bucket_insert(action, bucket, state);
-				}
-				return;
-			}
-			pred = link;
+	uint32_t slot;
+	mc_link_t *pred;
+	struct mc_entry *entry = mc_action_bucket_search(&action->base, bucket, freelist, &slot, &pred);
+	if (entry != NULL) {
+		action->entry_match = (!action->stamp || action->stamp == mc_entry_getstamp(entry));
+		if (action->entry_match) {
+			uint8_t state = entry->state;
+			mc_action_unlink_found(action->base.part, bucket, slot, pred, entry);
+			mc_entry_list_insert(action->base.part, freelist, entry);
+			mc_action_bucket_insert(action, bucket, entry, state);
 		}
+	} else {
+		action->entry_match = false;
 	}
-
-	action->base.old_entry = NULL;
-	action->entry_match = false;
+	action->base.old_entry = entry;
 }
 
-static struct mm_stack *
-mm_action_bucket_start(struct mc_action *action, struct mm_stack *freelist)
+static struct mc_bucket *
+mm_action_bucket_start(struct mc_action *action, struct mc_entry_list *freelist)
 {
-	mm_stack_prepare(freelist);
+	mc_entry_list_prepare(freelist);
 
 	mc_table_lookup_lock(action->part);
 
 	uint32_t index = mc_table_index(action->part, action->hash);
-	return &action->part->buckets[index];
+	struct mc_bucket *bucket = &action->part->buckets[index];
+	mc_bucket_write_begin(bucket);
+	return bucket;
 }
 
 static void
-mc_action_bucket_finish(struct mc_action *action, struct mm_stack *freelist)
+mc_action_bucket_finish(struct mc_action *action, struct mc_bucket *bucket, struct mc_entry_list *freelist)
 {
+	mc_bucket_write_end(bucket);
 	mc_table_lookup_unlock(action->part);
 
-	if (!mm_stack_empty(freelist)) {
+	if (!mc_entry_list_empty(freelist)) {
 		mc_table_freelist_lock(action->part);
 		mc_action_free_entries(action->part, freelist);
 		mc_table_freelist_unlock(action->part);
+		mc_table_release_entries(action->part);
 	}
 }
 
 static void
-mc_action_complete(struct mc_action *action UNUSED)
+mc_action_lookup_entry(struct mc_action *action, bool touch)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mm_memory_store_fence();
-	action->ready = 1;
-#endif
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(action, &freelist);
+
+	mc_action_bucket_lookup(action, bucket, &freelist);
+	if (action->old_entry != NULL) {
+		if (touch) {
+			action->old_entry->exp_time = action->exp_time;
+			mc_table_replica_invalidate(action->part, action->hash);
+		}
+		mc_action_ref_entry(action->old_entry);
+		mc_action_access_entry(action->old_entry);
+	}
+
+	mc_action_bucket_finish(action, bucket, &freelist);
+}
+
+static void
+mc_action_complete(struct mc_action *action)
+{
+	if (mc_table.access == MC_ACCESS_COMBINER) {
+		mm_memory_store_fence();
+		action->ready = 1;
+	}
 }
 
 /**********************************************************************
@@ -363,21 +724,122 @@ mc_action_lookup_low(struct mc_action *action)
 {
 	ENTER();
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(action, &freelist);
+	mc_evict_record(&action->part->evict, action->hash);
+	mc_action_lookup_entry(action, false);
 
-	mc_action_bucket_lookup(action, bucket, &freelist);
-	if (action->old_entry != NULL) {
-		mc_action_ref_entry(action->old_entry);
-		mc_action_access_entry(action->old_entry);
-	}
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+void
+mc_action_touch_low(struct mc_action *action)
+{
+	ENTER();
+
+	mc_evict_record(&action->part->evict, action->hash);
+	mc_action_lookup_entry(action, true);
+
+	mc_action_complete(action);
 
-	mc_action_bucket_finish(action, &freelist);
+	LEAVE();
+}
 
+#if ENABLE_MEMCACHE_OPTIMISTIC
+static void
+mc_action_peek_fallback(struct mc_action *action)
+{
+	mc_action_lookup_entry(action, false);
 	mc_action_complete(action);
+}
+
+void
+mc_action_peek_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	const uint8_t tag = mc_bucket_tag(action->hash);
+	const uint32_t time = mc_action_get_exp_time();
+
+	mc_evict_record(&part->evict, action->hash);
+	mc_table_epoch_enter();
+
+	for (uint32_t attempt = 0; attempt < MC_ACTION_PEEK_ATTEMPTS; attempt++) {
+		uint32_t index = mc_table_index(part, action->hash);
+		struct mc_bucket *bucket = &part->buckets[index];
+		uint32_t version = mc_bucket_read_begin(bucket);
+
+		// A concurrent split or merge step marks both its buckets as
+		// being modified before it updates the number of buckets. So
+		// the index taken before the bucket version might only become
+		// stale if the step is already over. Check for this.
+		if (mc_table_index(part, action->hash) != index)
+			continue;
+
+		// Fetch the slots only after the tags.
+		uint32_t mask = mc_bucket_match(bucket, tag);
+		mm_memory_load_fence();
+
+		// The entries are guaranteed to stay intact while the epoch
+		// is held even if concurrently unlinked.
+		struct mc_entry *entry = NULL;
+		while (mask) {
+			uint32_t slot = mm_ctz(mask);
+			mask &= mask - 1;
+
+			struct mc_entry *slot_entry = mc_table_entry(part, mm_memory_load(bucket->slots[slot]));
+			if (mc_action_match_entry(action, slot_entry)) {
+				entry = slot_entry;
+				break;
+			}
+		}
+		bool overflow = !mc_entry_list_empty(&bucket->overflow);
+
+		if (mc_bucket_read_retry(bucket, version))
+			continue;
+		// Leave rare overflow chains to the locked lookup.
+		if (entry == NULL && overflow)
+			break;
+		if (entry != NULL && mc_action_is_expired_entry(part, entry, time))
+			entry = NULL;
+
+		if (entry == NULL) {
+			mc_table_epoch_leave();
+			action->old_entry = NULL;
+			goto leave;
+		}
+
+		mc_action_access_entry_atomic(entry);
+
+		// Copying out small values is cheaper than referencing them.
+		// But the entries with slack might be updated in place so
+		// they are always referenced. So are the disk stubs as their
+		// records might be moved.
+		if (mm_memory_load(*mc_entry_slackptr(entry)) == 0) {
+			mm_memory_load_fence();
+			if (entry->value_len <= MC_ACTION_PEEK_COPY_MAX && !mc_entry_is_disk(entry)) {
+				action->old_entry = entry;
+				action->entry_pinned = true;
+				goto leave;
+			}
+		}
+		if (mc_action_try_ref_entry(entry)) {
+			mc_table_epoch_leave();
+			action->old_entry = entry;
+			action->entry_pinned = false;
+			goto leave;
+		}
+	}
+
+	mc_table_epoch_leave();
+	mc_action_execute(action, mc_action_peek_fallback);
+	action->entry_pinned = false;
 
+leave:
 	LEAVE();
 }
+#endif
 
 void
 mc_action_finish_low(struct mc_action *action)
@@ -386,8 +848,7 @@ mc_action_finish_low(struct mc_action *action)
 
 	if (mc_action_unref_entry(action->old_entry)) {
 		mc_table_freelist_lock(action->part);
-		mc_action_free_chunks(action->part, action->old_entry);
-		mc_action_free_entry(action->part, action->old_entry);
+		mc_action_release_entry(action->part, action->old_entry);
 		mc_table_freelist_unlock(action->part);
 	}
 
@@ -401,12 +862,12 @@ mc_action_delete_low(struct mc_action *action)
 {
 	ENTER();
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(action, &freelist);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(action, &freelist);
 
 	mc_action_bucket_delete(action, bucket, &freelist);
 
-	mc_action_bucket_finish(action, &freelist);
+	mc_action_bucket_finish(action, bucket, &freelist);
 
 	mc_action_complete(action);
 
@@ -422,29 +883,26 @@ mc_action_create_low(struct mc_action_storage *action)
 	mc_table_freelist_lock(part);
 
 	for (;;) {
-		if (!mm_stack_empty(&part->free_list)) {
-			struct mm_slink *link = mm_stack_remove(&part->free_list);
-			action->new_entry = containerof(link, struct mc_entry, link);
-			ASSERT(part->nentries_free);
-			part->nentries_free--;
-			break;
-		}
-
-		if (part->nentries_void) {
-			action->new_entry = part->entries_end++;
-			part->nentries_void--;
-			break;
-		}
-		if (mc_table_expand(part, mc_table.nentries_increment)) {
-			ASSERT(part->nentries_void);
-			action->new_entry = part->entries_end++;
-			part->nentries_void--;
+		action->new_entry = mc_action_take_entry(part);
+		if (action->new_entry != NULL)
 			break;
-		}
 
 		mc_table_freelist_unlock(part);
 
-		struct mm_stack victims;
+#if ENABLE_MEMCACHE_OPTIMISTIC
+		// Wait for lock-free readers to release retired entries
+		// rather than evict more. Move the epoch on from here as
+		// nothing else might do it soon, and let other fibers run
+		// meanwhile.
+		if (!mc_action_limbo_empty(part)) {
+			mc_table_epoch_advance();
+			mm_fiber_yield(mm_context_selfptr());
+			mc_table_freelist_lock(part);
+			continue;
+		}
+#endif
+
+		struct mc_entry_list victims;
 		mc_table_lookup_lock(part);
 		mc_action_find_victims(part, &victims, 1);
 		mc_table_lookup_unlock(part);
@@ -461,6 +919,8 @@ mc_action_create_low(struct mc_action_storage *action)
 	action->new_entry->key_len = action->base.key_len;
 	action->new_entry->value_len = action->value_len;
 	mc_action_alloc_chunks(part, action->new_entry);
+	mc_entry_setlease(action->new_entry, 0);
+	mc_entry_setslack(action->new_entry, 0);
 
 	mc_table_freelist_unlock(part);
 	mc_table_reserve_entries(part);
@@ -475,12 +935,13 @@ mc_action_resize_low(struct mc_action_storage *action)
 {
 	ENTER();
 
-	action->new_entry->value_len = action->value_len;
-
 	struct mc_tpart *const part = action->base.part;
 	mc_table_freelist_lock(part);
 	mc_action_free_chunks(part, action->new_entry);
+	action->new_entry->value_len = action->value_len;
 	mc_action_alloc_chunks(part, action->new_entry);
+	mc_entry_setlease(action->new_entry, 0);
+	mc_entry_setslack(action->new_entry, 0);
 	mc_table_freelist_unlock(part);
 
 	mc_action_complete(&action->base);
@@ -509,14 +970,14 @@ mc_action_insert_low(struct mc_action_storage *action)
 {
 	ENTER();
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(&action->base, &freelist);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
 
 	mc_action_bucket_lookup(&action->base, bucket, &freelist);
 	if (action->base.old_entry == NULL)
-		mc_action_bucket_insert(action, bucket, MC_ENTRY_USED_MIN);
+		mc_action_bucket_insert(action, bucket, NULL, MC_ENTRY_USED_MIN);
 
-	mc_action_bucket_finish(&action->base, &freelist);
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
 
 	if (action->base.old_entry == NULL)
 		mc_table_reserve_volume(action->base.part);
@@ -533,14 +994,14 @@ mc_action_update_low(struct mc_action_storage *action)
 {
 	ENTER();
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(&action->base, &freelist);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
 
 	mc_action_bucket_update(action, bucket, &freelist);
 	if (action->entry_match)
 		mc_action_access_entry(action->new_entry);
 
-	mc_action_bucket_finish(&action->base, &freelist);
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
 
 	if (action->entry_match)
 		mc_table_reserve_volume(action->base.part);
@@ -557,13 +1018,13 @@ mc_action_upsert_low(struct mc_action_storage *action)
 {
 	ENTER();
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(&action->base, &freelist);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
 
 	mc_action_bucket_delete(&action->base, bucket, &freelist);
-	mc_action_bucket_insert(action, bucket, MC_ENTRY_USED_MIN);
+	mc_action_bucket_insert(action, bucket, action->base.old_entry, MC_ENTRY_USED_MIN);
 
-	mc_action_bucket_finish(&action->base, &freelist);
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
 
 	mc_table_reserve_volume(action->base.part);
 
@@ -577,23 +1038,23 @@ mc_action_alter_low(struct mc_action_storage *action)
 {
 	ENTER();
 
-	uint32_t flags = action->base.old_entry->flags;
+	uint32_t flags = mc_entry_getflags(action->base.old_entry);
 	uint32_t exp_time = action->base.old_entry->exp_time;
 	mc_action_finish_low(&action->base);
 
-	struct mm_stack freelist;
-	struct mm_stack *bucket = mm_action_bucket_start(&action->base, &freelist);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
 
 	mc_action_bucket_update(action, bucket, &freelist);
 	if (action->entry_match) {
 		mc_action_access_entry(action->new_entry);
-		action->new_entry->flags = flags;
+		mc_entry_setflags(action->new_entry, flags);
 		action->new_entry->exp_time = exp_time;
 	} else if (action->base.old_entry != NULL) {
 		mc_action_ref_entry(action->base.old_entry);
 	}
 
-	mc_action_bucket_finish(&action->base, &freelist);
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
 
 	if (action->entry_match)
 		mc_table_reserve_volume(action->base.part);
@@ -605,49 +1066,176 @@ mc_action_alter_low(struct mc_action_storage *action)
 	LEAVE();
 }
 
-void
-mc_action_stride_low(struct mc_action *action)
+static void
+mc_action_delta_entry(struct mc_action_storage *action, bool decrement)
 {
-	ENTER();
-
-	mc_table_lookup_lock(action->part);
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
 
-	const uint32_t used = action->part->nbuckets;
-	action->part->nbuckets = used + MC_TABLE_STRIDE;
-
-	const uint32_t half_size = mm_lower_pow2(used);
-	const uint32_t mask = half_size + half_size - 1;
-
-	if (unlikely(used == half_size))
-		mc_table_buckets_resize(action->part, used, used * 2);
-
-	uint32_t target = used;
-	uint32_t source = used - half_size;
-	for (uint32_t count = 0; count < MC_TABLE_STRIDE; count++) {
-		struct mm_stack s_entries, t_entries;
-		mm_stack_prepare(&s_entries);
-		mm_stack_prepare(&t_entries);
-
-		struct mm_slink *link = mm_stack_head(&action->part->buckets[source]);
-		while (link != NULL) {
-			struct mm_slink *next = link->next;
-
-			struct mc_entry *entry = containerof(link, struct mc_entry, link);
-			uint32_t index = (entry->hash >> mc_table.part_bits) & mask;
-			if (index == source) {
-				mm_stack_insert(&s_entries, link);
-			} else {
-				ASSERT(index == target);
-				mm_stack_insert(&t_entries, link);
-			}
+	action->entry_match = false;
+	mc_action_bucket_lookup(&action->base, bucket, &freelist);
 
-			link = next;
+	struct mc_entry *entry = action->base.old_entry;
+	uint64_t value;
+	if (entry != NULL && mc_entry_getnum(entry, &value)) {
+		if (!decrement)
+			value += action->delta_value;
+		else if (value > action->delta_value)
+			value -= action->delta_value;
+		else
+			value = 0;
+
+		uint32_t capacity = entry->value_len + mc_entry_getslack(entry);
+		if (mc_entry_numlen(value) <= capacity && mc_action_claim_entry(entry)) {
+			mc_entry_setnum(entry, value);
+			mc_action_stamp_entry(action->base.part, entry);
+			mc_action_access_entry(entry);
+			mc_action_unclaim_entry(entry);
+
+			action->stamp = mc_entry_getstamp(entry);
+			action->delta_value = value;
+			action->entry_match = true;
 		}
-
-		action->part->buckets[source++] = s_entries;
-		action->part->buckets[target++] = t_entries;
 	}
 
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
+}
+
+void
+mc_action_increment_low(struct mc_action_storage *action)
+{
+	ENTER();
+
+	mc_action_delta_entry(action, false);
+
+	mc_action_complete(&action->base);
+
+	LEAVE();
+}
+
+void
+mc_action_decrement_low(struct mc_action_storage *action)
+{
+	ENTER();
+
+	mc_action_delta_entry(action, true);
+
+	mc_action_complete(&action->base);
+
+	LEAVE();
+}
+
+void
+mc_action_append_low(struct mc_action_storage *action)
+{
+	ENTER();
+
+	struct mc_entry_list freelist;
+	struct mc_bucket *bucket = mm_action_bucket_start(&action->base, &freelist);
+
+	action->entry_match = false;
+	mc_action_bucket_lookup(&action->base, bucket, &freelist);
+
+	struct mc_entry *entry = action->base.old_entry;
+	if (entry != NULL
+	    && action->value_len <= mc_entry_getslack(entry)
+	    && mc_action_claim_entry(entry)) {
+		mc_entry_appendvalue(entry, action->alter_value, action->value_len);
+		mc_action_stamp_entry(action->base.part, entry);
+		mc_action_access_entry(entry);
+		mc_action_unclaim_entry(entry);
+
+		action->stamp = mc_entry_getstamp(entry);
+		action->entry_match = true;
+	}
+
+	mc_action_bucket_finish(&action->base, bucket, &freelist);
+
+	mc_action_complete(&action->base);
+
+	LEAVE();
+}
+
+void
+mc_action_split_low(struct mc_action *action)
+{
+	ENTER();
+
+	mc_table_lookup_lock(action->part);
+
+	struct mc_tpart *const part = action->part;
+	const uint32_t used = part->nbuckets;
+	const uint32_t half_size = mm_lower_pow2(used);
+	const uint32_t mask = half_size + half_size - 1;
+	ASSERT(used < mc_table.nbuckets_max);
+
+	const uint32_t source = used - half_size;
+	const uint32_t target = used;
+	struct mc_bucket *s_bucket = &part->buckets[source];
+	struct mc_bucket *t_bucket = &part->buckets[target];
+
+	// Mark the affected buckets as being modified before lock-free
+	// readers might see the new number of buckets.
+	mc_bucket_write_begin(s_bucket);
+	mc_bucket_write_begin(t_bucket);
+	mm_memory_store(part->nbuckets, used + 1);
+
+	// Distribute the source bucket entries between the two buckets.
+	struct mc_entry_list entries;
+	mc_action_drain_bucket(part, s_bucket, &entries);
+	mc_bucket_prepare(t_bucket);
+	while (!mc_entry_list_empty(&entries)) {
+		struct mc_entry *entry = mc_entry_list_remove(part, &entries);
+		uint32_t index = (entry->hash >> mc_table.part_bits) & mask;
+		if (index == source) {
+			mc_action_place_entry(part, s_bucket, entry);
+		} else {
+			ASSERT(index == target);
+			mc_action_place_entry(part, t_bucket, entry);
+		}
+	}
+
+	mc_bucket_write_end(s_bucket);
+	mc_bucket_write_end(t_bucket);
+
+	mc_table_lookup_unlock(action->part);
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+void
+mc_action_merge_low(struct mc_action *action)
+{
+	ENTER();
+
+	mc_table_lookup_lock(action->part);
+
+	struct mc_tpart *const part = action->part;
+	const uint32_t used = part->nbuckets - 1;
+	const uint32_t half_size = mm_lower_pow2(used);
+	ASSERT(used >= mc_table.nbuckets_min);
+
+	// This is the exact reverse of the split step that added the last
+	// bucket.
+	struct mc_bucket *s_bucket = &part->buckets[used];
+	struct mc_bucket *t_bucket = &part->buckets[used - half_size];
+
+	mc_bucket_write_begin(s_bucket);
+	mc_bucket_write_begin(t_bucket);
+	mm_memory_store(part->nbuckets, used);
+
+	struct mc_entry_list entries;
+	mc_action_drain_bucket(part, s_bucket, &entries);
+	while (!mc_entry_list_empty(&entries)) {
+		struct mc_entry *entry = mc_entry_list_remove(part, &entries);
+		mc_action_place_entry(part, t_bucket, entry);
+	}
+
+	mc_bucket_write_end(s_bucket);
+	mc_bucket_write_end(t_bucket);
+
 	mc_table_lookup_unlock(action->part);
 
 	mc_action_complete(action);
@@ -660,7 +1248,7 @@ mc_action_evict_low(struct mc_action *action)
 {
 	ENTER();
 
-	struct mm_stack victims;
+	struct mc_entry_list victims;
 	mc_table_lookup_lock(action->part);
 	bool found = mc_action_find_victims(action->part, &victims, 32);
 	mc_table_lookup_unlock(action->part);
@@ -676,6 +1264,134 @@ mc_action_evict_low(struct mc_action *action)
 	LEAVE();
 }
 
+/* Put an entry that is out of the table back to it as a new one. */
+static void
+mc_action_relink_entry(struct mc_tpart *part, struct mc_entry *entry)
+{
+	uint32_t index = mc_table_index(part, entry->hash);
+	struct mc_bucket *bucket = &part->buckets[index];
+	entry->state = MC_ENTRY_USED_MIN;
+	mc_bucket_write_begin(bucket);
+	mc_action_place_entry(part, bucket, entry);
+	mc_bucket_write_end(bucket);
+	mc_evict_insert(&part->evict, entry, NULL);
+	part->volume += mc_action_entry_volume(entry);
+}
+
+/* Replace an evicted entry with a stub that refers to its value written
+   to the disk tier. The victim is already out of the table. */
+static void
+mc_action_demote_entry(struct mc_tpart *part, struct mc_entry *victim, uint32_t time)
+{
+	if (mc_entry_is_disk(victim) || mc_action_is_expired_entry(part, victim, time))
+		return;
+	if (victim->value_len < MC_DISK_VALUE_MIN || victim->value_len > MC_DISK_VALUE_MAX)
+		return;
+
+	struct mc_entry *stub = mc_action_take_entry(part);
+	if (stub == NULL)
+		return;
+
+	struct mc_disk_ref ref;
+	uint32_t owner = mc_table_entry_index(part, stub) + 1;
+	if (!mc_disk_append(&part->disk, owner, victim, &ref)) {
+		stub->state = MC_ENTRY_NOT_USED;
+		mc_action_free_entry(part, stub);
+		return;
+	}
+
+	// The stub takes over everything but the value.
+	stub->state = MC_ENTRY_NOT_USED;
+	stub->ref_count = 1;
+	stub->hash = victim->hash;
+	stub->key_len = victim->key_len;
+	stub->value_len = sizeof ref;
+	stub->exp_time = victim->exp_time;
+	mc_action_alloc_chunks(part, stub);
+	mc_entry_setkey(stub, mc_entry_getkey(victim));
+	mc_entry_setflags(stub, mc_entry_getflags(victim));
+	mc_entry_setstamp(stub, mc_entry_getstamp(victim));
+	mc_entry_setlease(stub, mc_entry_getlease(victim) | MC_ENTRY_DISK);
+	mc_entry_setslack(stub, 0);
+	mc_disk_setref(stub, &ref);
+
+	mc_action_relink_entry(part, stub);
+	mc_table_replica_invalidate(part, stub->hash);
+}
+
+/* Put an evicted stub back as the disk tier is meant to keep many more
+   entries than fit the memory. But the stubs take memory too so they
+   are let go if there are too many. */
+static bool
+mc_action_keep_stub(struct mc_tpart *part, struct mc_entry *entry, uint32_t time)
+{
+	if (!mc_entry_is_disk(entry) || mc_action_is_expired_entry(part, entry, time))
+		return false;
+	size_t volume = mc_action_entry_volume(entry);
+	if (part->disk.nlive * volume > (part->volume_max >> MC_DISK_STUB_SHARE_SHIFT))
+		return false;
+	mc_action_relink_entry(part, entry);
+	return true;
+}
+
+void
+mc_action_spill_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	const uint32_t time = mc_action_get_exp_time();
+
+	struct mc_entry_list victims;
+	mc_entry_list_prepare(&victims);
+
+	mc_table_lookup_lock(part);
+	mc_table_freelist_lock(part);
+
+	// Stop as soon as the head segment is full as it has to be written
+	// out before the next value goes there. As the kept stubs make no
+	// room stop also when there is enough room already lest the other
+	// stubs are dropped for nothing. The eviction policy might return
+	// the kept stubs over and over again so they are not kept any more
+	// when all of them have come up.
+	uint32_t kept = 0;
+	for (uint32_t count = 0; count < 32 && !mc_disk_is_full(&part->disk); ) {
+		struct mc_entry_list found;
+		if (!mc_action_find_victims(part, &found, 1))
+			break;
+		struct mc_entry *victim = mc_entry_list_remove(part, &found);
+		if (kept < part->disk.nlive && mc_action_keep_stub(part, victim, time)) {
+			kept++;
+			continue;
+		}
+		count++;
+		mc_action_demote_entry(part, victim, time);
+		mc_entry_list_insert(part, &victims, victim);
+		if (part->volume < part->volume_max)
+			break;
+	}
+
+	mc_table_lookup_unlock(part);
+	mc_action_free_entries(part, &victims);
+	mc_table_freelist_unlock(part);
+	mc_table_reserve_entries(part);
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+/* Make the thread replicas of all the partition entries stale. */
+static void
+mc_action_invalidate_replicas(struct mc_tpart *part)
+{
+	if (mc_table.replicas) {
+		mm_memory_store_fence();
+		for (uint32_t i = 0; i < MC_TABLE_REPLICA_VERSIONS; i++)
+			mm_memory_store(part->replica_versions[i], part->replica_versions[i] + 1);
+	}
+}
+
 void
 mc_action_flush_low(struct mc_action *action)
 {
@@ -683,6 +1399,7 @@ mc_action_flush_low(struct mc_action *action)
 
 	mc_table_lookup_lock(action->part);
 	action->part->flush_stamp = action->part->stamp;
+	mc_action_invalidate_replicas(action->part);
 	mc_table_lookup_unlock(action->part);
 
 	mc_action_complete(action);
@@ -690,3 +1407,522 @@ mc_action_flush_low(struct mc_action *action)
 	LEAVE();
 }
 
+void
+mc_action_flush_namespace_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	mc_table_lookup_lock(part);
+	uint64_t stamp = part->stamp;
+	mm_memory_store(part->namespace_stamps[action->hash % MC_TABLE_NAMESPACES], stamp);
+	mm_memory_store(part->namespace_stamp, stamp);
+	mc_action_invalidate_replicas(part);
+	mc_table_lookup_unlock(part);
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+void
+mc_action_crawl_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	const uint32_t time = mc_action_get_exp_time();
+
+	struct mc_entry_list victims;
+	mc_entry_list_prepare(&victims);
+	uint32_t nchecked = 0, nvictims = 0;
+
+	mc_table_lookup_lock(part);
+
+	// Check a slice of entries starting from the crawler position.
+	struct mc_entry *entry = part->crawl_hand;
+	while (nchecked < MC_ACTION_CRAWL_SLICE && entry < part->entries_end) {
+		uint8_t state = entry->state;
+		if (state >= MC_ENTRY_USED_MIN && state <= MC_ENTRY_USED_MAX
+		    && mc_action_is_expired_entry(part, entry, time)) {
+			uint32_t index = mc_table_index(part, entry->hash);
+			mc_action_remove_entry(part, &part->buckets[index], entry);
+			mc_entry_list_insert(part, &victims, entry);
+			++nvictims;
+		}
+		++nchecked;
+		++entry;
+	}
+
+	// Start over after the end of the table.
+	if (entry == part->entries_end)
+		entry = part->entries;
+	part->crawl_hand = entry;
+	part->crawl_checked += nchecked;
+	part->crawl_reclaimed += nvictims;
+
+	mc_table_lookup_unlock(part);
+
+	if (nvictims) {
+		mc_table_freelist_lock(part);
+		mc_action_free_entries(part, &victims);
+		mc_table_freelist_unlock(part);
+		mc_table_release_entries(part);
+	}
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+/* Move a live log record to the head segment. Only the entries in the
+   table that nobody else refers to might be moved. */
+static void
+mc_action_move_record(struct mc_tpart *part, struct mc_log_record *record, uint32_t epoch)
+{
+	struct mc_entry *entry = mc_table_entry(part, record->owner - 1);
+	uint8_t state = entry->state;
+	if (state < MC_ENTRY_USED_MIN || state > MC_ENTRY_USED_MAX)
+		return;
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Make concurrent lock-free readers fall back to the locked lookup.
+	// Those that have already pinned the entry keep reading the old
+	// copy that stays intact until they leave the epoch.
+	if (mm_atomic_uint16_cas(&entry->ref_count, 1, 0) != 1)
+		return;
+#else
+	if (entry->ref_count != 1)
+		return;
+#endif
+
+	size_t size = mc_log_record_size(record);
+	char *data = mc_log_record_data(record);
+	char *copy = mc_log_alloc(&part->log, &part->data_space, size, record->owner, epoch);
+	if (copy != NULL) {
+		memcpy(copy, data, size);
+		mm_memory_store_fence();
+
+		// The record is either the entry data block or a value chunk.
+		if (mc_entry_getdata(entry) == data) {
+			mc_entry_setdata(entry, copy);
+		} else {
+			char **chunks = mc_entry_getchunks(entry);
+			uint32_t nchunks = mc_entry_nchunks(entry);
+			for (uint32_t i = 0; i < nchunks; i++) {
+				if (chunks[i] == data) {
+					chunks[i] = copy;
+					break;
+				}
+			}
+		}
+
+		mc_log_free(&part->log, data, epoch);
+		part->log.moved += size;
+	}
+
+	mc_action_unclaim_entry(entry);
+}
+
+void
+mc_action_compact_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	mc_table_lookup_lock(part);
+	mc_table_freelist_lock(part);
+
+	// Look at a bounded amount of data at once.
+	uint32_t epoch = mc_action_log_epoch();
+	size_t budget = MC_LOG_CLEAN_STEP;
+	while (budget) {
+		struct mc_log_record *record = mc_log_clean_next(&part->log, epoch);
+		if (record == NULL)
+			break;
+		budget -= min(budget, mc_log_record_size(record));
+		mc_action_move_record(part, record, epoch);
+	}
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	if (part->log.retired != NULL)
+		mc_table_epoch_advance();
+#endif
+	mc_log_reclaim(&part->log, &part->data_space, mc_action_log_epoch());
+
+	mc_table_freelist_unlock(part);
+	mc_table_lookup_unlock(part);
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+/* Move a live disk record to the head segment. Only the stubs in the
+   table that nobody else refers to might be fixed. Returns false if the
+   head segment is full. */
+static bool
+mc_action_move_disk_record(struct mc_tpart *part, struct mc_disk_record *record, uint32_t offset)
+{
+	struct mc_entry *entry = mc_table_entry(part, record->owner - 1);
+	uint8_t state = entry->state;
+	if (state < MC_ENTRY_USED_MIN || state > MC_ENTRY_USED_MAX || !mc_entry_is_disk(entry))
+		return true;
+
+	// The record might be dead and the entry reused since then.
+	struct mc_disk_ref ref;
+	mc_disk_getref(entry, &ref);
+	if (ref.segment != part->disk.victim || ref.offset != offset)
+		return true;
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Lock-free readers never pin stubs so they all hold a reference.
+	if (mm_atomic_uint16_cas(&entry->ref_count, 1, 0) != 1)
+		return true;
+#else
+	if (entry->ref_count != 1)
+		return true;
+#endif
+
+	bool moved = mc_disk_compact_move(&part->disk, &ref);
+	if (moved)
+		mc_disk_setref(entry, &ref);
+
+	mc_action_unclaim_entry(entry);
+	return moved;
+}
+
+void
+mc_action_compact_disk_low(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->part;
+	mc_table_lookup_lock(part);
+	mc_table_freelist_lock(part);
+
+	// Look at a bounded amount of data at once. Stay at the record that
+	// does not fit the head segment until the next one is started.
+	size_t budget = MC_DISK_SEGMENT_SIZE / 16;
+	while (budget && !mc_disk_is_full(&part->disk)) {
+		uint32_t offset;
+		struct mc_disk_record *record = mc_disk_compact_next(&part->disk, &offset);
+		if (record == NULL)
+			break;
+		if (!mc_action_move_disk_record(part, record, offset))
+			break;
+		budget -= min(budget, mc_disk_record_footprint(record->size));
+		mc_disk_compact_advance(&part->disk);
+	}
+
+	mc_table_freelist_unlock(part);
+	mc_table_lookup_unlock(part);
+
+	mc_action_complete(action);
+
+	LEAVE();
+}
+
+void
+mc_action_scan_low(struct mc_action_scan *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->base.part;
+	const uint32_t time = mc_action_get_exp_time();
+	uint32_t nchecked = 0;
+	action->nentries = 0;
+
+	mc_table_lookup_lock(part);
+
+	// Reference live entries starting from the scan position. Limit
+	// the number of checked entries to keep the lock hold time short.
+	struct mc_entry *entry = action->position;
+	struct mc_entry *end = mm_memory_load(part->entries_end);
+	while (action->nentries < MC_ACTION_SCAN_SLICE && nchecked < MC_ACTION_CRAWL_SLICE && entry < end) {
+		uint8_t state = entry->state;
+		if (state >= MC_ENTRY_USED_MIN && state <= MC_ENTRY_USED_MAX
+		    && !mc_action_is_expired_entry(part, entry, time)) {
+			mc_action_ref_entry(entry);
+			action->entries[action->nentries++] = entry;
+		}
+		++nchecked;
+		++entry;
+	}
+	action->position = entry < end ? entry : NULL;
+
+	mc_table_lookup_unlock(part);
+
+	mc_action_complete(&action->base);
+
+	LEAVE();
+}
+
+void
+mc_action_release_low(struct mc_action_scan *action)
+{
+	ENTER();
+
+	struct mc_tpart *const part = action->base.part;
+	for (uint32_t i = 0; i < action->nentries; i++) {
+		struct mc_entry *entry = action->entries[i];
+		if (mc_action_unref_entry(entry)) {
+			mc_table_freelist_lock(part);
+			mc_action_release_entry(part, entry);
+			mc_table_freelist_unlock(part);
+		}
+	}
+	action->nentries = 0;
+
+	mc_action_complete(&action->base);
+
+	LEAVE();
+}
+
+void
+mc_action_batch_low(struct mc_action_batch *batch)
+{
+	ENTER();
+
+	struct mc_tpart *const part = batch->base.part;
+	struct mc_entry_list freelist;
+	mc_entry_list_prepare(&freelist);
+	bool stored = false;
+
+	mc_table_lookup_lock(part);
+
+	for (uint32_t i = 0; i < batch->nactions; i++) {
+		struct mc_action *action = batch->actions[i];
+		struct mc_action_storage *storage = (struct mc_action_storage *) action;
+		ASSERT(action->part == part);
+
+		uint32_t index = mc_table_index(part, action->hash);
+		struct mc_bucket *bucket = &part->buckets[index];
+		mc_bucket_write_begin(bucket);
+
+		switch (batch->kinds[i]) {
+		case MC_ACTION_BATCH_LOOKUP:
+			mc_evict_record(&part->evict, action->hash);
+			mc_action_bucket_lookup(action, bucket, &freelist);
+			if (action->old_entry != NULL) {
+				mc_action_ref_entry(action->old_entry);
+				mc_action_access_entry(action->old_entry);
+			}
+			action->entry_pinned = false;
+			break;
+		case MC_ACTION_BATCH_INSERT:
+			mc_action_bucket_lookup(action, bucket, &freelist);
+			if (action->old_entry == NULL) {
+				mc_action_bucket_insert(storage, bucket, NULL, MC_ENTRY_USED_MIN);
+				stored = true;
+			}
+			break;
+		case MC_ACTION_BATCH_UPDATE:
+		case MC_ACTION_BATCH_CAS:
+			mc_action_bucket_update(storage, bucket, &freelist);
+			if (storage->entry_match) {
+				mc_action_access_entry(storage->new_entry);
+				stored = true;
+			}
+			break;
+		case MC_ACTION_BATCH_UPSERT:
+			mc_action_bucket_delete(action, bucket, &freelist);
+			mc_action_bucket_insert(storage, bucket, action->old_entry, MC_ENTRY_USED_MIN);
+			stored = true;
+			break;
+		default:
+			ABORT();
+		}
+
+		mc_bucket_write_end(bucket);
+	}
+
+	mc_table_lookup_unlock(part);
+
+	// Free the replaced entries and the new entries that failed to
+	// get into the table.
+	mc_table_freelist_lock(part);
+	if (!mc_entry_list_empty(&freelist))
+		mc_action_free_entries(part, &freelist);
+	for (uint32_t i = 0; i < batch->nactions; i++) {
+		struct mc_action_storage *storage = (struct mc_action_storage *) batch->actions[i];
+		uint8_t kind = batch->kinds[i];
+		if ((kind == MC_ACTION_BATCH_INSERT && storage->base.old_entry != NULL)
+		    || ((kind == MC_ACTION_BATCH_UPDATE || kind == MC_ACTION_BATCH_CAS)
+			&& !storage->entry_match)) {
+			mc_action_free_chunks(part, storage->new_entry);
+			mc_action_free_entry(part, storage->new_entry);
+		}
+	}
+	mc_table_freelist_unlock(part);
+
+	if (stored)
+		mc_table_reserve_volume(part);
+
+	mc_action_complete(&batch->base);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Lookup prefetching.
+ **********************************************************************/
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+
+void NONNULL(1)
+mc_action_prefetch(struct mc_action **actions, uint32_t nactions)
+{
+	ENTER();
+
+	// Each stage touches only the memory prefetched by the previous
+	// one so that the cache misses of all the actions overlap. This
+	// is done without locks, so a stale slot is only a wasted prefetch.
+	// But the buckets and entries are read and a table shrink unmaps
+	// the buckets it frees. It waits for the readers in the current
+	// epoch to leave so enter it for the time of reading.
+	mc_table_epoch_enter();
+
+	for (uint32_t i = 0; i < nactions; i++) {
+		struct mc_action *action = actions[i];
+		uint32_t index = mc_table_index(action->part, action->hash);
+		mm_prefetch(&action->part->buckets[index]);
+	}
+
+	for (uint32_t i = 0; i < nactions; i++) {
+		struct mc_action *action = actions[i];
+		struct mc_tpart *part = action->part;
+		struct mc_bucket *bucket = &part->buckets[mc_table_index(part, action->hash)];
+		uint32_t mask = mc_bucket_match(bucket, mc_bucket_tag(action->hash));
+		while (mask) {
+			uint32_t slot = mm_ctz(mask);
+			mask &= mask - 1;
+			mm_prefetch(mc_table_entry(part, mm_memory_load(bucket->slots[slot])));
+		}
+	}
+
+	for (uint32_t i = 0; i < nactions; i++) {
+		struct mc_action *action = actions[i];
+		struct mc_tpart *part = action->part;
+		struct mc_bucket *bucket = &part->buckets[mc_table_index(part, action->hash)];
+		uint32_t mask = mc_bucket_match(bucket, mc_bucket_tag(action->hash));
+		while (mask) {
+			uint32_t slot = mm_ctz(mask);
+			mask &= mask - 1;
+			struct mc_entry *entry = mc_table_entry(part, mm_memory_load(bucket->slots[slot]));
+			if (mm_memory_load(entry->hash) == action->hash)
+				mm_prefetch(mc_entry_getkey(entry));
+		}
+	}
+
+	mc_table_epoch_leave();
+
+	LEAVE();
+}
+
+#endif
+
+/**********************************************************************
+ * Actions on partitions owned by other threads.
+ **********************************************************************/
+
+static void
+mc_action_remote_complete_req(struct mm_context *context UNUSED, uintptr_t *arguments)
+{
+	struct mc_action *action = (struct mc_action *) arguments[0];
+	struct mm_fiber *fiber = (struct mm_fiber *) arguments[1];
+
+	// This runs on the thread of the waiting fiber so it cannot miss
+	// the flag and go to sleep in between.
+	action->ready = 1;
+	mm_fiber_run(fiber);
+}
+
+static void
+mc_action_remote_execute_req(struct mm_context *context UNUSED, uintptr_t *arguments)
+{
+	struct mc_action *action = (struct mc_action *) arguments[0];
+	mc_action_routine_t routine = (mc_action_routine_t) arguments[1];
+	struct mm_context *origin = (struct mm_context *) arguments[2];
+	struct mm_fiber *fiber = (struct mm_fiber *) arguments[3];
+
+	(*routine)(action);
+
+	mm_async_call_2(origin, mc_action_remote_complete_req, (uintptr_t) action, (uintptr_t) fiber);
+}
+
+static void
+mc_action_remote_finish_req(struct mm_context *context UNUSED, uintptr_t *arguments)
+{
+	struct mc_action action;
+	action.old_entry = (struct mc_entry *) arguments[0];
+	action.part = (struct mc_tpart *) arguments[1];
+
+	mc_action_finish_low(&action);
+}
+
+void NONNULL(1, 2)
+mc_action_remote_execute(struct mc_action *action, mc_action_routine_t routine)
+{
+	ENTER();
+
+	// The owner thread might be waiting for this one in turn so the
+	// incoming requests are handled by yielding while the request ring
+	// is full. Then the fiber sleeps until the owner wakes it up.
+	struct mm_context *const context = mm_context_selfptr();
+	action->ready = 0;
+	while (!mm_async_trycall_4(action->part->owner, mc_action_remote_execute_req,
+				   (uintptr_t) action, (uintptr_t) routine,
+				   (uintptr_t) context, (uintptr_t) context->fiber))
+		mm_fiber_yield(context);
+	while (!action->ready)
+		mm_fiber_block(context);
+
+	LEAVE();
+}
+
+void NONNULL(1)
+mc_action_remote_finish(struct mc_action *action)
+{
+	ENTER();
+
+	// Nothing is returned so there is no need to wait.
+	struct mm_context *const context = mm_context_selfptr();
+	while (!mm_async_trycall_2(action->part->owner, mc_action_remote_finish_req,
+				   (uintptr_t) action->old_entry, (uintptr_t) action->part))
+		mm_fiber_yield(context);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Table reattachment.
+ **********************************************************************/
+
+void NONNULL(1)
+mc_action_reattach(struct mc_tpart *part)
+{
+	ENTER();
+
+	mc_entry_list_prepare(&part->free_list);
+	part->nentries_free = 0;
+	part->volume = 0;
+
+	for (struct mc_entry *entry = part->entries; entry < part->entries_end; entry++) {
+		uint8_t state = entry->state;
+		if (state >= MC_ENTRY_USED_MIN && state <= MC_ENTRY_USED_MAX) {
+			// Only the table refers to the entry now.
+			entry->ref_count = 1;
+			part->volume += mc_action_entry_volume(entry);
+			mc_evict_insert(&part->evict, entry, entry);
+		} else if (state == MC_ENTRY_NOT_USED) {
+			// The entry was retired or not yet inserted.
+			mc_action_free_chunks(part, entry);
+			mc_action_free_entry(part, entry);
+		} else {
+			mc_entry_list_insert(part, &part->free_list, entry);
+			part->nentries_free++;
+		}
+	}
+
+	LEAVE();
+}
@@ -25,12 +25,28 @@
 #include "base/hash.h"
 #include "base/cksum.h"
 
-#if ENABLE_MEMCACHE_COMBINER
-# include "base/combiner.h"
-#endif
-#if ENABLE_MEMCACHE_DELEGATE
-# include "base/fiber/future.h"
-#endif
+#include "base/combiner.h"
+
+/* Values up to this size are copied out by lock-free readers rather
+   than referenced. */
+#define MC_ACTION_PEEK_COPY_MAX		(1024)
+
+/* The number of entries checked by the expiry crawler at once. */
+#define MC_ACTION_CRAWL_SLICE		(256)
+
+/* The number of entries referenced by a table scan at once. */
+#define MC_ACTION_SCAN_SLICE		(64)
+
+/* The maximum number of actions done in a single batch. */
+#define MC_ACTION_BATCH_SIZE		(64)
+
+/* The kinds of batched actions. */
+#define MC_ACTION_BATCH_NONE		0
+#define MC_ACTION_BATCH_LOOKUP		1
+#define MC_ACTION_BATCH_INSERT		2
+#define MC_ACTION_BATCH_UPDATE		3
+#define MC_ACTION_BATCH_UPSERT		4
+#define MC_ACTION_BATCH_CAS		5
 
 struct mc_action
 {
@@ -44,9 +60,8 @@ struct mc_action
 		bool ascii_get_last;
 	};
 
-#if ENABLE_MEMCACHE_COMBINER
+	/* Set when a remote or combined action is done. */
 	uint8_t ready;
-#endif
 
 	union
 	{
@@ -73,9 +88,15 @@ struct mc_action
 	/* A matching table entry. */
 	struct mc_entry *old_entry;
 
-#if ENABLE_MEMCACHE_DELEGATE
-	struct mm_future future;
-#endif
+	/* The matching entry is pinned by the reclamation epoch rather
+	   than referenced. It must be released with mc_action_unpin(). */
+	bool entry_pinned;
+
+	/* The kind of batched action already done for this one if any. */
+	uint8_t batched;
+
+	/* The new expiration time for the touch action. */
+	uint32_t exp_time;
 };
 
 struct mc_action_storage
@@ -88,8 +109,13 @@ struct mc_action_storage
 	/* A newly created table entry. */
 	struct mc_entry *new_entry;
 
-	/* The alter action value. */
-	const char *alter_value;
+	union
+	{
+		/* The alter action value. */
+		const char *alter_value;
+		/* The delta action argument and then its result. */
+		uint64_t delta_value;
+	};
 
 	/* The value length. */
 	uint32_t value_len;
@@ -101,9 +127,42 @@ struct mc_action_storage
 	bool entry_match;
 };
 
+/* A table scan that references a slice of live entries at a time. */
+struct mc_action_scan
+{
+	struct mc_action base;
+
+	/* The next entry to check, NULL after the end of the table. */
+	struct mc_entry *position;
+
+	/* The referenced entries. */
+	uint32_t nentries;
+	struct mc_entry *entries[MC_ACTION_SCAN_SLICE];
+};
+
+/* A number of actions for a single partition done at once. */
+struct mc_action_batch
+{
+	struct mc_action base;
+
+	uint32_t nactions;
+	uint8_t kinds[MC_ACTION_BATCH_SIZE];
+	struct mc_action *actions[MC_ACTION_BATCH_SIZE];
+};
+
+typedef void (*mc_action_routine_t)(struct mc_action *);
+
 void NONNULL(1)
 mc_action_lookup_low(struct mc_action *action);
 
+#if ENABLE_MEMCACHE_OPTIMISTIC
+void NONNULL(1)
+mc_action_peek_low(struct mc_action *action);
+#endif
+
+void NONNULL(1)
+mc_action_touch_low(struct mc_action *action);
+
 void NONNULL(1)
 mc_action_finish_low(struct mc_action *action);
 
@@ -132,20 +191,69 @@ void NONNULL(1)
 mc_action_alter_low(struct mc_action_storage *action);
 
 void NONNULL(1)
-mc_action_stride_low(struct mc_action *action);
+mc_action_increment_low(struct mc_action_storage *action);
+
+void NONNULL(1)
+mc_action_decrement_low(struct mc_action_storage *action);
+
+void NONNULL(1)
+mc_action_append_low(struct mc_action_storage *action);
+
+void NONNULL(1)
+mc_action_split_low(struct mc_action *action);
+
+void NONNULL(1)
+mc_action_merge_low(struct mc_action *action);
 
 void NONNULL(1)
 mc_action_evict_low(struct mc_action *action);
 
+void NONNULL(1)
+mc_action_spill_low(struct mc_action *action);
+
 void NONNULL(1)
 mc_action_flush_low(struct mc_action *action);
 
+void NONNULL(1)
+mc_action_flush_namespace_low(struct mc_action *action);
+
+void NONNULL(1)
+mc_action_crawl_low(struct mc_action *action);
+
+void
+mc_action_compact_low(struct mc_action *action);
+
+void NONNULL(1)
+mc_action_compact_disk_low(struct mc_action *action);
+
+void NONNULL(1)
+mc_action_scan_low(struct mc_action_scan *action);
+
+void NONNULL(1)
+mc_action_release_low(struct mc_action_scan *action);
+
+void NONNULL(1)
+mc_action_batch_low(struct mc_action_batch *batch);
+
+void NONNULL(1, 2)
+mc_action_remote_execute(struct mc_action *action, mc_action_routine_t routine);
+
+void NONNULL(1)
+mc_action_remote_finish(struct mc_action *action);
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+/* Bring the buckets and the candidate entries of a number of actions
+   into the cache ahead of their actual execution. */
+void NONNULL(1)
+mc_action_prefetch(struct mc_action **actions, uint32_t nactions);
+#endif
+
+void NONNULL(1)
+mc_action_reattach(struct mc_tpart *part);
+
 static inline void NONNULL(1)
 mc_action_cleanup(struct mc_action *action UNUSED)
 {
-#if ENABLE_MEMCACHE_DELEGATE
-	mm_future_unique_cleanup(&action->future);
-#endif
 }
 
 static inline void NONNULL(1)
@@ -163,49 +271,66 @@ mc_action_set_key(struct mc_action *action, const char *key, uint16_t key_len)
 	mc_action_hash(action);
 }
 
-static inline void NONNULL(1)
-mc_action_wait(struct mc_action *action UNUSED)
-{
-#if ENABLE_MEMCACHE_COMBINER
-	while (!action->ready)
-		mm_spin_pause();
-	mm_memory_load_fence();
-#elif ENABLE_MEMCACHE_DELEGATE
-	mm_future_unique_wait(&action->future);
-#endif
-}
-
-#if ENABLE_MEMCACHE_COMBINER
 static inline void NONNULL(1, 2)
-mc_combiner_execute(struct mc_action *action, void (*routine)(struct mc_action *))
+mc_combiner_execute(struct mc_action *action, mc_action_routine_t routine)
 {
 	action->ready = 0;
 	mm_memory_fence();
-	mm_combiner_execute(action->part->combiner, (mm_combiner_routine_t) routine, (uintptr_t) action);
-	mc_action_wait(action);
+	// The routine takes the action pointer as the combiner data.
+	mm_combiner_execute(action->part->combiner, (mm_combiner_routine_t) (void (*)(void)) routine, (uintptr_t) action);
+	while (!mm_memory_load(action->ready))
+		mm_cpu_backoff();
+	mm_memory_load_fence();
 }
-#endif
 
-#if ENABLE_MEMCACHE_DELEGATE
+/* Execute an action with the table access method in use. The routine
+   is known at each call site so the locking case ends up as a direct
+   call. */
 static inline void NONNULL(1, 2)
-mc_delegate_execute(struct mc_action *action, void (*routine)(struct mc_action *))
+mc_action_execute(struct mc_action *action, mc_action_routine_t routine)
 {
-	mm_future_unique_prepare(&action->future, (mm_routine_t) routine, (mm_value_t) action);
-	mm_future_unique_start(&action->future, action->part->target);
-	mc_action_wait(action);
+	if (mc_table.access == MC_ACCESS_COMBINER)
+		mc_combiner_execute(action, routine);
+	else if (mc_table_is_remote(action->part))
+		mc_action_remote_execute(action, routine);
+	else
+		(*routine)(action);
 }
-#endif
 
 /* Find an entry. */
 static inline void NONNULL(1)
 mc_action_lookup(struct mc_action *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_lookup_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_lookup_low);
+	mc_action_execute(action, mc_action_lookup_low);
+}
+
+/* Find an entry and update its expiration time. */
+static inline void NONNULL(1)
+mc_action_touch(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_touch_low);
+	action->entry_pinned = false;
+}
+
+/* Find an entry for read-only use. */
+static inline void NONNULL(1)
+mc_action_peek(struct mc_action *action)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mc_action_peek_low(action);
 #else
-	mc_action_lookup_low(action);
+	mc_action_lookup(action);
+	action->entry_pinned = false;
+#endif
+}
+
+/* Finish using an entry pinned by mc_action_peek(). */
+static inline void NONNULL(1)
+mc_action_unpin(struct mc_action *action UNUSED)
+{
+	ASSERT(action->entry_pinned);
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mc_table_epoch_leave();
 #endif
 }
 
@@ -213,26 +338,17 @@ mc_action_lookup(struct mc_action *action)
 static inline void NONNULL(1)
 mc_action_finish(struct mc_action *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_finish_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_finish_low);
-#else
-	mc_action_finish_low(action);
-#endif
+	if (mc_table_is_remote(action->part))
+		mc_action_remote_finish(action);
+	else
+		mc_action_execute(action, mc_action_finish_low);
 }
 
 /* Delete a matching entry if any. */
 static inline void NONNULL(1)
 mc_action_delete(struct mc_action *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_delete_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_delete_low);
-#else
-	mc_action_delete_low(action);
-#endif
+	mc_action_execute(action, mc_action_delete_low);
 }
 
 /* Create a new entry. */
@@ -240,13 +356,7 @@ static inline void NONNULL(1)
 mc_action_create(struct mc_action_storage *action, uint32_t value_len)
 {
 	action->value_len = value_len;
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_create_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_create_low);
-#else
-	mc_action_create_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_create_low);
 }
 
 /* Resize a new entry. */
@@ -254,118 +364,148 @@ static inline void NONNULL(1)
 mc_action_resize(struct mc_action_storage *action, uint32_t value_len)
 {
 	action->value_len = value_len;
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_resize_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_resize_low);
-#else
-	mc_action_resize_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_resize_low);
 }
 
 /* Abandon a newly created entry. */
 static inline void NONNULL(1)
 mc_action_cancel(struct mc_action_storage *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_cancel_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_cancel_low);
-#else
-	mc_action_cancel_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_cancel_low);
 }
 
 /* Insert a newly created entry. */
 static inline void NONNULL(1)
 mc_action_insert(struct mc_action_storage *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_insert_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_insert_low);
-#else
-	mc_action_insert_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_insert_low);
 }
 
 /* Replace a matching entry if any. */
 static inline void NONNULL(1)
 mc_action_update(struct mc_action_storage *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_update_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_update_low);
-#else
-	mc_action_update_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_update_low);
 }
 
 /* Either replace a matching entry or insert a new one. */
 static inline void NONNULL(1)
 mc_action_upsert(struct mc_action_storage *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_upsert_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_upsert_low);
-#else
-	mc_action_upsert_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_upsert_low);
 }
 
 /* Replace a matching entry with conflict detection. */
 static inline void NONNULL(1)
 mc_action_alter(struct mc_action_storage *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_alter_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_alter_low);
-#else
-	mc_action_alter_low(action);
-#endif
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_alter_low);
 }
 
+/* Increment a numeric value in place if it has room for the result. */
 static inline void NONNULL(1)
-mc_action_stride(struct mc_action *action)
+mc_action_increment(struct mc_action_storage *action, uint64_t delta)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_stride_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_stride_low);
-#else
-	mc_action_stride_low(action);
-#endif
+	action->delta_value = delta;
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_increment_low);
+}
+
+/* Decrement a numeric value in place. */
+static inline void NONNULL(1)
+mc_action_decrement(struct mc_action_storage *action, uint64_t delta)
+{
+	action->delta_value = delta;
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_decrement_low);
+}
+
+/* Append to a value in place if it has enough slack. */
+static inline void NONNULL(1)
+mc_action_append(struct mc_action_storage *action)
+{
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_append_low);
+}
+
+/* Add a bucket splitting the entries of an older one. */
+static inline void NONNULL(1)
+mc_action_split(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_split_low);
+}
+
+/* Remove the last bucket moving its entries back to the one it was
+   split from. */
+static inline void NONNULL(1)
+mc_action_merge(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_merge_low);
 }
 
 static inline void NONNULL(1)
 mc_action_evict(struct mc_action *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_evict_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_evict_low);
-#else
-	mc_action_evict_low(action);
-#endif
+	mc_action_execute(action, mc_action_evict_low);
+}
+
+/* Evict some entries moving their long values to the disk tier. */
+static inline void NONNULL(1)
+mc_action_spill(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_spill_low);
 }
 
 static inline void NONNULL(1)
 mc_action_flush(struct mc_action *action)
 {
-#if ENABLE_MEMCACHE_COMBINER
-	mc_combiner_execute(action, mc_action_flush_low);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mc_delegate_execute(action, mc_action_flush_low);
-#else
-	mc_action_flush_low(action);
-#endif
+	mc_action_execute(action, mc_action_flush_low);
 }
 
-#if ENABLE_MEMCACHE_COMBINER
-void mc_action_perform(uintptr_t data);
-#endif
+/* Flush the namespace with the hash given in the action. */
+static inline void NONNULL(1)
+mc_action_flush_namespace(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_flush_namespace_low);
+}
+
+static inline void NONNULL(1)
+mc_action_crawl(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_crawl_low);
+}
+
+/* Move some live data out of the log segment being cleaned. */
+static inline void NONNULL(1)
+mc_action_compact(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_compact_low);
+}
+
+/* Move some live records out of the disk segment being compacted. */
+static inline void NONNULL(1)
+mc_action_compact_disk(struct mc_action *action)
+{
+	mc_action_execute(action, mc_action_compact_disk_low);
+}
+
+/* Reference the next slice of live entries. */
+static inline void NONNULL(1)
+mc_action_scan(struct mc_action_scan *action)
+{
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_scan_low);
+}
+
+/* Release the entries referenced by the last scan. */
+static inline void NONNULL(1)
+mc_action_release(struct mc_action_scan *action)
+{
+	mc_action_execute(&action->base, (mc_action_routine_t) mc_action_release_low);
+}
+
+/* Do a number of lookup and storage actions under a single lock. The
+   storage actions must have their new entries created. */
+static inline void NONNULL(1)
+mc_action_batch(struct mc_action_batch *batch)
+{
+	mc_action_execute(&batch->base, (mc_action_routine_t) mc_action_batch_low);
+}
 
 #endif /* MEMCACHE_ACTION_H */
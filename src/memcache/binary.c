@@ -19,6 +19,7 @@
 
 #include "memcache/binary.h"
 #include "memcache/command.h"
+#include "memcache/compress.h"
 #include "memcache/state.h"
 
 #include "base/bytes.h"
@@ -27,6 +28,7 @@
 
 #define MC_BINARY_STORAGE_EXTRA_SIZE	(8)
 #define MC_BINARY_DELTA_EXTRA_SIZE	(20)
+#define MC_BINARY_TOUCH_EXTRA_SIZE	(4)
 
 static const struct mc_command_type *mc_binary_commands[256] = {
 	[MC_BINARY_OPCODE_GET]		= &mc_command_binary_get,
@@ -56,6 +58,9 @@ static const struct mc_command_type *mc_binary_commands[256] = {
 	[MC_BINARY_OPCODE_FLUSHQ]	= &mc_command_binary_flushq,
 	[MC_BINARY_OPCODE_VERSION]	= &mc_command_binary_version,
 	[MC_BINARY_OPCODE_STAT]		= &mc_command_binary_stat,
+	[MC_BINARY_OPCODE_TOUCH]	= &mc_command_binary_touch,
+	[MC_BINARY_OPCODE_GAT]		= &mc_command_binary_gat,
+	[MC_BINARY_OPCODE_GATQ]		= &mc_command_binary_gatq,
 };
 
 static bool
@@ -181,13 +186,12 @@ mc_binary_storage_command(struct mc_state *state, const struct mc_command_type *
 
 	// Initialize the entry and its key.
 	struct mc_entry *entry = command->action.new_entry;
-	entry->flags = mm_ntohl(extras.flags);
+	mc_entry_setflags(entry, mm_ntohl(extras.flags));
 	entry->exp_time = mc_entry_fix_exptime(mm_ntohl(extras.exp_time));
 	mc_entry_setkey(entry, command->action.base.key);
 
 	// Read the entry value.
-	char *value = mc_entry_getvalue(entry);
-	mm_netbuf_read(&state->sock, value, entry->value_len);
+	mc_compress_read_value(state, &command->action);
 
 	return true;
 }
@@ -259,6 +263,26 @@ mc_binary_delta_command(struct mc_state *state, const struct mc_command_type *ty
 	return true;
 }
 
+static bool
+mc_binary_touch_command(struct mc_state *state, const struct mc_command_type *type,
+			const struct mc_binary_header *header, uint16_t key_len)
+{
+	if (!mc_binary_fill(state, key_len + MC_BINARY_TOUCH_EXTRA_SIZE))
+		return false;
+
+	// Read the extras.
+	uint32_t exp_time;
+	mm_netbuf_read(&state->sock, &exp_time, MC_BINARY_TOUCH_EXTRA_SIZE);
+
+	struct mc_command_simple *command = mc_command_create_binary_simple(state, type, header);
+	command->action.exp_time = mc_entry_fix_exptime(mm_ntohl(exp_time));
+
+	// Read the key.
+	mc_binary_set_key(state, &command->action, key_len);
+
+	return true;
+}
+
 static bool
 mc_binary_flush_command(struct mc_state *state, const struct mc_command_type *type,
 			const struct mc_binary_header *header, uint8_t ext_len)
@@ -349,6 +373,13 @@ mc_binary_parse(struct mc_state *state)
 			rc = mc_binary_delta_command(state, type, header, key_len);
 		break;
 
+	case MC_COMMAND_TOUCH:
+		if (unlikely(ext_len != MC_BINARY_TOUCH_EXTRA_SIZE) || unlikely(key_len + ext_len != body_len) || unlikely(key_len == 0))
+			rc = mc_binary_invalid_arguments(state, header, body_len);
+		else
+			rc = mc_binary_touch_command(state, type, header, key_len);
+		break;
+
 	case MC_COMMAND_FLUSH:
 		if (unlikely(ext_len != 0 && ext_len != 4) || unlikely(key_len != 0) || unlikely(body_len != ext_len))
 			rc = mc_binary_invalid_arguments(state, header, body_len);
@@ -57,6 +57,9 @@ struct mc_state;
 #define MC_BINARY_OPCODE_FLUSHQ			0x18
 #define MC_BINARY_OPCODE_APPENDQ		0x19
 #define MC_BINARY_OPCODE_PREPENDQ		0x1a
+#define MC_BINARY_OPCODE_TOUCH			0x1c
+#define MC_BINARY_OPCODE_GAT			0x1d
+#define MC_BINARY_OPCODE_GATQ			0x1e
 
 /* Binary protocol response status codes. */
 #define MC_BINARY_STATUS_NO_ERROR		0x00
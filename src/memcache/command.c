@@ -19,7 +19,11 @@
 
 #include "memcache/command.h"
 #include "memcache/binary.h"
+#include "memcache/compress.h"
 #include "memcache/entry.h"
+#include "memcache/hotkeys.h"
+#include "memcache/replica.h"
+#include "memcache/snapshot.h"
 #include "memcache/state.h"
 #include "memcache/table.h"
 
@@ -31,6 +35,10 @@
 #include "base/net/net.h"
 #include "base/thread/domain.h"
 
+#include <stdio.h>
+
+extern struct mm_memcache_config mc_config;
+
 // The logging verbosity level.
 static uint8_t mc_verbose = 0;
 
@@ -41,6 +49,8 @@ static char mc_result_ok[] = "OK\r\n";
 static char mc_result_end[] = "END\r\n";
 static char mc_result_end2[] = "\r\nEND\r\n";
 static char mc_result_error[] = "ERROR\r\n";
+static char mc_result_bad_format[] = "CLIENT_ERROR bad command line format\r\n";
+static char mc_result_bad_chunk[] = "CLIENT_ERROR bad data chunk\r\n";
 static char mc_result_exists[] = "EXISTS\r\n";
 static char mc_result_stored[] = "STORED\r\n";
 static char mc_result_deleted[] = "DELETED\r\n";
@@ -50,10 +60,28 @@ static char mc_result_not_stored[] = "NOT_STORED\r\n";
 static char mc_result_delta_non_num[] = "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
 static char mc_result_not_implemented[] = "SERVER_ERROR not implemented\r\n";
 static char mc_result_version[] = "VERSION " VERSION "\r\n";
+static char mc_result_no_snapshot[] = "SERVER_ERROR snapshot file is not configured\r\n";
+static char mc_result_snapshot_busy[] = "SERVER_ERROR snapshot is already in progress\r\n";
+static char mc_result_no_namespaces[] = "SERVER_ERROR key namespaces are not configured\r\n";
+
+// Meta command reply codes, the reply flags follow them.
+static char mc_result_meta_hd[] = "HD";
+static char mc_result_meta_en[] = "EN";
+static char mc_result_meta_ex[] = "EX";
+static char mc_result_meta_nf[] = "NF";
+static char mc_result_meta_ns[] = "NS";
+static char mc_result_meta_mn[] = "MN\r\n";
 
 #define RES_N(res)		(sizeof(res) - 1)
 #define WRITE(sock, res)	mm_netbuf_write(sock, res, RES_N(res))
 
+// Meta command reply lease flags: the client has won the lease to
+// refill the entry (W), the entry is stale (X), the lease has already
+// been won by another client (Z).
+#define MC_COMMAND_LEASE_WIN	1
+#define MC_COMMAND_LEASE_STALE	2
+#define MC_COMMAND_LEASE_HOLD	4
+
 /**********************************************************************
  * Command type definitions.
  **********************************************************************/
@@ -104,6 +132,91 @@ mc_command_stat_aggregate(struct mc_command_stat *stat)
 #undef MC_STAT_ADD
 }
 
+struct mc_command_crawl_stat
+{
+	unsigned long long runs;
+	unsigned long long checked;
+	unsigned long long reclaimed;
+};
+
+static void
+mc_command_crawl_stat_aggregate(struct mc_command_crawl_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		stat->runs += mm_memory_load(part->crawl_runs);
+		stat->checked += mm_memory_load(part->crawl_checked);
+		stat->reclaimed += mm_memory_load(part->crawl_reclaimed);
+	}
+}
+
+struct mc_command_memory_stat
+{
+	unsigned long long bytes;
+	unsigned long long limit;
+	unsigned long long overhead;
+};
+
+static void
+mc_command_memory_stat_aggregate(struct mc_command_memory_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		stat->bytes += mm_memory_load(part->volume);
+	}
+	stat->limit = mm_memory_load(mc_table.memory_max);
+	stat->overhead = mm_memory_load(mc_table.memory_overhead);
+}
+
+struct mc_command_log_stat
+{
+	unsigned long long bytes;
+	unsigned long long live;
+	unsigned long long cleaned;
+	unsigned long long moved;
+};
+
+static void
+mc_command_log_stat_aggregate(struct mc_command_log_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		stat->bytes += mc_log_size(&part->log);
+		stat->live += mm_memory_load(part->log.live);
+		stat->cleaned += mm_memory_load(part->log.cleaned);
+		stat->moved += mm_memory_load(part->log.moved);
+	}
+}
+
+struct mc_command_disk_stat
+{
+	unsigned long long bytes;
+	unsigned long long live;
+	unsigned long long items;
+	unsigned long long written;
+	unsigned long long compacted;
+	unsigned long long moved;
+};
+
+static void
+mc_command_disk_stat_aggregate(struct mc_command_disk_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_disk *disk = &mc_table.parts[i].disk;
+		uint32_t nused = disk->nsegments - mm_memory_load(disk->nfree);
+		stat->bytes += (unsigned long long) nused * MC_DISK_SEGMENT_SIZE;
+		stat->live += mm_memory_load(disk->live);
+		stat->items += mm_memory_load(disk->items);
+		stat->written += mm_memory_load(disk->written_bytes);
+		stat->compacted += mm_memory_load(disk->compacted);
+		stat->moved += mm_memory_load(disk->moved);
+	}
+}
+
 /**********************************************************************
  * Memcache command creation.
  **********************************************************************/
@@ -113,6 +226,7 @@ mc_command_prepare_base(struct mc_command_base *base, const struct mc_command_ty
 {
 	base->type = type;
 	base->next = NULL;
+	mc_command_action(base)->batched = MC_ACTION_BATCH_NONE;
 
 	if (state->command_last == NULL) {
 		state->command_first = base;
@@ -142,6 +256,34 @@ mc_command_create_ascii_storage(struct mc_state *state, const struct mc_command_
 
 	struct mc_command_storage *command = mm_buffer_embed(&state->sock.txbuf, sizeof(struct mc_command_storage));
 	mc_command_prepare_base(&command->base, type, state);
+	// Only the cas command has a stamp to match.
+	command->action.stamp = 0;
+
+	LEAVE();
+	return command;
+}
+
+struct mc_command_meta * NONNULL(1, 2)
+mc_command_create_meta(struct mc_state *state, const struct mc_command_type *type)
+{
+	ENTER();
+
+	struct mc_command_meta *command = mm_buffer_embed(&state->sock.txbuf, sizeof(struct mc_command_meta));
+	mc_command_prepare_base(&command->storage.base, type, state);
+	command->storage.action.stamp = 0;
+	command->storage.action.new_entry = NULL;
+	command->storage.action.own_alter_value = false;
+	command->storage.binary_value = 0;
+	command->storage.binary_delta = 1;
+	command->opaque_len = 0;
+	command->nflags = 0;
+	command->quiet = false;
+	command->touch = false;
+	command->vivify = false;
+	command->invalidate = false;
+	command->mode = type == &mc_command_ascii_ma ? 'I' : 'S';
+	command->exp_time = 0;
+	command->recache_time = 0;
 
 	LEAVE();
 	return command;
@@ -175,10 +317,204 @@ mc_command_create_binary_storage(struct mc_state *state, const struct mc_command
 	return command;
 }
 
+/**********************************************************************
+ * Batched table access.
+ **********************************************************************/
+
+/* Find out which kind of batched action a command needs if any. */
+static uint8_t
+mc_command_batch_kind(struct mc_command_base *command)
+{
+	const struct mc_command_type *type = command->type;
+	if (type->kind == MC_COMMAND_LOOKUP) {
+		// The mg command that touches, creates or leases the entry
+		// has to see it right when the command is executed.
+		if (type == &mc_command_ascii_mg) {
+			struct mc_command_meta *meta = (struct mc_command_meta *) command;
+			if (meta->touch || meta->vivify || meta->recache_time)
+				return MC_ACTION_BATCH_NONE;
+		}
+		return MC_ACTION_BATCH_LOOKUP;
+	}
+	if (type->kind != MC_COMMAND_STORAGE)
+		return MC_ACTION_BATCH_NONE;
+
+	struct mc_command_storage *storage = (struct mc_command_storage *) command;
+	if (type == &mc_command_ascii_ms) {
+		switch (((struct mc_command_meta *) command)->mode) {
+		case 'S':
+			return MC_ACTION_BATCH_UPSERT;
+		case 'E':
+			return MC_ACTION_BATCH_INSERT;
+		case 'R':
+			return MC_ACTION_BATCH_UPDATE;
+		case 'C':
+			return MC_ACTION_BATCH_CAS;
+		default:
+			return MC_ACTION_BATCH_NONE;
+		}
+	}
+	if (type == &mc_command_ascii_set)
+		return MC_ACTION_BATCH_UPSERT;
+	if (type == &mc_command_binary_set || type == &mc_command_binary_setq)
+		return storage->action.stamp ? MC_ACTION_BATCH_CAS : MC_ACTION_BATCH_UPSERT;
+	if (type == &mc_command_ascii_add || type == &mc_command_binary_add
+	    || type == &mc_command_binary_addq)
+		return MC_ACTION_BATCH_INSERT;
+	if (type == &mc_command_ascii_replace)
+		return MC_ACTION_BATCH_UPDATE;
+	if (type == &mc_command_ascii_cas)
+		return MC_ACTION_BATCH_CAS;
+	if (type == &mc_command_binary_replace || type == &mc_command_binary_replaceq)
+		return storage->action.stamp ? MC_ACTION_BATCH_CAS : MC_ACTION_BATCH_UPDATE;
+	return MC_ACTION_BATCH_NONE;
+}
+
+struct mc_command_base * NONNULL(1)
+mc_command_batch(struct mc_command_base *command)
+{
+	ENTER();
+
+	// Collect a run of commands with simple table access.
+	uint32_t nactions = 0;
+	uint8_t kinds[MC_ACTION_BATCH_SIZE];
+	struct mc_action *actions[MC_ACTION_BATCH_SIZE];
+	while (command != NULL && nactions < MC_ACTION_BATCH_SIZE) {
+		uint8_t kind = mc_command_batch_kind(command);
+		if (kind == MC_ACTION_BATCH_NONE)
+			break;
+		kinds[nactions] = kind;
+		actions[nactions++] = mc_command_action(command);
+		command = command->next;
+	}
+	if (nactions == 0) {
+		command = command->next;
+		goto leave;
+	}
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Overlap the cache misses of all the actions. The keys are hashed
+	// already by the parser.
+	if (nactions > 1)
+		mc_action_prefetch(actions, nactions);
+#endif
+
+	// Do the actions of every partition in a single batch. The order
+	// of actions matters only within the same partition.
+	struct mc_action_batch batch;
+	for (uint32_t i = 0; i < nactions; i++) {
+		if (actions[i] == NULL)
+			continue;
+
+		bool modify = false;
+		batch.base.part = actions[i]->part;
+		batch.nactions = 0;
+		for (uint32_t j = i; j < nactions; j++) {
+			if (actions[j] == NULL || actions[j]->part != batch.base.part)
+				continue;
+			batch.kinds[batch.nactions] = kinds[j];
+			batch.actions[batch.nactions++] = actions[j];
+			modify |= kinds[j] != MC_ACTION_BATCH_LOOKUP;
+			actions[j] = NULL;
+		}
+
+		// A single action gains nothing from batching. Lock-free
+		// lookups are better off as is unless they are mixed with
+		// updates.
+		if (batch.nactions < 2)
+			continue;
+#if ENABLE_MEMCACHE_OPTIMISTIC
+		if (!modify)
+			continue;
+#else
+		(void) modify;
+#endif
+
+		for (uint32_t j = 0; j < batch.nactions; j++)
+			batch.actions[j]->batched = batch.kinds[j];
+		mc_action_batch(&batch);
+		mc_action_cleanup(&batch.base);
+	}
+
+leave:
+	LEAVE();
+	return command;
+}
+
 /**********************************************************************
  * Command processing helpers.
  **********************************************************************/
 
+static void
+mc_command_sample(struct mc_state *state, struct mc_action *action)
+{
+	uint32_t count = mc_hotkeys_sample(state->hotkeys, action);
+	if (unlikely(count >= MC_REPLICA_HOT) && state->replicas != NULL)
+		mc_replica_promote(state->replicas, state->hotkeys, action);
+}
+
+static void
+mc_command_peek(struct mc_state *state, struct mc_action *action)
+{
+	mc_command_sample(state, action);
+	if (!action->batched)
+		mc_action_peek(action);
+}
+
+/* Find an entry for a plain read. Hot ones might come from replicas. */
+static void
+mc_command_peek_value(struct mc_state *state, struct mc_action *action)
+{
+	mc_command_sample(state, action);
+	if (action->batched)
+		return;
+
+	struct mc_replica *replica = NULL;
+	if (state->replicas != NULL) {
+		replica = mc_replica_find(state->replicas, action);
+		if (replica != NULL && mc_replica_read(replica, action)) {
+			mm_counter_local_inc(&state->stat->replica_hits);
+			return;
+		}
+	}
+
+	mc_action_peek(action);
+	if (replica != NULL)
+		mc_replica_fill(replica, action);
+}
+
+static void
+mc_command_insert(struct mc_action_storage *action)
+{
+	if (!action->base.batched)
+		mc_action_insert(action);
+}
+
+static void
+mc_command_update(struct mc_action_storage *action)
+{
+	if (!action->base.batched)
+		mc_action_update(action);
+}
+
+static void
+mc_command_upsert(struct mc_action_storage *action)
+{
+	if (!action->base.batched)
+		mc_action_upsert(action);
+}
+
+/* Check if a storage action has to match the entry stamp. A batched
+   action replaces the stamp with the new one, so the batch kind tells
+   it then. */
+static bool
+mc_command_match_stamp(struct mc_action_storage *action)
+{
+	if (action->base.batched)
+		return action->base.batched == MC_ACTION_BATCH_CAS;
+	return action->stamp != 0;
+}
+
 static void
 mc_command_quit(struct mc_state *state)
 {
@@ -200,6 +536,20 @@ mc_command_flush(uint32_t exptime)
 	}
 }
 
+/* Flush the namespace in every partition as its keys are spread over
+   all of them. */
+static void
+mc_command_flush_namespace(const char *name, uint32_t name_len)
+{
+	uint32_t hash = mc_hash(name, name_len);
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_action action;
+		action.part = &mc_table.parts[i];
+		action.hash = hash;
+		mc_action_flush_namespace(&action);
+	}
+}
+
 static void
 mc_command_transmit_unref(uintptr_t data)
 {
@@ -215,41 +565,240 @@ mc_command_transmit_unref(uintptr_t data)
 	LEAVE();
 }
 
+/* A decompressed value that is spliced to the socket. */
+struct mc_command_value
+{
+	/* The entry to release along with the value, NULL if pinned. The
+	   entry key might still be spliced too. */
+	struct mc_entry *entry;
+	char data[];
+};
+
 static void
+mc_command_transmit_free(uintptr_t data)
+{
+	ENTER();
+
+	struct mc_command_value *value = (struct mc_command_value *) data;
+	if (value->entry != NULL)
+		mc_command_transmit_unref((uintptr_t) value->entry);
+	mm_memory_free(value);
+
+	LEAVE();
+}
+
+/* Read the value of a disk stub before anything is sent for it as the
+   reply cannot be taken back then. The stub is never pinned so it is
+   released along with the value. On a disk error it is released at once
+   and the entry is taken for a miss. */
+static bool
+mc_command_fetch_value(struct mc_action *action, struct mc_command_value **value)
+{
+	struct mc_entry *entry = action->old_entry;
+	if (!mc_entry_is_disk(entry)) {
+		*value = NULL;
+		return true;
+	}
+
+	uint32_t value_len = mc_disk_length(entry);
+	*value = mm_memory_xalloc(sizeof(struct mc_command_value) + value_len);
+	if (!mc_disk_copy_value((*value)->data, entry)) {
+		mm_memory_free(*value);
+		mc_action_finish(action);
+		action->old_entry = NULL;
+		return false;
+	}
+	(*value)->entry = entry;
+	return true;
+}
+
+static void
+mc_command_transmit_value(struct mc_state *state, struct mc_action *action, struct mc_command_value *fetched)
+{
+	ENTER();
+
+	struct mc_entry *entry = action->old_entry;
+	if (fetched != NULL) {
+		mm_netbuf_splice(&state->sock, fetched->data, mc_disk_length(entry),
+				 mc_command_transmit_free, (uintptr_t) fetched);
+	} else if (mc_entry_is_compressed(entry)) {
+		// Splice the decompressed value so that it is not copied
+		// once again.
+		uint32_t value_len = mc_compress_length(entry);
+		struct mc_command_value *value = mm_memory_xalloc(sizeof(struct mc_command_value) + value_len);
+		mc_compress_copy_value(value->data, entry);
+		if (action->entry_pinned) {
+			mc_action_unpin(action);
+			value->entry = NULL;
+		} else {
+			value->entry = entry;
+		}
+		mm_netbuf_splice(&state->sock, value->data, value_len,
+				 mc_command_transmit_free, (uintptr_t) value);
+	} else if (action->entry_pinned) {
+		mm_netbuf_write(&state->sock, mc_entry_getvalue(entry), entry->value_len);
+		mc_action_unpin(action);
+	} else if (!mc_entry_is_chunked(entry)) {
+		mm_netbuf_splice(&state->sock, mc_entry_getvalue(entry), entry->value_len,
+				 mc_command_transmit_unref, (uintptr_t) entry);
+	} else {
+		// Splice every chunk as a separate segment. The entry is
+		// released along with the last one.
+		char **chunks = mc_entry_getchunks(entry);
+		uint32_t last = mc_entry_nchunks(entry) - 1;
+		for (uint32_t i = 0; i < last; i++)
+			mm_netbuf_splice(&state->sock, chunks[i], MC_ENTRY_CHUNK_SIZE, NULL, 0);
+		mm_netbuf_splice(&state->sock, chunks[last], mc_entry_chunk_size(entry, last),
+				 mc_command_transmit_unref, (uintptr_t) entry);
+	}
+
+	LEAVE();
+}
+
+static bool
 mc_command_transmit_entry(struct mc_state *state, struct mc_command_simple *command, bool cas)
 {
 	ENTER();
+	bool rc = true;
+
+	struct mc_command_value *fetched;
+	if (!mc_command_fetch_value(&command->action, &fetched)) {
+		rc = false;
+		goto leave;
+	}
 
 	struct mc_entry *entry = command->action.old_entry;
 	char *key = mc_entry_getkey(entry);
-	char *value = mc_entry_getvalue(entry);
 	uint8_t key_len = entry->key_len;
-	uint32_t value_len = entry->value_len;
+	uint32_t value_len = mc_compress_length(entry);
 
 	if (cas) {
 		mm_netbuf_printf(
 			&state->sock,
 			"VALUE %.*s %u %u %llu\r\n",
 			key_len, key,
-			entry->flags, value_len,
-			(unsigned long long) entry->stamp);
+			mc_entry_getflags(entry), value_len,
+			(unsigned long long) mc_entry_getstamp(entry));
 	} else {
 		mm_netbuf_printf(
 			&state->sock,
 			"VALUE %.*s %u %u\r\n",
 			key_len, key,
-			entry->flags, value_len);
+			mc_entry_getflags(entry), value_len);
 	}
 
-	mm_netbuf_splice(&state->sock, value, value_len,
-			 mc_command_transmit_unref, (uintptr_t) entry);
+	mc_command_transmit_value(state, &command->action, fetched);
 
 	if (command->action.ascii_get_last)
 		WRITE(&state->sock, mc_result_end2);
 	else
 		WRITE(&state->sock, mc_result_nl);
 
+leave:
 	LEAVE();
+	return rc;
+}
+
+static bool
+mc_command_meta_has_flag(struct mc_command_meta *command, char flag)
+{
+	return memchr(command->flags, flag, command->nflags) != NULL;
+}
+
+static void
+mc_command_transmit_meta_flags(struct mc_state *state, struct mc_command_meta *command, struct mc_entry *entry, uint64_t stamp, uint8_t lease)
+{
+	ENTER();
+
+	struct mc_action *action = &command->storage.action.base;
+	for (uint32_t i = 0; i < command->nflags; i++) {
+		switch (command->flags[i]) {
+		case 'k':
+			if (entry != NULL)
+				mm_netbuf_printf(&state->sock, " k%.*s", entry->key_len, mc_entry_getkey(entry));
+			else
+				mm_netbuf_printf(&state->sock, " k%.*s", action->key_len, action->key);
+			break;
+		case 'O':
+			mm_netbuf_printf(&state->sock, " O%.*s", command->opaque_len, command->opaque);
+			break;
+		case 'c':
+			if (stamp)
+				mm_netbuf_printf(&state->sock, " c%llu", (unsigned long long) stamp);
+			break;
+		case 'f':
+			if (entry != NULL)
+				mm_netbuf_printf(&state->sock, " f%u", mc_entry_getflags(entry));
+			break;
+		case 's':
+			if (entry != NULL)
+				mm_netbuf_printf(&state->sock, " s%u", mc_compress_length(entry));
+			break;
+		case 't':
+			if (entry == NULL)
+				break;
+			if (entry->exp_time == 0) {
+				WRITE(&state->sock, " t-1");
+			} else {
+				uint32_t time = mm_context_getrealtime(mm_context_selfptr()) / 1000000;
+				uint32_t ttl = entry->exp_time > time ? entry->exp_time - time : 0;
+				mm_netbuf_printf(&state->sock, " t%u", ttl);
+			}
+			break;
+		}
+	}
+	if ((lease & MC_COMMAND_LEASE_WIN) != 0)
+		WRITE(&state->sock, " W");
+	if ((lease & MC_COMMAND_LEASE_STALE) != 0)
+		WRITE(&state->sock, " X");
+	if ((lease & MC_COMMAND_LEASE_HOLD) != 0)
+		WRITE(&state->sock, " Z");
+	WRITE(&state->sock, mc_result_nl);
+
+	LEAVE();
+}
+
+static void
+mc_command_transmit_meta_status(struct mc_state *state, struct mc_command_meta *command, const char *status, uint64_t stamp)
+{
+	ENTER();
+
+	mm_netbuf_write(&state->sock, status, 2);
+	mc_command_transmit_meta_flags(state, command, NULL, stamp, 0);
+
+	LEAVE();
+}
+
+static bool
+mc_command_transmit_meta_entry(struct mc_state *state, struct mc_command_meta *command, uint8_t lease)
+{
+	ENTER();
+	bool rc = true;
+
+	struct mc_action *action = &command->storage.action.base;
+	struct mc_entry *entry = action->old_entry;
+	if (mc_command_meta_has_flag(command, 'v')) {
+		struct mc_command_value *fetched;
+		if (!mc_command_fetch_value(action, &fetched)) {
+			rc = false;
+			goto leave;
+		}
+		mm_netbuf_printf(&state->sock, "VA %u", mc_compress_length(entry));
+		mc_command_transmit_meta_flags(state, command, entry, mc_entry_getstamp(entry), lease);
+		mc_command_transmit_value(state, action, fetched);
+		WRITE(&state->sock, mc_result_nl);
+	} else {
+		WRITE(&state->sock, mc_result_meta_hd);
+		mc_command_transmit_meta_flags(state, command, entry, mc_entry_getstamp(entry), lease);
+		if (action->entry_pinned)
+			mc_action_unpin(action);
+		else
+			mc_action_finish(action);
+	}
+
+leave:
+	LEAVE();
+	return rc;
 }
 
 static void
@@ -259,7 +808,7 @@ mc_command_transmit_delta(struct mc_state *state, const char *value)
 
 	mm_netbuf_write(&state->sock, value, strlen(value));
 
-	WRITE(&state->sock, mc_result_end);
+	WRITE(&state->sock, mc_result_nl);
 
 	LEAVE();
 }
@@ -328,15 +877,20 @@ mc_command_transmit_binary_stamp(struct mc_state *state, struct mc_action *actio
 	LEAVE();
 }
 
-static void
+static bool
 mc_command_transmit_binary_entry(struct mc_state *state, struct mc_action *action, bool with_key)
 {
 	ENTER();
+	bool rc = true;
+
+	struct mc_command_value *fetched;
+	if (!mc_command_fetch_value(action, &fetched)) {
+		rc = false;
+		goto leave;
+	}
 
 	struct mc_entry *entry = action->old_entry;
 	uint16_t key_len = with_key ? entry->key_len : 0;
-	char *value = mc_entry_getvalue(entry);
-	uint32_t value_len = entry->value_len;
 
 	struct
 	{
@@ -351,18 +905,23 @@ mc_command_transmit_binary_entry(struct mc_state *state, struct mc_action *actio
 	packet.header.key_len = mm_htons(key_len);
 	packet.header.ext_len = 4;
 	packet.header.data_type = 0;
-	packet.header.body_len = mm_htonl(4 + key_len + entry->value_len);
-	packet.header.stamp = mm_htonll(entry->stamp);
-	packet.flags = mm_htonl(entry->flags);
+	packet.header.body_len = mm_htonl(4 + key_len + mc_compress_length(entry));
+	packet.header.stamp = mm_htonll(mc_entry_getstamp(entry));
+	packet.flags = mm_htonl(mc_entry_getflags(entry));
 
 	mm_netbuf_write(&state->sock, &packet, 28);
 	if (with_key) {
 		char *key = mc_entry_getkey(entry);
-		mm_netbuf_splice(&state->sock, key, key_len, NULL, 0);
+		if (action->entry_pinned)
+			mm_netbuf_write(&state->sock, key, key_len);
+		else
+			mm_netbuf_splice(&state->sock, key, key_len, NULL, 0);
 	}
-	mm_netbuf_splice(&state->sock, value, value_len, mc_command_transmit_unref, (uintptr_t) entry);
+	mc_command_transmit_value(state, action, fetched);
 
+leave:
 	LEAVE();
+	return rc;
 }
 
 static void
@@ -370,7 +929,6 @@ mc_command_transmit_binary_value(struct mc_state *state, struct mc_action_storag
 {
 	ENTER();
 
-	struct mc_entry *entry = action->new_entry;
 	struct
 	{
 		struct mc_binary_header header;
@@ -385,7 +943,7 @@ mc_command_transmit_binary_value(struct mc_state *state, struct mc_action_storag
 	packet.header.ext_len = 0;
 	packet.header.data_type = 0;
 	packet.header.body_len = mm_htonl(8);
-	packet.header.stamp = mm_htonll(entry->stamp);
+	packet.header.stamp = mm_htonll(action->stamp);
 	packet.value = mm_htonll(value);
 
 	mm_netbuf_write(&state->sock, &packet, 32);
@@ -404,6 +962,40 @@ mm_command_store_value(char *buffer, struct mc_entry *entry)
 	}
 }
 
+/* Copy a value that might be compressed or on disk to a new entry. The
+   result is neither. Fails on a disk error. */
+static bool
+mc_command_copy_value(struct mc_entry *entry, uint32_t offset, struct mc_entry *source)
+{
+	if ((mc_entry_getlease(source) & MC_ENTRY_VALUE_BITS) == 0) {
+		mc_entry_copyvalue(entry, offset, source);
+		return true;
+	}
+
+	bool rc = true;
+	uint32_t value_len = mc_compress_length(source);
+	char *value = mm_memory_xalloc(value_len);
+	if (mc_entry_is_disk(source))
+		rc = mc_disk_copy_value(value, source);
+	else
+		mc_compress_copy_value(value, source);
+	if (rc)
+		mc_entry_setvalue(entry, offset, value, value_len);
+	mm_memory_free(value);
+	return rc;
+}
+
+/* Give up altering an entry which value cannot be read. It is taken for
+   a miss. */
+static void
+mc_command_copy_failed(struct mc_action_storage *action)
+{
+	mc_action_cancel(action);
+	action->new_entry = NULL;
+	mc_action_finish(&action->base);
+	action->base.old_entry = NULL;
+}
+
 static void
 mc_command_append(struct mc_action_storage *action)
 {
@@ -412,31 +1004,51 @@ mc_command_append(struct mc_action_storage *action)
 	uint32_t alter_value_len = action->value_len;
 	action->new_entry = NULL;
 
+	// Try to fit the value into the slack space first.
+	mc_action_append(action);
+	if (action->entry_match || action->base.old_entry == NULL)
+		goto leave;
+
 	mc_action_lookup(&action->base);
 
-	struct mc_entry *const old_entry = action->base.old_entry;
-	while (old_entry != NULL) {
-		uint32_t value_len = old_entry->value_len + alter_value_len;
+	while (action->base.old_entry != NULL) {
+		struct mc_entry *old_entry = action->base.old_entry;
+		uint32_t old_value_len = mc_compress_length(old_entry);
+		uint32_t value_len = old_value_len + alter_value_len;
+
+		// Reserve some slack for subsequent appends unless the value
+		// is chunked anyway.
+		uint32_t capacity = value_len;
+		if (value_len < MC_ENTRY_CHUNK_SIZE) {
+			uint32_t slack = value_len / 2;
+			if (slack > MC_ENTRY_CHUNK_SIZE - value_len)
+				slack = MC_ENTRY_CHUNK_SIZE - value_len;
+			capacity += slack;
+		}
+
 		if (action->new_entry == NULL) {
-			mc_action_create(action, value_len);
+			mc_action_create(action, capacity);
 			mc_entry_setkey(action->new_entry, action->base.key);
-		} else if (action->new_entry->value_len != value_len) {
-			mc_action_resize(action, value_len);
+		} else if (action->new_entry->value_len + mc_entry_getslack(action->new_entry) != capacity) {
+			mc_action_resize(action, capacity);
 			mc_entry_setkey(action->new_entry, action->base.key);
 		}
 
 		struct mc_entry *new_entry = action->new_entry;
-		char *new_value = mc_entry_getvalue(new_entry);
-		char *old_value = mc_entry_getvalue(old_entry);
-		memcpy(new_value, old_value, old_entry->value_len);
-		memcpy(new_value + old_entry->value_len, alter_value, alter_value_len);
-		action->stamp = old_entry->stamp;
+		mc_entry_setlength(new_entry, value_len);
+		if (!mc_command_copy_value(new_entry, 0, old_entry)) {
+			mc_command_copy_failed(action);
+			break;
+		}
+		mc_entry_setvalue(new_entry, old_value_len, alter_value, alter_value_len);
+		action->stamp = mc_entry_getstamp(old_entry);
 
 		mc_action_alter(action);
 		if (action->entry_match)
 			break;
 	}
 
+leave:
 	if (action->own_alter_value)
 		mm_memory_free((char *) alter_value);
 
@@ -456,7 +1068,7 @@ mc_command_prepend(struct mc_action_storage *action)
 
 	struct mc_entry *const old_entry = action->base.old_entry;
 	while (old_entry != NULL) {
-		uint32_t value_len = old_entry->value_len + alter_value_len;
+		uint32_t value_len = mc_compress_length(old_entry) + alter_value_len;
 		if (action->new_entry == NULL) {
 			mc_action_create(action, value_len);
 			mc_entry_setkey(action->new_entry, action->base.key);
@@ -466,11 +1078,12 @@ mc_command_prepend(struct mc_action_storage *action)
 		}
 
 		struct mc_entry *new_entry = action->new_entry;
-		char *new_value = mc_entry_getvalue(new_entry);
-		char *old_value = mc_entry_getvalue(old_entry);
-		memcpy(new_value, alter_value, alter_value_len);
-		memcpy(new_value + alter_value_len, old_value, old_entry->value_len);
-		action->stamp = old_entry->stamp;
+		mc_entry_setvalue(new_entry, 0, alter_value, alter_value_len);
+		if (!mc_command_copy_value(new_entry, alter_value_len, old_entry)) {
+			mc_command_copy_failed(action);
+			break;
+		}
+		action->stamp = mc_entry_getstamp(old_entry);
 
 		mc_action_alter(action);
 		if (action->entry_match)
@@ -491,7 +1104,16 @@ mc_command_increment(struct mc_command_storage *command, bool ascii, char *buffe
 	struct mc_action_storage *action = &command->action;
 	action->new_entry = NULL;
 
-	mc_action_lookup(&action->base);
+	// Most updates fit the space of the previous value.
+	mc_action_increment(action, command->binary_delta);
+	if (action->entry_match) {
+		value = action->delta_value;
+		if (buffer != NULL)
+			snprintf(buffer, MC_ENTRY_NUM_LEN_MAX + 1, "%llu", (unsigned long long) value);
+		goto leave;
+	}
+	if (action->base.old_entry != NULL)
+		mc_action_lookup(&action->base);
 
 	for (;;) {
 		struct mc_entry *const old_entry = action->base.old_entry;
@@ -509,7 +1131,7 @@ mc_command_increment(struct mc_command_storage *command, bool ascii, char *buffe
 				break;
 			}
 			value += command->binary_delta;
-			action->stamp = old_entry->stamp;
+			action->stamp = mc_entry_getstamp(old_entry);
 		}
 
 		if (action->new_entry == NULL) {
@@ -520,8 +1142,10 @@ mc_command_increment(struct mc_command_storage *command, bool ascii, char *buffe
 
 		if (old_entry == NULL) {
 			mc_action_insert(action);
-			if (action->base.old_entry == NULL)
+			if (action->base.old_entry == NULL) {
+				action->entry_match = true;
 				break;
+			}
 		} else {
 			mm_command_store_value(buffer, action->new_entry);
 			mc_action_alter(action);
@@ -530,6 +1154,7 @@ mc_command_increment(struct mc_command_storage *command, bool ascii, char *buffe
 		}
 	}
 
+leave:
 	LEAVE();
 	return value;
 }
@@ -542,7 +1167,16 @@ mc_command_decrement(struct mc_command_storage *command, bool ascii, char *buffe
 	struct mc_action_storage *action = &command->action;
 	action->new_entry = NULL;
 
-	mc_action_lookup(&action->base);
+	// Most updates fit the space of the previous value.
+	mc_action_decrement(action, command->binary_delta);
+	if (action->entry_match) {
+		value = action->delta_value;
+		if (buffer != NULL)
+			snprintf(buffer, MC_ENTRY_NUM_LEN_MAX + 1, "%llu", (unsigned long long) value);
+		goto leave;
+	}
+	if (action->base.old_entry != NULL)
+		mc_action_lookup(&action->base);
 
 	for (;;) {
 		struct mc_entry *const old_entry = action->base.old_entry;
@@ -563,7 +1197,7 @@ mc_command_decrement(struct mc_command_storage *command, bool ascii, char *buffe
 				value -= command->binary_delta;
 			else
 				value = 0;
-			action->stamp = old_entry->stamp;
+			action->stamp = mc_entry_getstamp(old_entry);
 		}
 
 		if (action->new_entry == NULL) {
@@ -574,8 +1208,10 @@ mc_command_decrement(struct mc_command_storage *command, bool ascii, char *buffe
 
 		if (old_entry == NULL) {
 			mc_action_insert(action);
-			if (action->base.old_entry == NULL)
+			if (action->base.old_entry == NULL) {
+				action->entry_match = true;
 				break;
+			}
 		} else {
 			mm_command_store_value(buffer, action->new_entry);
 			mc_action_alter(action);
@@ -584,6 +1220,7 @@ mc_command_decrement(struct mc_command_storage *command, bool ascii, char *buffe
 		}
 	}
 
+leave:
 	LEAVE();
 	return value;
 }
@@ -597,9 +1234,8 @@ mc_command_execute_ascii_get(struct mc_state *state, struct mc_command_simple *c
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_entry(state, command, false);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_entry(state, command, false)) {
 		mm_counter_local_inc(&state->stat->get_hits);
 	} else {
 		if (command->action.ascii_get_last)
@@ -616,16 +1252,57 @@ mc_command_execute_ascii_gets(struct mc_state *state, struct mc_command_simple *
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_entry(state, command, true);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_entry(state, command, true)) {
+		mm_counter_local_inc(&state->stat->get_hits);
+	} else {
+		if (command->action.ascii_get_last)
+			WRITE(&state->sock, mc_result_end);
+		mm_counter_local_inc(&state->stat->get_misses);
+	}
+	mm_counter_local_inc(&state->stat->cmd_get);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_gat(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	mc_action_touch(&command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_entry(state, command, false)) {
+		mm_counter_local_inc(&state->stat->get_hits);
+		mm_counter_local_inc(&state->stat->touch_hits);
+	} else {
+		if (command->action.ascii_get_last)
+			WRITE(&state->sock, mc_result_end);
+		mm_counter_local_inc(&state->stat->get_misses);
+		mm_counter_local_inc(&state->stat->touch_misses);
+	}
+	mm_counter_local_inc(&state->stat->cmd_get);
+	mm_counter_local_inc(&state->stat->cmd_touch);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_gats(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	mc_action_touch(&command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_entry(state, command, true)) {
 		mm_counter_local_inc(&state->stat->get_hits);
+		mm_counter_local_inc(&state->stat->touch_hits);
 	} else {
 		if (command->action.ascii_get_last)
 			WRITE(&state->sock, mc_result_end);
 		mm_counter_local_inc(&state->stat->get_misses);
+		mm_counter_local_inc(&state->stat->touch_misses);
 	}
 	mm_counter_local_inc(&state->stat->cmd_get);
+	mm_counter_local_inc(&state->stat->cmd_touch);
 
 	LEAVE();
 }
@@ -635,7 +1312,7 @@ mc_command_execute_ascii_set(struct mc_state *state, struct mc_command_storage *
 {
 	ENTER();
 
-	mc_action_upsert(&command->action);
+	mc_command_upsert(&command->action);
 	if (command->action.base.ascii_noreply)
 		/* Be quiet. */;
 	else
@@ -650,7 +1327,7 @@ mc_command_execute_ascii_add(struct mc_state *state, struct mc_command_storage *
 {
 	ENTER();
 
-	mc_action_insert(&command->action);
+	mc_command_insert(&command->action);
 	if (command->action.base.ascii_noreply)
 		/* Be quiet. */;
 	else if (command->action.base.old_entry == NULL)
@@ -667,7 +1344,7 @@ mc_command_execute_ascii_replace(struct mc_state *state, struct mc_command_stora
 {
 	ENTER();
 
-	mc_action_update(&command->action);
+	mc_command_update(&command->action);
 	if (command->action.base.ascii_noreply)
 		/* Be quiet. */;
 	else if (command->action.base.old_entry != NULL)
@@ -684,17 +1361,17 @@ mc_command_execute_ascii_cas(struct mc_state *state, struct mc_command_storage *
 {
 	ENTER();
 
-	mc_action_update(&command->action);
+	mc_command_update(&command->action);
 	if (command->action.entry_match) {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_stored);
 		mm_counter_local_inc(&state->stat->cas_hits);
 	} else if (command->action.base.old_entry != NULL) {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_exists);
 		mm_counter_local_inc(&state->stat->cas_badval);
 	} else {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_not_stored);
 		mm_counter_local_inc(&state->stat->cas_misses);
 	}
@@ -744,15 +1421,15 @@ mc_command_execute_ascii_incr(struct mc_state *state, struct mc_command_storage
 
 	char buffer[MC_ENTRY_NUM_LEN_MAX + 1];
 	mc_command_increment(command, true, buffer);
-	if (command->action.new_entry != NULL) {
-		if (command->action.base.ascii_noreply)
+	if (command->action.entry_match) {
+		if (!command->action.base.ascii_noreply)
 			mc_command_transmit_delta(state, buffer);
 		mm_counter_local_inc(&state->stat->incr_hits);
 	} else if (command->action.base.old_entry != NULL) {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_delta_non_num);
 	} else {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_not_found);
 		mm_counter_local_inc(&state->stat->incr_misses);
 	}
@@ -767,15 +1444,15 @@ mc_command_execute_ascii_decr(struct mc_state *state, struct mc_command_storage
 
 	char buffer[MC_ENTRY_NUM_LEN_MAX + 1];
 	mc_command_decrement(command, true, buffer);
-	if (command->action.new_entry != NULL) {
-		if (command->action.base.ascii_noreply)
+	if (command->action.entry_match) {
+		if (!command->action.base.ascii_noreply)
 			mc_command_transmit_delta(state, buffer);
 		mm_counter_local_inc(&state->stat->decr_hits);
 	} else if (command->action.base.old_entry != NULL) {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_delta_non_num);
 	} else {
-		if (command->action.base.ascii_noreply)
+		if (!command->action.base.ascii_noreply)
 			WRITE(&state->sock, mc_result_not_found);
 		mm_counter_local_inc(&state->stat->decr_misses);
 	}
@@ -807,31 +1484,14 @@ mc_command_execute_ascii_touch(struct mc_state *state, struct mc_command_simple
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-
+	mc_action_touch(&command->action);
 	if (command->action.old_entry != NULL) {
-		// There is no much need for synchronization here.
-		// * A concurrent touch is not a big problem. Nobody knows
-		// which one of them is set to win;
-		// * If we set exptime on an entry that has concurrently
-		// been deleted then there is absolutely no harm;
-		// * If we set exptime on an entry that has concurrently
-		// been replaced then the replace command has its own
-		// exptime which wins and this seems to be just fine;
-		// * If we set exptime on an entry that is being incremented
-		// or decremented then admittedly we might loose the exptime
-		// update. But after all who is going to ever sensibly use
-		// exptime and incr/decr together?
-		command->action.old_entry->exp_time = command->action.ascii_exp_time;
 		mc_action_finish(&command->action);
-	}
-
-	if (command->action.old_entry != NULL) {
-		if (command->action.ascii_noreply)
+		if (!command->action.ascii_noreply)
 			WRITE(&state->sock, mc_result_touched);
-		mm_counter_local_inc(&state->stat->touch_misses);
+		mm_counter_local_inc(&state->stat->touch_hits);
 	} else {
-		if (command->action.ascii_noreply)
+		if (!command->action.ascii_noreply)
 			WRITE(&state->sock, mc_result_not_found);
 		mm_counter_local_inc(&state->stat->touch_misses);
 	}
@@ -846,6 +1506,31 @@ mc_command_execute_ascii_slabs(struct mc_state *state, struct mc_command_simple
 	WRITE(&state->sock, mc_result_not_implemented);
 }
 
+/* Report the hot keys, one per line with the number of samples, the
+   bound of its overestimation and the table partition. */
+static void
+mc_command_transmit_hotkeys(struct mc_state *state)
+{
+	ENTER();
+
+	struct mc_hotkeys_report *report = mm_memory_xalloc(sizeof(struct mc_hotkeys_report));
+	mc_hotkeys_report(report);
+
+	mm_netbuf_printf(&state->sock, "STAT sample_rate %u\r\n", report->rate);
+	mm_netbuf_printf(&state->sock, "STAT samples %llu\r\n", report->nsamples);
+	for (uint32_t i = 0; i < report->nkeys; i++) {
+		struct mc_hotkey *key = &report->keys[i];
+		uint32_t part = mc_table_part(key->hash) - mc_table.parts;
+		mm_netbuf_printf(&state->sock, "STAT hotkey:%.*s %u %u %u\r\n",
+				 key->key_len, key->key, key->count, key->error, part);
+	}
+	WRITE(&state->sock, mc_result_end);
+
+	mm_memory_free(report);
+
+	LEAVE();
+}
+
 static void
 mc_command_execute_ascii_stats(struct mc_state *state, struct mc_command_simple *command)
 {
@@ -853,12 +1538,55 @@ mc_command_execute_ascii_stats(struct mc_state *state, struct mc_command_simple
 
 #define MC_STAT_APPEND(x) mm_netbuf_printf(&state->sock, "STAT %s %llu\r\n", stringify_expanded(x), stat.x);
 
-	if (command->action.ascii_stats) {
+	if (command->action.ascii_stats == MC_COMMAND_STATS_HOTKEYS) {
+		mc_command_transmit_hotkeys(state);
+	} else if (command->action.ascii_stats != MC_COMMAND_STATS_GENERAL) {
 		WRITE(&state->sock, mc_result_not_implemented);
 	} else {
 		struct mc_command_stat stat;
 		mc_command_stat_aggregate(&stat);
 		MC_STAT_LIST(MC_STAT_APPEND)
+		double ratio = stat.compress_bytes_out ? (double) stat.compress_bytes_in / stat.compress_bytes_out : 1.0;
+		mm_netbuf_printf(&state->sock, "STAT compress_ratio %.2f\r\n", ratio);
+
+		struct mc_command_memory_stat memory_stat;
+		mc_command_memory_stat_aggregate(&memory_stat);
+		mm_netbuf_printf(&state->sock, "STAT bytes %llu\r\n", memory_stat.bytes);
+		mm_netbuf_printf(&state->sock, "STAT limit_maxbytes %llu\r\n", memory_stat.limit);
+		mm_netbuf_printf(&state->sock, "STAT memory_overhead %llu\r\n", memory_stat.overhead);
+
+		struct mc_command_crawl_stat crawl_stat;
+		mc_command_crawl_stat_aggregate(&crawl_stat);
+		mm_netbuf_printf(&state->sock, "STAT crawler_runs %llu\r\n", crawl_stat.runs);
+		mm_netbuf_printf(&state->sock, "STAT crawler_items_checked %llu\r\n", crawl_stat.checked);
+		mm_netbuf_printf(&state->sock, "STAT crawler_reclaimed %llu\r\n", crawl_stat.reclaimed);
+
+		if (mc_table.storage == MC_STORAGE_LOG) {
+			struct mc_command_log_stat log_stat;
+			mc_command_log_stat_aggregate(&log_stat);
+			mm_netbuf_printf(&state->sock, "STAT log_bytes %llu\r\n", log_stat.bytes);
+			mm_netbuf_printf(&state->sock, "STAT log_live_bytes %llu\r\n", log_stat.live);
+			mm_netbuf_printf(&state->sock, "STAT log_segments_cleaned %llu\r\n", log_stat.cleaned);
+			mm_netbuf_printf(&state->sock, "STAT log_bytes_moved %llu\r\n", log_stat.moved);
+		}
+		if (mc_table.disk_path != NULL) {
+			struct mc_command_disk_stat disk_stat;
+			mc_command_disk_stat_aggregate(&disk_stat);
+			mm_netbuf_printf(&state->sock, "STAT disk_bytes %llu\r\n", disk_stat.bytes);
+			mm_netbuf_printf(&state->sock, "STAT disk_live_bytes %llu\r\n", disk_stat.live);
+			mm_netbuf_printf(&state->sock, "STAT disk_items_written %llu\r\n", disk_stat.items);
+			mm_netbuf_printf(&state->sock, "STAT disk_bytes_written %llu\r\n", disk_stat.written);
+			mm_netbuf_printf(&state->sock, "STAT disk_segments_compacted %llu\r\n", disk_stat.compacted);
+			mm_netbuf_printf(&state->sock, "STAT disk_bytes_moved %llu\r\n", disk_stat.moved);
+		}
+
+		struct mc_snapshot_stat snapshot_stat;
+		mc_snapshot_stat(&snapshot_stat);
+		mm_netbuf_printf(&state->sock, "STAT snapshot_in_progress %d\r\n", snapshot_stat.running);
+		mm_netbuf_printf(&state->sock, "STAT snapshot_runs %llu\r\n", snapshot_stat.runs);
+		mm_netbuf_printf(&state->sock, "STAT snapshot_items %llu\r\n", snapshot_stat.entries);
+		mm_netbuf_printf(&state->sock, "STAT snapshot_bytes %llu\r\n", snapshot_stat.bytes);
+
 		WRITE(&state->sock, mc_result_end);
 	}
 
@@ -882,6 +1610,25 @@ mc_command_execute_ascii_flush_all(struct mc_state *state, struct mc_command_sim
 	LEAVE();
 }
 
+static void
+mc_command_execute_ascii_flush_namespace(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	if (mc_table.namespace_delimiter) {
+		mc_command_flush_namespace(command->action.key, command->action.key_len);
+		if (command->action.ascii_noreply)
+			/* Be quiet. */;
+		else
+			WRITE(&state->sock, mc_result_ok);
+		mm_counter_local_inc(&state->stat->cmd_flush_namespace);
+	} else {
+		WRITE(&state->sock, mc_result_no_namespaces);
+	}
+
+	LEAVE();
+}
+
 static void
 mc_command_execute_ascii_version(struct mc_state *state, struct mc_command_simple *command UNUSED)
 {
@@ -907,6 +1654,21 @@ mc_command_execute_ascii_verbosity(struct mc_state *state, struct mc_command_sim
 	LEAVE();
 }
 
+static void
+mc_command_execute_ascii_snapshot(struct mc_state *state, struct mc_command_simple *command UNUSED)
+{
+	ENTER();
+
+	if (mc_config.snapshot_path == NULL)
+		WRITE(&state->sock, mc_result_no_snapshot);
+	else if (!mc_snapshot_save(mc_config.snapshot_path))
+		WRITE(&state->sock, mc_result_snapshot_busy);
+	else
+		WRITE(&state->sock, mc_result_ok);
+
+	LEAVE();
+}
+
 static void
 mc_command_execute_ascii_quit(struct mc_state *state, struct mc_command_simple *command UNUSED)
 {
@@ -927,6 +1689,280 @@ mc_command_execute_ascii_error(struct mc_state *state, struct mc_command_simple
 	LEAVE();
 }
 
+static void
+mc_command_execute_ascii_bad_format(struct mc_state *state, struct mc_command_simple *command UNUSED)
+{
+	ENTER();
+
+	WRITE(&state->sock, mc_result_bad_format);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_bad_chunk(struct mc_state *state, struct mc_command_simple *command UNUSED)
+{
+	ENTER();
+
+	WRITE(&state->sock, mc_result_bad_chunk);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Meta protocol commands.
+ **********************************************************************/
+
+/* Decide on the lease flags for a found entry. A stale entry or one
+   that is about to expire is refilled by the first client to see it,
+   the others are told to use what they have or hold on. */
+static uint8_t
+mc_command_meta_lease(struct mc_state *state, struct mc_command_meta *command, struct mc_entry *entry)
+{
+	uint8_t lease = 0;
+	bool refill = false;
+	if ((mc_entry_getlease(entry) & MC_ENTRY_LEASE_STALE) != 0) {
+		lease |= MC_COMMAND_LEASE_STALE;
+		mm_counter_local_inc(&state->stat->lease_stale);
+		refill = true;
+	} else if (command->recache_time && entry->exp_time) {
+		uint32_t time = mm_context_getrealtime(mm_context_selfptr()) / 1000000;
+		refill = entry->exp_time < time + command->recache_time;
+	}
+
+	if (refill && mc_entry_takelease(entry)) {
+		lease |= MC_COMMAND_LEASE_WIN;
+		mm_counter_local_inc(&state->stat->lease_wins);
+	} else if ((mc_entry_getlease(entry) & MC_ENTRY_LEASE_WON) != 0) {
+		lease |= MC_COMMAND_LEASE_HOLD;
+		mm_counter_local_inc(&state->stat->lease_holds);
+	}
+
+	return lease;
+}
+
+/* Create an empty entry on a miss. The client that manages to insert
+   it wins the lease to fill it. */
+static bool
+mc_command_meta_vivify(struct mc_state *state, struct mc_command_meta *command)
+{
+	ENTER();
+
+	struct mc_action_storage *action = &command->storage.action;
+	mc_action_create(action, 0);
+	mc_entry_setflags(action->new_entry, 0);
+	mc_entry_setlease(action->new_entry, MC_ENTRY_LEASE_WON);
+	action->new_entry->exp_time = command->exp_time;
+	mc_entry_setkey(action->new_entry, action->base.key);
+
+	mc_action_insert(action);
+	action->new_entry = NULL;
+	bool rc = (action->base.old_entry == NULL);
+	if (rc) {
+		// The new entry is not referenced so it is not safe to
+		// access it any more. But it is known to be empty.
+		if (mc_command_meta_has_flag(command, 'v')) {
+			WRITE(&state->sock, "VA 0");
+			mc_command_transmit_meta_flags(state, command, NULL, action->stamp, MC_COMMAND_LEASE_WIN);
+			WRITE(&state->sock, mc_result_nl);
+		} else {
+			WRITE(&state->sock, mc_result_meta_hd);
+			mc_command_transmit_meta_flags(state, command, NULL, action->stamp, MC_COMMAND_LEASE_WIN);
+		}
+		mm_counter_local_inc(&state->stat->lease_wins);
+	}
+
+	LEAVE();
+	return rc;
+}
+
+static void
+mc_command_execute_ascii_mg(struct mc_state *state, struct mc_command_meta *command)
+{
+	ENTER();
+
+	struct mc_action *action = &command->storage.action.base;
+	action->exp_time = command->exp_time;
+	if (command->touch)
+		mc_action_touch(action);
+	else
+		mc_command_peek(state, action);
+	// Retry the lookup if another client has created the entry first.
+	while (action->old_entry == NULL && command->vivify) {
+		if (mc_command_meta_vivify(state, command)) {
+			mm_counter_local_inc(&state->stat->get_misses);
+			goto leave;
+		}
+		if (command->touch)
+			mc_action_touch(action);
+		else
+			mc_action_peek(action);
+	}
+
+	uint8_t lease = 0;
+	if (action->old_entry != NULL)
+		lease = mc_command_meta_lease(state, command, action->old_entry);
+	if (action->old_entry != NULL && mc_command_transmit_meta_entry(state, command, lease)) {
+		if (command->touch)
+			mm_counter_local_inc(&state->stat->touch_hits);
+		mm_counter_local_inc(&state->stat->get_hits);
+	} else {
+		if (!command->quiet)
+			mc_command_transmit_meta_status(state, command, mc_result_meta_en, 0);
+		if (command->touch)
+			mm_counter_local_inc(&state->stat->touch_misses);
+		mm_counter_local_inc(&state->stat->get_misses);
+	}
+
+leave:
+	if (command->touch)
+		mm_counter_local_inc(&state->stat->cmd_touch);
+	mm_counter_local_inc(&state->stat->cmd_get);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_ms(struct mc_state *state, struct mc_command_meta *command)
+{
+	ENTER();
+
+	struct mc_action_storage *action = &command->storage.action;
+	const char *status;
+	switch (command->mode) {
+	case 'E':
+		mc_command_insert(action);
+		status = action->base.old_entry == NULL ? mc_result_meta_hd : mc_result_meta_ns;
+		break;
+	case 'A':
+		mc_command_append(action);
+		status = action->base.old_entry != NULL ? mc_result_meta_hd : mc_result_meta_ns;
+		break;
+	case 'P':
+		mc_command_prepend(action);
+		status = action->base.old_entry != NULL ? mc_result_meta_hd : mc_result_meta_ns;
+		break;
+	case 'R':
+		mc_command_update(action);
+		status = action->base.old_entry != NULL ? mc_result_meta_hd : mc_result_meta_ns;
+		break;
+	case 'C':
+		mc_command_update(action);
+		if (action->entry_match) {
+			status = mc_result_meta_hd;
+			mm_counter_local_inc(&state->stat->cas_hits);
+		} else if (action->base.old_entry != NULL) {
+			status = mc_result_meta_ex;
+			mm_counter_local_inc(&state->stat->cas_badval);
+		} else {
+			status = mc_result_meta_nf;
+			mm_counter_local_inc(&state->stat->cas_misses);
+		}
+		break;
+	default:
+		mc_command_upsert(action);
+		status = mc_result_meta_hd;
+		break;
+	}
+
+	if (status != mc_result_meta_hd)
+		mc_command_transmit_meta_status(state, command, status, 0);
+	else if (!command->quiet)
+		mc_command_transmit_meta_status(state, command, status, action->stamp);
+	mm_counter_local_inc(&state->stat->cmd_set);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_md(struct mc_state *state, struct mc_command_meta *command)
+{
+	ENTER();
+
+	struct mc_action *action = &command->storage.action.base;
+	if (command->invalidate) {
+		// Keep the entry but make the next mg command win the lease
+		// to refill it.
+		if (command->touch) {
+			action->exp_time = command->exp_time;
+			mc_action_touch(action);
+		} else {
+			mc_action_lookup(action);
+		}
+		if (action->old_entry != NULL) {
+			uint8_t lease = mc_entry_getlease(action->old_entry) & MC_ENTRY_VALUE_BITS;
+			mc_entry_setlease(action->old_entry, lease | MC_ENTRY_LEASE_STALE);
+			mc_action_finish(action);
+		}
+	} else {
+		mc_action_delete(action);
+	}
+	if (action->old_entry != NULL) {
+		if (!command->quiet)
+			mc_command_transmit_meta_status(state, command, mc_result_meta_hd, 0);
+		mm_counter_local_inc(&state->stat->delete_hits);
+	} else {
+		if (!command->quiet)
+			mc_command_transmit_meta_status(state, command, mc_result_meta_nf, 0);
+		mm_counter_local_inc(&state->stat->delete_misses);
+	}
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_ma(struct mc_state *state, struct mc_command_meta *command)
+{
+	ENTER();
+
+	struct mc_action_storage *action = &command->storage.action;
+	uint64_t value;
+	if (command->mode == 'I')
+		value = mc_command_increment(&command->storage, !command->vivify, NULL);
+	else
+		value = mc_command_decrement(&command->storage, !command->vivify, NULL);
+
+	if (action->entry_match) {
+		if (action->base.old_entry == NULL)
+			action->new_entry->exp_time = command->exp_time;
+		if (mc_command_meta_has_flag(command, 'v')) {
+			char buffer[MC_ENTRY_NUM_LEN_MAX + 1];
+			int length = snprintf(buffer, sizeof buffer, "%llu", (unsigned long long) value);
+			mm_netbuf_printf(&state->sock, "VA %d", length);
+			mc_command_transmit_meta_flags(state, command, NULL, action->stamp, 0);
+			mm_netbuf_write(&state->sock, buffer, length);
+			WRITE(&state->sock, mc_result_nl);
+		} else if (!command->quiet) {
+			mc_command_transmit_meta_status(state, command, mc_result_meta_hd, action->stamp);
+		}
+		if (command->mode == 'I')
+			mm_counter_local_inc(&state->stat->incr_hits);
+		else
+			mm_counter_local_inc(&state->stat->decr_hits);
+	} else if (action->base.old_entry != NULL) {
+		WRITE(&state->sock, mc_result_delta_non_num);
+	} else {
+		if (!command->quiet)
+			mc_command_transmit_meta_status(state, command, mc_result_meta_nf, 0);
+		if (command->mode == 'I')
+			mm_counter_local_inc(&state->stat->incr_misses);
+		else
+			mm_counter_local_inc(&state->stat->decr_misses);
+	}
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_ascii_mn(struct mc_state *state, struct mc_command_simple *command UNUSED)
+{
+	ENTER();
+
+	WRITE(&state->sock, mc_result_meta_mn);
+
+	LEAVE();
+}
+
 /**********************************************************************
  * Binary protocol commands.
  **********************************************************************/
@@ -936,9 +1972,8 @@ mc_command_execute_binary_get(struct mc_state *state, struct mc_command_simple *
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_binary_entry(state, &command->action, false);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, false)) {
 		mm_counter_local_inc(&state->stat->get_hits);
 	} else {
 		mc_command_transmit_binary_status(state, &command->action, MC_BINARY_STATUS_KEY_NOT_FOUND);
@@ -954,9 +1989,8 @@ mc_command_execute_binary_getq(struct mc_state *state, struct mc_command_simple
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_binary_entry(state, &command->action, false);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, false)) {
 		mm_counter_local_inc(&state->stat->get_hits);
 	} else {
 		mm_counter_local_inc(&state->stat->get_misses);
@@ -971,9 +2005,8 @@ mc_command_execute_binary_getk(struct mc_state *state, struct mc_command_simple
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_binary_entry(state, &command->action, true);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, true)) {
 		mm_counter_local_inc(&state->stat->get_hits);
 	} else {
 		mc_command_transmit_binary_status(state, &command->action, MC_BINARY_STATUS_KEY_NOT_FOUND);
@@ -989,9 +2022,8 @@ mc_command_execute_binary_getkq(struct mc_state *state, struct mc_command_simple
 {
 	ENTER();
 
-	mc_action_lookup(&command->action);
-	if (command->action.old_entry != NULL) {
-		mc_command_transmit_binary_entry(state, &command->action, true);
+	mc_command_peek_value(state, &command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, true)) {
 		mm_counter_local_inc(&state->stat->get_hits);
 	} else {
 		mm_counter_local_inc(&state->stat->get_misses);
@@ -1006,8 +2038,8 @@ mc_command_execute_binary_set(struct mc_state *state, struct mc_command_storage
 {
 	ENTER();
 
-	if (command->action.stamp) {
-		mc_action_update(&command->action);
+	if (mc_command_match_stamp(&command->action)) {
+		mc_command_update(&command->action);
 		if (command->action.entry_match) {
 			mc_command_transmit_binary_stamp(state, &command->action.base, command->action.stamp);
 			mm_counter_local_inc(&state->stat->cas_hits);
@@ -1019,7 +2051,7 @@ mc_command_execute_binary_set(struct mc_state *state, struct mc_command_storage
 			mm_counter_local_inc(&state->stat->cas_misses);
 		}
 	} else {
-		mc_action_upsert(&command->action);
+		mc_command_upsert(&command->action);
 		mc_command_transmit_binary_stamp(state, &command->action.base, command->action.stamp);
 	}
 	mm_counter_local_inc(&state->stat->cmd_set);
@@ -1032,8 +2064,8 @@ mc_command_execute_binary_setq(struct mc_state *state, struct mc_command_storage
 {
 	ENTER();
 
-	if (command->action.stamp) {
-		mc_action_update(&command->action);
+	if (mc_command_match_stamp(&command->action)) {
+		mc_command_update(&command->action);
 		if (command->action.entry_match) {
 			mm_counter_local_inc(&state->stat->cas_hits);
 		} else if (command->action.base.old_entry != NULL) {
@@ -1044,7 +2076,7 @@ mc_command_execute_binary_setq(struct mc_state *state, struct mc_command_storage
 			mm_counter_local_inc(&state->stat->cas_misses);
 		}
 	} else {
-		mc_action_upsert(&command->action);
+		mc_command_upsert(&command->action);
 	}
 	mm_counter_local_inc(&state->stat->cmd_set);
 
@@ -1056,7 +2088,7 @@ mc_command_execute_binary_add(struct mc_state *state, struct mc_command_storage
 {
 	ENTER();
 
-	mc_action_insert(&command->action);
+	mc_command_insert(&command->action);
 	if (command->action.base.old_entry == NULL)
 		mc_command_transmit_binary_stamp(state, &command->action.base, command->action.stamp);
 	else
@@ -1071,7 +2103,7 @@ mc_command_execute_binary_addq(struct mc_state *state, struct mc_command_storage
 {
 	ENTER();
 
-	mc_action_insert(&command->action);
+	mc_command_insert(&command->action);
 	if (command->action.base.old_entry == NULL)
 		/* Be quiet. */;
 	else
@@ -1086,8 +2118,8 @@ mc_command_execute_binary_replace(struct mc_state *state, struct mc_command_stor
 {
 	ENTER();
 
-	if (command->action.stamp) {
-		mc_action_update(&command->action);
+	if (mc_command_match_stamp(&command->action)) {
+		mc_command_update(&command->action);
 		if (command->action.entry_match) {
 			mc_command_transmit_binary_stamp(state, &command->action.base, command->action.stamp);
 			mm_counter_local_inc(&state->stat->cas_hits);
@@ -1099,7 +2131,7 @@ mc_command_execute_binary_replace(struct mc_state *state, struct mc_command_stor
 			mm_counter_local_inc(&state->stat->cas_misses);
 		}
 	} else {
-		mc_action_update(&command->action);
+		mc_command_update(&command->action);
 		if (command->action.base.old_entry != NULL)
 			mc_command_transmit_binary_stamp(state, &command->action.base, command->action.stamp);
 		else
@@ -1115,8 +2147,8 @@ mc_command_execute_binary_replaceq(struct mc_state *state, struct mc_command_sto
 {
 	ENTER();
 
-	if (command->action.stamp) {
-		mc_action_update(&command->action);
+	if (mc_command_match_stamp(&command->action)) {
+		mc_command_update(&command->action);
 		if (command->action.entry_match) {
 			mm_counter_local_inc(&state->stat->cas_hits);
 		} else if (command->action.base.old_entry != NULL) {
@@ -1127,7 +2159,7 @@ mc_command_execute_binary_replaceq(struct mc_state *state, struct mc_command_sto
 			mm_counter_local_inc(&state->stat->cas_misses);
 		}
 	} else {
-		mc_action_update(&command->action);
+		mc_command_update(&command->action);
 		if (command->action.base.old_entry != NULL)
 			/* Be quiet. */;
 		else
@@ -1204,7 +2236,7 @@ mc_command_execute_binary_increment(struct mc_state *state, struct mc_command_st
 	ENTER();
 
 	uint64_t value = mc_command_increment(command, false, NULL);
-	if (command->action.new_entry != NULL) {
+	if (command->action.entry_match) {
 		mc_command_transmit_binary_value(state, &command->action, value);
 		mm_counter_local_inc(&state->stat->incr_hits);
 	} else if (command->action.base.old_entry != NULL) {
@@ -1223,7 +2255,7 @@ mc_command_execute_binary_incrementq(struct mc_state *state, struct mc_command_s
 	ENTER();
 
 	mc_command_increment(command, false, NULL);
-	if (command->action.new_entry != NULL) {
+	if (command->action.entry_match) {
 		mm_counter_local_inc(&state->stat->incr_hits);
 	} else if (command->action.base.old_entry != NULL) {
 		mc_command_transmit_binary_status(state, &command->action.base, MC_BINARY_STATUS_NON_NUMERIC_VALUE);
@@ -1241,7 +2273,7 @@ mc_command_execute_binary_decrement(struct mc_state *state, struct mc_command_st
 	ENTER();
 
 	uint64_t value = mc_command_decrement(command, false, NULL);
-	if (command->action.new_entry != NULL) {
+	if (command->action.entry_match) {
 		mc_command_transmit_binary_value(state, &command->action, value);
 		mm_counter_local_inc(&state->stat->decr_hits);
 	} else if (command->action.base.old_entry != NULL) {
@@ -1260,7 +2292,7 @@ mc_command_execute_binary_decrementq(struct mc_state *state, struct mc_command_s
 	ENTER();
 
 	mc_command_decrement(command, false, NULL);
-	if (command->action.new_entry != NULL) {
+	if (command->action.entry_match) {
 		mm_counter_local_inc(&state->stat->decr_hits);
 	} else if (command->action.base.old_entry != NULL) {
 		mc_command_transmit_binary_status(state, &command->action.base, MC_BINARY_STATUS_NON_NUMERIC_VALUE);
@@ -1379,6 +2411,64 @@ mc_command_execute_binary_stat(struct mc_state *state, struct mc_command_simple
 	LEAVE();
 }
 
+static void
+mc_command_execute_binary_touch(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	mc_action_touch(&command->action);
+	if (command->action.old_entry != NULL) {
+		mc_command_transmit_binary_status(state, &command->action, MC_BINARY_STATUS_NO_ERROR);
+		mc_action_finish(&command->action);
+		mm_counter_local_inc(&state->stat->touch_hits);
+	} else {
+		mc_command_transmit_binary_status(state, &command->action, MC_BINARY_STATUS_KEY_NOT_FOUND);
+		mm_counter_local_inc(&state->stat->touch_misses);
+	}
+	mm_counter_local_inc(&state->stat->cmd_touch);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_binary_gat(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	mc_action_touch(&command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, false)) {
+		mm_counter_local_inc(&state->stat->get_hits);
+		mm_counter_local_inc(&state->stat->touch_hits);
+	} else {
+		mc_command_transmit_binary_status(state, &command->action, MC_BINARY_STATUS_KEY_NOT_FOUND);
+		mm_counter_local_inc(&state->stat->get_misses);
+		mm_counter_local_inc(&state->stat->touch_misses);
+	}
+	mm_counter_local_inc(&state->stat->cmd_get);
+	mm_counter_local_inc(&state->stat->cmd_touch);
+
+	LEAVE();
+}
+
+static void
+mc_command_execute_binary_gatq(struct mc_state *state, struct mc_command_simple *command)
+{
+	ENTER();
+
+	mc_action_touch(&command->action);
+	if (command->action.old_entry != NULL && mc_command_transmit_binary_entry(state, &command->action, false)) {
+		mm_counter_local_inc(&state->stat->get_hits);
+		mm_counter_local_inc(&state->stat->touch_hits);
+	} else {
+		mm_counter_local_inc(&state->stat->get_misses);
+		mm_counter_local_inc(&state->stat->touch_misses);
+	}
+	mm_counter_local_inc(&state->stat->cmd_get);
+	mm_counter_local_inc(&state->stat->cmd_touch);
+
+	LEAVE();
+}
+
 static void
 mc_command_execute_binary_error(struct mc_state *state, struct mc_command_simple *command)
 {
@@ -51,6 +51,13 @@ enum mc_command_kind {
 	MC_COMMAND_ERROR,
 };
 
+/* The stats command subjects. */
+enum mc_command_stats {
+	MC_COMMAND_STATS_GENERAL,
+	MC_COMMAND_STATS_HOTKEYS,
+	MC_COMMAND_STATS_UNKNOWN,
+};
+
 /*
  * Some preprocessor magic to emit command definitions.
  */
@@ -58,6 +65,8 @@ enum mc_command_kind {
 #define MC_COMMAND_LIST(_)					\
 	_(ascii,  get,		simple,  MC_COMMAND_LOOKUP)	\
 	_(ascii,  gets,		simple,  MC_COMMAND_LOOKUP)	\
+	_(ascii,  gat,		simple,  MC_COMMAND_TOUCH)	\
+	_(ascii,  gats,		simple,  MC_COMMAND_TOUCH)	\
 	_(ascii,  set,		storage, MC_COMMAND_STORAGE)	\
 	_(ascii,  add,		storage, MC_COMMAND_STORAGE)	\
 	_(ascii,  replace,	storage, MC_COMMAND_STORAGE)	\
@@ -71,10 +80,19 @@ enum mc_command_kind {
 	_(ascii,  slabs,	simple,  MC_COMMAND_CUSTOM)	\
 	_(ascii,  stats,	simple,  MC_COMMAND_CUSTOM)	\
 	_(ascii,  flush_all,	simple,  MC_COMMAND_FLUSH)	\
+	_(ascii,  flush_namespace, simple,  MC_COMMAND_FLUSH)	\
 	_(ascii,  version,	simple,  MC_COMMAND_CUSTOM)	\
 	_(ascii,  verbosity,	simple,  MC_COMMAND_CUSTOM)	\
+	_(ascii,  snapshot,	simple,  MC_COMMAND_CUSTOM)	\
 	_(ascii,  quit,		simple,  MC_COMMAND_CUSTOM)	\
+	_(ascii,  mg,		meta,    MC_COMMAND_LOOKUP)	\
+	_(ascii,  ms,		meta,    MC_COMMAND_STORAGE)	\
+	_(ascii,  md,		meta,    MC_COMMAND_DELETE)	\
+	_(ascii,  ma,		meta,    MC_COMMAND_DELTA)	\
+	_(ascii,  mn,		simple,  MC_COMMAND_CUSTOM)	\
 	_(ascii,  error,	simple,  MC_COMMAND_ERROR)	\
+	_(ascii,  bad_format,	simple,  MC_COMMAND_ERROR)	\
+	_(ascii,  bad_chunk,	simple,  MC_COMMAND_ERROR)	\
 	_(binary, get,		simple,  MC_COMMAND_LOOKUP)	\
 	_(binary, getq,		simple,  MC_COMMAND_LOOKUP)	\
 	_(binary, getk,		simple,  MC_COMMAND_LOOKUP)	\
@@ -102,6 +120,9 @@ enum mc_command_kind {
 	_(binary, flushq,	simple,  MC_COMMAND_FLUSH)	\
 	_(binary, version,	simple,  MC_COMMAND_CUSTOM)	\
 	_(binary, stat,		simple,  MC_COMMAND_CUSTOM)	\
+	_(binary, touch,	simple,  MC_COMMAND_TOUCH)	\
+	_(binary, gat,		simple,  MC_COMMAND_TOUCH)	\
+	_(binary, gatq,		simple,  MC_COMMAND_TOUCH)	\
 	_(binary, error,	simple,  MC_COMMAND_ERROR)
 
 /*
@@ -151,6 +172,43 @@ struct mc_command_storage
 	uint64_t binary_delta;
 };
 
+/* The maximum number of meta command flags that ask for a reply value. */
+#define MC_COMMAND_META_FLAGS		16
+/* The maximum length of a meta command opaque token. */
+#define MC_COMMAND_META_OPAQUE_MAX	32
+
+/* A meta protocol command. The ma command keeps its initial value and
+   delta in the storage command fields. */
+struct mc_command_meta
+{
+	struct mc_command_storage storage;
+
+	/* The opaque token to reflect in the reply. */
+	const char *opaque;
+	uint8_t opaque_len;
+
+	/* The flags that ask for a reply value in the request order. */
+	uint8_t nflags;
+	char flags[MC_COMMAND_META_FLAGS];
+
+	/* Suppress the reply for the most common outcome. */
+	bool quiet;
+	/* Update the entry expiration time. */
+	bool touch;
+	/* Create a missing entry for the mg and ma commands. */
+	bool vivify;
+	/* Mark the entry stale rather than delete it for the md command. */
+	bool invalidate;
+	/* The ms or ma command mode. The ms command with a stamp to
+	   compare has the 'C' mode. */
+	char mode;
+
+	uint32_t exp_time;
+	/* Hand out the refill lease if the entry expires sooner than
+	   this number of seconds. */
+	uint32_t recache_time;
+};
+
 /**********************************************************************
  * Command routines.
  **********************************************************************/
@@ -161,22 +219,36 @@ mc_command_create_simple(struct mc_state *state, const struct mc_command_type *t
 struct mc_command_storage * NONNULL(1, 2)
 mc_command_create_ascii_storage(struct mc_state *state, const struct mc_command_type *type);
 
+struct mc_command_meta * NONNULL(1, 2)
+mc_command_create_meta(struct mc_state *state, const struct mc_command_type *type);
+
 struct mc_command_simple * NONNULL(1, 2, 3)
 mc_command_create_binary_simple(struct mc_state *state, const struct mc_command_type *type, const struct mc_binary_header *header);
 
 struct mc_command_storage * NONNULL(1, 2, 3)
 mc_command_create_binary_storage(struct mc_state *state, const struct mc_command_type *type, const struct mc_binary_header *header);
 
+/* Do the table access for a run of commands starting with the given one
+   in per-partition batches. Returns the command after the run. */
+struct mc_command_base * NONNULL(1)
+mc_command_batch(struct mc_command_base *command);
+
 static inline void NONNULL(1, 2)
 mc_command_execute(struct mc_state *state, struct mc_command_base *command)
 {
 	(command->type->exec)(state, command);
 }
 
+static inline struct mc_action * NONNULL(1)
+mc_command_action(struct mc_command_base *command)
+{
+	return &((struct mc_command_simple *) command)->action;
+}
+
 static inline void NONNULL(1)
 mc_command_cleanup(struct mc_command_base *command)
 {
-	mc_action_cleanup(&((struct mc_command_simple *) command)->action);
+	mc_action_cleanup(mc_command_action(command));
 }
 
 #endif /* MEMCACHE_COMMAND_H */
@@ -0,0 +1,172 @@
+/*
+ * memcache/compress.c - MainMemory memcache value compression.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/compress.h"
+#include "memcache/state.h"
+#include "memcache/table.h"
+
+#include "base/clock.h"
+#include "base/compress.h"
+#include "base/report.h"
+#include "base/memory/alloc.h"
+#include "base/thread/thread.h"
+
+/* The shortest value to compress, zero if disabled. */
+static uint32_t mc_compress_threshold = 0;
+
+static struct mc_stat *
+mc_compress_stat(void)
+{
+	return MM_THREAD_LOCAL_DEREF(mm_thread_self(), mc_table.stat);
+}
+
+void
+mc_compress_start(uint32_t threshold)
+{
+	ENTER();
+
+	if (threshold != 0 && threshold < MC_COMPRESS_VALUE_MIN)
+		threshold = MC_COMPRESS_VALUE_MIN;
+	mc_compress_threshold = threshold;
+	if (threshold)
+		mm_brief("memcache value compression: %u bytes and longer", threshold);
+
+	LEAVE();
+}
+
+void NONNULL(1, 2)
+mc_compress_read_value(struct mc_state *state, struct mc_action_storage *action)
+{
+	ENTER();
+
+	struct mc_entry *entry = action->new_entry;
+	uint32_t value_len = entry->value_len;
+	if (mc_compress_threshold == 0 || value_len < mc_compress_threshold || value_len > MC_COMPRESS_VALUE_MAX) {
+		mc_state_read_value(state, entry);
+		goto leave;
+	}
+
+	// Compress the value right in the receive buffer if it is there
+	// in one piece.
+	char *value = mm_netbuf_rget(&state->sock);
+	char *end = mm_netbuf_rend(&state->sock);
+	if (unlikely(value == end)) {
+		mm_netbuf_rnext(&state->sock);
+		value = mm_netbuf_rget(&state->sock);
+		end = mm_netbuf_rend(&state->sock);
+	}
+	char *copy = NULL;
+	if (value + value_len <= end) {
+		mm_netbuf_radd(&state->sock, value_len);
+	} else {
+		copy = value = mm_memory_xalloc(value_len);
+		mm_netbuf_read(&state->sock, value, value_len);
+	}
+
+	// Give up as soon as the result does not fit the required saving.
+	mm_timeval_t start = mm_clock_gettime_monotonic();
+	uint32_t room = value_len - (value_len >> MC_COMPRESS_SAVING_SHIFT);
+	struct mm_compress_table *table = mm_memory_xalloc(sizeof(struct mm_compress_table) + room);
+	char *packed = (char *) (table + 1);
+	uint32_t size = mm_compress(packed + MC_COMPRESS_HEADER_SIZE, room - MC_COMPRESS_HEADER_SIZE,
+				    value, value_len, table);
+
+	struct mc_stat *stat = state->stat;
+	mm_counter_local_inc(&stat->compress_tries);
+	mm_counter_local_add(&stat->compress_usec, mm_clock_gettime_monotonic() - start);
+
+	if (size == 0) {
+		mc_entry_setvalue(entry, 0, value, value_len);
+	} else {
+		size += MC_COMPRESS_HEADER_SIZE;
+		memcpy(packed, &value_len, MC_COMPRESS_HEADER_SIZE);
+
+		// The entry data block is replaced along with the key and
+		// the flags it might keep.
+		char key[UINT8_MAX];
+		memcpy(key, mc_entry_getkey(entry), entry->key_len);
+		uint32_t flags = mc_entry_getflags(entry);
+		mc_action_resize(action, size);
+		mc_entry_setkey(entry, key);
+		mc_entry_setflags(entry, flags);
+		mc_entry_setvalue(entry, 0, packed, size);
+		mc_entry_setlease(entry, MC_ENTRY_COMPRESSED);
+
+		mm_counter_local_inc(&stat->compress_items);
+		mm_counter_local_add(&stat->compress_bytes_in, value_len);
+		mm_counter_local_add(&stat->compress_bytes_out, size);
+	}
+
+	mm_memory_free(table);
+	if (copy != NULL)
+		mm_memory_free(copy);
+
+leave:
+	LEAVE();
+}
+
+void NONNULL(1, 3, 5)
+mc_compress_unpack(char *buffer, uint32_t value_len, const char *packed, uint32_t packed_len,
+		   struct mc_entry *entry)
+{
+	ENTER();
+
+	mm_timeval_t start = mm_clock_gettime_monotonic();
+
+	// A bad value might only come from a damaged snapshot file.
+	if (packed_len < MC_COMPRESS_HEADER_SIZE
+	    || !mm_decompress(buffer, value_len, packed + MC_COMPRESS_HEADER_SIZE,
+			      packed_len - MC_COMPRESS_HEADER_SIZE)) {
+		mm_warning(0, "memcache: bad compressed value for key %.*s",
+			   entry->key_len, mc_entry_getkey(entry));
+		memset(buffer, 0, value_len);
+	}
+
+	struct mc_stat *stat = mc_compress_stat();
+	mm_counter_local_inc(&stat->decompress_items);
+	mm_counter_local_add(&stat->decompress_usec, mm_clock_gettime_monotonic() - start);
+
+	LEAVE();
+}
+
+void NONNULL(1, 2)
+mc_compress_copy_value(char *buffer, struct mc_entry *entry)
+{
+	ENTER();
+	ASSERT(mc_entry_is_compressed(entry));
+
+	// A chunked value is gathered in one piece first.
+	char *packed, *copy = NULL;
+	if (!mc_entry_is_chunked(entry)) {
+		packed = mc_entry_getvalue(entry);
+	} else {
+		copy = packed = mm_memory_xalloc(entry->value_len);
+		char **chunks = mc_entry_getchunks(entry);
+		uint32_t nchunks = mc_entry_nchunks(entry);
+		for (uint32_t i = 0; i < nchunks; i++)
+			memcpy(copy + i * MC_ENTRY_CHUNK_SIZE, chunks[i], mc_entry_chunk_size(entry, i));
+	}
+
+	mc_compress_unpack(buffer, mc_compress_length(entry), packed, entry->value_len, entry);
+
+	if (copy != NULL)
+		mm_memory_free(copy);
+
+	LEAVE();
+}
@@ -0,0 +1,85 @@
+/*
+ * memcache/compress.h - MainMemory memcache value compression.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_COMPRESS_H
+#define MEMCACHE_COMPRESS_H
+
+#include "memcache/memcache.h"
+#include "memcache/action.h"
+#include "memcache/disk.h"
+#include "memcache/entry.h"
+
+/* Forward declaration. */
+struct mc_state;
+
+/*
+ * The values that are long enough might be stored compressed if this
+ * saves at least a fraction of their size. Such an entry is marked so
+ * and its value starts with the original length. Clients always see
+ * the original value, it is decompressed on every read.
+ */
+
+/* The shortest value to compress. */
+#define MC_COMPRESS_VALUE_MIN	(64)
+/* The longest value to compress. */
+#define MC_COMPRESS_VALUE_MAX	(1024 * 1024)
+
+/* The part of the value size the compression has to save. */
+#define MC_COMPRESS_SAVING_SHIFT	(3)
+
+/* The compressed value header size. */
+#define MC_COMPRESS_HEADER_SIZE	(sizeof(uint32_t))
+
+/* Enable the compression of values of the given length and longer, zero
+   disables it. */
+void
+mc_compress_start(uint32_t threshold);
+
+/* Read a new entry value from the receive buffer. Store it compressed
+   if it is worth it. */
+void NONNULL(1, 2)
+mc_compress_read_value(struct mc_state *state, struct mc_action_storage *action);
+
+/* Get the value length as clients see it. */
+static inline uint32_t NONNULL(1)
+mc_compress_length(struct mc_entry *entry)
+{
+	if (mc_entry_is_disk(entry))
+		return mc_disk_length(entry);
+	if (!mc_entry_is_compressed(entry))
+		return entry->value_len;
+
+	uint32_t value_len;
+	if (mc_entry_is_chunked(entry))
+		memcpy(&value_len, mc_entry_getchunks(entry)[0], sizeof value_len);
+	else
+		memcpy(&value_len, mc_entry_getvalue(entry), sizeof value_len);
+	return value_len;
+}
+
+/* Decompress the value to a buffer of mc_compress_length() bytes. */
+void NONNULL(1, 2)
+mc_compress_copy_value(char *buffer, struct mc_entry *entry);
+
+/* Decompress a value stored elsewhere to a buffer of value_len bytes. */
+void NONNULL(1, 3, 5)
+mc_compress_unpack(char *buffer, uint32_t value_len, const char *packed, uint32_t packed_len,
+		   struct mc_entry *entry);
+
+#endif /* MEMCACHE_COMPRESS_H */
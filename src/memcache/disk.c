@@ -0,0 +1,462 @@
+/*
+ * memcache/disk.c - MainMemory memcache disk tier for cold values.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/disk.h"
+#include "memcache/compress.h"
+#include "memcache/table.h"
+
+#include "base/async.h"
+#include "base/format.h"
+#include "base/report.h"
+#include "base/memory/alloc.h"
+#include "base/thread/thread.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MC_DISK_NONE	UINT32_MAX
+
+/**********************************************************************
+ * File I/O.
+ **********************************************************************/
+
+static bool
+mc_disk_read_data(struct mc_disk *disk, char *data, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t n = mm_async_pread(disk->fd, data, size, offset);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			mm_error(n < 0 ? errno : 0, "memcache disk: read %s", disk->path);
+			return false;
+		}
+		data += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool
+mc_disk_write_data(struct mc_disk *disk, const char *data, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t n = mm_async_pwrite(disk->fd, data, size, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			mm_error(errno, "memcache disk: write %s", disk->path);
+			return false;
+		}
+		data += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static inline off_t
+mc_disk_position(uint32_t segment, uint32_t offset)
+{
+	return (off_t) segment * MC_DISK_SEGMENT_SIZE + offset;
+}
+
+/**********************************************************************
+ * Disk segments.
+ **********************************************************************/
+
+/* Make an empty segment free for reuse. Must be called with the lock. */
+static void
+mc_disk_release_segment(struct mc_disk *disk, uint32_t index)
+{
+	struct mc_disk_segment *segment = &disk->segments[index];
+	ASSERT(segment->live == 0);
+	ASSERT(index != disk->head && index != disk->victim);
+	segment->used = 0;
+	disk->nfree++;
+}
+
+/* Find a free segment. Must be called with the lock. */
+static uint32_t
+mc_disk_find_free(struct mc_disk *disk)
+{
+	for (uint32_t i = 0; i < disk->nsegments; i++) {
+		if (disk->segments[i].used == 0 && i != disk->head)
+			return i;
+	}
+	return MC_DISK_NONE;
+}
+
+/* Find the segment that is the cheapest to compact if it is worth it.
+   Must be called with the lock. */
+static uint32_t
+mc_disk_find_victim(struct mc_disk *disk)
+{
+	uint32_t victim = MC_DISK_NONE;
+	uint32_t live = MC_DISK_SEGMENT_SIZE / 100 * MC_DISK_UTILIZATION;
+	for (uint32_t i = 0; i < disk->nsegments; i++) {
+		struct mc_disk_segment *segment = &disk->segments[i];
+		if (segment->used == 0 || i == disk->head)
+			continue;
+		if (segment->live < live) {
+			victim = i;
+			live = segment->live;
+		}
+	}
+	return victim;
+}
+
+void NONNULL(1)
+mc_disk_prepare(struct mc_disk *disk, const char *path, uint32_t index, uint32_t nsegments)
+{
+	ENTER();
+
+	memset(disk, 0, sizeof *disk);
+	disk->fd = -1;
+	disk->victim = MC_DISK_NONE;
+	disk->lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	if (path == NULL)
+		goto leave;
+
+	// The stubs do not survive a restart so the file starts empty.
+	disk->path = mm_format(&mm_memory_fixed_xarena, "%s.%u", path, index);
+	disk->fd = open(disk->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (disk->fd < 0)
+		mm_fatal(errno, "memcache disk: %s", disk->path);
+
+	disk->nsegments = max(nsegments, (uint32_t) MC_DISK_SEGMENTS_MIN);
+	disk->segments = mm_memory_fixed_xcalloc(disk->nsegments, sizeof(struct mc_disk_segment));
+	disk->nfree = disk->nsegments - 1;
+	disk->buffer = mm_memory_fixed_xalloc(MC_DISK_SEGMENT_SIZE);
+
+leave:
+	LEAVE();
+}
+
+void NONNULL(1)
+mc_disk_cleanup(struct mc_disk *disk)
+{
+	ENTER();
+
+	if (!mc_disk_enabled(disk))
+		goto leave;
+
+	close(disk->fd);
+	unlink(disk->path);
+	disk->fd = -1;
+
+	mm_memory_fixed_free(disk->segments);
+	mm_memory_fixed_free(disk->buffer);
+	mm_memory_fixed_free(disk->victim_buffer);
+	mm_memory_fixed_free(disk->path);
+
+leave:
+	LEAVE();
+}
+
+/**********************************************************************
+ * Disk records.
+ **********************************************************************/
+
+bool NONNULL(1, 3, 4)
+mc_disk_append(struct mc_disk *disk, uint32_t owner, struct mc_entry *entry, struct mc_disk_ref *ref)
+{
+	ENTER();
+
+	uint32_t size = entry->value_len;
+	uint32_t footprint = mc_disk_record_footprint(size);
+	uint32_t length = mc_compress_length(entry);
+
+	mm_regular_lock(&disk->lock);
+
+	struct mc_disk_segment *segment = &disk->segments[disk->head];
+	bool fits = !disk->full && segment->used + footprint <= MC_DISK_SEGMENT_SIZE;
+	if (fits) {
+		struct mc_disk_record *record = (struct mc_disk_record *) (disk->buffer + segment->used);
+		record->owner = owner;
+		record->size = size;
+
+		char *data = (char *) (record + 1);
+		if (!mc_entry_is_chunked(entry)) {
+			memcpy(data, mc_entry_getvalue(entry), size);
+		} else {
+			char **chunks = mc_entry_getchunks(entry);
+			uint32_t nchunks = mc_entry_nchunks(entry);
+			for (uint32_t i = 0; i < nchunks; i++)
+				memcpy(data + i * MC_ENTRY_CHUNK_SIZE, chunks[i], mc_entry_chunk_size(entry, i));
+		}
+
+		ref->segment = disk->head;
+		ref->offset = segment->used;
+		ref->size = size;
+		ref->length = length;
+
+		segment->used += footprint;
+		segment->live += footprint;
+		disk->live += footprint;
+		disk->nlive++;
+		disk->items++;
+	} else {
+		mm_memory_store(disk->full, true);
+	}
+
+	mm_regular_unlock(&disk->lock);
+
+	LEAVE();
+	return fits;
+}
+
+void NONNULL(1, 2)
+mc_disk_free(struct mc_disk *disk, const struct mc_disk_ref *ref)
+{
+	ENTER();
+
+	uint32_t footprint = mc_disk_record_footprint(ref->size);
+
+	mm_regular_lock(&disk->lock);
+
+	struct mc_disk_segment *segment = &disk->segments[ref->segment];
+	ASSERT(segment->live >= footprint);
+	segment->live -= footprint;
+	disk->live -= footprint;
+	disk->nlive--;
+
+	// The head segment and the one being compacted are released when
+	// they are done with.
+	if (segment->live == 0 && ref->segment != disk->head && ref->segment != disk->victim)
+		mc_disk_release_segment(disk, ref->segment);
+
+	mm_regular_unlock(&disk->lock);
+
+	LEAVE();
+}
+
+bool NONNULL(1)
+mc_disk_flush(struct mc_disk *disk, bool compacting)
+{
+	ENTER();
+
+	bool done = false;
+	uint32_t head = disk->head;
+
+	// Only the caller appends records so the buffer stays intact while
+	// it is written out. Meanwhile the readers still copy the records
+	// from the buffer.
+	if (!disk->written) {
+		uint32_t used = disk->segments[head].used;
+		if (!mc_disk_write_data(disk, disk->buffer, used, mc_disk_position(head, 0)))
+			goto leave;
+		disk->written = true;
+		disk->written_bytes += used;
+	}
+
+	mm_regular_lock(&disk->lock);
+	if (disk->nfree > (compacting ? 0 : MC_DISK_RESERVE)) {
+		uint32_t next = mc_disk_find_free(disk);
+		ASSERT(next != MC_DISK_NONE);
+		disk->nfree--;
+		disk->head = next;
+		disk->full = false;
+		disk->written = false;
+		if (disk->segments[head].live == 0 && head != disk->victim)
+			mc_disk_release_segment(disk, head);
+		done = true;
+	}
+	mm_regular_unlock(&disk->lock);
+
+leave:
+	LEAVE();
+	return done;
+}
+
+/**********************************************************************
+ * Disk compaction.
+ **********************************************************************/
+
+bool NONNULL(1)
+mc_disk_check_compact(struct mc_disk *disk)
+{
+	if (mm_memory_load(disk->nfree) > MC_DISK_RESERVE)
+		return false;
+
+	mm_regular_lock(&disk->lock);
+	uint32_t victim = mc_disk_find_victim(disk);
+	mm_regular_unlock(&disk->lock);
+
+	return victim != MC_DISK_NONE;
+}
+
+bool NONNULL(1)
+mc_disk_compact_start(struct mc_disk *disk)
+{
+	ENTER();
+
+	bool started = false;
+
+	mm_regular_lock(&disk->lock);
+	uint32_t victim = mc_disk_find_victim(disk);
+	if (victim != MC_DISK_NONE) {
+		disk->victim = victim;
+		disk->victim_used = disk->segments[victim].used;
+		disk->victim_offset = 0;
+	}
+	mm_regular_unlock(&disk->lock);
+	if (victim == MC_DISK_NONE)
+		goto leave;
+
+	// The records are looked through in memory.
+	if (disk->victim_buffer == NULL)
+		disk->victim_buffer = mm_memory_fixed_xalloc(MC_DISK_SEGMENT_SIZE);
+	if (!mc_disk_read_data(disk, disk->victim_buffer, disk->victim_used, mc_disk_position(victim, 0))) {
+		mc_disk_compact_finish(disk);
+		goto leave;
+	}
+	started = true;
+
+leave:
+	LEAVE();
+	return started;
+}
+
+struct mc_disk_record * NONNULL(1, 2)
+mc_disk_compact_next(struct mc_disk *disk, uint32_t *offset)
+{
+	if (disk->victim_offset >= disk->victim_used)
+		return NULL;
+	*offset = disk->victim_offset;
+	return (struct mc_disk_record *) (disk->victim_buffer + disk->victim_offset);
+}
+
+void NONNULL(1)
+mc_disk_compact_advance(struct mc_disk *disk)
+{
+	struct mc_disk_record *record = (struct mc_disk_record *) (disk->victim_buffer + disk->victim_offset);
+	disk->victim_offset += mc_disk_record_footprint(record->size);
+}
+
+bool NONNULL(1, 2)
+mc_disk_compact_move(struct mc_disk *disk, struct mc_disk_ref *ref)
+{
+	ENTER();
+	ASSERT(ref->segment == disk->victim);
+	ASSERT(ref->offset == disk->victim_offset);
+
+	uint32_t footprint = mc_disk_record_footprint(ref->size);
+
+	mm_regular_lock(&disk->lock);
+
+	struct mc_disk_segment *segment = &disk->segments[disk->head];
+	bool fits = !disk->full && segment->used + footprint <= MC_DISK_SEGMENT_SIZE;
+	if (fits) {
+		memcpy(disk->buffer + segment->used, disk->victim_buffer + ref->offset, footprint);
+		disk->segments[disk->victim].live -= footprint;
+
+		ref->segment = disk->head;
+		ref->offset = segment->used;
+
+		segment->used += footprint;
+		segment->live += footprint;
+		disk->moved += footprint;
+	} else {
+		mm_memory_store(disk->full, true);
+	}
+
+	mm_regular_unlock(&disk->lock);
+
+	LEAVE();
+	return fits;
+}
+
+void NONNULL(1)
+mc_disk_compact_finish(struct mc_disk *disk)
+{
+	ENTER();
+
+	mm_regular_lock(&disk->lock);
+	uint32_t victim = disk->victim;
+	disk->victim = MC_DISK_NONE;
+	// The segment stays as is if some records could not be moved.
+	if (disk->segments[victim].live == 0) {
+		mc_disk_release_segment(disk, victim);
+		disk->compacted++;
+	}
+	mm_regular_unlock(&disk->lock);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Disk reads.
+ **********************************************************************/
+
+bool NONNULL(1, 2, 3)
+mc_disk_read(struct mc_disk *disk, const struct mc_disk_ref *ref, char *buffer)
+{
+	ENTER();
+
+	// The head segment records might not be written out yet.
+	mm_regular_lock(&disk->lock);
+	bool done = (ref->segment == disk->head);
+	if (done)
+		memcpy(buffer, disk->buffer + ref->offset + sizeof(struct mc_disk_record), ref->size);
+	mm_regular_unlock(&disk->lock);
+
+	// Other records stay intact while their stubs are referenced.
+	if (!done) {
+		off_t position = mc_disk_position(ref->segment, ref->offset + sizeof(struct mc_disk_record));
+		done = mc_disk_read_data(disk, buffer, ref->size, position);
+	}
+
+	LEAVE();
+	return done;
+}
+
+bool NONNULL(1, 2)
+mc_disk_copy_value(char *buffer, struct mc_entry *entry)
+{
+	ENTER();
+	ASSERT(mc_entry_is_disk(entry));
+
+	struct mc_disk_ref ref;
+	mc_disk_getref(entry, &ref);
+	struct mc_disk *disk = &mc_table_part(entry->hash)->disk;
+
+	// A compressed value is read aside and then unpacked.
+	char *data = buffer;
+	if (mc_entry_is_compressed(entry))
+		data = mm_memory_xalloc(ref.size);
+
+	bool done = mc_disk_read(disk, &ref, data);
+	if (!done) {
+		mm_warning(0, "memcache: cannot read value for key %.*s from disk",
+			   entry->key_len, mc_entry_getkey(entry));
+	} else if (data != buffer) {
+		mc_compress_unpack(buffer, ref.length, data, ref.size, entry);
+	}
+
+	if (data != buffer)
+		mm_memory_free(data);
+
+	struct mc_stat *stat = MM_THREAD_LOCAL_DEREF(mm_thread_self(), mc_table.stat);
+	mm_counter_local_inc(&stat->disk_reads);
+
+	LEAVE();
+	return done;
+}
@@ -0,0 +1,229 @@
+/*
+ * memcache/disk.h - MainMemory memcache disk tier for cold values.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_DISK_H
+#define MEMCACHE_DISK_H
+
+#include "memcache/memcache.h"
+#include "memcache/entry.h"
+
+#include "base/bitops.h"
+#include "base/lock.h"
+
+/*
+ * With the disk tier the long values of evicted entries are written to
+ * a file of each partition rather than dropped. Such an entry stays in
+ * the table as a stub that keeps the value location in place of the
+ * value. The file is split into segments. The head segment is filled
+ * in memory and written out whole, so the file is only appended to
+ * until a segment is free for reuse. A segment is free as soon as all
+ * the stubs that refer to it go away. Nearly dead segments are also
+ * compacted in the background: their live records are moved to the
+ * head one and the stubs are fixed.
+ *
+ * The reads go to the file with asynchronous system calls so they block
+ * only the fiber that waits for the value.
+ */
+
+/* The segment size. */
+#define MC_DISK_SEGMENT_SIZE	(1024 * 1024)
+/* The minimum number of segments per partition. */
+#define MC_DISK_SEGMENTS_MIN	(4)
+/* The number of free segments left for compaction. */
+#define MC_DISK_RESERVE		(1)
+/* The live data percentage below which a segment is compacted. */
+#define MC_DISK_UTILIZATION	(75)
+
+/* The shortest value to move to disk. */
+#define MC_DISK_VALUE_MIN	(512)
+/* The longest value to move to disk. */
+#define MC_DISK_VALUE_MAX	(MC_DISK_SEGMENT_SIZE - sizeof(struct mc_disk_record))
+
+/* The stubs are evicted as usual only when they take more than this
+   part of the memory. */
+#define MC_DISK_STUB_SHARE_SHIFT	(1)
+
+/* The record sizes and offsets are aligned to this many bytes. */
+#define MC_DISK_UNIT		(8)
+
+/* A value record that is followed by the value as it is stored. */
+struct mc_disk_record
+{
+	/* The owner entry index plus one. */
+	uint32_t owner;
+	/* The value size. */
+	uint32_t size;
+};
+
+/* The value location that a stub entry keeps in place of the value. */
+struct mc_disk_ref
+{
+	/* The record position in the file. */
+	uint32_t segment;
+	uint32_t offset;
+	/* The value size as it is stored. */
+	uint32_t size;
+	/* The value length as clients see it. */
+	uint32_t length;
+};
+
+struct mc_disk_segment
+{
+	/* The size of appended records. */
+	uint32_t used;
+	/* The size of live records. */
+	uint32_t live;
+};
+
+struct mc_disk
+{
+	/* The file, -1 if there is no disk tier. */
+	int fd;
+	char *path;
+
+	/* All the file segments and the number of free ones. */
+	struct mc_disk_segment *segments;
+	uint32_t nsegments;
+	uint32_t nfree;
+
+	/* The segment filled in memory. It is full when the last record
+	   did not fit and it has to be written out. */
+	uint32_t head;
+	char *buffer;
+	bool full;
+	bool written;
+
+	/* The segment being compacted, its copy and scan position. */
+	uint32_t victim;
+	char *victim_buffer;
+	uint32_t victim_used;
+	uint32_t victim_offset;
+
+	/* The segment state is changed with this lock. The readers also
+	   copy the head segment records with it. */
+	mm_regular_lock_t lock;
+
+	/* The total size and number of live records. */
+	size_t live;
+	uint32_t nlive;
+
+	/* Statistics. */
+	uint64_t items;
+	uint64_t written_bytes;
+	uint64_t compacted;
+	uint64_t moved;
+};
+
+void NONNULL(1)
+mc_disk_prepare(struct mc_disk *disk, const char *path, uint32_t index, uint32_t nsegments);
+
+void NONNULL(1)
+mc_disk_cleanup(struct mc_disk *disk);
+
+/* Append a record for an entry value. Fails if the head segment has no
+   room for it and has to be written out first. */
+bool NONNULL(1, 3, 4)
+mc_disk_append(struct mc_disk *disk, uint32_t owner, struct mc_entry *entry, struct mc_disk_ref *ref);
+
+/* Forget a record when its stub entry goes away. */
+void NONNULL(1, 2)
+mc_disk_free(struct mc_disk *disk, const struct mc_disk_ref *ref);
+
+/* Write out the full head segment and start a new one if there is a
+   free segment. Only compaction may take the reserved ones. Returns
+   false if the head is still full. */
+bool NONNULL(1)
+mc_disk_flush(struct mc_disk *disk, bool compacting);
+
+/* Check if there are too few free segments and some to compact. */
+bool NONNULL(1)
+mc_disk_check_compact(struct mc_disk *disk);
+
+/* Pick the segment with the fewest live records and read it. */
+bool NONNULL(1)
+mc_disk_compact_start(struct mc_disk *disk);
+
+/* Get the current record of the segment being compacted and its offset,
+   NULL when the segment is done. */
+struct mc_disk_record * NONNULL(1, 2)
+mc_disk_compact_next(struct mc_disk *disk, uint32_t *offset);
+
+/* Go on to the next record of the segment being compacted. */
+void NONNULL(1)
+mc_disk_compact_advance(struct mc_disk *disk);
+
+/* Move the current record of the segment being compacted to the head
+   segment. Fails if the head segment has no room for it. */
+bool NONNULL(1, 2)
+mc_disk_compact_move(struct mc_disk *disk, struct mc_disk_ref *ref);
+
+/* Free the compacted segment if no live records are left there. */
+void NONNULL(1)
+mc_disk_compact_finish(struct mc_disk *disk);
+
+/* Read a stored value. */
+bool NONNULL(1, 2, 3)
+mc_disk_read(struct mc_disk *disk, const struct mc_disk_ref *ref, char *buffer);
+
+/* Read the value of a stub entry to a buffer of mc_disk_length() bytes
+   decompressing it if needed. Fails on a disk error. */
+bool NONNULL(1, 2)
+mc_disk_copy_value(char *buffer, struct mc_entry *entry);
+
+static inline bool NONNULL(1)
+mc_disk_enabled(struct mc_disk *disk)
+{
+	return disk->fd >= 0;
+}
+
+static inline bool NONNULL(1)
+mc_disk_is_full(struct mc_disk *disk)
+{
+	return mm_memory_load(disk->full);
+}
+
+/* The file space taken by a record for the given value size. */
+static inline uint32_t
+mc_disk_record_footprint(uint32_t size)
+{
+	return mm_round_up(sizeof(struct mc_disk_record) + size, MC_DISK_UNIT);
+}
+
+static inline void NONNULL(1, 2)
+mc_disk_getref(struct mc_entry *entry, struct mc_disk_ref *ref)
+{
+	memcpy(ref, mc_entry_getvalue(entry), sizeof *ref);
+}
+
+static inline void NONNULL(1, 2)
+mc_disk_setref(struct mc_entry *entry, const struct mc_disk_ref *ref)
+{
+	memcpy(mc_entry_getvalue(entry), ref, sizeof *ref);
+}
+
+/* Get the value length of a stub entry as clients see it. */
+static inline uint32_t NONNULL(1)
+mc_disk_length(struct mc_entry *entry)
+{
+	struct mc_disk_ref ref;
+	mc_disk_getref(entry, &ref);
+	return ref.length;
+}
+
+#endif /* MEMCACHE_DISK_H */
@@ -21,6 +21,10 @@
 
 #include "base/scan.h"
 
+#if ENABLE_MEMCACHE_COMPACT
+char *mc_entry_space;
+#endif
+
 void NONNULL(1)
 mc_entry_setnum(struct mc_entry *entry, uint64_t value)
 {
@@ -32,18 +36,26 @@ mc_entry_setnum(struct mc_entry *entry, uint64_t value)
 		value /= 10;
 	} while (value);
 
-	entry->value_len = value_len;
+	// Keep the whole space for the next update.
+	uint32_t capacity = entry->value_len + mc_entry_getslack(entry);
+	ASSERT(value_len <= capacity);
 
 	char *v = mc_entry_getvalue(entry);
-	do {
-		size_t i = entry->value_len - value_len--;
-		v[i] = buffer[value_len];
-	} while (value_len);
+	for (size_t i = 0; i < value_len; i++)
+		v[i] = buffer[value_len - i - 1];
+
+	entry->value_len = value_len;
+	// A lock-free reader that sees no slack must see the final value.
+	mm_memory_store_fence();
+	mc_entry_setslack(entry, capacity - value_len);
 }
 
 bool NONNULL(1, 2)
 mc_entry_getnum(struct mc_entry *entry, uint64_t *value)
 {
+	if (entry->value_len > MC_ENTRY_NUM_LEN_MAX || (mc_entry_getlease(entry) & MC_ENTRY_VALUE_BITS) != 0)
+		return false;
+
 	const char *p = mc_entry_getvalue(entry);
 	const char *e = p + entry->value_len;
 
@@ -51,3 +63,59 @@ mc_entry_getnum(struct mc_entry *entry, uint64_t *value)
 	p = mm_scan_u64(value, &error, p, e);
 	return error == 0 && p == e;
 }
+
+void NONNULL(1, 3)
+mc_entry_setvalue(struct mc_entry *entry, uint32_t offset, const char *value, uint32_t value_len)
+{
+	ASSERT(offset + value_len <= entry->value_len);
+
+	if (!mc_entry_is_chunked(entry)) {
+		memcpy(mc_entry_getvalue(entry) + offset, value, value_len);
+		return;
+	}
+
+	char **chunks = mc_entry_getchunks(entry);
+	uint32_t index = offset / MC_ENTRY_CHUNK_SIZE;
+	offset %= MC_ENTRY_CHUNK_SIZE;
+	while (value_len) {
+		uint32_t n = MC_ENTRY_CHUNK_SIZE - offset;
+		if (n > value_len)
+			n = value_len;
+		memcpy(chunks[index] + offset, value, n);
+		value += n;
+		value_len -= n;
+		offset = 0;
+		index++;
+	}
+}
+
+void NONNULL(1, 2)
+mc_entry_appendvalue(struct mc_entry *entry, const char *value, uint32_t value_len)
+{
+	uint16_t slack = mc_entry_getslack(entry);
+	ASSERT(value_len <= slack);
+
+	memcpy(mc_entry_getvalue(entry) + entry->value_len, value, value_len);
+
+	entry->value_len += value_len;
+	// A lock-free reader that sees no slack must see the final value.
+	mm_memory_store_fence();
+	mc_entry_setslack(entry, slack - value_len);
+}
+
+void NONNULL(1, 3)
+mc_entry_copyvalue(struct mc_entry *entry, uint32_t offset, struct mc_entry *source)
+{
+	if (!mc_entry_is_chunked(source)) {
+		mc_entry_setvalue(entry, offset, mc_entry_getvalue(source), source->value_len);
+		return;
+	}
+
+	char **chunks = mc_entry_getchunks(source);
+	uint32_t nchunks = mc_entry_nchunks(source);
+	for (uint32_t i = 0; i < nchunks; i++) {
+		uint32_t size = mc_entry_chunk_size(source, i);
+		mc_entry_setvalue(entry, offset, chunks[i], size);
+		offset += size;
+	}
+}
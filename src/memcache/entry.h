@@ -22,14 +22,13 @@
 
 #include "memcache/memcache.h"
 
+#include "base/atomic.h"
+#include "base/bitops.h"
 #include "base/context.h"
 #include "base/list.h"
+#include "base/report.h"
 #include "base/event/event.h"
 
-#if !ENABLE_MEMCACHE_COMBINER
-# include "base/atomic.h"
-#endif
-
 /* Forward declaration. */
 struct mc_action;
 
@@ -40,28 +39,103 @@ struct mc_action;
 
 #define MC_ENTRY_NUM_LEN_MAX	20
 
+/* Entry lease bits: a client was told to refill the entry, the entry
+   value is out of date. */
+#define MC_ENTRY_LEASE_WON	1
+#define MC_ENTRY_LEASE_STALE	2
+/* The entry value is compressed or kept on disk. These bits share the
+   lease byte but they are set before the entry is inserted and never
+   change after that. */
+#define MC_ENTRY_COMPRESSED	4
+#define MC_ENTRY_DISK		8
+#define MC_ENTRY_VALUE_BITS	(MC_ENTRY_COMPRESSED | MC_ENTRY_DISK)
+
+/* Values longer than this are stored as a chain of chunks. */
+#define MC_ENTRY_CHUNK_SIZE	(16 * 1024)
+
+#if ENABLE_MEMCACHE_COMPACT
+
+/* The entry data block offsets are kept in this many byte units. */
+#define MC_ENTRY_SPACE_SHIFT	3
+#define MC_ENTRY_SPACE_MAX	((size_t) UINT32_MAX << MC_ENTRY_SPACE_SHIFT)
+
+/* A link to the next entry in a list: its partition index plus one. */
+typedef uint32_t mc_link_t;
+
+/* The entry fields that are rarely used go to the data block. */
+struct mc_entry_extra
+{
+	uint64_t stamp;
+	uint32_t flags;
+
+	/* The eviction policy segment. */
+	uint8_t segment;
+	/* The lease and value storage bits. */
+	uint8_t lease;
+	/* The spare space after the value. */
+	uint16_t slack;
+};
+
+/* The base address for entry data block offsets. */
+extern char *mc_entry_space;
+
+#else
+
+/* The entry space for short key/value data. It makes the whole entry
+   take exactly one cache line so that the entries of longer items do
+   not waste much. */
+#define MC_ENTRY_INLINE_SIZE	(16)
+
+/* A link to the next entry in a list. */
+typedef struct mc_entry *mc_link_t;
+
+#endif
+
 struct mc_entry
 {
-	struct mm_slink link;
+	mc_link_t link;
+#if ENABLE_MEMCACHE_COMPACT
+	/* The data block offset, zero if none. */
+	uint32_t data;
+#else
 	char *data;
+#endif
 
 	uint32_t hash;
 	uint32_t exp_time;
+#if !ENABLE_MEMCACHE_COMPACT
 	uint32_t flags;
+#endif
 
-#if ENABLE_MEMCACHE_COMBINER
-	uint16_t ref_count;
-#else
 	mm_atomic_uint16_t ref_count;
-#endif
 
 	uint8_t state;
 
 	uint8_t key_len;
 	uint32_t value_len;
+
+#if !ENABLE_MEMCACHE_COMPACT
+	/* The eviction policy segment. */
+	uint8_t segment;
+	/* The lease and value storage bits. */
+	uint8_t lease;
+	/* The spare space after the value. */
+	uint16_t slack;
+
 	uint64_t stamp;
+
+	/* The key/value data if it is short enough. */
+	char inline_data[MC_ENTRY_INLINE_SIZE];
+#endif
 };
 
+/* The minimum memory taken by an entry. */
+#if ENABLE_MEMCACHE_COMPACT
+# define MC_ENTRY_SIZE_MIN	(sizeof(struct mc_entry) + sizeof(struct mc_entry_extra))
+#else
+# define MC_ENTRY_SIZE_MIN	(sizeof(struct mc_entry))
+#endif
+
 static inline uint32_t
 mc_entry_fix_exptime(uint32_t exptime)
 {
@@ -71,16 +145,193 @@ mc_entry_fix_exptime(uint32_t exptime)
 	return exptime;
 }
 
+/* Get the data block that holds the key and either the value or the
+   chunk list. */
+static inline char *
+mc_entry_getdata(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	if (entry->data == 0)
+		return NULL;
+	return mc_entry_space + ((size_t) entry->data << MC_ENTRY_SPACE_SHIFT);
+#else
+	return entry->data;
+#endif
+}
+
+static inline void
+mc_entry_setdata(struct mc_entry *entry, char *data)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	if (data == NULL) {
+		entry->data = 0;
+		return;
+	}
+	size_t offset = data - mc_entry_space;
+	ASSERT(offset != 0 && offset < MC_ENTRY_SPACE_MAX);
+	ASSERT((offset & ((1u << MC_ENTRY_SPACE_SHIFT) - 1)) == 0);
+	entry->data = offset >> MC_ENTRY_SPACE_SHIFT;
+#else
+	entry->data = data;
+#endif
+}
+
+#if ENABLE_MEMCACHE_COMPACT
+static inline struct mc_entry_extra *
+mc_entry_getextra(struct mc_entry *entry)
+{
+	return (struct mc_entry_extra *) mc_entry_getdata(entry);
+}
+#endif
+
+static inline uint64_t
+mc_entry_getstamp(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return mc_entry_getextra(entry)->stamp;
+#else
+	return entry->stamp;
+#endif
+}
+
+static inline void
+mc_entry_setstamp(struct mc_entry *entry, uint64_t stamp)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	mc_entry_getextra(entry)->stamp = stamp;
+#else
+	entry->stamp = stamp;
+#endif
+}
+
 static inline uint32_t
-mc_entry_size(struct mc_entry *entry)
+mc_entry_getflags(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return mc_entry_getextra(entry)->flags;
+#else
+	return entry->flags;
+#endif
+}
+
+static inline void
+mc_entry_setflags(struct mc_entry *entry, uint32_t flags)
 {
-	return (sizeof(struct mc_entry)	+ entry->key_len + entry->value_len);
+#if ENABLE_MEMCACHE_COMPACT
+	mc_entry_getextra(entry)->flags = flags;
+#else
+	entry->flags = flags;
+#endif
+}
+
+static inline uint8_t
+mc_entry_getsegment(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return mc_entry_getextra(entry)->segment;
+#else
+	return entry->segment;
+#endif
+}
+
+static inline void
+mc_entry_setsegment(struct mc_entry *entry, uint8_t segment)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	mc_entry_getextra(entry)->segment = segment;
+#else
+	entry->segment = segment;
+#endif
+}
+
+/* The size of spare space after the value. Only the entries that have
+   some might be updated in place. Lock-free readers check it first. */
+static inline uint16_t *
+mc_entry_slackptr(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return &mc_entry_getextra(entry)->slack;
+#else
+	return &entry->slack;
+#endif
+}
+
+static inline uint16_t
+mc_entry_getslack(struct mc_entry *entry)
+{
+	return *mc_entry_slackptr(entry);
+}
+
+static inline void
+mc_entry_setslack(struct mc_entry *entry, uint16_t slack)
+{
+	mm_memory_store(*mc_entry_slackptr(entry), slack);
+}
+
+static inline uint8_t *
+mc_entry_leaseptr(struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return &mc_entry_getextra(entry)->lease;
+#else
+	return &entry->lease;
+#endif
+}
+
+static inline uint8_t
+mc_entry_getlease(struct mc_entry *entry)
+{
+	return mm_memory_load(*mc_entry_leaseptr(entry));
+}
+
+static inline void
+mc_entry_setlease(struct mc_entry *entry, uint8_t lease)
+{
+	mm_memory_store(*mc_entry_leaseptr(entry), lease);
+}
+
+/* Hand out the lease to refill the entry unless it is already taken.
+   The entry might be concurrently accessed by other clients so only
+   one of them is allowed to win. */
+static inline bool
+mc_entry_takelease(struct mc_entry *entry)
+{
+	uint8_t *ptr = mc_entry_leaseptr(entry);
+	uint8_t lease = mm_memory_load(*ptr);
+	while ((lease & MC_ENTRY_LEASE_WON) == 0) {
+#if ENABLE_SMP
+		uint8_t found = mm_atomic_uint8_cas((mm_atomic_uint8_t *) ptr, lease, lease | MC_ENTRY_LEASE_WON);
+		if (found == lease)
+			return true;
+		lease = found;
+#else
+		*ptr = lease | MC_ENTRY_LEASE_WON;
+		return true;
+#endif
+	}
+	return false;
+}
+
+static inline bool
+mc_entry_is_compressed(struct mc_entry *entry)
+{
+	return (mc_entry_getlease(entry) & MC_ENTRY_COMPRESSED) != 0;
+}
+
+static inline bool
+mc_entry_is_disk(struct mc_entry *entry)
+{
+	return (mc_entry_getlease(entry) & MC_ENTRY_DISK) != 0;
 }
 
 static inline char *
 mc_entry_getkey(struct mc_entry *entry)
 {
+#if ENABLE_MEMCACHE_COMPACT
+	return mc_entry_getdata(entry) + sizeof(struct mc_entry_extra);
+#else
 	return entry->data;
+#endif
 }
 
 static inline void
@@ -90,12 +341,120 @@ mc_entry_setkey(struct mc_entry *entry, const char *key)
 	memcpy(entry_key, key, entry->key_len);
 }
 
+static inline bool
+mc_entry_is_chunked(struct mc_entry *entry)
+{
+	return entry->value_len > MC_ENTRY_CHUNK_SIZE;
+}
+
+static inline uint32_t
+mc_entry_nchunks(struct mc_entry *entry)
+{
+	return (entry->value_len + MC_ENTRY_CHUNK_SIZE - 1) / MC_ENTRY_CHUNK_SIZE;
+}
+
+/* The size of the entry data block that holds the key and either the
+   value or the chunk list. */
+static inline size_t
+mc_entry_data_size(struct mc_entry *entry)
+{
+	size_t size;
+	if (mc_entry_is_chunked(entry))
+		size = mm_round_up(entry->key_len, sizeof(char *)) + mc_entry_nchunks(entry) * sizeof(char *);
+	else
+		size = entry->key_len + entry->value_len;
+#if ENABLE_MEMCACHE_COMPACT
+	// Keep the block aligned so that its offset might be scaled.
+	size = mm_round_up(sizeof(struct mc_entry_extra) + size, 1u << MC_ENTRY_SPACE_SHIFT);
+#endif
+	return size;
+}
+
+/* Check if the entry data fits the entry itself. */
+static inline bool
+mc_entry_is_inline(struct mc_entry *entry UNUSED)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return false;
+#else
+	return mc_entry_data_size(entry) <= MC_ENTRY_INLINE_SIZE;
+#endif
+}
+
+/* The size of the entry data block as it was allocated. Unlike the
+   mc_entry_data_size() result it does not change when the value is
+   updated within the slack space. */
+static inline size_t
+mc_entry_data_capacity(struct mc_entry *entry)
+{
+	if (mc_entry_is_chunked(entry))
+		return mc_entry_data_size(entry);
+	size_t size = entry->key_len + entry->value_len + mc_entry_getslack(entry);
+#if ENABLE_MEMCACHE_COMPACT
+	size = mm_round_up(sizeof(struct mc_entry_extra) + size, 1u << MC_ENTRY_SPACE_SHIFT);
+#endif
+	return size;
+}
+
+/* Change the value length within the space taken by the value and its
+   slack. The rest of the space is left as slack. */
+static inline void
+mc_entry_setlength(struct mc_entry *entry, uint32_t value_len)
+{
+	uint32_t capacity = entry->value_len + mc_entry_getslack(entry);
+	ASSERT(value_len <= capacity);
+	ASSERT(capacity <= MC_ENTRY_CHUNK_SIZE || value_len == capacity);
+	entry->value_len = value_len;
+	mc_entry_setslack(entry, capacity - value_len);
+}
+
+static inline char **
+mc_entry_getchunks(struct mc_entry *entry)
+{
+	ASSERT(mc_entry_is_chunked(entry));
+	return (char **) (mc_entry_getkey(entry) + mm_round_up(entry->key_len, sizeof(char *)));
+}
+
+static inline uint32_t
+mc_entry_chunk_size(struct mc_entry *entry, uint32_t index)
+{
+	uint32_t offset = index * MC_ENTRY_CHUNK_SIZE;
+	uint32_t size = entry->value_len - offset;
+	return size < MC_ENTRY_CHUNK_SIZE ? size : MC_ENTRY_CHUNK_SIZE;
+}
+
+/* Get a contiguous value. Chunked values need the chunk list instead. */
 static inline char *
 mc_entry_getvalue(struct mc_entry *entry)
 {
-	return entry->data + entry->key_len;
+	ASSERT(!mc_entry_is_chunked(entry));
+	return mc_entry_getkey(entry) + entry->key_len;
+}
+
+void NONNULL(1, 3)
+mc_entry_setvalue(struct mc_entry *entry, uint32_t offset, const char *value, uint32_t value_len);
+
+void NONNULL(1, 3)
+mc_entry_copyvalue(struct mc_entry *entry, uint32_t offset, struct mc_entry *source);
+
+/* Extend the value into the slack space. */
+void NONNULL(1, 2)
+mc_entry_appendvalue(struct mc_entry *entry, const char *value, uint32_t value_len);
+
+/* The number of digits in a numeric value. */
+static inline uint32_t
+mc_entry_numlen(uint64_t value)
+{
+	uint32_t len = 1;
+	while (value >= 10) {
+		value /= 10;
+		len++;
+	}
+	return len;
 }
 
+/* Store a numeric value. It might take any part of the space left by
+   the previous value along with its slack. */
 void NONNULL(1)
 mc_entry_setnum(struct mc_entry *entry, uint64_t value);
 
@@ -0,0 +1,401 @@
+/*
+ * memcache/evict.c - MainMemory memcache eviction policies.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/evict.h"
+
+#include "base/bitops.h"
+#include "base/report.h"
+#include "base/memory/alloc.h"
+
+/* The number of sketch rows. */
+#define MC_SKETCH_DEPTH		4
+
+/* The minimum number of sketch counters per row. */
+#define MC_SKETCH_WIDTH_MIN	64
+
+/* The maximum value of a 4-bit counter. */
+#define MC_SKETCH_COUNT_MAX	15
+
+/* The number of additions per counter that triggers aging. */
+#define MC_SKETCH_SAMPLE_FACTOR	10
+
+static const uint32_t mc_sketch_seeds[MC_SKETCH_DEPTH] = {
+	0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+};
+
+/**********************************************************************
+ * Access frequency sketch.
+ **********************************************************************/
+
+static void
+mc_sketch_prepare(struct mc_sketch *sketch, uint32_t nentries)
+{
+	uint32_t width = mm_upper_pow2(nentries);
+	if (width < MC_SKETCH_WIDTH_MIN)
+		width = MC_SKETCH_WIDTH_MIN;
+	sketch->table = mm_memory_xcalloc(MC_SKETCH_DEPTH, width / 2);
+	sketch->mask = width - 1;
+	sketch->nadded = 0;
+	sketch->nadded_max = width * MC_SKETCH_SAMPLE_FACTOR;
+}
+
+static void
+mc_sketch_cleanup(struct mc_sketch *sketch)
+{
+	mm_memory_free(sketch->table);
+}
+
+static inline uint32_t
+mc_sketch_index(struct mc_sketch *sketch, uint32_t hash, uint32_t row)
+{
+	uint32_t x = (hash ^ (hash >> 16)) * mc_sketch_seeds[row];
+	x ^= x >> 15;
+	return row * (sketch->mask + 1) + (x & sketch->mask);
+}
+
+static inline uint32_t
+mc_sketch_get(struct mc_sketch *sketch, uint32_t index)
+{
+	uint8_t byte = mm_memory_load(sketch->table[index >> 1]);
+	return (byte >> ((index & 1) * 4)) & 0x0f;
+}
+
+static inline void
+mc_sketch_inc(struct mc_sketch *sketch, uint32_t index)
+{
+	// The update is not atomic. Losing a count now and then is fine.
+	uint8_t byte = mm_memory_load(sketch->table[index >> 1]);
+	byte += 1 << ((index & 1) * 4);
+	mm_memory_store(sketch->table[index >> 1], byte);
+}
+
+static uint32_t
+mc_sketch_estimate(struct mc_sketch *sketch, uint32_t hash)
+{
+	uint32_t count = MC_SKETCH_COUNT_MAX;
+	for (uint32_t row = 0; row < MC_SKETCH_DEPTH; row++) {
+		uint32_t c = mc_sketch_get(sketch, mc_sketch_index(sketch, hash, row));
+		if (count > c)
+			count = c;
+	}
+	return count;
+}
+
+static void
+mc_sketch_halve(struct mc_sketch *sketch)
+{
+	size_t size = MC_SKETCH_DEPTH * (sketch->mask + 1) / 2;
+	for (size_t i = 0; i < size; i++) {
+		uint8_t byte = mm_memory_load(sketch->table[i]);
+		mm_memory_store(sketch->table[i], (byte >> 1) & 0x77);
+	}
+}
+
+static void
+mc_sketch_add(struct mc_sketch *sketch, uint32_t hash)
+{
+	// Use conservative update: increment only the minimal counters.
+	uint32_t index[MC_SKETCH_DEPTH];
+	uint32_t count[MC_SKETCH_DEPTH];
+	uint32_t min = MC_SKETCH_COUNT_MAX;
+	for (uint32_t row = 0; row < MC_SKETCH_DEPTH; row++) {
+		index[row] = mc_sketch_index(sketch, hash, row);
+		count[row] = mc_sketch_get(sketch, index[row]);
+		if (min > count[row])
+			min = count[row];
+	}
+	if (min == MC_SKETCH_COUNT_MAX)
+		return;
+	for (uint32_t row = 0; row < MC_SKETCH_DEPTH; row++) {
+		if (count[row] == min)
+			mc_sketch_inc(sketch, index[row]);
+	}
+
+	// Let the frequency estimates decay after enough samples.
+	if (++sketch->nadded >= sketch->nadded_max) {
+		mc_sketch_halve(sketch);
+		sketch->nadded /= 2;
+	}
+}
+
+/**********************************************************************
+ * Helper routines.
+ **********************************************************************/
+
+static inline uint32_t
+mc_evict_window_target(struct mc_evict *evict)
+{
+	return evict->nentries / 100 + 1;
+}
+
+static inline uint32_t
+mc_evict_protected_target(struct mc_evict *evict)
+{
+	return (evict->nentries - evict->nwindow) / 5 * 4;
+}
+
+static void
+mc_evict_count(struct mc_evict *evict, struct mc_entry *entry)
+{
+	evict->nentries++;
+	if (mc_entry_getsegment(entry) == MC_EVICT_PROTECTED)
+		evict->nprotected++;
+	else if (mc_entry_getsegment(entry) == MC_EVICT_WINDOW)
+		evict->nwindow++;
+}
+
+static void
+mc_evict_uncount(struct mc_evict *evict, struct mc_entry *entry)
+{
+	ASSERT(evict->nentries);
+	evict->nentries--;
+	if (mc_entry_getsegment(entry) == MC_EVICT_PROTECTED)
+		evict->nprotected--;
+	else if (mc_entry_getsegment(entry) == MC_EVICT_WINDOW)
+		evict->nwindow--;
+}
+
+static bool
+mc_evict_age(struct mc_entry *entry)
+{
+	if (entry->state > MC_ENTRY_USED_MIN) {
+		entry->state--;
+		return true;
+	}
+	return false;
+}
+
+static void
+mc_evict_promote(struct mc_evict *evict, struct mc_entry *entry)
+{
+	mc_entry_setsegment(entry, MC_EVICT_PROTECTED);
+	evict->nprotected++;
+}
+
+static struct mc_entry *
+mc_evict_visit_protected(struct mc_evict *evict, struct mc_entry *entry)
+{
+	// Demote the least used entries when the segment is overfull.
+	if (!mc_evict_age(entry) && evict->nprotected > mc_evict_protected_target(evict)) {
+		mc_entry_setsegment(entry, MC_EVICT_PROBATION);
+		evict->nprotected--;
+	}
+	return NULL;
+}
+
+static void
+mc_evict_remove_generic(struct mc_evict *evict, struct mc_entry *entry)
+{
+	mc_evict_uncount(evict, entry);
+	if (evict->candidate == entry)
+		evict->candidate = NULL;
+}
+
+/**********************************************************************
+ * CLOCK policy.
+ **********************************************************************/
+
+static void
+mc_evict_clock_insert(struct mc_evict *evict, struct mc_entry *entry, struct mc_entry *prev UNUSED)
+{
+	mc_entry_setsegment(entry, MC_EVICT_PROBATION);
+	mc_evict_count(evict, entry);
+}
+
+static struct mc_entry *
+mc_evict_clock_visit(struct mc_evict *evict UNUSED, struct mc_entry *entry)
+{
+	return mc_evict_age(entry) ? NULL : entry;
+}
+
+const struct mc_evict_vtable mc_evict_clock = {
+	.name = "clock",
+	.insert = mc_evict_clock_insert,
+	.remove = mc_evict_remove_generic,
+	.visit = mc_evict_clock_visit,
+	.record = NULL,
+};
+
+/**********************************************************************
+ * Segmented LRU policy.
+ **********************************************************************/
+
+/*
+ * New entries go to the probation segment. If an entry is used before
+ * the hand gets to it then it is promoted to the protected segment. So
+ * a scan of cold keys churns only the probation segment.
+ */
+
+static void
+mc_evict_slru_insert(struct mc_evict *evict, struct mc_entry *entry, struct mc_entry *prev)
+{
+	mc_entry_setsegment(entry, prev != NULL ? mc_entry_getsegment(prev) : MC_EVICT_PROBATION);
+	mc_evict_count(evict, entry);
+}
+
+static struct mc_entry *
+mc_evict_slru_visit(struct mc_evict *evict, struct mc_entry *entry)
+{
+	if (mc_entry_getsegment(entry) == MC_EVICT_PROTECTED)
+		return mc_evict_visit_protected(evict, entry);
+
+	if (mc_evict_age(entry)) {
+		mc_evict_promote(evict, entry);
+		return NULL;
+	}
+	return entry;
+}
+
+const struct mc_evict_vtable mc_evict_slru = {
+	.name = "slru",
+	.insert = mc_evict_slru_insert,
+	.remove = mc_evict_remove_generic,
+	.visit = mc_evict_slru_visit,
+	.record = NULL,
+};
+
+/**********************************************************************
+ * W-TinyLFU policy.
+ **********************************************************************/
+
+/*
+ * New entries go to a small window segment. An entry that leaves the
+ * window becomes an admission candidate. It competes with the next
+ * probation victim and the one with lower access frequency is evicted.
+ * If there are more candidates than victims then only the most recent
+ * one competes.
+ * The main segments work like the segmented LRU policy.
+ */
+
+static struct mc_entry *
+mc_evict_tinylfu_duel(struct mc_evict *evict, struct mc_entry *candidate, struct mc_entry *victim)
+{
+	uint32_t candidate_freq = mc_sketch_estimate(&evict->sketch, candidate->hash);
+	uint32_t victim_freq = mc_sketch_estimate(&evict->sketch, victim->hash);
+	return candidate_freq > victim_freq ? victim : candidate;
+}
+
+static void
+mc_evict_tinylfu_insert(struct mc_evict *evict, struct mc_entry *entry, struct mc_entry *prev)
+{
+	mc_entry_setsegment(entry, prev != NULL ? mc_entry_getsegment(prev) : MC_EVICT_WINDOW);
+	mc_evict_count(evict, entry);
+	mc_sketch_add(&evict->sketch, entry->hash);
+}
+
+static struct mc_entry *
+mc_evict_tinylfu_visit(struct mc_evict *evict, struct mc_entry *entry)
+{
+	if (mc_entry_getsegment(entry) == MC_EVICT_PROTECTED)
+		return mc_evict_visit_protected(evict, entry);
+
+	if (mc_entry_getsegment(entry) == MC_EVICT_WINDOW) {
+		bool used = mc_evict_age(entry);
+		if (evict->nwindow <= mc_evict_window_target(evict))
+			return NULL;
+
+		// The entry leaves the window. A used entry is admitted right
+		// away. Otherwise it becomes the candidate. If the previous
+		// candidate has not met a victim yet then it stays admitted.
+		mc_entry_setsegment(entry, MC_EVICT_PROBATION);
+		evict->nwindow--;
+		if (!used)
+			evict->candidate = entry;
+		return NULL;
+	}
+
+	// The hand came to the admitted candidate itself.
+	if (evict->candidate == entry)
+		evict->candidate = NULL;
+
+	if (mc_evict_age(entry)) {
+		mc_evict_promote(evict, entry);
+		return NULL;
+	}
+
+	struct mc_entry *candidate = evict->candidate;
+	if (candidate == NULL)
+		return entry;
+	evict->candidate = NULL;
+	return mc_evict_tinylfu_duel(evict, candidate, entry);
+}
+
+static void
+mc_evict_tinylfu_record(struct mc_evict *evict, uint32_t hash)
+{
+	mc_sketch_add(&evict->sketch, hash);
+}
+
+const struct mc_evict_vtable mc_evict_tinylfu = {
+	.name = "tinylfu",
+	.insert = mc_evict_tinylfu_insert,
+	.remove = mc_evict_remove_generic,
+	.visit = mc_evict_tinylfu_visit,
+	.record = mc_evict_tinylfu_record,
+};
+
+/**********************************************************************
+ * Eviction policy setup.
+ **********************************************************************/
+
+static const struct mc_evict_vtable *mc_evict_policies[] = {
+	&mc_evict_clock,
+	&mc_evict_slru,
+	&mc_evict_tinylfu,
+};
+
+const struct mc_evict_vtable *
+mc_evict_lookup(const char *name)
+{
+	for (size_t i = 0; i < sizeof mc_evict_policies / sizeof mc_evict_policies[0]; i++) {
+		if (strcmp(name, mc_evict_policies[i]->name) == 0)
+			return mc_evict_policies[i];
+	}
+	return NULL;
+}
+
+void NONNULL(1, 2)
+mc_evict_prepare(struct mc_evict *evict, const struct mc_evict_vtable *vtable, uint32_t nentries_max)
+{
+	ENTER();
+
+	evict->vtable = vtable;
+	evict->nentries = 0;
+	evict->nwindow = 0;
+	evict->nprotected = 0;
+	evict->candidate = NULL;
+
+	if (vtable->record != NULL)
+		mc_sketch_prepare(&evict->sketch, nentries_max);
+	else
+		evict->sketch.table = NULL;
+
+	LEAVE();
+}
+
+void NONNULL(1)
+mc_evict_cleanup(struct mc_evict *evict)
+{
+	ENTER();
+
+	if (evict->sketch.table != NULL)
+		mc_sketch_cleanup(&evict->sketch);
+
+	LEAVE();
+}
@@ -0,0 +1,124 @@
+/*
+ * memcache/evict.h - MainMemory memcache eviction policies.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_EVICT_H
+#define MEMCACHE_EVICT_H
+
+#include "memcache/memcache.h"
+#include "memcache/entry.h"
+
+/*
+ * All the policies are driven by the CLOCK hand that sweeps the entry
+ * pool. Entry access only bumps the entry usage counter (entry->state)
+ * so it is cheap enough for lock-free readers. The policies differ in
+ * the way they treat entries met by the hand. The segmented policies
+ * keep the segment of an entry along with its other fields.
+ */
+
+/* Entry segments. */
+#define MC_EVICT_PROBATION	0
+#define MC_EVICT_PROTECTED	1
+#define MC_EVICT_WINDOW		2
+
+/* Count-min sketch of entry access frequency. */
+struct mc_sketch
+{
+	/* Rows of 4-bit counters, two per byte. */
+	uint8_t *table;
+	/* The number of counters per row minus one. */
+	uint32_t mask;
+	/* The number of additions since the last aging. */
+	uint32_t nadded;
+	/* The number of additions that triggers aging. */
+	uint32_t nadded_max;
+};
+
+struct mc_evict;
+
+struct mc_evict_vtable
+{
+	const char *name;
+
+	/* Set up a new entry that is possibly a replacement of another. */
+	void (*insert)(struct mc_evict *evict, struct mc_entry *entry, struct mc_entry *prev);
+	/* Forget an entry that is removed from the table. */
+	void (*remove)(struct mc_evict *evict, struct mc_entry *entry);
+	/* Check an entry met by the hand, return an entry to evict if any. */
+	struct mc_entry * (*visit)(struct mc_evict *evict, struct mc_entry *entry);
+	/* Account a key lookup, optional. */
+	void (*record)(struct mc_evict *evict, uint32_t hash);
+};
+
+/* Per-partition eviction policy state. */
+struct mc_evict
+{
+	const struct mc_evict_vtable *vtable;
+
+	/* The number of entries in the table. */
+	uint32_t nentries;
+	/* The number of entries in specific segments. */
+	uint32_t nwindow;
+	uint32_t nprotected;
+
+	/* An entry evicted from the window that waits for admission. */
+	struct mc_entry *candidate;
+
+	/* Access frequency for admission. */
+	struct mc_sketch sketch;
+};
+
+extern const struct mc_evict_vtable mc_evict_clock;
+extern const struct mc_evict_vtable mc_evict_slru;
+extern const struct mc_evict_vtable mc_evict_tinylfu;
+
+const struct mc_evict_vtable *
+mc_evict_lookup(const char *name);
+
+void NONNULL(1, 2)
+mc_evict_prepare(struct mc_evict *evict, const struct mc_evict_vtable *vtable, uint32_t nentries_max);
+
+void NONNULL(1)
+mc_evict_cleanup(struct mc_evict *evict);
+
+static inline void NONNULL(1, 2)
+mc_evict_insert(struct mc_evict *evict, struct mc_entry *entry, struct mc_entry *prev)
+{
+	(evict->vtable->insert)(evict, entry, prev);
+}
+
+static inline void NONNULL(1, 2)
+mc_evict_remove(struct mc_evict *evict, struct mc_entry *entry)
+{
+	(evict->vtable->remove)(evict, entry);
+}
+
+static inline struct mc_entry * NONNULL(1, 2)
+mc_evict_visit(struct mc_evict *evict, struct mc_entry *entry)
+{
+	return (evict->vtable->visit)(evict, entry);
+}
+
+static inline void NONNULL(1)
+mc_evict_record(struct mc_evict *evict, uint32_t hash)
+{
+	if (evict->vtable->record != NULL)
+		(evict->vtable->record)(evict, hash);
+}
+
+#endif /* MEMCACHE_EVICT_H */
@@ -0,0 +1,261 @@
+/*
+ * memcache/hotkeys.c - MainMemory memcache hot key detection.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/hotkeys.h"
+
+#include "base/report.h"
+#include "base/memory/alloc.h"
+#include "base/thread/domain.h"
+#include "base/thread/thread.h"
+
+#include <stdlib.h>
+
+/* The number of attempts to get a consistent copy of a sketch. */
+#define MC_HOTKEYS_COPY_ATTEMPTS	8
+
+static struct
+{
+	/* The sampling rate, zero if disabled. */
+	uint32_t rate;
+
+	/* The per-thread sketches. */
+	mm_thread_t nthreads;
+	struct mc_hotkeys_local *locals;
+
+} mc_hotkeys;
+
+/**********************************************************************
+ * Sampling.
+ **********************************************************************/
+
+static uint32_t
+mc_hotkeys_countdown(struct mc_hotkeys_local *local)
+{
+	if (mc_hotkeys.rate == 0)
+		return UINT32_MAX;
+
+	// Use a random interval to avoid beats with periodic requests.
+	uint32_t x = local->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	local->random = x;
+	return 1 + x % (2 * mc_hotkeys.rate - 1);
+}
+
+static void
+mc_hotkeys_decay(struct mc_hotkeys_local *local)
+{
+	uint32_t nkeys = 0;
+	for (uint32_t i = 0; i < local->nkeys; i++) {
+		struct mc_hotkey *key = &local->keys[i];
+		key->count /= 2;
+		key->error /= 2;
+		if (key->count == 0)
+			continue;
+		if (nkeys != i)
+			local->keys[nkeys] = *key;
+		nkeys++;
+	}
+	local->nkeys = nkeys;
+	local->nwindow = 0;
+}
+
+static struct mc_hotkey *
+mc_hotkeys_find(struct mc_hotkey *keys, uint32_t nkeys, uint32_t hash, const char *key, uint8_t key_len)
+{
+	for (uint32_t i = 0; i < nkeys; i++) {
+		if (keys[i].hash == hash && keys[i].key_len == key_len && !memcmp(keys[i].key, key, key_len))
+			return &keys[i];
+	}
+	return NULL;
+}
+
+uint32_t NONNULL(1, 2)
+mc_hotkeys_record(struct mc_hotkeys_local *local, struct mc_action *action)
+{
+	ENTER();
+	uint32_t count = 0;
+
+	local->countdown = mc_hotkeys_countdown(local);
+	if (mc_hotkeys.rate == 0)
+		goto leave;
+
+	mm_memory_store(local->version, local->version + 1);
+	mm_memory_store_fence();
+
+	local->nsamples++;
+	if (++(local->nwindow) > MC_HOTKEYS_WINDOW)
+		mc_hotkeys_decay(local);
+
+	struct mc_hotkey *key = mc_hotkeys_find(local->keys, local->nkeys, action->hash, action->key, action->key_len);
+	if (key != NULL) {
+		key->count++;
+	} else {
+		if (local->nkeys < MC_HOTKEYS_SIZE) {
+			key = &local->keys[local->nkeys++];
+			key->count = 0;
+		} else {
+			// Replace the least frequent key. The new one inherits
+			// its count as the possible error.
+			key = &local->keys[0];
+			for (uint32_t i = 1; i < MC_HOTKEYS_SIZE; i++) {
+				if (local->keys[i].count < key->count)
+					key = &local->keys[i];
+			}
+		}
+		key->hash = action->hash;
+		key->error = key->count;
+		key->count++;
+		key->key_len = action->key_len;
+		memcpy(key->key, action->key, action->key_len);
+	}
+	count = key->count;
+
+	mm_memory_store_fence();
+	mm_memory_store(local->version, local->version + 1);
+
+leave:
+	LEAVE();
+	return count;
+}
+
+uint32_t NONNULL(1, 3)
+mc_hotkeys_count(struct mc_hotkeys_local *local, uint32_t hash, const char *key, uint8_t key_len)
+{
+	struct mc_hotkey *hotkey = mc_hotkeys_find(local->keys, local->nkeys, hash, key, key_len);
+	return hotkey != NULL ? hotkey->count : 0;
+}
+
+/**********************************************************************
+ * Reporting.
+ **********************************************************************/
+
+static bool
+mc_hotkeys_copy(struct mc_hotkeys_local *local, struct mc_hotkeys_local *copy)
+{
+	for (uint32_t attempt = 0; attempt < MC_HOTKEYS_COPY_ATTEMPTS; attempt++) {
+		uint32_t version = mm_memory_load(local->version);
+		if (version & 1)
+			continue;
+		mm_memory_load_fence();
+		memcpy(copy, local, sizeof(struct mc_hotkeys_local));
+		mm_memory_load_fence();
+		if (mm_memory_load(local->version) == version)
+			return true;
+	}
+	return false;
+}
+
+static int
+mc_hotkeys_compare(const void *a, const void *b)
+{
+	const struct mc_hotkey *ka = a;
+	const struct mc_hotkey *kb = b;
+	if (ka->count != kb->count)
+		return ka->count < kb->count ? 1 : -1;
+	return 0;
+}
+
+void NONNULL(1)
+mc_hotkeys_report(struct mc_hotkeys_report *report)
+{
+	ENTER();
+
+	report->rate = mc_hotkeys.rate;
+	report->nsamples = 0;
+	report->nkeys = 0;
+
+	// Sum up the counts of the same keys from all the threads. A key
+	// that is missing in some sketch might still have a count there up
+	// to the minimum one so the error bounds just add up.
+	struct mc_hotkeys_local *copy = mm_memory_xalloc(sizeof(struct mc_hotkeys_local));
+	struct mc_hotkey *keys = mm_memory_xcalloc(mc_hotkeys.nthreads * MC_HOTKEYS_SIZE, sizeof(struct mc_hotkey));
+	uint32_t nkeys = 0;
+	for (mm_thread_t i = 0; i < mc_hotkeys.nthreads; i++) {
+		if (!mc_hotkeys_copy(&mc_hotkeys.locals[i], copy))
+			continue;
+		report->nsamples += copy->nsamples;
+
+		for (uint32_t j = 0; j < copy->nkeys; j++) {
+			struct mc_hotkey *src = &copy->keys[j];
+			struct mc_hotkey *dst = mc_hotkeys_find(keys, nkeys, src->hash, src->key, src->key_len);
+			if (dst != NULL) {
+				dst->count += src->count;
+				dst->error += src->error;
+			} else {
+				keys[nkeys++] = *src;
+			}
+		}
+	}
+
+	qsort(keys, nkeys, sizeof(struct mc_hotkey), mc_hotkeys_compare);
+	if (nkeys > MC_HOTKEYS_SIZE)
+		nkeys = MC_HOTKEYS_SIZE;
+	memcpy(report->keys, keys, nkeys * sizeof(struct mc_hotkey));
+	report->nkeys = nkeys;
+
+	mm_memory_free(keys);
+	mm_memory_free(copy);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Initialization and termination.
+ **********************************************************************/
+
+struct mc_hotkeys_local *
+mc_hotkeys_local(void)
+{
+	return &mc_hotkeys.locals[mm_thread_self()];
+}
+
+void
+mc_hotkeys_start(uint32_t rate)
+{
+	ENTER();
+
+	if (rate)
+		mm_brief("memcache hot key sampling rate: 1/%u", rate);
+	mc_hotkeys.rate = rate;
+
+	mc_hotkeys.nthreads = mm_domain_getsize(mm_domain_selfptr());
+	size_t size = mc_hotkeys.nthreads * sizeof(struct mc_hotkeys_local);
+	mc_hotkeys.locals = mm_memory_aligned_xalloc(MM_CACHELINE, size);
+	memset(mc_hotkeys.locals, 0, size);
+	for (mm_thread_t i = 0; i < mc_hotkeys.nthreads; i++) {
+		struct mc_hotkeys_local *local = &mc_hotkeys.locals[i];
+		local->random = (i + 1) * 2654435761u;
+		local->countdown = mc_hotkeys_countdown(local);
+	}
+
+	LEAVE();
+}
+
+void
+mc_hotkeys_stop(void)
+{
+	ENTER();
+
+	mm_memory_free(mc_hotkeys.locals);
+	mc_hotkeys.locals = NULL;
+
+	LEAVE();
+}
@@ -0,0 +1,105 @@
+/*
+ * memcache/hotkeys.h - MainMemory memcache hot key detection.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_HOTKEYS_H
+#define MEMCACHE_HOTKEYS_H
+
+#include "memcache/memcache.h"
+#include "memcache/action.h"
+
+/*
+ * A random fraction of lookups is sampled into a small Space-Saving
+ * sketch of each thread. The sketch keeps the most frequent keys with
+ * a bound of their count overestimation. The counts are halved every
+ * so many samples for the keys that are no longer hot to fade out.
+ * The sketches are merged on demand.
+ */
+
+/* The number of keys tracked by each thread. */
+#define MC_HOTKEYS_SIZE		32
+/* The number of samples after which the counts are halved. */
+#define MC_HOTKEYS_WINDOW	(16 * 1024)
+
+struct mc_hotkey
+{
+	uint32_t hash;
+	/* The number of samples. */
+	uint32_t count;
+	/* The part of the count that might belong to other keys. */
+	uint32_t error;
+	uint8_t key_len;
+	char key[UINT8_MAX];
+};
+
+struct mc_hotkeys_local
+{
+	/* The number of lookups left until the next sample. */
+	uint32_t countdown;
+	/* The random sampling generator state. */
+	uint32_t random;
+
+	/* The version is odd while the sketch is updated. */
+	uint32_t version;
+	uint32_t nkeys;
+	uint32_t nwindow;
+	uint64_t nsamples;
+	struct mc_hotkey keys[MC_HOTKEYS_SIZE];
+
+} CACHE_ALIGN;
+
+/* The merged sketches. */
+struct mc_hotkeys_report
+{
+	uint32_t rate;
+	unsigned long long nsamples;
+	uint32_t nkeys;
+	struct mc_hotkey keys[MC_HOTKEYS_SIZE];
+};
+
+void
+mc_hotkeys_start(uint32_t rate);
+
+void
+mc_hotkeys_stop(void);
+
+/* Get the sketch of the current thread. */
+struct mc_hotkeys_local *
+mc_hotkeys_local(void);
+
+uint32_t NONNULL(1, 2)
+mc_hotkeys_record(struct mc_hotkeys_local *local, struct mc_action *action);
+
+/* Get the number of samples of a key in the sketch of the current thread. */
+uint32_t NONNULL(1, 3)
+mc_hotkeys_count(struct mc_hotkeys_local *local, uint32_t hash, const char *key, uint8_t key_len);
+
+void NONNULL(1)
+mc_hotkeys_report(struct mc_hotkeys_report *report);
+
+/* Count a lookup. Only a sampled one does any real work. Return the
+   number of samples of the key if it is sampled, zero otherwise. */
+static inline uint32_t NONNULL(1, 2)
+mc_hotkeys_sample(struct mc_hotkeys_local *local, struct mc_action *action)
+{
+	if (unlikely(--(local->countdown) == 0))
+		return mc_hotkeys_record(local, action);
+	return 0;
+}
+
+#endif /* MEMCACHE_HOTKEYS_H */
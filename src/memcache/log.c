@@ -0,0 +1,279 @@
+/*
+ * memcache/log.c - MainMemory memcache log-structured entry data.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/log.h"
+
+#include "base/report.h"
+#include "base/memory/alloc.h"
+
+/**********************************************************************
+ * Log segments.
+ **********************************************************************/
+
+static inline struct mc_log_record *
+mc_log_segment_record(struct mc_log_segment *segment, uint32_t offset)
+{
+	return (struct mc_log_record *) ((char *) segment + offset);
+}
+
+static inline struct mc_log_segment *
+mc_log_record_segment(struct mc_log_record *record)
+{
+	return (struct mc_log_segment *) ((char *) record - ((size_t) record->offset << MC_LOG_UNIT_SHIFT));
+}
+
+/* Check if the lock-free readers that might have seen a retired segment
+   are gone. This takes two epoch advances. A zero epoch means that there
+   are no such readers at all. */
+static inline bool
+mc_log_segment_quiet(struct mc_log_segment *segment, uint32_t epoch)
+{
+	return epoch == 0 || (epoch - segment->epoch) >= 4;
+}
+
+static void
+mc_log_add_segment(struct mc_log *log, struct mc_log_segment *segment)
+{
+	if (log->nsegments == log->nsegments_max) {
+		log->nsegments_max = log->nsegments_max ? log->nsegments_max * 2 : 16;
+		log->segments = mm_memory_fixed_xrealloc(log->segments, log->nsegments_max * sizeof(struct mc_log_segment *));
+	}
+	segment->index = log->nsegments;
+	log->segments[log->nsegments] = segment;
+	mm_memory_store(log->nsegments, log->nsegments + 1);
+}
+
+/* Take an empty segment out of the log. Its memory is kept until the
+   lock-free readers are done with it. */
+static void
+mc_log_retire_segment(struct mc_log *log, struct mc_log_segment *segment, uint32_t epoch)
+{
+	ASSERT(segment->live == 0);
+	ASSERT(segment != log->head && segment != log->victim);
+
+	uint32_t last = log->nsegments - 1;
+	log->segments[segment->index] = log->segments[last];
+	log->segments[segment->index]->index = segment->index;
+	mm_memory_store(log->nsegments, last);
+	log->used -= segment->used - sizeof(struct mc_log_segment);
+
+	segment->epoch = epoch;
+	segment->next = log->retired;
+	log->retired = segment;
+}
+
+static bool
+mc_log_open_segment(struct mc_log *log, struct mm_memory_cache *cache, uint32_t epoch)
+{
+	mc_log_reclaim(log, cache, epoch);
+
+	struct mc_log_segment *segment = mm_memory_cache_alloc(cache, MC_LOG_SEGMENT_SIZE);
+	if (segment == NULL)
+		return false;
+	segment->used = sizeof(struct mc_log_segment);
+	segment->live = 0;
+	mc_log_add_segment(log, segment);
+
+	// An old head that has nothing alive is no longer needed.
+	struct mc_log_segment *head = log->head;
+	log->head = segment;
+	if (head != NULL && head->live == 0 && head != log->victim)
+		mc_log_retire_segment(log, head, epoch);
+
+	return true;
+}
+
+/**********************************************************************
+ * Log records.
+ **********************************************************************/
+
+char * NONNULL(1, 2)
+mc_log_alloc(struct mc_log *log, struct mm_memory_cache *cache, size_t size, uint32_t owner, uint32_t epoch)
+{
+	ENTER();
+	ASSERT(owner != 0);
+
+	char *data = NULL;
+	size = mc_log_record_footprint(size);
+	ASSERT(size <= MC_LOG_SEGMENT_SIZE - sizeof(struct mc_log_segment));
+
+	struct mc_log_segment *segment = log->head;
+	if (segment == NULL || (segment->used + size) > MC_LOG_SEGMENT_SIZE) {
+		if (!mc_log_open_segment(log, cache, epoch))
+			goto leave;
+		segment = log->head;
+	}
+
+	struct mc_log_record *record = mc_log_segment_record(segment, segment->used);
+	record->owner = owner;
+	record->size = size >> MC_LOG_UNIT_SHIFT;
+	record->offset = segment->used >> MC_LOG_UNIT_SHIFT;
+	segment->used += size;
+	segment->live += size;
+	log->used += size;
+	log->live += size;
+	data = mc_log_record_data(record);
+
+leave:
+	LEAVE();
+	return data;
+}
+
+void NONNULL(1, 2)
+mc_log_free(struct mc_log *log, char *data, uint32_t epoch)
+{
+	ENTER();
+
+	struct mc_log_record *record = ((struct mc_log_record *) data) - 1;
+	struct mc_log_segment *segment = mc_log_record_segment(record);
+	ASSERT(record->owner != 0);
+
+	uint32_t size = (uint32_t) record->size << MC_LOG_UNIT_SHIFT;
+	record->owner = 0;
+	segment->live -= size;
+	log->live -= size;
+
+	// The head is still appended to and the victim is retired by the
+	// cleaner itself.
+	if (segment->live == 0 && segment != log->head && segment != log->victim)
+		mc_log_retire_segment(log, segment, epoch);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Log cleaning.
+ **********************************************************************/
+
+bool NONNULL(1)
+mc_log_check_clean(struct mc_log *log)
+{
+	if (log->victim != NULL)
+		return true;
+	if (log->nsegments < 2)
+		return false;
+
+	// Only the segments that are no longer appended to count. The room
+	// left at their ends is not won back by moving the records so only
+	// the dead records count. And it takes a whole segment of them to
+	// free anything.
+	size_t used = log->used - log->head->used;
+	size_t live = log->live - log->head->live;
+	return live * 100 < used * MC_LOG_UTILIZATION && (used - live) >= MC_LOG_SEGMENT_SIZE;
+}
+
+struct mc_log_record * NONNULL(1)
+mc_log_clean_next(struct mc_log *log, uint32_t epoch)
+{
+	ENTER();
+
+	struct mc_log_record *record = NULL;
+
+	// Pick the segment with the most dead records as it wins the most.
+	struct mc_log_segment *segment = log->victim;
+	if (segment == NULL) {
+		if (!mc_log_check_clean(log))
+			goto leave;
+		for (uint32_t i = 0; i < log->nsegments; i++) {
+			struct mc_log_segment *next = log->segments[i];
+			if (next == log->head)
+				continue;
+			if (segment == NULL || (segment->used - segment->live) < (next->used - next->live))
+				segment = next;
+		}
+		log->victim = segment;
+		log->victim_offset = sizeof(struct mc_log_segment);
+	}
+
+	while (segment->live != 0 && log->victim_offset < segment->used) {
+		struct mc_log_record *next = mc_log_segment_record(segment, log->victim_offset);
+		log->victim_offset += (uint32_t) next->size << MC_LOG_UNIT_SHIFT;
+		if (next->owner != 0) {
+			record = next;
+			goto leave;
+		}
+	}
+
+	// The records left are still in use. They are tried again if the
+	// segment is picked later.
+	log->victim = NULL;
+	if (segment->live == 0) {
+		mc_log_retire_segment(log, segment, epoch);
+		log->cleaned++;
+	}
+
+leave:
+	LEAVE();
+	return record;
+}
+
+void NONNULL(1, 2)
+mc_log_reclaim(struct mc_log *log, struct mm_memory_cache *cache, uint32_t epoch)
+{
+	ENTER();
+
+	struct mc_log_segment **pred = &log->retired;
+	while (*pred != NULL) {
+		struct mc_log_segment *segment = *pred;
+		if (mc_log_segment_quiet(segment, epoch)) {
+			*pred = segment->next;
+			mm_memory_cache_local_free(cache, segment);
+		} else {
+			pred = &segment->next;
+		}
+	}
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Log initialization and termination.
+ **********************************************************************/
+
+void NONNULL(1)
+mc_log_prepare(struct mc_log *log)
+{
+	ENTER();
+
+	log->segments = NULL;
+	log->nsegments = 0;
+	log->nsegments_max = 0;
+	log->head = NULL;
+	log->victim = NULL;
+	log->victim_offset = 0;
+	log->retired = NULL;
+	log->used = 0;
+	log->live = 0;
+	log->cleaned = 0;
+	log->moved = 0;
+
+	LEAVE();
+}
+
+void NONNULL(1)
+mc_log_cleanup(struct mc_log *log)
+{
+	ENTER();
+
+	// The segments themselves go away along with the data space.
+	mm_memory_fixed_free(log->segments);
+	mc_log_prepare(log);
+
+	LEAVE();
+}
@@ -0,0 +1,157 @@
+/*
+ * memcache/log.h - MainMemory memcache log-structured entry data.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_LOG_H
+#define MEMCACHE_LOG_H
+
+#include "memcache/memcache.h"
+
+#include "base/atomic.h"
+#include "base/bitops.h"
+#include "base/memory/cache.h"
+
+/*
+ * With the log storage the entry data blocks and value chunks of each
+ * partition are appended to large segments rather than allocated one
+ * by one. A freed block only leaves a dead record behind. The cleaner
+ * picks the segments with the most dead records, moves their live ones
+ * to the head segment and frees them whole. So the memory taken by the
+ * log stays close to the live data size no matter how the value sizes
+ * churn.
+ *
+ * Each record starts with a header that names the entry it belongs to
+ * so that the cleaner might fix the entry after the move.
+ */
+
+/* The segment size. */
+#define MC_LOG_SEGMENT_SIZE	(64 * 1024)
+/* The live data percentage the cleaner keeps the log above. */
+#define MC_LOG_UTILIZATION	(90)
+/* The number of record bytes the cleaner looks at in one step. */
+#define MC_LOG_CLEAN_STEP	(64 * 1024)
+
+/* The record sizes and offsets are kept in this many byte units. */
+#define MC_LOG_UNIT_SHIFT	3
+
+struct mc_log_record
+{
+	/* The owner entry index plus one, zero if the record is dead. */
+	uint32_t owner;
+	/* The record size including the header. */
+	uint16_t size;
+	/* The record offset from the segment start. */
+	uint16_t offset;
+};
+
+struct mc_log_segment
+{
+	/* The segment position in the log, the next retired segment. */
+	union
+	{
+		uint32_t index;
+		struct mc_log_segment *next;
+	};
+	/* The epoch the segment was retired at. */
+	uint32_t epoch;
+	/* The size of appended records. */
+	uint32_t used;
+	/* The size of live records. */
+	uint32_t live;
+};
+
+struct mc_log
+{
+	/* The segments in use. */
+	struct mc_log_segment **segments;
+	uint32_t nsegments;
+	uint32_t nsegments_max;
+
+	/* The segment to append to. */
+	struct mc_log_segment *head;
+
+	/* The segment the cleaner works on and its scan position. */
+	struct mc_log_segment *victim;
+	uint32_t victim_offset;
+
+	/* Empty segments that lock-free readers might still look at. */
+	struct mc_log_segment *retired;
+
+	/* The total size of appended and live records. */
+	size_t used;
+	size_t live;
+
+	/* Statistics. */
+	uint64_t cleaned;
+	uint64_t moved;
+};
+
+void NONNULL(1)
+mc_log_prepare(struct mc_log *log);
+
+void NONNULL(1)
+mc_log_cleanup(struct mc_log *log);
+
+/* Append a record for an entry data block or value chunk. The epoch is
+   that of entry reclamation, zero if there are no lock-free readers. */
+char * NONNULL(1, 2)
+mc_log_alloc(struct mc_log *log, struct mm_memory_cache *cache, size_t size, uint32_t owner, uint32_t epoch);
+
+void NONNULL(1, 2)
+mc_log_free(struct mc_log *log, char *data, uint32_t epoch);
+
+/* Free the retired segments that no lock-free reader might look at. */
+void NONNULL(1, 2)
+mc_log_reclaim(struct mc_log *log, struct mm_memory_cache *cache, uint32_t epoch);
+
+/* Check if there is enough dead space to clean up. */
+bool NONNULL(1)
+mc_log_check_clean(struct mc_log *log);
+
+/* Get the next live record to move away from the segment being cleaned,
+   NULL when the segment is done. */
+struct mc_log_record * NONNULL(1)
+mc_log_clean_next(struct mc_log *log, uint32_t epoch);
+
+/* The memory taken by the log. */
+static inline size_t NONNULL(1)
+mc_log_size(struct mc_log *log)
+{
+	return (size_t) mm_memory_load(log->nsegments) * MC_LOG_SEGMENT_SIZE;
+}
+
+/* The memory taken by a record for the given data size. */
+static inline size_t
+mc_log_record_footprint(size_t size)
+{
+	return mm_round_up(sizeof(struct mc_log_record) + size, 1u << MC_LOG_UNIT_SHIFT);
+}
+
+static inline char * NONNULL(1)
+mc_log_record_data(struct mc_log_record *record)
+{
+	return (char *) (record + 1);
+}
+
+static inline size_t NONNULL(1)
+mc_log_record_size(struct mc_log_record *record)
+{
+	return ((size_t) record->size << MC_LOG_UNIT_SHIFT) - sizeof(struct mc_log_record);
+}
+
+#endif /* MEMCACHE_LOG_H */
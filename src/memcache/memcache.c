@@ -20,7 +20,11 @@
 #include "memcache/memcache.h"
 #include "memcache/binary.h"
 #include "memcache/command.h"
+#include "memcache/compress.h"
 #include "memcache/entry.h"
+#include "memcache/evict.h"
+#include "memcache/hotkeys.h"
+#include "memcache/replica.h"
 #include "memcache/parser.h"
 #include "memcache/state.h"
 #include "memcache/table.h"
@@ -41,16 +45,57 @@ struct mm_memcache_config mc_config;
 
 #define MC_READ_TIMEOUT		10000
 
+/* The vote count that makes a connection move to another thread. */
+#define MC_STEER_VOTES		16
+
+/* Find the thread that owns the partitions of most keys of a connection
+   with a majority vote. It keeps counting to a limit so that it might
+   change the choice later. */
+static void
+mc_steer_vote(struct mc_state *state, struct mc_command_base *command)
+{
+	switch (command->type->kind) {
+	case MC_COMMAND_LOOKUP:
+	case MC_COMMAND_STORAGE:
+	case MC_COMMAND_CONCAT:
+	case MC_COMMAND_DELETE:
+	case MC_COMMAND_DELTA:
+	case MC_COMMAND_TOUCH:
+		// These commands have a key.
+		break;
+	default:
+		return;
+	}
+	struct mm_context *owner = mc_command_action(command)->part->owner;
+	if (owner == NULL)
+		return;
+
+	if (state->steer_votes == 0) {
+		state->steer_owner = owner;
+		state->steer_votes = 1;
+	} else if (state->steer_owner != owner) {
+		state->steer_votes--;
+	} else if (state->steer_votes < MC_STEER_VOTES) {
+		state->steer_votes++;
+	}
+}
+
 static void
 mc_process_command(struct mc_state *state, struct mc_command_base *command)
 {
 	ENTER();
 
 	do {
-		struct mc_command_base *next = command->next;
-		mc_command_execute(state, command);
-		mc_command_cleanup(command);
-		command = next;
+		// Access the table for a run of commands in batches and
+		// then execute them in order.
+		struct mc_command_base *end = mc_command_batch(command);
+		do {
+			struct mc_command_base *next = command->next;
+			mc_steer_vote(state, command);
+			mc_command_execute(state, command);
+			mc_command_cleanup(command);
+			command = next;
+		} while (command != end);
 
 	} while (command != NULL);
 
@@ -65,6 +110,8 @@ mc_reader_routine(mm_value_t arg)
 	struct mm_net_socket *const sock = mm_net_arg_to_socket(arg);
 	struct mc_state *const state = containerof(sock, struct mc_state, sock.sock);
 	state->stat = MM_THREAD_LOCAL_DEREF(mm_thread_self(), mc_table.stat);
+	state->hotkeys = mc_hotkeys_local();
+	state->replicas = mc_replica_local();
 	state->command_first = NULL;
 	state->command_last = NULL;
 
@@ -144,6 +191,11 @@ parse:
 	// Process the parsed commands.
 	mc_process_command(state, state->command_first);
 
+	// Move the connection to the thread that owns the partitions of
+	// its keys once it is idle.
+	if (state->steer_votes >= MC_STEER_VOTES)
+		mm_net_steer(sock, state->steer_owner);
+
 	// Transmit buffered results and compact the output buffer storage.
 	mm_netbuf_flush(&state->sock);
 	mm_netbuf_compact_write_buf(&state->sock);
@@ -169,6 +221,9 @@ mc_memcache_start(void)
 	ENTER();
 
 	mc_table_start(&mc_config);
+	mc_hotkeys_start(mc_config.hotkeys_rate);
+	mc_replica_start(mc_config.replicas);
+	mc_compress_start(mc_config.compress_min);
 
 	LEAVE();
 }
@@ -178,6 +233,8 @@ mc_memcache_stop(void)
 {
 	ENTER();
 
+	mc_replica_stop();
+	mc_hotkeys_stop();
 	mc_table_stop();
 
 	LEAVE();
@@ -215,6 +272,101 @@ mm_memcache_init(const struct mm_memcache_config *config)
 	else
 		mc_config.volume = MC_TABLE_VOLUME_DEFAULT;
 
+	// Determine the entry eviction policy.
+	if (config != NULL && config->eviction != NULL)
+		mc_config.eviction = config->eviction;
+	else
+		mc_config.eviction = MC_EVICTION_DEFAULT;
+	if (mc_evict_lookup(mc_config.eviction) == NULL)
+		mm_fatal(0, "unknown memcache eviction policy: %s", mc_config.eviction);
+
+	// Determine the table access method.
+	if (config != NULL && config->access != NULL)
+		mc_config.access = config->access;
+	else
+		mc_config.access = MC_ACCESS_DEFAULT;
+	if (mc_table_access_lookup(mc_config.access) < 0)
+		mm_fatal(0, "unknown memcache table access method: %s", mc_config.access);
+
+	// Determine the shared memory table storage.
+	if (config != NULL && config->shm_path != NULL && *config->shm_path)
+		mc_config.shm_path = config->shm_path;
+	else
+		mc_config.shm_path = NULL;
+
+	// Determine the entry data storage method. The log segment list is
+	// not kept in the shared memory so the log cannot be reattached.
+	if (config != NULL && config->storage != NULL)
+		mc_config.storage = config->storage;
+	else
+		mc_config.storage = MC_STORAGE_DEFAULT;
+	if (mc_table_storage_lookup(mc_config.storage) < 0)
+		mm_fatal(0, "unknown memcache data storage method: %s", mc_config.storage);
+	if (mc_config.shm_path != NULL && strcmp(mc_config.storage, MC_STORAGE_DEFAULT) != 0) {
+		mm_brief("memcache data storage: %s is disabled with shared memory", mc_config.storage);
+		mc_config.storage = MC_STORAGE_DEFAULT;
+	}
+
+	// Determine the disk tier. The stubs in the shared memory would
+	// outlive the files so they do not go together.
+	if (config != NULL && config->disk_path != NULL && *config->disk_path) {
+		mc_config.disk_path = config->disk_path;
+		mc_config.disk_size = config->disk_size;
+	} else {
+		mc_config.disk_path = NULL;
+		mc_config.disk_size = 0;
+	}
+	if (mc_config.disk_path != NULL && mc_config.shm_path != NULL) {
+		mm_brief("memcache disk tier: disabled with shared memory");
+		mc_config.disk_path = NULL;
+	}
+
+	// Determine the snapshot files.
+	if (config != NULL && config->snapshot_path != NULL && *config->snapshot_path)
+		mc_config.snapshot_path = config->snapshot_path;
+	else
+		mc_config.snapshot_path = NULL;
+	if (config != NULL && config->load_snapshot_path != NULL && *config->load_snapshot_path)
+		mc_config.load_snapshot_path = config->load_snapshot_path;
+	else
+		mc_config.load_snapshot_path = NULL;
+
+	// Determine the expiry crawler budget.
+	if (config != NULL)
+		mc_config.crawl_budget = config->crawl_budget;
+	else
+		mc_config.crawl_budget = MC_CRAWL_BUDGET_DEFAULT;
+
+	// Determine the hot key sampling rate.
+	if (config != NULL)
+		mc_config.hotkeys_rate = config->hotkeys_rate;
+	else
+		mc_config.hotkeys_rate = MC_HOTKEYS_RATE_DEFAULT;
+
+	// Determine the number of hot entry replicas. The hot entries are
+	// found by sampling. Compact entries cannot address data outside
+	// of the table space so they cannot be replicated.
+	if (config != NULL)
+		mc_config.replicas = min(config->replicas, MC_REPLICA_MAX);
+	else
+		mc_config.replicas = 0;
+	if (mc_config.replicas && (ENABLE_MEMCACHE_COMPACT || !mc_config.hotkeys_rate)) {
+		mm_brief("memcache replicas: disabled, they need hot key sampling and regular entries");
+		mc_config.replicas = 0;
+	}
+
+	// Determine the shortest value to compress.
+	if (config != NULL)
+		mc_config.compress_min = config->compress_min;
+	else
+		mc_config.compress_min = 0;
+
+	// Determine the key namespace delimiter.
+	if (config != NULL)
+		mc_config.namespace_delimiter = config->namespace_delimiter;
+	else
+		mc_config.namespace_delimiter = 0;
+
 	if (config != NULL)
 		mc_config.batch_size = config->batch_size;
 
@@ -232,24 +384,10 @@ mm_memcache_init(const struct mm_memcache_config *config)
 	mc_config.tx_chunk_size = tx_chunk_size;
 
 	// Determine the required memcache table partitions.
-#if ENABLE_MEMCACHE_DELEGATE
-	size_t nbits = 1;
-	if (config != NULL) {
-		nbits = mm_bitset_size(&config->affinity);
-		if (nbits == 0)
-			nbits = 1;
-	}
-	mm_bitset_prepare(&mc_config.affinity, &mm_common_space.xarena, nbits);
-	if (config != NULL)
-		mm_bitset_or(&mc_config.affinity, &config->affinity);
-	if (!mm_bitset_any(&mc_config.affinity))
-		mm_bitset_set(&mc_config.affinity, 0);
-#else
 	if (config != NULL && config->nparts)
 		mc_config.nparts = config->nparts;
 	else
 		mc_config.nparts = 1;
-#endif
 
 	LEAVE();
 }
@@ -21,14 +21,12 @@
 #define MEMCACHE_H
 
 #include "common.h"
-#include "base/bitset.h"
 
-/* Enable table access combiner. */
-#define ENABLE_MEMCACHE_COMBINER	0
-/* Enable table access via delegate thread. */
-#define ENABLE_MEMCACHE_DELEGATE	0
-/* Enable table access with locking. */
-#define ENABLE_MEMCACHE_LOCKING		0
+/* Enable lock-free table lookups for read-only commands. */
+#define ENABLE_MEMCACHE_OPTIMISTIC	1
+
+/* Enable compact table entries with 32-bit links and data offsets. */
+#define ENABLE_MEMCACHE_COMPACT		0
 
 /* Build with -msse4.2 to enable hash based on the SSE4.2 crc32 instruction. */
 #ifndef mc_hash
@@ -42,19 +40,28 @@
 /* Maximum total data size by default. */
 #define MC_TABLE_VOLUME_DEFAULT		(64 * 1024 * 1024)
 
+/* Entry eviction policy by default. */
+#define MC_EVICTION_DEFAULT		"tinylfu"
+
+/* Table access method by default. */
+#define MC_ACCESS_DEFAULT		"locking"
+
+/* Entry data storage method by default. */
+#define MC_STORAGE_DEFAULT		"heap"
+
+/* Expiry crawler time budget by default, in microseconds per second. */
+#define MC_CRAWL_BUDGET_DEFAULT		(1000)
+
+/* Hot key sampling rate by default, one of this many lookups. */
+#define MC_HOTKEYS_RATE_DEFAULT		(100)
+
 #define MC_COMBINER_SIZE		(1024)
 #define MC_COMBINER_HANDOFF		(16)
 
-/* Sanity checks for requested table access method. */
-#if (ENABLE_MEMCACHE_COMBINER && ENABLE_MEMCACHE_DELEGATE)	\
- || (ENABLE_MEMCACHE_COMBINER && ENABLE_MEMCACHE_LOCKING)	\
- || (ENABLE_MEMCACHE_DELEGATE && ENABLE_MEMCACHE_LOCKING)
-# error "Ambiguous memcache table access method."
-#endif
-/* Use locking by default. */
-#if !ENABLE_MEMCACHE_COMBINER && !ENABLE_MEMCACHE_DELEGATE
-# undef ENABLE_MEMCACHE_LOCKING
-# define ENABLE_MEMCACHE_LOCKING	1
+/* Optimistic reads are only needed with multiple threads. */
+#if !ENABLE_SMP
+# undef ENABLE_MEMCACHE_OPTIMISTIC
+# define ENABLE_MEMCACHE_OPTIMISTIC	0
 #endif
 
 struct mm_memcache_config
@@ -65,13 +72,55 @@ struct mm_memcache_config
 	size_t volume;
 	mm_thread_t nparts;
 
+	/* The name of entry eviction policy. */
+	const char *eviction;
+
+	/* The name of table access method: locking, combiner, delegate.
+	   The delegate method lets each partition be accessed only by the
+	   thread it is assigned to, other threads send it their actions. */
+	const char *access;
+
+	/* The name of entry data storage method: heap, log. The log method
+	   appends the data to large segments and compacts them. */
+	const char *storage;
+
+	/* Expiry crawler time budget per partition in microseconds per
+	   second, zero disables the crawler. */
+	uint32_t crawl_budget;
+
+	/* Hot key sampling rate, one of this many lookups, zero disables
+	   the sampling. */
+	uint32_t hotkeys_rate;
+
+	/* The number of hot entries replicated by each thread, zero
+	   disables the replicas. */
+	uint32_t replicas;
+
+	/* The shortest value to store compressed, zero disables the
+	   compression. */
+	uint32_t compress_min;
+
+	/* The key char that ends the namespace prefix of keys, zero if
+	   there are no namespaces. All the keys of a namespace might be
+	   flushed at once. */
+	char namespace_delimiter;
+
+	/* The shared memory file to keep the table across restarts. */
+	const char *shm_path;
+
+	/* The path prefix of the disk tier files for long values of
+	   evicted entries and their total size. */
+	const char *disk_path;
+	size_t disk_size;
+
+	/* The snapshot file written on the snapshot command. */
+	const char *snapshot_path;
+	/* The snapshot file to load on start. */
+	const char *load_snapshot_path;
+
 	uint32_t batch_size;
 	uint32_t rx_chunk_size;
 	uint32_t tx_chunk_size;
-
-#if ENABLE_MEMCACHE_DELEGATE
-	struct mm_bitset affinity;
-#endif
 };
 
 void mm_memcache_init(const struct mm_memcache_config *config);
@@ -19,6 +19,7 @@
 
 #include "memcache/parser.h"
 #include "memcache/binary.h"
+#include "memcache/compress.h"
 #include "memcache/state.h"
 
 #include "base/memory/alloc.h"
@@ -50,6 +51,8 @@ enum {
 	S_KEY_COPY,
 	S_GET_1,
 	S_GET_N,
+	S_GAT_1,
+	S_GAT_2,
 };
 
 // Storage command states.
@@ -78,8 +81,12 @@ enum {
 	S_TOUCH_1,
 	S_TOUCH_2,
 	S_TOUCH_3,
+	S_FLUSH,
+	S_FLUSH_KIND,
 	S_FLUSH_ALL_1,
 	S_FLUSH_ALL_2,
+	S_FLUSH_NS_1,
+	S_FLUSH_NS_2,
 	S_VERBOSITY_1,
 	S_VERBOSITY_2,
 	S_OPT,
@@ -127,9 +134,7 @@ mc_parser_scan_value(struct mc_state *state, uint32_t kind)
 
 	// Read the entry value.
 	if (kind != MC_COMMAND_CONCAT) {
-		struct mc_entry *entry = action->new_entry;
-		char *value = mc_entry_getvalue(entry);
-		mm_netbuf_read(&state->sock, value, action->value_len);
+		mc_compress_read_value(state, action);
 	} else {
 		char *end = mm_netbuf_rend(&state->sock);
 		if (unlikely(mm_netbuf_rget(&state->sock) == end)) {
@@ -156,12 +161,16 @@ leave:
 
 // TODO: Really support some options.
 static void
-mc_parser_handle_option(struct mc_command_simple *command)
+mc_parser_handle_option(struct mc_command_simple *command, const char *option, size_t option_len)
 {
 	ENTER();
 
 	if (command->base.type == &mc_command_ascii_stats) {
-		command->action.ascii_stats++;
+		if (command->action.ascii_stats == MC_COMMAND_STATS_GENERAL
+		    && option_len == 7 && !memcmp(option, "hotkeys", 7))
+			command->action.ascii_stats = MC_COMMAND_STATS_HOTKEYS;
+		else
+			command->action.ascii_stats = MC_COMMAND_STATS_UNKNOWN;
 	} else if (command->base.type == &mc_command_ascii_slabs) {
 		// do nothing
 	}
@@ -175,6 +184,8 @@ mc_parser_lookup_command(struct mc_state *parser, const struct mc_command_type *
 {
 	// The count of scanned chars. Used to check if the client sends too much junk data.
 	int count = 0;
+	// The expiration time for get-and-touch commands.
+	uint32_t exp_time = 0;
 
 	// Parse the rest of the command.
 	struct mc_command_simple *command = mc_command_create_simple(parser, type);
@@ -314,6 +325,34 @@ again:
 				state = S_KEY;
 				command = mc_command_create_simple(parser, type);
 				command->action.ascii_get_last = false;
+				command->action.exp_time = exp_time;
+				goto again;
+			}
+
+		case S_GAT_1:
+			ASSERT(c != ' ');
+			if (likely(c >= '0') && likely(c <= '9')) {
+				state = S_GAT_2;
+				exp_time = c - '0';
+				break;
+			} else {
+				state = S_ERROR;
+				goto again;
+			}
+
+		case S_GAT_2:
+			if (c >= '0' && c <= '9') {
+				// TODO: overflow check?
+				exp_time = exp_time * 10 + (c - '0');
+				break;
+			} else if (c == ' ') {
+				exp_time = mc_entry_fix_exptime(exp_time);
+				command->action.exp_time = exp_time;
+				state = S_SPACE;
+				shift = S_GET_1;
+				break;
+			} else {
+				state = S_ERROR;
 				goto again;
 			}
 
@@ -539,7 +578,7 @@ again:
 			mc_action_hash(&command->action.base);
 			if (type->kind != MC_COMMAND_CONCAT) {
 				mc_action_create(&command->action, num32);
-				command->action.new_entry->flags = set_flags;
+				mc_entry_setflags(command->action.new_entry, set_flags);
 				command->action.new_entry->exp_time = set_exp_time;
 				mc_entry_setkey(command->action.new_entry, command->action.base.key);
 			} else {
@@ -680,11 +719,13 @@ mc_parser_other_command(struct mc_state *parser, const struct mc_command_type *t
 {
 	// Temporary storage for numeric parameters.
 	uint32_t num32 = 0;
+	// The start of the current option.
+	const char *option = NULL;
 
 	// Parse the rest of the command.
 	struct mc_command_simple *command = mc_command_create_simple(parser, type);
 	command->action.ascii_noreply = false;
-	command->action.ascii_stats = 0;
+	command->action.ascii_stats = MC_COMMAND_STATS_GENERAL;
 
 	for (;; s++) {
 		if (unlikely(s == e)) {
@@ -828,7 +869,7 @@ again:
 			goto again;
 
 		case S_TOUCH_3:
-			command->action.ascii_exp_time = mc_entry_fix_exptime(num32);
+			command->action.exp_time = mc_entry_fix_exptime(num32);
 			ASSERT(c != ' ');
 			if (c == 'n') {
 				state = S_MATCH;
@@ -840,6 +881,32 @@ again:
 				goto again;
 			}
 
+		case S_FLUSH:
+			if (c == '_') {
+				state = S_FLUSH_KIND;
+				break;
+			} else {
+				state = S_ERROR;
+				goto again;
+			}
+
+		case S_FLUSH_KIND:
+			if (c == 'a') {
+				state = S_MATCH;
+				match = "ll";
+				shift = S_FLUSH_ALL_1;
+				break;
+			} else if (c == 'n') {
+				command->base.type = &mc_command_ascii_flush_namespace;
+				state = S_MATCH;
+				match = "amespace";
+				shift = S_FLUSH_NS_1;
+				break;
+			} else {
+				state = S_ERROR;
+				goto again;
+			}
+
 		case S_FLUSH_ALL_1:
 			ASSERT(c != ' ');
 			if (c == '\r' || c == '\n') {
@@ -872,6 +939,23 @@ again:
 				goto again;
 			}
 
+		case S_FLUSH_NS_1:
+			state = S_KEY;
+			shift = S_FLUSH_NS_2;
+			goto again;
+
+		case S_FLUSH_NS_2:
+			ASSERT(c != ' ');
+			if (c == 'n') {
+				state = S_MATCH;
+				match = "oreply";
+				shift = S_NOREPLY;
+				break;
+			} else {
+				state = S_EOL;
+				goto again;
+			}
+
 		case S_VERBOSITY_1:
 			ASSERT(c != ' ');
 			if (c >= '0' && c <= '9') {
@@ -906,24 +990,22 @@ again:
 				state = S_EOL;
 				goto again;
 			} else {
-				// TODO: add c to the option value
+				option = s;
 				state = S_OPT_N;
 				break;
 			}
 
 		case S_OPT_N:
 			// TODO: limit the option number
-			// TODO: use the option value
 			if (c == ' ') {
-				mc_parser_handle_option(command);
+				mc_parser_handle_option(command, option, s - option);
 				state = S_SPACE;
 				break;
 			} else if (c == '\r' || c == '\n') {
-				mc_parser_handle_option(command);
+				mc_parser_handle_option(command, option, s - option);
 				state = S_EOL;
 				goto again;
 			} else {
-				// TODO: add c to the option value
 				break;
 			}
 
@@ -962,6 +1044,277 @@ again:
 	}
 }
 
+/* Find the next space-separated token of a meta command line. */
+static char *
+mc_parser_meta_token(char **s, char *e)
+{
+	char *p = *s;
+	while (p < e && *p == ' ')
+		p++;
+	char *t = p;
+	while (p < e && *p != ' ')
+		p++;
+	*s = p;
+	return t;
+}
+
+static bool
+mc_parser_meta_number(const char *s, const char *e, uint64_t *value)
+{
+	if (s == e || (e - s) > 20)
+		return false;
+
+	uint64_t n = 0;
+	for (; s < e; s++) {
+		if (*s < '0' || *s > '9')
+			return false;
+		n = n * 10 + (*s - '0');
+	}
+	*value = n;
+	return true;
+}
+
+/* Check if a meta command accepts a given flag. Some standard flags are
+   accepted but ignored: the CAS values are always generated and so on.
+   But base64 encoded keys are not supported and the 'b' flag is rejected
+   as the key would be silently taken as it is. */
+static bool
+mc_parser_meta_flag(const struct mc_command_type *type, char flag, bool *ignored)
+{
+	const char *flags, *ignored_flags;
+	if (type == &mc_command_ascii_mg) {
+		flags = "cfkOqstvNRT";
+		ignored_flags = "Eu";
+	} else if (type == &mc_command_ascii_ms) {
+		flags = "ckOqCFMT";
+		ignored_flags = "EIsS";
+	} else if (type == &mc_command_ascii_md) {
+		flags = "kOqIT";
+		ignored_flags = "E";
+	} else {
+		flags = "ckOqvDJMN";
+		ignored_flags = "E";
+	}
+	if (flag == 0)
+		return false;
+	*ignored = strchr(ignored_flags, flag) != NULL;
+	return *ignored || strchr(flags, flag) != NULL;
+}
+
+/* Skip the data block of a rejected meta command. */
+static bool
+mc_parser_meta_skip(struct mc_state *parser, uint64_t required)
+{
+	for (;;) {
+		required -= mm_netbuf_skip(&parser->sock, required);
+		if (required == 0)
+			return true;
+
+		ssize_t n = mm_netbuf_fill(&parser->sock, required);
+		if (n <= 0) {
+			if (n == 0 || (errno != EAGAIN && errno != ETIMEDOUT))
+				parser->error = true;
+			return false;
+		}
+	}
+}
+
+/* Consume the line end after a data block. */
+static bool
+mc_parser_meta_data_end(struct mc_state *parser, bool *valid)
+{
+	bool cr = false;
+	for (;;) {
+		char *s = mm_netbuf_rget(&parser->sock);
+		if (s == mm_netbuf_rend(&parser->sock)) {
+			if (!mm_netbuf_rnext(&parser->sock))
+				return false;
+			continue;
+		}
+		if (*s == '\r' && !cr) {
+			cr = true;
+			mm_netbuf_rset(&parser->sock, s + 1);
+			continue;
+		}
+		*valid = (*s == '\n');
+		if (*valid)
+			mm_netbuf_rset(&parser->sock, s + 1);
+		return true;
+	}
+}
+
+static bool
+mc_parser_meta_command(struct mc_state *parser, const struct mc_command_type *type, char *s, char *e)
+{
+	// Unlike the classic commands the whole command line is required
+	// at once. The meta flags are easier to handle this way.
+	char *eol = memchr(s, '\n', e - s);
+	if (eol == NULL) {
+		if ((e - mm_netbuf_rget(&parser->sock)) >= 1024)
+			parser->trash = true;
+		return false;
+	}
+	char *end = eol;
+	if (end > s && *(end - 1) == '\r')
+		end--;
+
+	struct mc_command_meta *command = mc_command_create_meta(parser, type);
+	struct mc_action_storage *action = &command->storage.action;
+
+	// Once the data length is known the data block is skipped on
+	// errors so that it is not taken for commands.
+	uint64_t value_len = 0;
+	bool has_data = false;
+
+	char *key = mc_parser_meta_token(&s, end);
+	uint32_t key_len = s - key;
+	if (type == &mc_command_ascii_ms) {
+		char *t = mc_parser_meta_token(&s, end);
+		if (!mc_parser_meta_number(t, s, &value_len) || value_len > UINT32_MAX)
+			goto error;
+		has_data = true;
+	}
+
+	if (key_len == 0 || key_len > MC_KEY_LEN_MAX)
+		goto error;
+	mc_action_set_key(&action->base, key, key_len);
+
+	uint32_t flags = 0;
+	for (;;) {
+		char *t = mc_parser_meta_token(&s, end);
+		if (t == s)
+			break;
+		bool ignored;
+		if (!mc_parser_meta_flag(type, *t, &ignored))
+			goto error;
+		if (ignored)
+			continue;
+
+		// Remember the flags that ask for a reply value.
+		if (strchr("cfkOstv", *t) != NULL) {
+			if (command->nflags == MC_COMMAND_META_FLAGS)
+				goto error;
+			command->flags[command->nflags++] = *t;
+		}
+
+		uint64_t num;
+		switch (*t) {
+		case 'q':
+			command->quiet = true;
+			break;
+		case 'O':
+			if ((s - t - 1) > MC_COMMAND_META_OPAQUE_MAX)
+				goto error;
+			command->opaque = t + 1;
+			command->opaque_len = s - t - 1;
+			break;
+		case 'T':
+		case 'N':
+			if (!mc_parser_meta_number(t + 1, s, &num) || num > UINT32_MAX)
+				goto error;
+			command->exp_time = mc_entry_fix_exptime(num);
+			command->touch |= (*t == 'T');
+			command->vivify |= (*t == 'N');
+			break;
+		case 'R':
+			if (!mc_parser_meta_number(t + 1, s, &num) || num > UINT32_MAX)
+				goto error;
+			command->recache_time = num;
+			break;
+		case 'I':
+			if ((s - t) != 1)
+				goto error;
+			command->invalidate = true;
+			break;
+		case 'F':
+			if (!mc_parser_meta_number(t + 1, s, &num) || num > UINT32_MAX)
+				goto error;
+			flags = num;
+			break;
+		case 'C':
+			if (!mc_parser_meta_number(t + 1, s, &num))
+				goto error;
+			action->stamp = num;
+			break;
+		case 'D':
+			if (!mc_parser_meta_number(t + 1, s, &command->storage.binary_delta))
+				goto error;
+			break;
+		case 'J':
+			if (!mc_parser_meta_number(t + 1, s, &command->storage.binary_value))
+				goto error;
+			break;
+		case 'M':
+			if ((s - t) != 2)
+				goto error;
+			if (type == &mc_command_ascii_ms) {
+				command->mode = t[1] & ~0x20;
+				if (command->mode == 0 || strchr("SEARP", command->mode) == NULL)
+					goto error;
+			} else if (t[1] == 'I' || t[1] == 'i' || t[1] == '+') {
+				command->mode = 'I';
+			} else if (t[1] == 'D' || t[1] == 'd' || t[1] == '-') {
+				command->mode = 'D';
+			} else {
+				goto error;
+			}
+			break;
+		}
+	}
+	mm_netbuf_rset(&parser->sock, eol + 1);
+	if (type != &mc_command_ascii_ms)
+		return true;
+
+	// Only plain storage may compare the stamp. This is marked with
+	// a mode of its own as a batched store changes the stamp.
+	if (action->stamp) {
+		if (command->mode != 'S' && command->mode != 'R')
+			goto error;
+		command->mode = 'C';
+	}
+
+	// Read the data block.
+	uint32_t kind = MC_COMMAND_STORAGE;
+	if (command->mode == 'A' || command->mode == 'P') {
+		kind = MC_COMMAND_CONCAT;
+		action->value_len = value_len;
+	} else {
+		mc_action_create(action, value_len);
+		mc_entry_setflags(action->new_entry, flags);
+		action->new_entry->exp_time = command->exp_time;
+		mc_entry_setkey(action->new_entry, action->base.key);
+	}
+	bool valid;
+	if (!mc_parser_scan_value(parser, kind) || !mc_parser_meta_data_end(parser, &valid)) {
+		if (action->new_entry != NULL)
+			mc_action_cancel(action);
+		if (action->own_alter_value)
+			mm_memory_free((char *) action->alter_value);
+		return false;
+	}
+	if (!valid) {
+		DEBUG("bad data chunk");
+		if (action->new_entry != NULL) {
+			mc_action_cancel(action);
+			action->new_entry = NULL;
+		}
+		if (action->own_alter_value)
+			mm_memory_free((char *) action->alter_value);
+		mc_command_cleanup(&command->storage.base);
+		command->storage.base.type = &mc_command_ascii_bad_chunk;
+	}
+	return true;
+
+error:
+	DEBUG("bad meta command");
+	mm_netbuf_rset(&parser->sock, eol + 1);
+	if (has_data && !mc_parser_meta_skip(parser, value_len + 2))
+		return false;
+	mc_command_cleanup(&command->storage.base);
+	command->storage.base.type = &mc_command_ascii_bad_format;
+	return true;
+}
+
 bool NONNULL(1)
 mc_parser_parse(struct mc_state *parser)
 {
@@ -989,7 +1342,11 @@ mc_parser_parse(struct mc_state *parser)
 			parser->trash = true;
 			rc = false;
 		} else if ((rc = memchr(s, '\n', e - s) != NULL)) {
-			mc_parser_other_command(parser, &mc_command_ascii_error, s, e, S_ERROR, S_ERROR, "");
+			// Only the meta no-op command might be this short.
+			if ((e - s) >= 3 && s[0] == 'm' && s[1] == 'n')
+				mc_parser_other_command(parser, &mc_command_ascii_mn, s + 2, e, S_SPACE, S_EOL, "");
+			else
+				mc_parser_other_command(parser, &mc_command_ascii_error, s, e, S_ERROR, S_ERROR, "");
 		}
 		goto leave;
 	}
@@ -1000,6 +1357,32 @@ mc_parser_parse(struct mc_state *parser)
 	uint32_t start = Cx4(s[0], s[1], s[2], s[3]);
 	if (start == Cx4('g', 'e', 't', ' ')) {
 		rc = mc_parser_lookup_command(parser, &mc_command_ascii_get, s + 4, e, S_SPACE, S_GET_1);
+	} else if (s[0] == 'm' && (s[2] == ' ' || s[2] == '\r' || s[2] == '\n')) {
+		switch (s[1]) {
+		case 'g':
+			rc = mc_parser_meta_command(parser, &mc_command_ascii_mg, s + 2, e);
+			break;
+		case 's':
+			rc = mc_parser_meta_command(parser, &mc_command_ascii_ms, s + 2, e);
+			break;
+		case 'd':
+			rc = mc_parser_meta_command(parser, &mc_command_ascii_md, s + 2, e);
+			break;
+		case 'a':
+			rc = mc_parser_meta_command(parser, &mc_command_ascii_ma, s + 2, e);
+			break;
+		case 'n':
+			rc = mc_parser_other_command(parser, &mc_command_ascii_mn, s + 2, e, S_SPACE, S_EOL, "");
+			break;
+		default:
+			DEBUG("unrecognized meta command");
+			rc = mc_parser_other_command(parser, &mc_command_ascii_error, s, e, S_ERROR, S_ERROR, "");
+			break;
+		}
+	} else if (start == Cx4('g', 'a', 't', ' ')) {
+		rc = mc_parser_lookup_command(parser, &mc_command_ascii_gat, s + 4, e, S_SPACE, S_GAT_1);
+	} else if (start == Cx4('g', 'a', 't', 's') && s[4] == ' ') {
+		rc = mc_parser_lookup_command(parser, &mc_command_ascii_gats, s + 5, e, S_SPACE, S_GAT_1);
 	} else if (start == Cx4('s', 'e', 't', ' ')) {
 		rc = mc_parser_storage_command(parser, &mc_command_ascii_set, s + 4, e, S_SPACE, S_SET_1, "");
 	} else if (start == Cx4('r', 'e', 'p', 'l') && s[4] == 'a') {
@@ -1027,11 +1410,15 @@ mc_parser_parse(struct mc_state *parser)
 	} else if (start == Cx4('s', 't', 'a', 't') && s[4] == 's') {
 		rc = mc_parser_other_command(parser, &mc_command_ascii_stats, s + 5, e, S_MATCH, S_OPT, "");
 	} else if (start == Cx4('f', 'l', 'u', 's') && s[4] == 'h') {
-		rc = mc_parser_other_command(parser, &mc_command_ascii_flush_all, s + 5, e, S_MATCH, S_FLUSH_ALL_1, "_all");
+		// The command is taken for flush_all until the parser sees
+		// that it is flush_namespace.
+		rc = mc_parser_other_command(parser, &mc_command_ascii_flush_all, s + 5, e, S_FLUSH, S_FLUSH, "");
 	} else if (start == Cx4('v', 'e', 'r', 's') && s[4] == 'i') {
 		rc = mc_parser_other_command(parser, &mc_command_ascii_version, s + 5, e, S_MATCH, S_EOL, "on");
 	} else if (start == Cx4('v', 'e', 'r', 'b') && s[4] == 'o') {
 		rc = mc_parser_other_command(parser, &mc_command_ascii_verbosity, s + 5, e, S_MATCH, S_VERBOSITY_1, "sity");
+	} else if (start == Cx4('s', 'n', 'a', 'p') && s[4] == 's') {
+		rc = mc_parser_other_command(parser, &mc_command_ascii_snapshot, s + 5, e, S_MATCH, S_EOL, "hot");
 	} else if (start == Cx4('q', 'u', 'i', 't')) {
 		rc = mc_parser_other_command(parser, &mc_command_ascii_quit, s + 4, e, S_SPACE, S_EOL, "");
 	} else {
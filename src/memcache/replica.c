@@ -0,0 +1,159 @@
+/*
+ * memcache/replica.c - MainMemory memcache hot entry replicas.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/replica.h"
+
+#include "base/report.h"
+#include "base/memory/alloc.h"
+#include "base/thread/domain.h"
+#include "base/thread/thread.h"
+
+static struct
+{
+	/* The number of replicas per thread, zero if disabled. */
+	uint32_t nreplicas;
+
+	/* The per-thread replicas. */
+	mm_thread_t nthreads;
+	struct mc_replica_local *locals;
+
+} mc_replica;
+
+/**********************************************************************
+ * Replica management.
+ **********************************************************************/
+
+void NONNULL(1, 2, 3)
+mc_replica_promote(struct mc_replica_local *local, struct mc_hotkeys_local *hotkeys, struct mc_action *action)
+{
+	ENTER();
+
+	if (mc_replica_find(local, action) != NULL)
+		goto leave;
+
+	// Replace an unused replica or the one for the least hot key.
+	uint32_t victim = local->nreplicas;
+	uint32_t victim_count = mc_hotkeys_count(hotkeys, action->hash, action->key, action->key_len);
+	for (uint32_t i = 0; i < local->nreplicas; i++) {
+		struct mc_entry *entry = &local->replicas[i].entry;
+		uint32_t count = 0;
+		if (entry->key_len)
+			count = mc_hotkeys_count(hotkeys, entry->hash, mc_entry_getkey(entry), entry->key_len);
+		if (count < victim_count) {
+			victim = i;
+			victim_count = count;
+		}
+	}
+	if (victim == local->nreplicas)
+		goto leave;
+
+	// Keep the key for lookups but no value until the next read.
+	struct mc_replica *replica = &local->replicas[victim];
+	replica->countdown = 0;
+	replica->entry.hash = action->hash;
+	replica->entry.key_len = action->key_len;
+	replica->entry.value_len = 0;
+	mc_entry_setdata(&replica->entry, replica->data);
+	mc_entry_setkey(&replica->entry, action->key);
+	local->hashes[victim] = action->hash;
+
+leave:
+	LEAVE();
+}
+
+void NONNULL(1, 2)
+mc_replica_fill(struct mc_replica *replica, struct mc_action *action)
+{
+	ENTER();
+
+	// Large values are not worth the private memory. Neither are the
+	// values on disk.
+	struct mc_entry *source = action->old_entry;
+	if (source == NULL || source->value_len > MC_ACTION_PEEK_COPY_MAX || mc_entry_is_disk(source))
+		goto leave;
+
+	// A pinned entry never changes in place and a referenced one is
+	// never changed in place while the reference is held.
+	struct mc_entry *entry = &replica->entry;
+	entry->exp_time = source->exp_time;
+	entry->value_len = source->value_len;
+	mc_entry_setflags(entry, mc_entry_getflags(source));
+	mc_entry_setstamp(entry, mc_entry_getstamp(source));
+	mc_entry_setslack(entry, 0);
+	mc_entry_setlease(entry, mc_entry_getlease(source) & MC_ENTRY_COMPRESSED);
+	memcpy(mc_entry_getvalue(entry), mc_entry_getvalue(source), source->value_len);
+	replica->countdown = MC_REPLICA_REFRESH;
+
+leave:
+	LEAVE();
+}
+
+/**********************************************************************
+ * Initialization and termination.
+ **********************************************************************/
+
+struct mc_replica_local *
+mc_replica_local(void)
+{
+	if (mc_replica.nreplicas == 0)
+		return NULL;
+	return &mc_replica.locals[mm_thread_self()];
+}
+
+void
+mc_replica_start(uint32_t nreplicas)
+{
+	ENTER();
+
+	if (nreplicas == 0)
+		goto leave;
+	mm_brief("memcache hot entry replicas per thread: %u", nreplicas);
+	mc_replica.nreplicas = nreplicas;
+
+	mc_replica.nthreads = mm_domain_getsize(mm_domain_selfptr());
+	size_t size = mc_replica.nthreads * sizeof(struct mc_replica_local);
+	mc_replica.locals = mm_memory_aligned_xalloc(MM_CACHELINE, size);
+	memset(mc_replica.locals, 0, size);
+	for (mm_thread_t i = 0; i < mc_replica.nthreads; i++) {
+		struct mc_replica_local *local = &mc_replica.locals[i];
+		local->nreplicas = nreplicas;
+		local->replicas = mm_memory_xcalloc(nreplicas, sizeof(struct mc_replica));
+	}
+
+leave:
+	LEAVE();
+}
+
+void
+mc_replica_stop(void)
+{
+	ENTER();
+
+	if (mc_replica.nreplicas == 0)
+		goto leave;
+
+	for (mm_thread_t i = 0; i < mc_replica.nthreads; i++)
+		mm_memory_free(mc_replica.locals[i].replicas);
+	mm_memory_free(mc_replica.locals);
+	mc_replica.locals = NULL;
+	mc_replica.nreplicas = 0;
+
+leave:
+	LEAVE();
+}
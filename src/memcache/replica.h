@@ -0,0 +1,120 @@
+/*
+ * memcache/replica.h - MainMemory memcache hot entry replicas.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_REPLICA_H
+#define MEMCACHE_REPLICA_H
+
+#include "memcache/memcache.h"
+#include "memcache/action.h"
+#include "memcache/hotkeys.h"
+
+/*
+ * Each thread might keep private copies of a few entries that its hot
+ * key sketch finds the most frequent. A read of such an entry touches
+ * no shared memory but a partition version that changes only if some
+ * entry with similar hash is changed. The copies are still refreshed
+ * from the table every so many reads for the eviction policy to see
+ * the original entries used.
+ */
+
+/* The maximum number of replicas per thread. */
+#define MC_REPLICA_MAX		(16u)
+/* The number of key samples that make it eligible for a replica. */
+#define MC_REPLICA_HOT		(64)
+/* The number of reads served by a replica before it is refreshed. */
+#define MC_REPLICA_REFRESH	(4096)
+
+struct mc_replica
+{
+	/* The entry copy with its data in the buffer below. */
+	struct mc_entry entry;
+	/* The partition version the copy is valid for. */
+	uint32_t version;
+	/* The number of reads left, zero if the copy is not valid. */
+	uint32_t countdown;
+	char data[UINT8_MAX + MC_ACTION_PEEK_COPY_MAX];
+};
+
+struct mc_replica_local
+{
+	uint32_t nreplicas;
+	/* Replica key hashes to check before the keys themselves. */
+	uint32_t hashes[MC_REPLICA_MAX];
+	struct mc_replica *replicas;
+
+} CACHE_ALIGN;
+
+void
+mc_replica_start(uint32_t nreplicas);
+
+void
+mc_replica_stop(void);
+
+/* Get the replicas of the current thread, NULL if disabled. */
+struct mc_replica_local *
+mc_replica_local(void);
+
+/* Make a replica for a hot key unless there are hotter ones already. */
+void NONNULL(1, 2, 3)
+mc_replica_promote(struct mc_replica_local *local, struct mc_hotkeys_local *hotkeys, struct mc_action *action);
+
+/* Copy a found entry to a replica that failed mc_replica_read(). */
+void NONNULL(1, 2)
+mc_replica_fill(struct mc_replica *replica, struct mc_action *action);
+
+static inline struct mc_replica * NONNULL(1, 2)
+mc_replica_find(struct mc_replica_local *local, struct mc_action *action)
+{
+	for (uint32_t i = 0; i < local->nreplicas; i++) {
+		if (local->hashes[i] != action->hash)
+			continue;
+		struct mc_entry *entry = &local->replicas[i].entry;
+		if (entry->key_len == action->key_len && !memcmp(mc_entry_getkey(entry), action->key, action->key_len))
+			return &local->replicas[i];
+	}
+	return NULL;
+}
+
+/* Try to use a replica for a lookup. The copy is handed out pinned so
+   it is released the same way as a table entry. If the copy is out of
+   date then the current version is kept for the following refill. */
+static inline bool NONNULL(1, 2)
+mc_replica_read(struct mc_replica *replica, struct mc_action *action)
+{
+	uint32_t version = mm_memory_load(*mc_table_replica_version(action->part, action->hash));
+	uint32_t exp_time = replica->entry.exp_time;
+	if (replica->version == version && replica->countdown != 0
+	    && (exp_time == 0 || exp_time > mm_memory_load(mc_table.time))) {
+		replica->countdown--;
+#if ENABLE_MEMCACHE_OPTIMISTIC
+		mc_table_epoch_enter();
+#endif
+		action->old_entry = &replica->entry;
+		action->entry_pinned = true;
+		return true;
+	}
+
+	// Look at the table only after the version.
+	mm_memory_load_fence();
+	replica->version = version;
+	replica->countdown = 0;
+	return false;
+}
+
+#endif /* MEMCACHE_REPLICA_H */
@@ -0,0 +1,300 @@
+/*
+ * memcache/shm.c - MainMemory memcache shared memory table storage.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/shm.h"
+
+#include "base/bitops.h"
+#include "base/report.h"
+#include "base/memory/alloc.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE	0
+#endif
+
+#define MC_SHM_MAGIC		"MMCACHE"
+#define MC_SHM_VERSION		1
+
+/* The size of a data slot, it matches the span size. */
+#define MC_SHM_SLOT_SIZE	MM_MEMORY_SPAN_ALIGNMENT
+
+struct mc_shm_header
+{
+	char magic[8];
+	uint32_t version;
+
+	/* Set on orderly shutdown, cleared while the table is in use. */
+	uint32_t clean;
+
+	/* The address and size of the mapping. */
+	uint64_t base;
+	uint64_t size;
+
+	struct mc_shm_layout layout;
+
+	/* Offsets of table regions. */
+	uint64_t parts_offset;
+	uint64_t entries_offset;
+	uint64_t buckets_offset;
+	uint64_t data_offset;
+
+	/* Data slot usage map, a byte per slot. */
+	uint32_t nslots;
+	uint8_t slots[];
+};
+
+/**********************************************************************
+ * Helper routines.
+ **********************************************************************/
+
+static bool
+mc_shm_layout_equal(const struct mc_shm_layout *a, const struct mc_shm_layout *b)
+{
+	return a->entry_size == b->entry_size
+		&& a->bucket_size == b->bucket_size
+		&& a->part_size == b->part_size
+		&& a->nparts == b->nparts
+		&& a->nentries_max == b->nentries_max
+		&& a->nbuckets_max == b->nbuckets_max
+		&& a->volume_max == b->volume_max
+		&& a->parts_size == b->parts_size
+		&& a->entries_size == b->entries_size
+		&& a->buckets_size == b->buckets_size
+		&& a->data_size == b->data_size;
+}
+
+static void
+mc_shm_zero_space(struct mc_shm *shm, void *addr, size_t size)
+{
+	// Drop the pages. They read as zeros afterwards.
+	if (madvise(addr, size, shm->fd < 0 ? MADV_DONTNEED : MADV_REMOVE) < 0)
+		memset(addr, 0, size);
+}
+
+/**********************************************************************
+ * Data span source.
+ **********************************************************************/
+
+static void *
+mc_shm_source_alloc(struct mm_memory_span_source *source, size_t size, size_t addr_mask)
+{
+	struct mc_shm *shm = containerof(source, struct mc_shm, source);
+	struct mc_shm_header *header = shm->header;
+	ASSERT(addr_mask < MC_SHM_SLOT_SIZE);
+	(void) addr_mask;
+
+	uint32_t n = (size + MC_SHM_SLOT_SIZE - 1) / MC_SHM_SLOT_SIZE;
+	void *addr = NULL;
+
+	// Find the first sufficient run of free slots.
+	mm_regular_lock(&shm->source_lock);
+	uint32_t run = 0;
+	for (uint32_t i = 0; i < header->nslots; i++) {
+		if (header->slots[i]) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			uint32_t first = i + 1 - n;
+			memset(&header->slots[first], 1, n);
+			addr = (char *) header + header->data_offset + (size_t) first * MC_SHM_SLOT_SIZE;
+			break;
+		}
+	}
+	mm_regular_unlock(&shm->source_lock);
+
+	if (addr == NULL)
+		errno = ENOMEM;
+	return addr;
+}
+
+static void
+mc_shm_source_free(struct mm_memory_span_source *source, void *addr, size_t size)
+{
+	struct mc_shm *shm = containerof(source, struct mc_shm, source);
+	struct mc_shm_header *header = shm->header;
+
+	uint32_t n = (size + MC_SHM_SLOT_SIZE - 1) / MC_SHM_SLOT_SIZE;
+	size_t offset = (char *) addr - ((char *) header + header->data_offset);
+	uint32_t first = offset / MC_SHM_SLOT_SIZE;
+	VERIFY(first + n <= header->nslots);
+
+	// The span memory must be zero when given out again.
+	mc_shm_zero_space(shm, addr, (size_t) n * MC_SHM_SLOT_SIZE);
+
+	mm_regular_lock(&shm->source_lock);
+	memset(&header->slots[first], 0, n);
+	mm_regular_unlock(&shm->source_lock);
+}
+
+/**********************************************************************
+ * Shared memory mapping.
+ **********************************************************************/
+
+/* Check if the file holds a table that might be reused and map it. */
+static struct mc_shm_header *
+mc_shm_attach(int fd, const struct mc_shm_layout *layout, size_t size)
+{
+	struct mc_shm_header header;
+	if (pread(fd, &header, sizeof header, 0) != sizeof header)
+		return NULL;
+
+	if (memcmp(header.magic, MC_SHM_MAGIC, sizeof header.magic) != 0) {
+		mm_brief("memcache shared memory: no stored table");
+		return NULL;
+	}
+	if (header.version != MC_SHM_VERSION || header.size != size
+	    || !mc_shm_layout_equal(&header.layout, layout)) {
+		mm_brief("memcache shared memory: incompatible stored table");
+		return NULL;
+	}
+	if (!header.clean) {
+		mm_brief("memcache shared memory: stored table was not closed properly");
+		return NULL;
+	}
+
+	void *base = (void *) (uintptr_t) header.base;
+	void *addr = mmap(base, size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_NORESERVE | MAP_FIXED_NOREPLACE, fd, 0);
+	if (addr == MAP_FAILED) {
+		mm_brief("memcache shared memory: failed to map stored table at %p", base);
+		return NULL;
+	}
+	if (addr != base) {
+		mm_brief("memcache shared memory: failed to map stored table at %p", base);
+		munmap(addr, size);
+		return NULL;
+	}
+
+	return addr;
+}
+
+/* Map the file or anonymous memory anew at any address aligned to the
+   slot size. */
+static struct mc_shm_header *
+mc_shm_create(int fd, size_t size)
+{
+	// Discard any old content.
+	if (fd >= 0 && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0))
+		mm_fatal(errno, "memcache shared memory: ftruncate");
+
+	size_t reserve = size + MC_SHM_SLOT_SIZE;
+	char *space = mmap(NULL, reserve, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (space == MAP_FAILED)
+		mm_fatal(errno, "mmap");
+	char *base = (char *) mm_round_up((uintptr_t) space, MC_SHM_SLOT_SIZE);
+
+	int flags = fd >= 0 ? MAP_SHARED : MAP_ANON | MAP_PRIVATE;
+	void *addr = mmap(base, size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE | MAP_FIXED, fd, 0);
+	if (addr == MAP_FAILED)
+		mm_fatal(errno, "memcache shared memory: mmap");
+
+	size_t leading = base - space;
+	size_t trailing = reserve - leading - size;
+	if (leading)
+		munmap(space, leading);
+	if (trailing)
+		munmap(base + size, trailing);
+
+	return addr;
+}
+
+struct mc_shm * NONNULL(2, 3)
+mc_shm_open(const char *path, const struct mc_shm_layout *layout, bool *attached)
+{
+	ENTER();
+
+	// Lay out the table regions.
+	uint32_t nslots = layout->data_size / MC_SHM_SLOT_SIZE;
+	size_t parts_offset = mm_round_up(sizeof(struct mc_shm_header) + nslots, MM_PAGE_SIZE);
+	size_t entries_offset = mm_round_up(parts_offset + layout->parts_size, MM_PAGE_SIZE);
+	size_t buckets_offset = entries_offset + layout->entries_size;
+	size_t data_offset = mm_round_up(buckets_offset + layout->buckets_size, MC_SHM_SLOT_SIZE);
+	size_t size = data_offset + (size_t) nslots * MC_SHM_SLOT_SIZE;
+
+	int fd = -1;
+	struct mc_shm_header *header = NULL;
+	if (path != NULL) {
+		fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			mm_fatal(errno, "memcache shared memory: %s", path);
+		header = mc_shm_attach(fd, layout, size);
+	}
+	*attached = (header != NULL);
+	if (header == NULL) {
+		header = mc_shm_create(fd, size);
+		memcpy(header->magic, MC_SHM_MAGIC, sizeof header->magic);
+		header->version = MC_SHM_VERSION;
+		header->base = (uintptr_t) header;
+		header->size = size;
+		header->layout = *layout;
+		header->parts_offset = parts_offset;
+		header->entries_offset = entries_offset;
+		header->buckets_offset = buckets_offset;
+		header->data_offset = data_offset;
+		header->nslots = nslots;
+	}
+	// The table is going to be modified from now on.
+	header->clean = 0;
+
+	mm_brief("memcache shared memory: %s, %zu bytes at %p, %s",
+		 path != NULL ? path : "anonymous", size, (void *) header,
+		 *attached ? "reattached" : "created");
+
+	struct mc_shm *shm = mm_memory_xalloc(sizeof(struct mc_shm));
+	shm->header = header;
+	shm->size = size;
+	shm->fd = fd;
+	shm->parts = (char *) header + header->parts_offset;
+	shm->entries = (char *) header + header->entries_offset;
+	shm->buckets = (char *) header + header->buckets_offset;
+	shm->source.alloc = mc_shm_source_alloc;
+	shm->source.free = mc_shm_source_free;
+	shm->source_lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+
+	LEAVE();
+	return shm;
+}
+
+void NONNULL(1)
+mc_shm_close(struct mc_shm *shm)
+{
+	ENTER();
+
+	struct mc_shm_header *header = shm->header;
+	mm_memory_store(header->clean, 1);
+
+	if (munmap(header, header->size) < 0)
+		mm_error(errno, "munmap");
+	if (shm->fd >= 0)
+		close(shm->fd);
+	mm_memory_free(shm);
+
+	LEAVE();
+}
+
+void NONNULL(1, 2)
+mc_shm_release_space(struct mc_shm *shm, void *addr, size_t size)
+{
+	mc_shm_zero_space(shm, addr, size);
+}
@@ -0,0 +1,83 @@
+/*
+ * memcache/shm.h - MainMemory memcache shared memory table storage.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_SHM_H
+#define MEMCACHE_SHM_H
+
+#include "memcache/memcache.h"
+
+#include "base/lock.h"
+#include "base/memory/span.h"
+
+/*
+ * The table partitions, entries, buckets, and key/value data might be
+ * kept in a single shared memory file (e.g. on tmpfs or hugetlbfs). A
+ * restarted process maps the file at the very same address and so all
+ * the pointers inside stay valid. If this is not possible or the file
+ * was not left in a consistent state then the table starts empty.
+ * Without a file the same layout is kept in anonymous memory.
+ */
+
+/* The table size parameters that must match to reuse a stored table. */
+struct mc_shm_layout
+{
+	uint32_t entry_size;
+	uint32_t bucket_size;
+	uint32_t part_size;
+
+	uint32_t nparts;
+	uint32_t nentries_max;
+	uint32_t nbuckets_max;
+	uint64_t volume_max;
+
+	uint64_t parts_size;
+	uint64_t entries_size;
+	uint64_t buckets_size;
+	uint64_t data_size;
+};
+
+struct mc_shm_header;
+
+struct mc_shm
+{
+	/* The mapped file, or -1 for anonymous memory. */
+	struct mc_shm_header *header;
+	size_t size;
+	int fd;
+
+	/* Table regions inside the mapping. */
+	void *parts;
+	void *entries;
+	void *buckets;
+
+	/* Partition data spans are allocated from the mapping. */
+	struct mm_memory_span_source source;
+	mm_regular_lock_t source_lock;
+};
+
+struct mc_shm * NONNULL(2, 3)
+mc_shm_open(const char *path, const struct mc_shm_layout *layout, bool *attached);
+
+void NONNULL(1)
+mc_shm_close(struct mc_shm *shm);
+
+void NONNULL(1, 2)
+mc_shm_release_space(struct mc_shm *shm, void *addr, size_t size);
+
+#endif /* MEMCACHE_SHM_H */
@@ -0,0 +1,560 @@
+/*
+ * memcache/snapshot.c - MainMemory memcache table snapshots.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memcache/snapshot.h"
+#include "memcache/action.h"
+#include "memcache/compress.h"
+#include "memcache/entry.h"
+#include "memcache/table.h"
+
+#include "base/async.h"
+#include "base/context.h"
+#include "base/format.h"
+#include "base/report.h"
+#include "base/fiber/fiber.h"
+#include "base/memory/alloc.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MC_SNAPSHOT_MAGIC	"MMSNAP"
+#define MC_SNAPSHOT_VERSION	1
+
+/* The file starts with the header that is followed by the sections.
+   Each section is a sequence of entry records terminated by a record
+   with zero key length. */
+struct mc_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nsections;
+	uint64_t sections[];
+};
+
+/* An entry record that is followed by the key and the value. */
+struct mc_snapshot_record
+{
+	uint8_t key_len;
+	/* The value is saved compressed as it is kept. */
+	uint8_t compressed;
+	uint8_t reserved[2];
+	uint32_t value_len;
+	uint32_t flags;
+	uint32_t exp_time;
+};
+
+/* Snapshot writer state. */
+#if ENABLE_SMP
+static mm_regular_lock_t mc_snapshot_running = MM_REGULAR_LOCK_INIT;
+#else
+static bool mc_snapshot_running = false;
+#endif
+
+/* Snapshot writer statistics. */
+static bool mc_snapshot_saving;
+static uint64_t mc_snapshot_runs;
+static uint64_t mc_snapshot_entries;
+static uint64_t mc_snapshot_bytes;
+
+/**********************************************************************
+ * Snapshot writing.
+ **********************************************************************/
+
+struct mc_snapshot_writer
+{
+	int fd;
+	bool failed;
+
+	/* The file size so far. */
+	uint64_t offset;
+
+	/* The write buffer. */
+	size_t used;
+	char *buffer;
+
+	/* The file names. */
+	char *path;
+	char *temp_path;
+};
+
+/* Write out the buffer. The writes are made asynchronously so that the
+   snapshot fiber does not block its thread that serves clients too. */
+static void
+mc_snapshot_flush(struct mc_snapshot_writer *writer)
+{
+	char *data = writer->buffer;
+	size_t size = writer->used;
+	writer->used = 0;
+
+	while (size && !writer->failed) {
+		ssize_t n = mm_async_write(writer->fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			mm_error(errno, "memcache snapshot: write");
+			writer->failed = true;
+			break;
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+static void
+mc_snapshot_write(struct mc_snapshot_writer *writer, const void *data, size_t size)
+{
+	writer->offset += size;
+	while (size) {
+		size_t n = min(size, MC_SNAPSHOT_BUFFER_SIZE - writer->used);
+		memcpy(writer->buffer + writer->used, data, n);
+		writer->used += n;
+		data = (const char *) data + n;
+		size -= n;
+
+		if (writer->used == MC_SNAPSHOT_BUFFER_SIZE)
+			mc_snapshot_flush(writer);
+	}
+}
+
+static void
+mc_snapshot_write_entry(struct mc_snapshot_writer *writer, struct mc_entry *entry)
+{
+	// A value on disk is read first and saved as it is stored there.
+	char *stored = NULL;
+	uint32_t value_len = entry->value_len;
+	if (mc_entry_is_disk(entry)) {
+		struct mc_disk_ref ref;
+		mc_disk_getref(entry, &ref);
+		stored = mm_memory_xalloc(ref.size);
+		if (!mc_disk_read(&mc_table_part(entry->hash)->disk, &ref, stored)) {
+			mm_warning(0, "memcache snapshot: skipped key %.*s, cannot read its value",
+				   entry->key_len, mc_entry_getkey(entry));
+			mm_memory_free(stored);
+			return;
+		}
+		value_len = ref.size;
+	}
+
+	struct mc_snapshot_record record = {
+		.key_len = entry->key_len,
+		.compressed = mc_entry_is_compressed(entry),
+		.value_len = value_len,
+		.flags = mc_entry_getflags(entry),
+		.exp_time = entry->exp_time,
+	};
+	mc_snapshot_write(writer, &record, sizeof record);
+	mc_snapshot_write(writer, mc_entry_getkey(entry), entry->key_len);
+
+	if (stored != NULL) {
+		mc_snapshot_write(writer, stored, value_len);
+		mm_memory_free(stored);
+	} else if (!mc_entry_is_chunked(entry)) {
+		mc_snapshot_write(writer, mc_entry_getvalue(entry), entry->value_len);
+	} else {
+		char **chunks = mc_entry_getchunks(entry);
+		uint32_t nchunks = mc_entry_nchunks(entry);
+		for (uint32_t i = 0; i < nchunks; i++)
+			mc_snapshot_write(writer, chunks[i], mc_entry_chunk_size(entry, i));
+	}
+}
+
+static uint64_t
+mc_snapshot_write_part(struct mc_snapshot_writer *writer, struct mc_tpart *part)
+{
+	ENTER();
+
+	struct mc_action_scan action;
+	action.base.part = part;
+	action.position = part->entries;
+
+	// Entries are referenced under the lookup lock a slice at a time
+	// and then written out without any lock held.
+	uint64_t nentries = 0;
+	do {
+		mc_action_scan(&action);
+		for (uint32_t i = 0; i < action.nentries; i++)
+			mc_snapshot_write_entry(writer, action.entries[i]);
+		nentries += action.nentries;
+		mc_action_release(&action);
+
+		mm_fiber_yield(mm_context_selfptr());
+	} while (action.position != NULL && !writer->failed);
+
+	mc_action_cleanup(&action.base);
+
+	// Terminate the section.
+	struct mc_snapshot_record record = { .key_len = 0 };
+	mc_snapshot_write(writer, &record, sizeof record);
+
+	LEAVE();
+	return nentries;
+}
+
+static mm_value_t
+mc_snapshot_save_routine(mm_value_t arg)
+{
+	ENTER();
+
+	struct mc_snapshot_writer *writer = (struct mc_snapshot_writer *) arg;
+	const mm_thread_t nparts = mc_table.nparts;
+	const size_t header_size = sizeof(struct mc_snapshot_header) + nparts * sizeof(uint64_t);
+
+	struct mc_snapshot_header *header = mm_memory_xalloc(header_size);
+	memset(header, 0, header_size);
+	memcpy(header->magic, MC_SNAPSHOT_MAGIC, sizeof MC_SNAPSHOT_MAGIC);
+	header->version = MC_SNAPSHOT_VERSION;
+	header->nsections = nparts;
+
+	// Reserve room for the header. It is rewritten at the end when
+	// section offsets are known.
+	uint64_t nentries = 0;
+	mc_snapshot_write(writer, header, header_size);
+	for (mm_thread_t i = 0; i < nparts && !writer->failed; i++) {
+		header->sections[i] = writer->offset;
+		nentries += mc_snapshot_write_part(writer, &mc_table.parts[i]);
+	}
+	mc_snapshot_flush(writer);
+
+	if (!writer->failed && mm_async_pwrite(writer->fd, header, header_size, 0) != (ssize_t) header_size) {
+		mm_error(errno, "memcache snapshot: write");
+		writer->failed = true;
+	}
+	if (!writer->failed && mm_async_fsync(writer->fd) < 0) {
+		mm_error(errno, "memcache snapshot: fsync");
+		writer->failed = true;
+	}
+	mm_async_close(writer->fd);
+
+	// Replace the previous snapshot only with a complete one.
+	if (!writer->failed && rename(writer->temp_path, writer->path) < 0) {
+		mm_error(errno, "memcache snapshot: rename");
+		writer->failed = true;
+	}
+	if (writer->failed) {
+		unlink(writer->temp_path);
+	} else {
+		mm_memory_store(mc_snapshot_entries, nentries);
+		mm_memory_store(mc_snapshot_bytes, writer->offset);
+		mm_brief("memcache snapshot: saved %llu entries, %llu bytes to %s",
+			 (unsigned long long) nentries, (unsigned long long) writer->offset,
+			 writer->path);
+	}
+
+	mm_memory_free(header);
+
+	LEAVE();
+	return 0;
+}
+
+static void
+mc_snapshot_save_complete(mm_value_t arg, mm_value_t result UNUSED)
+{
+	ENTER();
+
+	struct mc_snapshot_writer *writer = (struct mc_snapshot_writer *) arg;
+	mm_memory_free(writer->buffer);
+	mm_memory_free(writer->temp_path);
+	mm_memory_free(writer->path);
+	mm_memory_free(writer);
+
+	mm_memory_store(mc_snapshot_saving, false);
+#if ENABLE_SMP
+	mm_regular_unlock(&mc_snapshot_running);
+#else
+	mc_snapshot_running = false;
+#endif
+
+	LEAVE();
+}
+
+bool NONNULL(1)
+mc_snapshot_save(const char *path)
+{
+	ENTER();
+	bool rc = false;
+
+#if ENABLE_SMP
+	if (!mm_regular_trylock(&mc_snapshot_running))
+		goto leave;
+#else
+	if (mc_snapshot_running)
+		goto leave;
+	mc_snapshot_running = true;
+#endif
+
+	struct mc_snapshot_writer *writer = mm_memory_xalloc(sizeof(struct mc_snapshot_writer));
+	writer->path = mm_memory_strdup(path);
+	writer->temp_path = mm_format(&mm_memory_xarena, "%s.tmp", path);
+	writer->buffer = mm_memory_xalloc(MC_SNAPSHOT_BUFFER_SIZE);
+	writer->used = 0;
+	writer->offset = 0;
+	writer->failed = false;
+
+	writer->fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (writer->fd < 0) {
+		mm_error(errno, "memcache snapshot: %s", writer->temp_path);
+		writer->failed = true;
+		mc_snapshot_save_complete((mm_value_t) writer, 0);
+		goto leave;
+	}
+
+	mm_memory_store(mc_snapshot_saving, true);
+	mm_memory_store(mc_snapshot_runs, mc_snapshot_runs + 1);
+	mm_brief("memcache snapshot: saving to %s", path);
+
+	MM_TASK(save_task, mc_snapshot_save_routine, mc_snapshot_save_complete, mm_task_reassign_on);
+	mm_context_post_task(&save_task, (mm_value_t) writer);
+	rc = true;
+
+leave:
+	LEAVE();
+	return rc;
+}
+
+void NONNULL(1)
+mc_snapshot_stat(struct mc_snapshot_stat *stat)
+{
+	stat->running = mm_memory_load(mc_snapshot_saving);
+	stat->runs = mm_memory_load(mc_snapshot_runs);
+	stat->entries = mm_memory_load(mc_snapshot_entries);
+	stat->bytes = mm_memory_load(mc_snapshot_bytes);
+}
+
+/**********************************************************************
+ * Snapshot loading.
+ **********************************************************************/
+
+struct mc_snapshot_loader
+{
+	int fd;
+	char *path;
+
+	/* The number of sections still being loaded. */
+	mm_atomic_uint32_t npending;
+	/* The number of loaded entries. */
+	mm_atomic_uint64_t nentries;
+};
+
+/* A section loader state. */
+struct mc_snapshot_reader
+{
+	struct mc_snapshot_loader *loader;
+
+	/* The file offset of the buffer end. */
+	uint64_t offset;
+
+	/* The read buffer. */
+	size_t start;
+	size_t end;
+	char *buffer;
+};
+
+/* Make sure that the given number of bytes is buffered. */
+static bool
+mc_snapshot_fill(struct mc_snapshot_reader *reader, size_t size)
+{
+	ASSERT(size <= MC_SNAPSHOT_BUFFER_SIZE);
+	if ((reader->end - reader->start) >= size)
+		return true;
+
+	// Move the remaining data to the buffer start.
+	size_t used = reader->end - reader->start;
+	memmove(reader->buffer, reader->buffer + reader->start, used);
+	reader->start = 0;
+	reader->end = used;
+
+	while (reader->end < size) {
+		ssize_t n = mm_async_pread(reader->loader->fd, reader->buffer + reader->end,
+					   MC_SNAPSHOT_BUFFER_SIZE - reader->end, reader->offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			mm_error(errno, "memcache snapshot: read");
+			return false;
+		}
+		if (n == 0) {
+			mm_error(0, "memcache snapshot: unexpected end of file");
+			return false;
+		}
+		reader->end += n;
+		reader->offset += n;
+	}
+	return true;
+}
+
+static bool
+mc_snapshot_load_entry(struct mc_snapshot_reader *reader, struct mc_snapshot_record *record, uint32_t time)
+{
+	// Copy the key as the read buffer might be refilled.
+	char key[UINT8_MAX];
+	if (!mc_snapshot_fill(reader, record->key_len))
+		return false;
+	memcpy(key, reader->buffer + reader->start, record->key_len);
+	reader->start += record->key_len;
+
+	struct mc_action_storage action;
+	mc_action_set_key(&action.base, key, record->key_len);
+	mc_action_create(&action, record->value_len);
+	mc_entry_setkey(action.new_entry, key);
+	mc_entry_setflags(action.new_entry, record->flags);
+	action.new_entry->exp_time = record->exp_time;
+	if (record->compressed)
+		mc_entry_setlease(action.new_entry, MC_ENTRY_COMPRESSED);
+
+	uint32_t offset = 0;
+	while (offset < record->value_len) {
+		if (!mc_snapshot_fill(reader, 1)) {
+			mc_action_cancel(&action);
+			mc_action_cleanup(&action.base);
+			return false;
+		}
+		uint32_t n = min(record->value_len - offset, reader->end - reader->start);
+		mc_entry_setvalue(action.new_entry, offset, reader->buffer + reader->start, n);
+		reader->start += n;
+		offset += n;
+	}
+
+	// Skip entries expired since the snapshot was taken. Do not
+	// overwrite entries stored by clients meanwhile.
+	if (record->exp_time && record->exp_time <= time)
+		mc_action_cancel(&action);
+	else
+		mc_action_insert(&action);
+	mc_action_cleanup(&action.base);
+
+	return true;
+}
+
+static mm_value_t
+mc_snapshot_load_routine(mm_value_t arg)
+{
+	ENTER();
+
+	struct mc_snapshot_reader *reader = (struct mc_snapshot_reader *) arg;
+	const uint32_t time = mm_memory_load(mc_table.time);
+
+	uint64_t nentries = 0;
+	for (;;) {
+		if (!mc_snapshot_fill(reader, sizeof(struct mc_snapshot_record)))
+			break;
+		struct mc_snapshot_record record;
+		memcpy(&record, reader->buffer + reader->start, sizeof record);
+		reader->start += sizeof record;
+
+		if (record.key_len == 0)
+			break;
+		if (record.value_len > mc_table.volume_max
+		    || (record.compressed && record.value_len <= MC_COMPRESS_HEADER_SIZE)) {
+			mm_error(0, "memcache snapshot: corrupt entry record");
+			break;
+		}
+
+		if (!mc_snapshot_load_entry(reader, &record, time))
+			break;
+		if ((++nentries % MC_ACTION_SCAN_SLICE) == 0)
+			mm_fiber_yield(mm_context_selfptr());
+	}
+	mm_atomic_uint64_fetch_and_add(&reader->loader->nentries, nentries);
+
+	LEAVE();
+	return 0;
+}
+
+static void
+mc_snapshot_load_complete(mm_value_t arg, mm_value_t result UNUSED)
+{
+	ENTER();
+
+	struct mc_snapshot_reader *reader = (struct mc_snapshot_reader *) arg;
+	struct mc_snapshot_loader *loader = reader->loader;
+	mm_memory_free(reader->buffer);
+	mm_memory_free(reader);
+
+	// The last section loader finishes the whole thing.
+	if (mm_atomic_uint32_dec_and_test(&loader->npending) == 0) {
+		mm_brief("memcache snapshot: loaded %llu entries from %s",
+			 (unsigned long long) mm_memory_load(loader->nentries), loader->path);
+		close(loader->fd);
+		mm_memory_free(loader->path);
+		mm_memory_free(loader);
+	}
+
+	LEAVE();
+}
+
+void NONNULL(1)
+mc_snapshot_load(const char *path)
+{
+	ENTER();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		mm_error(errno, "memcache snapshot: %s", path);
+		goto leave;
+	}
+
+	struct mc_snapshot_header header;
+	if (pread(fd, &header, sizeof header, 0) != sizeof header
+	    || memcmp(header.magic, MC_SNAPSHOT_MAGIC, sizeof MC_SNAPSHOT_MAGIC) != 0
+	    || header.version != MC_SNAPSHOT_VERSION
+	    || header.nsections == 0) {
+		mm_error(0, "memcache snapshot: %s: not a snapshot file", path);
+		close(fd);
+		goto leave;
+	}
+
+	size_t sections_size = header.nsections * sizeof(uint64_t);
+	uint64_t *sections = mm_memory_xalloc(sections_size);
+	if (pread(fd, sections, sections_size, sizeof header) != (ssize_t) sections_size) {
+		mm_error(0, "memcache snapshot: %s: truncated file", path);
+		mm_memory_free(sections);
+		close(fd);
+		goto leave;
+	}
+
+	mm_brief("memcache snapshot: loading %u sections from %s", header.nsections, path);
+
+	struct mc_snapshot_loader *loader = mm_memory_xalloc(sizeof(struct mc_snapshot_loader));
+	loader->fd = fd;
+	loader->path = mm_memory_strdup(path);
+	loader->npending = header.nsections;
+	loader->nentries = 0;
+
+	// Load the sections in parallel. The entries are not necessarily
+	// stored to the partitions they came from as the number of
+	// partitions might differ. The tasks are queued locally as other
+	// threads might not run yet, they take the tasks over when idle.
+	struct mm_context *const context = mm_context_selfptr();
+	MM_TASK(load_task, mc_snapshot_load_routine, mc_snapshot_load_complete, mm_task_reassign_on);
+	for (uint32_t i = 0; i < header.nsections; i++) {
+		struct mc_snapshot_reader *reader = mm_memory_xalloc(sizeof(struct mc_snapshot_reader));
+		reader->loader = loader;
+		reader->offset = sections[i];
+		reader->start = 0;
+		reader->end = 0;
+		reader->buffer = mm_memory_xalloc(MC_SNAPSHOT_BUFFER_SIZE);
+		mm_context_add_task(context, &load_task, (mm_value_t) reader);
+	}
+
+	mm_memory_free(sections);
+
+leave:
+	LEAVE();
+}
@@ -0,0 +1,54 @@
+/*
+ * memcache/snapshot.h - MainMemory memcache table snapshots.
+ *
+ * Copyright (C) 2012-2019  Aleksey Demakov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMCACHE_SNAPSHOT_H
+#define MEMCACHE_SNAPSHOT_H
+
+#include "memcache/memcache.h"
+
+/*
+ * A snapshot is a file with all the live table entries. It is written
+ * in the background while the table is in use, so it is not an exact
+ * point-in-time image. The entries of each partition go to a separate
+ * file section and the sections are loaded in parallel.
+ */
+
+/* The snapshot file write and read buffer size. */
+#define MC_SNAPSHOT_BUFFER_SIZE		(256 * 1024)
+
+struct mc_snapshot_stat
+{
+	bool running;
+	unsigned long long runs;
+	unsigned long long entries;
+	unsigned long long bytes;
+};
+
+/* Start writing a snapshot. Returns false if one is already running. */
+bool NONNULL(1)
+mc_snapshot_save(const char *path);
+
+/* Start loading a snapshot into the table. */
+void NONNULL(1)
+mc_snapshot_load(const char *path);
+
+void NONNULL(1)
+mc_snapshot_stat(struct mc_snapshot_stat *stat);
+
+#endif /* MEMCACHE_SNAPSHOT_H */
@@ -34,6 +34,8 @@ mc_state_create(void)
 
 	state->command_first = NULL;
 	state->command_last = NULL;
+	state->steer_owner = NULL;
+	state->steer_votes = 0;
 	state->protocol = MC_PROTOCOL_INIT;
 	state->error = false;
 	state->trash = false;
@@ -22,6 +22,9 @@
 
 #include "memcache/command.h"
 #include "memcache/binary.h"
+#include "memcache/entry.h"
+#include "memcache/hotkeys.h"
+#include "memcache/replica.h"
 
 #include "base/report.h"
 #include "base/net/netbuf.h"
@@ -43,6 +46,15 @@ struct mc_state
 
 	/* Statistics shard for current thread. */
 	struct mc_stat *stat;
+	/* Hot key sketch for current thread. */
+	struct mc_hotkeys_local *hotkeys;
+	/* Hot entry replicas for current thread if enabled. */
+	struct mc_replica_local *replicas;
+
+	/* The thread that owns the partitions of most keys lately and the
+	   vote count for it, used with thread-owned partitions. */
+	struct mm_context *steer_owner;
+	uint32_t steer_votes;
 
 	/* Memcache protocol. */
 	uint8_t protocol;
@@ -85,4 +97,20 @@ mc_getprotocol(struct mc_state *state)
 	return protocol;
 }
 
+/* Read the entry value from the receive buffer straight into the entry
+   data or the value chunks. */
+static inline void NONNULL(1, 2)
+mc_state_read_value(struct mc_state *state, struct mc_entry *entry)
+{
+	if (!mc_entry_is_chunked(entry)) {
+		mm_netbuf_read(&state->sock, mc_entry_getvalue(entry), entry->value_len);
+		return;
+	}
+
+	char **chunks = mc_entry_getchunks(entry);
+	uint32_t nchunks = mc_entry_nchunks(entry);
+	for (uint32_t i = 0; i < nchunks; i++)
+		mm_netbuf_read(&state->sock, chunks[i], mc_entry_chunk_size(entry, i));
+}
+
 #endif /* MEMCACHE_STATE_H */
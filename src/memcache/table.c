@@ -20,7 +20,9 @@
 #include "memcache/table.h"
 #include "memcache/action.h"
 #include "memcache/entry.h"
+#include "memcache/snapshot.h"
 
+#include "base/clock.h"
 #include "base/combiner.h"
 #include "base/hash.h"
 #include "base/report.h"
@@ -29,6 +31,7 @@
 #include "base/fiber/fiber.h"
 #include "base/memory/alloc.h"
 #include "base/memory/cache.h"
+#include "base/memory/span.h"
 #include "base/thread/domain.h"
 
 #include <sys/mman.h>
@@ -50,7 +53,7 @@ struct mc_table mc_table;
 static inline size_t
 mc_table_buckets_size(uint16_t nparts, uint32_t nbuckets)
 {
-	size_t space = nbuckets * sizeof(struct mm_stack);
+	size_t space = nbuckets * sizeof(struct mc_bucket);
 	return nparts * mm_round_up(space, MM_PAGE_SIZE);
 }
 
@@ -68,14 +71,185 @@ mc_table_check_size(struct mc_tpart *part)
 	uint32_t ne = mm_memory_load(part->nentries);
 	ne -= mm_memory_load(part->nentries_free);
 	ne -= mm_memory_load(part->nentries_void);
-	return ne > (nb * 2) && nb < mc_table.nbuckets_max;
+	return ne > (nb * MC_BUCKET_LOAD) && nb < mc_table.nbuckets_max;
+}
+
+static inline bool
+mc_table_check_shrink(struct mc_tpart *part)
+{
+	uint32_t nb = mm_memory_load(part->nbuckets);
+	uint32_t ne = mm_memory_load(part->nentries);
+	ne -= mm_memory_load(part->nentries_free);
+	ne -= mm_memory_load(part->nentries_void);
+	return ne < (nb * MC_BUCKET_LOAD_MIN) && nb > mc_table.nbuckets_min;
 }
 
 static inline bool
 mc_table_check_volume(struct mc_tpart *part, size_t reserve)
 {
-	uint32_t n = mm_memory_load(part->volume);
-	return (n + reserve) > mc_table.volume_max;
+	size_t n = mm_memory_load(part->volume);
+	return (n + reserve) > mm_memory_load(part->volume_max);
+}
+
+/* Run a background task for a partition on the thread that owns it if
+   the partition has an owner and on any thread otherwise. */
+static void
+mc_table_post_task(struct mc_tpart *part UNUSED, mm_task_t task)
+{
+#if ENABLE_SMP
+	if (part->owner != NULL) {
+		mm_context_send_task(part->owner, task, (mm_value_t) part);
+		return;
+	}
+#endif
+	mm_context_post_task(task, (mm_value_t) part);
+}
+
+/**********************************************************************
+ * Expired entry crawler.
+ **********************************************************************/
+
+static mm_value_t
+mc_table_crawl_routine(mm_value_t arg)
+{
+	ENTER();
+
+	struct mc_tpart *part = (struct mc_tpart *) arg;
+	//ASSERT(part->crawling);
+
+	struct mc_action action;
+	action.part = part;
+
+	// Check entry slices until a full pass is done or the time budget
+	// is spent.
+	mm_timeval_t spent = 0;
+	part->crawl_runs++;
+	for (;;) {
+		mm_timeval_t start = mm_clock_gettime_monotonic();
+		mc_action_crawl(&action);
+		spent += mm_clock_gettime_monotonic() - start;
+
+		if (part->crawl_hand == part->entries)
+			break;
+		if (spent >= mc_table.crawl_budget)
+			break;
+		mm_fiber_yield(mm_context_selfptr());
+	}
+
+	LEAVE();
+	return 0;
+}
+
+static void
+mc_table_crawl_complete(mm_value_t arg, mm_value_t result UNUSED)
+{
+	ENTER();
+
+	struct mc_tpart *part = (struct mc_tpart *) arg;
+	//ASSERT(part->crawling);
+
+#if ENABLE_SMP
+	mm_regular_unlock(&part->crawling);
+#else
+	part->crawling = false;
+#endif
+
+	LEAVE();
+}
+
+static void
+mc_table_start_crawling(struct mc_tpart *part)
+{
+	ENTER();
+
+	MM_TASK(crawl_task, mc_table_crawl_routine, mc_table_crawl_complete, mm_task_reassign_on);
+	mc_table_post_task(part, &crawl_task);
+
+	LEAVE();
+}
+
+static void
+mc_table_crawl(void)
+{
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+#if ENABLE_SMP
+		if (mm_regular_trylock(&part->crawling))
+			mc_table_start_crawling(part);
+#else
+		if (!part->crawling) {
+			part->crawling = true;
+			mc_table_start_crawling(part);
+		}
+#endif
+	}
+}
+
+/**********************************************************************
+ * Memory governor.
+ **********************************************************************/
+
+/* Measure the memory taken besides the entries. These are the spans
+   of thread caches with network buffers and such, the table arrays
+   beyond the entries in use, and the part of the entry data spaces
+   that the entries do not use, that is free blocks, block headers and
+   dead log records. */
+static size_t
+mc_table_memory_overhead(void)
+{
+	size_t spans = mm_memory_span_footprint();
+	size_t data = 0, live = 0, arrays = 0;
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		data += mm_memory_cache_footprint(&part->data_space);
+		uint32_t nentries = mm_memory_load(part->nentries);
+		uint32_t unused = mm_memory_load(part->nentries_free) + mm_memory_load(part->nentries_void);
+		// The entry volume counts the entries along with their data.
+		size_t volume = mm_memory_load(part->volume);
+		size_t entries = (size_t) (nentries - min(unused, nentries)) * sizeof(struct mc_entry);
+		live += volume > entries ? volume - entries : 0;
+		arrays += unused * sizeof(struct mc_entry);
+		arrays += mm_memory_load(part->nbuckets) * sizeof(struct mc_bucket);
+	}
+	return (spans > data ? spans - data : 0) + (data > live ? data - live : 0) + arrays;
+}
+
+/* Share what the overhead leaves of the memory budget among partitions.
+   Each partition may have an equal share. The part of it that some do
+   not use is split among the others so that an uneven key distribution
+   does not waste memory. The partitions over their new limit start to
+   evict entries right away. */
+void
+mc_table_govern(void)
+{
+	ENTER();
+
+	size_t overhead = mc_table_memory_overhead();
+	mm_memory_store(mc_table.memory_overhead, overhead);
+
+	// Do not let a misjudged overhead starve the entries.
+	size_t budget = mc_table.memory_max - min(overhead, mc_table.memory_max / 2);
+	size_t share = budget / mc_table.nparts;
+
+	size_t spare = 0;
+	uint32_t nlarge = 0;
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		size_t volume = mm_memory_load(mc_table.parts[i].volume);
+		if (volume < share)
+			spare += share - volume;
+		else
+			nlarge++;
+	}
+	size_t bonus = nlarge ? spare / nlarge : 0;
+
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		size_t volume = mm_memory_load(part->volume);
+		mm_memory_store(part->volume_max, volume < share ? share : share + bonus);
+		mc_table_reserve_volume(part);
+	}
+
+	LEAVE();
 }
 
 /**********************************************************************
@@ -94,6 +268,19 @@ mc_table_exp_timer_routine(mm_value_t arg UNUSED)
 	mm_memory_store(mc_table.time, time);
 	DEBUG("time: %u", time);
 
+	// Let the crawler reclaim expired entries once a second.
+	if (mm_memory_load(mc_table.crawl_budget))
+		mc_table_crawl();
+
+	// Adjust the partition memory limits once a second too.
+	if (mm_memory_load(mc_table.memory_max))
+		mc_table_govern();
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Let the entries retired on quiet partitions be reclaimed.
+	mc_table_epoch_advance();
+#endif
+
 	LEAVE();
 	return 0;
 }
@@ -111,6 +298,36 @@ mc_table_prepare_exp_timer(void)
 	LEAVE();
 }
 
+/**********************************************************************
+ * Entry reclamation epoch.
+ **********************************************************************/
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+
+void
+mc_table_epoch_advance(void)
+{
+	ENTER();
+
+	// The epoch might advance only if every active lock-free reader
+	// has already seen its current value.
+	uint32_t epoch = mm_memory_load(mc_table.epoch);
+	for (mm_thread_t i = 0; i < mc_table.nthreads; i++) {
+		uint32_t *local = MM_THREAD_LOCAL_DEREF(i, mc_table.epoch_local);
+		uint32_t local_epoch = mm_memory_load(*local);
+		if (local_epoch != epoch && local_epoch != 0)
+			goto leave;
+	}
+
+	mm_atomic_uint32_cas(&mc_table.epoch, epoch, epoch + 2);
+	DEBUG("advance epoch %u", epoch + 2);
+
+leave:
+	LEAVE();
+}
+
+#endif
+
 /**********************************************************************
  * Table resize.
  **********************************************************************/
@@ -123,6 +340,14 @@ mc_table_resize(void *start, size_t old_size, size_t new_size)
 	ASSERT((new_size % MM_PAGE_SIZE) == 0);
 	ASSERT(old_size != new_size);
 
+	// The shared memory is mapped as a whole, just let the unused
+	// part go.
+	if (mc_table.shm != NULL) {
+		if (old_size > new_size)
+			mc_shm_release_space(mc_table.shm, (char *) start + new_size, old_size - new_size);
+		return;
+	}
+
 	void *addr, *map_addr;
 	if (old_size > new_size) {
 		size_t diff = old_size - new_size;
@@ -204,6 +429,58 @@ mc_table_expand(struct mc_tpart *part, uint32_t n)
 	return rc;
 }
 
+static void
+mc_table_grow(struct mc_tpart *part)
+{
+	ENTER();
+
+	// Only striding changes the number of buckets so it is safe to
+	// read it without locking.
+	uint32_t nbuckets = part->nbuckets;
+	if (mm_is_pow2(nbuckets))
+		mc_table_buckets_resize(part, nbuckets, nbuckets * 2);
+
+	struct mc_action action;
+	action.part = part;
+	for (uint32_t count = 0; count < MC_TABLE_STRIDE; count++) {
+		mc_action_split(&action);
+		mm_fiber_yield(mm_context_selfptr());
+	}
+
+	LEAVE();
+}
+
+static void
+mc_table_shrink(struct mc_tpart *part)
+{
+	ENTER();
+
+	struct mc_action action;
+	action.part = part;
+	for (uint32_t count = 0; count < MC_TABLE_STRIDE; count++) {
+		mc_action_merge(&action);
+		mm_fiber_yield(mm_context_selfptr());
+	}
+
+	uint32_t nbuckets = part->nbuckets;
+	if (mm_is_pow2(nbuckets)) {
+#if ENABLE_MEMCACHE_OPTIMISTIC
+		// Lock-free readers and lookup prefetching might still use
+		// the previous number of buckets until the epoch moves twice.
+		// Both are built only along with the epoch so this wait is
+		// done whenever they are.
+		uint32_t epoch = mm_memory_load(mc_table.epoch);
+		while (mm_memory_load(mc_table.epoch) - epoch < 4) {
+			mc_table_epoch_advance();
+			mm_fiber_yield(mm_context_selfptr());
+		}
+#endif
+		mc_table_buckets_resize(part, nbuckets * 2, nbuckets);
+	}
+
+	LEAVE();
+}
+
 static mm_value_t
 mc_table_stride_routine(mm_value_t arg)
 {
@@ -212,9 +489,10 @@ mc_table_stride_routine(mm_value_t arg)
 	struct mc_tpart *part = (struct mc_tpart *) arg;
 	//ASSERT(part->striding);
 
-	struct mc_action action;
-	action.part = part;
-	mc_action_stride(&action);
+	if (mc_table_check_size(part))
+		mc_table_grow(part);
+	else if (mc_table_check_shrink(part))
+		mc_table_shrink(part);
 
 	LEAVE();
 	return 0;
@@ -243,7 +521,7 @@ mc_table_start_striding(struct mc_tpart *part)
 	ENTER();
 
 	MM_TASK(stride_task, mc_table_stride_routine, mc_table_stride_complete, mm_task_reassign_on);
-	mm_context_post_task(&stride_task, (mm_value_t) part);
+	mc_table_post_task(part, &stride_task);
 
 	LEAVE();
 }
@@ -252,6 +530,32 @@ mc_table_start_striding(struct mc_tpart *part)
  * Entry eviction.
  **********************************************************************/
 
+static void
+mc_table_compact_disk(struct mc_action *action)
+{
+	ENTER();
+
+	struct mc_disk *disk = &action->part->disk;
+	if (!mc_disk_compact_start(disk))
+		goto leave;
+
+	// The moved records fill up the head segment that is written out
+	// as needed. If there is no free segment for the next one then the
+	// remaining records stay where they are.
+	uint32_t offset;
+	while (mc_disk_compact_next(disk, &offset) != NULL) {
+		mc_action_compact_disk(action);
+		if (mc_disk_is_full(disk) && !mc_disk_flush(disk, true))
+			break;
+		mm_fiber_yield(mm_context_selfptr());
+	}
+
+	mc_disk_compact_finish(disk);
+
+leave:
+	LEAVE();
+}
+
 static mm_value_t
 mc_table_evict_routine(mm_value_t arg)
 {
@@ -263,9 +567,22 @@ mc_table_evict_routine(mm_value_t arg)
 	struct mc_action action;
 	action.part = part;
 
+	// With the disk tier long values are moved there rather than
+	// dropped. The disk space is also reclaimed here.
 	size_t reserve = MC_TABLE_VOLUME_RESERVE / mc_table.nparts;
 	while (mc_table_check_volume(part, reserve)) {
-		mc_action_evict(&action);
+		struct mc_disk *disk = &part->disk;
+		if (mc_disk_enabled(disk)) {
+			if (mc_disk_check_compact(disk))
+				mc_table_compact_disk(&action);
+			if (mc_disk_is_full(disk))
+				mc_disk_flush(disk, false);
+		}
+		// The values are dropped if there is no more disk space.
+		if (mc_disk_enabled(disk) && !mc_disk_is_full(disk))
+			mc_action_spill(&action);
+		else
+			mc_action_evict(&action);
 		mm_fiber_yield(mm_context_selfptr());
 	}
 
@@ -296,7 +613,70 @@ mc_table_start_evicting(struct mc_tpart *part)
 	ENTER();
 
 	MM_TASK(evict_task, mc_table_evict_routine, mc_table_evict_complete, mm_task_reassign_on);
-	mm_context_post_task(&evict_task, (mm_value_t) part);
+	mc_table_post_task(part, &evict_task);
+
+	LEAVE();
+}
+
+/**********************************************************************
+ * Log segment cleaning.
+ **********************************************************************/
+
+static bool
+mc_table_check_clean(struct mc_tpart *part)
+{
+	return mc_table.storage == MC_STORAGE_LOG && mc_log_check_clean(&part->log);
+}
+
+static mm_value_t
+mc_table_clean_routine(mm_value_t arg)
+{
+	ENTER();
+
+	struct mc_tpart *part = (struct mc_tpart *) arg;
+	//ASSERT(part->cleaning);
+
+	struct mc_action action;
+	action.part = part;
+
+	// Stop when a segment is looked through but cannot be freed as
+	// its entries are in use. It is tried again on later stores.
+	while (mc_table_check_clean(part)) {
+		uint64_t cleaned = mm_memory_load(part->log.cleaned);
+		mc_action_compact(&action);
+		if (mm_memory_load(part->log.victim) == NULL && cleaned == mm_memory_load(part->log.cleaned))
+			break;
+		mm_fiber_yield(mm_context_selfptr());
+	}
+
+	LEAVE();
+	return 0;
+}
+
+static void
+mc_table_clean_complete(mm_value_t arg, mm_value_t result UNUSED)
+{
+	ENTER();
+
+	struct mc_tpart *part = (struct mc_tpart *) arg;
+	//ASSERT(part->cleaning);
+
+#if ENABLE_SMP
+	mm_regular_unlock(&part->cleaning);
+#else
+	part->cleaning = false;
+#endif
+
+	LEAVE();
+}
+
+static void
+mc_table_start_cleaning(struct mc_tpart *part)
+{
+	ENTER();
+
+	MM_TASK(clean_task, mc_table_clean_routine, mc_table_clean_complete, mm_task_reassign_on);
+	mc_table_post_task(part, &clean_task);
 
 	LEAVE();
 }
@@ -305,15 +685,21 @@ void NONNULL(1)
 mc_table_reserve_volume(struct mc_tpart *part)
 {
 #if ENABLE_SMP
-	if (!part->evicting.lock.lock.value && mc_table_check_volume(part, 0)) {
-		if (mm_regular_trylock(&part->evicting))
-			mc_table_start_evicting(part);
-	}
+	// The trylock alone tells if eviction or cleaning is already
+	// going on.
+	if (mc_table_check_volume(part, 0) && mm_regular_trylock(&part->evicting))
+		mc_table_start_evicting(part);
+	if (mc_table_check_clean(part) && mm_regular_trylock(&part->cleaning))
+		mc_table_start_cleaning(part);
 #else
 	if (!part->evicting && mc_table_check_volume(part, 0)) {
 		part->evicting = true;
 		mc_table_start_evicting(part);
 	}
+	if (!part->cleaning && mc_table_check_clean(part)) {
+		part->cleaning = true;
+		mc_table_start_cleaning(part);
+	}
 #endif
 }
 
@@ -321,10 +707,9 @@ void NONNULL(1)
 mc_table_reserve_entries(struct mc_tpart *part)
 {
 #if ENABLE_SMP
-	if (!part->striding.lock.lock.value && mc_table_check_size(part)) {
-		if (mm_regular_trylock(&part->striding))
-			mc_table_start_striding(part);
-	}
+	// The trylock alone tells if a striding step is already going on.
+	if (mc_table_check_size(part) && mm_regular_trylock(&part->striding))
+		mc_table_start_striding(part);
 #else
 	if (!part->striding && mc_table_check_size(part)) {
 		part->striding = true;
@@ -333,12 +718,79 @@ mc_table_reserve_entries(struct mc_tpart *part)
 #endif
 }
 
+void NONNULL(1)
+mc_table_release_entries(struct mc_tpart *part)
+{
+#if ENABLE_SMP
+	// The trylock alone tells if a striding step is already going on.
+	if (mc_table_check_shrink(part) && mm_regular_trylock(&part->striding))
+		mc_table_start_striding(part);
+#else
+	if (!part->striding && mc_table_check_shrink(part)) {
+		part->striding = true;
+		mc_table_start_striding(part);
+	}
+#endif
+}
+
 /**********************************************************************
  * Table initialization and termination.
  **********************************************************************/
 
+/* Set up the partition state that is private to the running process. */
 static void
-mc_table_init_part(mm_thread_t index, struct mm_strand *target UNUSED)
+mc_table_init_part_runtime(mm_thread_t index)
+{
+	struct mc_tpart *part = &mc_table.parts[index];
+
+	mc_evict_prepare(&part->evict, mc_table.evict, mc_table.nentries_max);
+
+	part->crawl_hand = part->entries;
+	part->crawl_runs = 0;
+	part->crawl_checked = 0;
+	part->crawl_reclaimed = 0;
+
+	// Start with an equal share until the memory governor steps in.
+	part->volume_max = mc_table.volume_max;
+
+	// The log segment list is kept in private memory.
+	mc_log_prepare(&part->log);
+
+	// The disk tier file is not kept across restarts.
+	mc_disk_prepare(&part->disk, mc_table.disk_path, index, mc_table.disk_nsegments);
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mc_entry_list_prepare(&part->limbo[0]);
+	mc_entry_list_prepare(&part->limbo[1]);
+	part->limbo_epoch[0] = 0;
+	part->limbo_epoch[1] = 0;
+	part->nretired = 0;
+#endif
+
+	part->locking = (mc_table.access == MC_ACCESS_LOCKING);
+	part->lookup_lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	part->freelist_lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	part->owner = NULL;
+
+	part->combiner = NULL;
+	if (mc_table.access == MC_ACCESS_COMBINER)
+		part->combiner = mm_combiner_create(MC_COMBINER_SIZE, MC_COMBINER_HANDOFF);
+
+#if ENABLE_SMP
+	part->evicting = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	part->striding = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	part->crawling = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+	part->cleaning = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
+#else
+	part->evicting = false;
+	part->striding = false;
+	part->crawling = false;
+	part->cleaning = false;
+#endif
+}
+
+static void
+mc_table_init_part(mm_thread_t index)
 {
 	struct mc_tpart *part = &mc_table.parts[index];
 
@@ -347,48 +799,99 @@ mc_table_init_part(mm_thread_t index, struct mm_strand *target UNUSED)
 	char *entries = ((char *) mc_table.entries_base)
 			+ mc_table_entries_size(index, mc_table.nentries_max);
 
-	part->buckets = (struct mm_stack *) buckets;
+	part->buckets = (struct mc_bucket *) buckets;
 	part->entries = (struct mc_entry *) entries;
 	part->entries_end = part->entries;
 
 	part->clock_hand = part->entries;
 
-	mm_stack_prepare(&part->free_list);
+	mc_entry_list_prepare(&part->free_list);
 
 	part->nbuckets = 0;
-	part->nbuckets = 0;
+	part->nentries = 0;
 	part->nentries_free = 0;
 	part->nentries_void = 0;
 
-	mm_memory_cache_prepare(&part->data_space, NULL);
+	if (mc_table.shm != NULL)
+		mm_memory_cache_prepare_source(&part->data_space, NULL, &mc_table.shm->source);
+	else
+		mm_memory_cache_prepare(&part->data_space, NULL);
 
 	part->volume = 0;
 
-#if ENABLE_MEMCACHE_COMBINER
-	part->combiner = mm_combiner_create(MC_COMBINER_SIZE, MC_COMBINER_HANDOFF);
-#elif ENABLE_MEMCACHE_DELEGATE
-	mm_verbose("bind partition %d to thread %d", index, mm_thread_getnumber(target->thread));
-	part->target = target;
-#elif ENABLE_MEMCACHE_LOCKING
-	part->lookup_lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
-	part->freelist_lock = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
-#endif
-
-#if ENABLE_SMP
-	part->evicting = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
-	part->striding = (mm_regular_lock_t) MM_REGULAR_LOCK_INIT;
-#else
-	part->evicting = false;
-	part->striding = false;
-#endif
+	mc_table_init_part_runtime(index);
 
 	part->stamp = index + 1;
 
 	// Allocate initial space for the table.
 	mc_table_expand(part, mc_table.nentries_increment);
-	uint32_t nbuckets = part->nentries / 2;
-	mc_table_buckets_resize(part, 0, nbuckets);
-	part->nbuckets = nbuckets;
+	mc_table_buckets_resize(part, 0, mc_table.nbuckets_min);
+	part->nbuckets = mc_table.nbuckets_min;
+}
+
+/* Take over a partition stored in shared memory by a previous process. */
+static void
+mc_table_reattach_part(mm_thread_t index)
+{
+	struct mc_tpart *part = &mc_table.parts[index];
+
+	char *buckets = ((char *) mc_table.buckets_base)
+			+ mc_table_buckets_size(index, mc_table.nbuckets_max);
+	char *entries = ((char *) mc_table.entries_base)
+			+ mc_table_entries_size(index, mc_table.nentries_max);
+	VERIFY(part->buckets == (struct mc_bucket *) buckets);
+	VERIFY(part->entries == (struct mc_entry *) entries);
+
+	mm_memory_cache_reattach(&part->data_space, &mc_table.shm->source);
+
+	mc_table_init_part_runtime(index);
+
+	// Drop the entry references and retired entries of the previous
+	// process and let the eviction policy know of the entries.
+	mc_action_reattach(part);
+
+	mm_brief("memcache reattached partition #%d: %u entries",
+		 (int) index, part->evict.nentries);
+}
+
+static void
+mc_table_start_part(mm_thread_t index, bool attached)
+{
+	if (attached)
+		mc_table_reattach_part(index);
+	else
+		mc_table_init_part(index);
+}
+
+int NONNULL(1)
+mc_table_access_lookup(const char *name)
+{
+	static const char *names[] = {
+		[MC_ACCESS_LOCKING] = "locking",
+		[MC_ACCESS_COMBINER] = "combiner",
+		[MC_ACCESS_DELEGATE] = "delegate",
+	};
+
+	for (size_t i = 0; i < sizeof names / sizeof names[0]; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int NONNULL(1)
+mc_table_storage_lookup(const char *name)
+{
+	static const char *names[] = {
+		[MC_STORAGE_HEAP] = "heap",
+		[MC_STORAGE_LOG] = "log",
+	};
+
+	for (size_t i = 0; i < sizeof names / sizeof names[0]; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+	return -1;
 }
 
 void
@@ -397,12 +900,7 @@ mc_table_start(const struct mm_memcache_config *config)
 	ENTER();
 
 	// Round the number of table partitions to a power of 2.
-	mm_thread_t nparts;
-#if ENABLE_MEMCACHE_DELEGATE
-	nparts = mm_bitset_count(&config->affinity);
-#else
-	nparts = config->nparts;
-#endif
+	mm_thread_t nparts = config->nparts;
 	ASSERT(nparts > 0);
 	uint16_t nbits = sizeof(int) * 8 - 1 - mm_clz(nparts);
 	nparts = 1 << nbits;
@@ -414,10 +912,11 @@ mc_table_start(const struct mm_memcache_config *config)
 	size_t volume = config->volume / nparts;
 	if (volume < MM_PAGE_SIZE)
 		volume = MM_PAGE_SIZE;
-	// Make a very liberal estimate that for an average table entry
-	// the combined size of key and data might be as small as 20 bytes.
-	size_t nentries_max = volume / (sizeof(struct mc_entry) + 20);
-	size_t nbuckets_max = mm_lower_pow2(nentries_max);
+	// Short keys and data might take no space beyond the minimum.
+	size_t nentries_max = volume / MC_ENTRY_SIZE_MIN;
+	size_t nbuckets_max = mm_upper_pow2(nentries_max / MC_BUCKET_LOAD);
+	if (nbuckets_max < MC_TABLE_STRIDE)
+		nbuckets_max = MC_TABLE_STRIDE;
 
 	mm_brief("memcache maximum data volume per partition: %lu",
 		 (unsigned long) volume);
@@ -430,23 +929,61 @@ mc_table_start(const struct mm_memcache_config *config)
 	if (nbuckets_max != (uint32_t) nbuckets_max)
 		mm_fatal(0, "too many buckets");
 
-	// Reserve address space for table entries.
 	size_t entries_size = mc_table_entries_size(nparts, nentries_max);
+	size_t buckets_size = mc_table_buckets_size(nparts, nbuckets_max);
 	mm_brief("memcache reserved entries for table: %ld bytes",
 		 (unsigned long) entries_size);
-	void *entries_base = mmap(NULL, entries_size, PROT_NONE,
-				  MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
-	if (entries_base == MAP_FAILED)
-		mm_fatal(errno, "mmap");
-
-	// Reserve address space for table buckets.
-	size_t buckets_size = mc_table_buckets_size(nparts, nbuckets_max);
 	mm_brief("memcache reserved buckets for table: %ld bytes",
 		 (unsigned long) buckets_size);
-	void *buckets_base = mmap(NULL, buckets_size, PROT_NONE,
-				  MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
-	if (buckets_base == MAP_FAILED)
-		mm_fatal(errno, "mmap");
+
+	struct mc_tpart *parts;
+	void *entries_base, *buckets_base;
+	bool attached = false;
+	// Compact entries address their data with offsets from the start
+	// of a single mapping, so they need it even without a file.
+	if (config->shm_path != NULL || ENABLE_MEMCACHE_COMPACT) {
+		// Map the table storage from a shared memory file.
+		struct mc_shm_layout layout;
+		memset(&layout, 0, sizeof layout);
+		layout.entry_size = sizeof(struct mc_entry);
+		layout.bucket_size = sizeof(struct mc_bucket);
+		layout.part_size = sizeof(struct mc_tpart);
+		layout.nparts = nparts;
+		layout.nentries_max = nentries_max;
+		layout.nbuckets_max = nbuckets_max;
+		layout.volume_max = volume;
+		layout.parts_size = nparts * sizeof(struct mc_tpart);
+		layout.entries_size = entries_size;
+		layout.buckets_size = buckets_size;
+		// Leave plenty of room for data fragmentation. The file is
+		// sparse so the unused room costs only address space.
+		layout.data_size = mm_round_up(4 * volume * nparts, MM_MEMORY_SPAN_ALIGNMENT)
+				   + 2 * nparts * MM_MEMORY_SPAN_ALIGNMENT;
+
+		mc_table.shm = mc_shm_open(config->shm_path, &layout, &attached);
+#if ENABLE_MEMCACHE_COMPACT
+		if (mc_table.shm->size > MC_ENTRY_SPACE_MAX)
+			mm_fatal(0, "memcache table space is too large for compact entries");
+		mc_entry_space = (char *) mc_table.shm->header;
+#endif
+		parts = mc_table.shm->parts;
+		entries_base = mc_table.shm->entries;
+		buckets_base = mc_table.shm->buckets;
+	} else {
+		// Reserve address space for table entries.
+		entries_base = mmap(NULL, entries_size, PROT_NONE,
+				    MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (entries_base == MAP_FAILED)
+			mm_fatal(errno, "mmap");
+
+		// Reserve address space for table buckets.
+		buckets_base = mmap(NULL, buckets_size, PROT_NONE,
+				    MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (buckets_base == MAP_FAILED)
+			mm_fatal(errno, "mmap");
+
+		parts = mm_memory_xcalloc(nparts, sizeof(struct mc_tpart));
+	}
 
 	// Compute the number of entries added on expansion.
 	uint32_t nentries_increment = 4 * 1024;
@@ -455,38 +992,66 @@ mc_table_start(const struct mm_memcache_config *config)
 	else if (nparts == 2)
 		nentries_increment *= 2;
 
+	// Start with enough buckets for the initial entries. This is a power
+	// of 2 so that whole strides hit the next one exactly. The table
+	// never shrinks below this.
+	uint32_t nbuckets_min = mm_lower_pow2(min(nentries_increment, (uint32_t) nentries_max) / MC_BUCKET_LOAD);
+	if (nbuckets_min < MC_TABLE_STRIDE)
+		nbuckets_min = MC_TABLE_STRIDE;
+
 	// Initialize the table.
-	mc_table.parts = mm_memory_xcalloc(nparts, sizeof(struct mc_tpart));
+	mc_table.parts = parts;
 	mc_table.nparts = nparts;
 	mc_table.part_bits = nbits;
 	mc_table.part_mask = nparts - 1;
 	mc_table.volume_max = volume;
+	mc_table.memory_max = 0;
+	mc_table.memory_overhead = 0;
+	mc_table.nbuckets_min = nbuckets_min;
 	mc_table.nbuckets_max = nbuckets_max;
 	mc_table.nentries_max = nentries_max;
 	mc_table.nentries_increment = nentries_increment;
 	mc_table.buckets_base = buckets_base;
 	mc_table.entries_base = entries_base;
 
+	// Set up the disk tier.
+	mc_table.disk_path = config->disk_path;
+	mc_table.disk_nsegments = config->disk_size / nparts / MC_DISK_SEGMENT_SIZE;
+	if (config->disk_path != NULL)
+		mm_brief("memcache disk tier: %s.*, %lu bytes", config->disk_path,
+			 (unsigned long) config->disk_size);
+
+	// Set up the key namespaces.
+	mc_table.namespace_delimiter = config->namespace_delimiter;
+	if (config->namespace_delimiter)
+		mm_brief("memcache key namespace delimiter: '%c'", config->namespace_delimiter);
+
+	// Set up the entry eviction policy.
+	mc_table.evict = mc_evict_lookup(config->eviction);
+	VERIFY(mc_table.evict != NULL);
+	mm_brief("memcache eviction policy: %s", mc_table.evict->name);
+
+	// Set up the table access method.
+	mc_table.access = mc_table_access_lookup(config->access);
+	VERIFY(mc_table.access >= 0);
+	mm_brief("memcache table access: %s", config->access);
+
+	// Set up the entry data storage method.
+	mc_table.storage = mc_table_storage_lookup(config->storage);
+	VERIFY(mc_table.storage >= 0);
+	mm_brief("memcache data storage: %s", config->storage);
+
 	// Initialize the entry expiration timer.
 	mc_table.time = 0;
 	mc_table_prepare_exp_timer();
 
+	// Track entry changes for thread replicas if there are any.
+	mc_table.replicas = (config->replicas != 0);
+
 	// Initialize the table partitions.
-#if ENABLE_MEMCACHE_DELEGATE
-	mm_thread_t part = 0;
-	mm_thread_t count = mm_bitset_size(&config->affinity);
-	mm_thread_t nthreads = mm_number_of_regular_threads();
-	for (mm_thread_t bit = 0; bit < count; bit++) {
-		if (mm_bitset_test(&config->affinity, bit)) {
-			mm_thread_t index = bit % nthreads;
-			mc_table_init_part(part++, mm_thread_ident_to_strand(index));
-		}
-	}
-#else
 	for (mm_thread_t index = 0; index < nparts; index++) {
-		mc_table_init_part(index, NULL);
+		mc_table_start_part(index, attached);
 	}
-#endif
 
 	struct mm_domain *const domain = mm_domain_selfptr();
 	MM_THREAD_LOCAL_ALLOC(domain, "mc_stat", mc_table.stat);
@@ -495,6 +1060,48 @@ mc_table_start(const struct mm_memcache_config *config)
 		memset(stat, 0, sizeof(*stat));
 	}
 
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	// Initialize the entry reclamation epoch.
+	mc_table.epoch = 1;
+	mc_table.nthreads = mm_domain_getsize(domain);
+	MM_THREAD_LOCAL_ALLOC(domain, "mc_epoch", mc_table.epoch_local);
+	for (mm_thread_t i = 0; i < mc_table.nthreads; i++) {
+		uint32_t *local = MM_THREAD_LOCAL_DEREF(i, mc_table.epoch_local);
+		*local = 0;
+	}
+#endif
+
+	// Start the expired entry crawler when everything is ready.
+	if (config->crawl_budget)
+		mm_brief("memcache expiry crawler budget: %u usec/sec", config->crawl_budget);
+	mm_memory_store(mc_table.crawl_budget, config->crawl_budget);
+
+	// Start the memory governor too.
+	mm_brief("memcache memory limit: %lu", (unsigned long) config->volume);
+	mm_memory_store(mc_table.memory_max, config->volume);
+
+	// Fill the table from a snapshot unless it is already reattached.
+	if (config->load_snapshot_path != NULL) {
+		if (attached)
+			mm_brief("memcache snapshot: skipped, the table is reattached");
+		else
+			mc_snapshot_load(config->load_snapshot_path);
+	}
+
+	// Hand the partitions over to their owner threads. The other threads
+	// are not running yet so the locks taken so far are not an issue.
+#if ENABLE_SMP
+	if (mc_table.access == MC_ACCESS_DELEGATE) {
+		mm_thread_t nthreads = mm_number_of_regular_threads();
+		for (mm_thread_t index = 0; index < nparts; index++) {
+			struct mc_tpart *part = &mc_table.parts[index];
+			part->owner = mm_thread_ident_to_context(index % nthreads);
+			part->locking = false;
+			mm_verbose("bind partition %d to thread %d", index, index % nthreads);
+		}
+	}
+#endif
+
 	LEAVE();
 }
 
@@ -503,9 +1110,28 @@ mc_table_stop(void)
 {
 	ENTER();
 
+	// Stop the expired entry crawler.
+	mm_memory_store(mc_table.crawl_budget, 0);
+
+	for (mm_thread_t p = 0; p < mc_table.nparts; p++) {
+		struct mc_tpart *part = &mc_table.parts[p];
+		mc_evict_cleanup(&part->evict);
+		mc_disk_cleanup(&part->disk);
+		if (part->combiner != NULL)
+			mm_combiner_destroy(part->combiner);
+	}
+
+	// Leave the table in the shared memory for the next process.
+	if (mc_table.shm != NULL) {
+		mc_shm_close(mc_table.shm);
+		mc_table.shm = NULL;
+		goto leave;
+	}
+
 	// Free the table entries.
 	for (mm_thread_t p = 0; p < mc_table.nparts; p++) {
 		struct mc_tpart *part = &mc_table.parts[p];
+		mc_log_cleanup(&part->log);
 		mm_memory_cache_cleanup(&part->data_space);
 	}
 
@@ -524,5 +1150,6 @@ mc_table_stop(void)
 	if (munmap(mc_table.entries_base, entries_size) < 0)
 		mm_error(errno, "munmap");
 
+leave:
 	LEAVE();
 }
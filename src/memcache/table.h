@@ -21,24 +21,61 @@
 #define MEMCACHE_TABLE_H
 
 #include "memcache/memcache.h"
+#include "memcache/disk.h"
 #include "memcache/entry.h"
+#include "memcache/evict.h"
+#include "memcache/log.h"
+#include "memcache/shm.h"
 
 #include "base/bitops.h"
+#include "base/context.h"
 #include "base/counter.h"
 #include "base/list.h"
+#include "base/lock.h"
 #include "base/event/event.h"
 #include "base/memory/cache.h"
 #include "base/thread/local.h"
+#include "base/thread/thread.h"
 
-#if ENABLE_MEMCACHE_LOCKING
-# include "base/lock.h"
+#if __SSE2__
+# include <emmintrin.h>
 #endif
 
+/* The number of entry slots in a bucket. */
+#define MC_BUCKET_SLOTS		10
+#define MC_BUCKET_SLOTS_MASK	((1u << MC_BUCKET_SLOTS) - 1)
+
+/* The average number of entries per bucket that triggers a split. */
+#define MC_BUCKET_LOAD		8
+/* The average number of entries per bucket that triggers a merge. */
+#define MC_BUCKET_LOAD_MIN	2
+
+/* The number of buckets added or removed at once. They are split or
+   merged one by one so no lookup waits for more than a single step. */
+#define MC_TABLE_STRIDE		64
+
+/* The number of replica versions per partition. */
+#define MC_TABLE_REPLICA_VERSIONS	64
+
+/* The number of key namespace flush stamps per partition. The namespaces
+   that share one are flushed together. */
+#define MC_TABLE_NAMESPACES		256
+
+/* Table access methods. */
+#define MC_ACCESS_LOCKING	0
+#define MC_ACCESS_COMBINER	1
+#define MC_ACCESS_DELEGATE	2
+
+/* Entry data storage methods. */
+#define MC_STORAGE_HEAP		0
+#define MC_STORAGE_LOG		1
+
 #define MC_STAT_LIST(_) 	\
 	_(cmd_get)		\
 	_(cmd_set)		\
 	_(cmd_touch)		\
 	_(cmd_flush)		\
+	_(cmd_flush_namespace)	\
 	_(get_hits)		\
 	_(get_misses)		\
 	_(delete_hits)		\
@@ -51,7 +88,19 @@
 	_(cas_misses)		\
 	_(cas_badval)		\
 	_(touch_hits)		\
-	_(touch_misses)
+	_(touch_misses)		\
+	_(lease_wins)		\
+	_(lease_holds)		\
+	_(lease_stale)		\
+	_(replica_hits)		\
+	_(compress_tries)	\
+	_(compress_items)	\
+	_(compress_bytes_in)	\
+	_(compress_bytes_out)	\
+	_(compress_usec)	\
+	_(decompress_items)	\
+	_(decompress_usec)	\
+	_(disk_reads)
 
 struct mc_stat
 {
@@ -60,11 +109,38 @@ struct mc_stat
 #undef MM_STAT_FIELD
 };
 
+/* A singly-linked list of entries of a single partition. */
+struct mc_entry_list
+{
+	mc_link_t head;
+};
+
+/*
+ * A hash table bucket that takes exactly one cache line. It keeps 8-bit
+ * hash tags for a few entries so that a lookup might skip non-matching
+ * entries without touching them. A zero tag stands for an empty slot.
+ * Entries that do not fit the slots go to the overflow chain.
+ */
+struct mc_bucket
+{
+	/* Hash tags of the slot entries. */
+	uint8_t tags[MC_BUCKET_SLOTS];
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	/* Sequence counter for lock-free readers, odd while modified. */
+	uint32_t version;
+#endif
+	/* Excess entries linked via their link field. */
+	struct mc_entry_list overflow;
+	/* Partition entry indexes for the slot entries. */
+	uint32_t slots[MC_BUCKET_SLOTS];
+
+} CACHE_ALIGN;
+
 /* A partition of table of memcache entries. */
 struct mc_tpart
 {
 	/* The hash table buckets. */
-	struct mm_stack *buckets;
+	struct mc_bucket *buckets;
 
 	/* The pool of all table entries. */
 	struct mc_entry *entries;
@@ -72,9 +148,17 @@ struct mc_tpart
 
 	/* Current eviction pointer. */
 	struct mc_entry *clock_hand;
+	/* Eviction policy state. */
+	struct mc_evict evict;
+
+	/* Current expiry crawler pointer and statistics. */
+	struct mc_entry *crawl_hand;
+	uint64_t crawl_runs;
+	uint64_t crawl_checked;
+	uint64_t crawl_reclaimed;
 
 	/* The list of unused entries. */
-	struct mm_stack free_list;
+	struct mc_entry_list free_list;
 
 	/* The number of buckets. */
 	uint32_t nbuckets;
@@ -85,31 +169,62 @@ struct mc_tpart
 
 	/* The memory space for key/value data. */
 	struct mm_memory_cache data_space;
+	/* The key/value data segments for the log storage. */
+	struct mc_log log;
+	/* The disk tier for long values of evicted entries. */
+	struct mc_disk disk;
 
-	/* The total data size of all entries. */
+	/* The memory taken by all the entries. */
 	size_t volume;
+	/* The memory the entries may take as set by the memory governor. */
+	size_t volume_max;
 
-#if ENABLE_MEMCACHE_COMBINER
-	struct mm_combiner *combiner;
-#elif ENABLE_MEMCACHE_DELEGATE
-	struct mm_strand *target;
-#elif ENABLE_MEMCACHE_LOCKING
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	/* Unlinked entries that might still be seen by lock-free readers
+	   and the reclamation epochs they were retired at. */
+	struct mc_entry_list limbo[2];
+	uint32_t limbo_epoch[2];
+	/* The number of entries retired so far. */
+	uint32_t nretired;
+#endif
+
+	/* The partition is protected by the locks below. */
+	bool locking;
 	mm_regular_lock_t lookup_lock;
 	mm_regular_lock_t freelist_lock;
-#endif
+	/* The only thread to access the partition for the delegate
+	   access method. */
+	struct mm_context *owner;
+	/* The combiner for the combiner access method. */
+	struct mm_combiner *combiner;
 
 #if ENABLE_SMP
 	mm_regular_lock_t evicting;
 	mm_regular_lock_t striding;
+	mm_regular_lock_t crawling;
+	mm_regular_lock_t cleaning;
 #else
 	bool evicting;
 	bool striding;
+	bool crawling;
+	bool cleaning;
 #endif
 
 	/* The last used value for CAS command. */
 	uint64_t stamp;
 	uint64_t flush_stamp;
 
+	/* The last flush stamps of key namespaces by their hash and the
+	   last of them all. The entries with older stamps in a flushed
+	   namespace are treated as flushed too. */
+	uint64_t namespace_stamp;
+	uint64_t namespace_stamps[MC_TABLE_NAMESPACES];
+
+	/* Versions of the entries with the same hash bits. They change
+	   whenever such an entry does so that thread replicas of hot
+	   entries might be checked without touching the entries. */
+	uint32_t replica_versions[MC_TABLE_REPLICA_VERSIONS] CACHE_ALIGN;
+
 } CACHE_ALIGN;
 
 /* The table of memcache entries. */
@@ -127,22 +242,61 @@ struct mc_table
 	uint32_t part_bits;
 	uint32_t part_mask;
 
-	/* The maximum number of buckets per partition. */
+	/* The minimum and maximum number of buckets per partition. */
+	uint32_t nbuckets_min;
 	uint32_t nbuckets_max;
 	/* The maximum number of entries per partition. */
 	uint32_t nentries_max;
 	/* The number of entries added on expansion. */
 	uint32_t nentries_increment;
-	/* The data size per partition that causes data eviction. */
+	/* The initial data size per partition that causes data eviction. */
 	size_t volume_max;
+	/* The memory budget shared by all the partitions. */
+	size_t memory_max;
+	/* The memory taken besides the entries as last measured. */
+	size_t memory_overhead;
+
+	/* The disk tier file path prefix if any and its size in segments
+	   per partition. */
+	const char *disk_path;
+	uint32_t disk_nsegments;
+
+	/* The key char that ends the namespace prefix, zero if none. */
+	char namespace_delimiter;
+
+	/* Entry eviction policy. */
+	const struct mc_evict_vtable *evict;
+
+	/* Table access method. */
+	int access;
+	/* Entry data storage method. */
+	int storage;
+
+	/* Expiry crawler time budget per second, in microseconds. */
+	uint32_t crawl_budget;
+
+	/* Entry changes have to be tracked for thread replicas. */
+	bool replicas;
 
 	/* Base table addresses. */
 	void *buckets_base;
 	void *entries_base;
 
+	/* Shared memory table storage if any. */
+	struct mc_shm *shm;
+
 	/* Entry expiration timer. */
 	struct mm_event_timer exp_timer;
 
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	/* Entry reclamation epoch, odd and thus never zero. */
+	mm_atomic_uint32_t epoch;
+	/* Per-thread epoch snapshots, zero outside of lock-free reads. */
+	MM_THREAD_LOCAL(uint32_t, epoch_local);
+	/* The number of threads that might do lock-free reads. */
+	mm_thread_t nthreads;
+#endif
+
 	/* Statistics. */
 	MM_THREAD_LOCAL(struct mc_stat, stat);
 };
@@ -159,6 +313,14 @@ mc_table_start(const struct mm_memcache_config *config);
 void
 mc_table_stop(void);
 
+/* Get the table access method by name, -1 if there is no such. */
+int NONNULL(1)
+mc_table_access_lookup(const char *name);
+
+/* Get the entry data storage method by name, -1 if there is no such. */
+int NONNULL(1)
+mc_table_storage_lookup(const char *name);
+
 /**********************************************************************
  * Memcache general table routines.
  **********************************************************************/
@@ -185,11 +347,230 @@ mc_table_index(struct mc_tpart *part, uint32_t hash)
 	return index;
 }
 
+static inline uint32_t * NONNULL(1)
+mc_table_replica_version(struct mc_tpart *part, uint32_t hash)
+{
+	return &part->replica_versions[(hash >> mc_table.part_bits) % MC_TABLE_REPLICA_VERSIONS];
+}
+
+/* Make thread replicas of an entry out of date. Must be called with
+   the lookup lock after the entry is changed. */
+static inline void NONNULL(1)
+mc_table_replica_invalidate(struct mc_tpart *part, uint32_t hash)
+{
+	if (mc_table.replicas) {
+		uint32_t *version = mc_table_replica_version(part, hash);
+		mm_memory_store_fence();
+		mm_memory_store(*version, *version + 1);
+	}
+}
+
+static inline struct mc_entry * NONNULL(1)
+mc_table_entry(struct mc_tpart *part, uint32_t index)
+{
+	return &part->entries[index];
+}
+
+static inline uint32_t NONNULL(1, 2)
+mc_table_entry_index(struct mc_tpart *part, struct mc_entry *entry)
+{
+	return entry - part->entries;
+}
+
+/**********************************************************************
+ * Memcache table entry lists.
+ **********************************************************************/
+
+/* Get the entry a link refers to. */
+static inline struct mc_entry * NONNULL(1)
+mc_table_link_entry(struct mc_tpart *part UNUSED, mc_link_t link)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return link ? mc_table_entry(part, link - 1) : NULL;
+#else
+	return link;
+#endif
+}
+
+/* Get a link to an entry. */
+static inline mc_link_t NONNULL(1, 2)
+mc_table_entry_link(struct mc_tpart *part UNUSED, struct mc_entry *entry)
+{
+#if ENABLE_MEMCACHE_COMPACT
+	return mc_table_entry_index(part, entry) + 1;
+#else
+	return entry;
+#endif
+}
+
+static inline void NONNULL(1)
+mc_entry_list_prepare(struct mc_entry_list *list)
+{
+	list->head = 0;
+}
+
+static inline bool NONNULL(1)
+mc_entry_list_empty(struct mc_entry_list *list)
+{
+	return mm_memory_load(list->head) == 0;
+}
+
+static inline void NONNULL(1, 2, 3)
+mc_entry_list_insert(struct mc_tpart *part, struct mc_entry_list *list, struct mc_entry *entry)
+{
+	entry->link = list->head;
+	list->head = mc_table_entry_link(part, entry);
+}
+
+static inline struct mc_entry * NONNULL(1, 2)
+mc_entry_list_remove(struct mc_tpart *part, struct mc_entry_list *list)
+{
+	struct mc_entry *entry = mc_table_link_entry(part, list->head);
+	list->head = entry->link;
+	return entry;
+}
+
+/**********************************************************************
+ * Memcache table bucket routines.
+ **********************************************************************/
+
+static inline uint8_t
+mc_bucket_tag(uint32_t hash)
+{
+	// Use the high hash bits as they are the last ones to get into
+	// the bucket index. Avoid zero as it marks an empty slot.
+	uint8_t tag = hash >> 24;
+	return tag ? tag : 1;
+}
+
+/* Get a bit mask of the slots with a given tag. */
+static inline uint32_t NONNULL(1)
+mc_bucket_match(const struct mc_bucket *bucket, uint8_t tag)
+{
+#if __SSE2__
+	__m128i tags = _mm_load_si128((const __m128i *) bucket->tags);
+	__m128i test = _mm_cmpeq_epi8(tags, _mm_set1_epi8(tag));
+	return _mm_movemask_epi8(test) & MC_BUCKET_SLOTS_MASK;
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < MC_BUCKET_SLOTS; i++) {
+		if (bucket->tags[i] == tag)
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+static inline void NONNULL(1)
+mc_bucket_prepare(struct mc_bucket *bucket)
+{
+	memset(bucket->tags, 0, sizeof bucket->tags);
+	mc_entry_list_prepare(&bucket->overflow);
+}
+
+/* Start modification of a bucket. Must be called with the lookup lock. */
+static inline void NONNULL(1)
+mc_bucket_write_begin(struct mc_bucket *bucket UNUSED)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mm_memory_store(bucket->version, bucket->version + 1);
+	mm_memory_store_fence();
+#endif
+}
+
+/* Finish modification of a bucket. Must be called with the lookup lock. */
+static inline void NONNULL(1)
+mc_bucket_write_end(struct mc_bucket *bucket UNUSED)
+{
+#if ENABLE_MEMCACHE_OPTIMISTIC
+	mm_memory_store_fence();
+	mm_memory_store(bucket->version, bucket->version + 1);
+#endif
+}
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+
+/* Start reading a bucket without locking. */
+static inline uint32_t NONNULL(1)
+mc_bucket_read_begin(struct mc_bucket *bucket)
+{
+	uint32_t version;
+	while (((version = mm_memory_load(bucket->version)) & 1) != 0)
+		mm_cpu_backoff();
+	mm_memory_load_fence();
+	return version;
+}
+
+/* Check if a bucket was modified while it was read without locking. */
+static inline bool NONNULL(1)
+mc_bucket_read_retry(struct mc_bucket *bucket, uint32_t version)
+{
+	mm_memory_load_fence();
+	return mm_memory_load(bucket->version) != version;
+}
+
+#endif
+
+/**********************************************************************
+ * Memcache table reclamation epoch.
+ **********************************************************************/
+
+#if ENABLE_MEMCACHE_OPTIMISTIC
+
+static inline uint32_t *
+mc_table_epoch_local(void)
+{
+	return MM_THREAD_LOCAL_DEREF(mm_thread_self(), mc_table.epoch_local);
+}
+
+/* Start a lock-free read. Entries seen after this are not reclaimed
+   until the matching mc_table_epoch_leave() call. */
+static inline void
+mc_table_epoch_enter(void)
+{
+	uint32_t *local = mc_table_epoch_local();
+	ASSERT(*local == 0);
+	mm_memory_store(*local, mm_memory_load(mc_table.epoch));
+	mm_memory_strict_fence();
+}
+
+/* Finish a lock-free read. */
+static inline void
+mc_table_epoch_leave(void)
+{
+	uint32_t *local = mc_table_epoch_local();
+	ASSERT(*local != 0);
+	mm_memory_fence();
+	mm_memory_store(*local, 0);
+}
+
+void
+mc_table_epoch_advance(void);
+
+#endif
+
+/**********************************************************************
+ * Memcache table locking.
+ **********************************************************************/
+
+/* Check if a partition is owned by another thread. */
+static inline bool NONNULL(1)
+mc_table_is_remote(struct mc_tpart *part)
+{
+#if ENABLE_SMP
+	return part->owner != NULL && part->owner != mm_context_selfptr();
+#else
+	(void) part;
+	return false;
+#endif
+}
+
 static inline void NONNULL(1)
 mc_table_lookup_lock(struct mc_tpart *part)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
-	mm_regular_lock(&part->lookup_lock);
+#if ENABLE_SMP
+	if (part->locking)
+		mm_regular_lock(&part->lookup_lock);
 #else
 	(void) part;
 #endif
@@ -198,8 +579,9 @@ mc_table_lookup_lock(struct mc_tpart *part)
 static inline void NONNULL(1)
 mc_table_lookup_unlock(struct mc_tpart *part)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
-	mm_regular_unlock(&part->lookup_lock);
+#if ENABLE_SMP
+	if (part->locking)
+		mm_regular_unlock(&part->lookup_lock);
 #else
 	(void) part;
 #endif
@@ -208,8 +590,9 @@ mc_table_lookup_unlock(struct mc_tpart *part)
 static inline void NONNULL(1)
 mc_table_freelist_lock(struct mc_tpart *part)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
-	mm_regular_lock(&part->freelist_lock);
+#if ENABLE_SMP
+	if (part->locking)
+		mm_regular_lock(&part->freelist_lock);
 #else
 	(void) part;
 #endif
@@ -218,8 +601,9 @@ mc_table_freelist_lock(struct mc_tpart *part)
 static inline void NONNULL(1)
 mc_table_freelist_unlock(struct mc_tpart *part)
 {
-#if ENABLE_SMP && ENABLE_MEMCACHE_LOCKING
-	mm_regular_unlock(&part->freelist_lock);
+#if ENABLE_SMP
+	if (part->locking)
+		mm_regular_unlock(&part->freelist_lock);
 #else
 	(void) part;
 #endif
@@ -237,7 +621,13 @@ mc_table_expand(struct mc_tpart *part, uint32_t n);
 void NONNULL(1)
 mc_table_reserve_volume(struct mc_tpart *part);
 
+void
+mc_table_govern(void);
+
 void NONNULL(1)
 mc_table_reserve_entries(struct mc_tpart *part);
 
+void NONNULL(1)
+mc_table_release_entries(struct mc_tpart *part);
+
 #endif /* MEMCACHE_TABLE_H */
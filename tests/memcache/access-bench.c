@@ -0,0 +1,446 @@
+#include "memcache/action.h"
+#include "memcache/table.h"
+
+#include "base/clock.h"
+#include "base/context.h"
+#include "base/runtime.h"
+#include "base/settings.h"
+#include "base/task.h"
+#include "base/fiber/fiber.h"
+#include "base/memory/alloc.h"
+#include "base/thread/thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/*
+ * Run a mix of table lookups and stores on every regular thread with
+ * uniformly random keys and report the action rate for each table access
+ * method. The runtime cannot be started twice so every method is run in
+ * a separate process. The lookups are lock-free peeks like the server
+ * does for get commands unless locked lookups are requested.
+ *
+ * With the growth option every thread instead stores new keys for the
+ * first half of its requests and deletes them for the second half so
+ * that the table grows and then shrinks all along. The latency option
+ * reports the action latency percentiles to see the effect of this.
+ *
+ * With the steering option every thread uses only the keys of the
+ * partitions bound to it with the delegate access method. This is what
+ * the server connections do after they are steered to the owner of
+ * their keys. Compare it to a run without the option for a number of
+ * threads, e.g. 8, 16 and 32, to see what steering saves.
+ */
+
+static unsigned long g_threads = 4;
+static unsigned long g_nparts = 8;
+static unsigned long g_nkeys = 100000;
+static unsigned long g_nrequests = 1000000;
+static unsigned long g_writes = 10;
+static unsigned long g_value_len = 32;
+static bool g_locked_lookups = false;
+static bool g_growth = false;
+static bool g_steering = false;
+static bool g_latency = false;
+static const char *g_access = NULL;
+
+static mm_atomic_uint32_t g_done;
+static mm_timeval_t *g_times;
+static uint32_t **g_latencies;
+
+static void NORETURN
+usage(char *prog_name, char *message)
+{
+	char *slash = strrchr(prog_name, '/');
+	if (slash != NULL && *(slash + 1))
+		prog_name = slash + 1;
+
+	if (message != NULL)
+		fprintf(stderr, "%s: %s\n", prog_name, message);
+
+	fprintf(stderr,
+		"Usage:\n\t%s"
+		" [-a <locking|combiner|delegate>]"
+		" [-t <threads>]"
+		" [-p <partitions>]"
+		" [-k <keys>]"
+		" [-n <requests-per-thread>]"
+		" [-w <write-percent>]"
+		" [-v <value-length>]"
+		" [-l]"
+		" [-g]"
+		" [-s]"
+		" [-q]\n",
+		prog_name);
+
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long
+getnum(char *prog_name, const char *s, int allow_zero)
+{
+	char *end;
+	unsigned long value = strtoul(s, &end, 0);
+	if (*end != 0)
+		usage(prog_name, "invalid value");
+	if (value == 0 && !allow_zero)
+		usage(prog_name, "invalid value");
+	return value;
+}
+
+static void
+set_params(int ac, char **av)
+{
+	int c;
+	while ((c = getopt(ac, av, ":a:t:p:k:n:w:v:lgsq")) != -1) {
+		switch (c) {
+		case 'a':
+			if (mc_table_access_lookup(optarg) < 0)
+				usage(av[0], "invalid access method");
+			g_access = optarg;
+			break;
+		case 't':
+			g_threads = getnum(av[0], optarg, 0);
+			break;
+		case 'p':
+			g_nparts = getnum(av[0], optarg, 0);
+			break;
+		case 'k':
+			g_nkeys = getnum(av[0], optarg, 0);
+			break;
+		case 'n':
+			g_nrequests = getnum(av[0], optarg, 0);
+			break;
+		case 'w':
+			g_writes = getnum(av[0], optarg, 1);
+			if (g_writes > 100)
+				usage(av[0], "invalid value");
+			break;
+		case 'v':
+			g_value_len = getnum(av[0], optarg, 1);
+			break;
+		case 'l':
+			g_locked_lookups = true;
+			break;
+		case 'g':
+			g_growth = true;
+			break;
+		case 's':
+			g_steering = true;
+			break;
+		case 'q':
+			g_latency = true;
+			break;
+		case ':':
+			usage(av[0], "missing option value");
+		default:
+			usage(av[0], "invalid option");
+		}
+	}
+
+	// Every thread needs some partitions to steer its keys to.
+	if (g_steering && g_nparts < g_threads)
+		usage(av[0], "steering needs at least as many partitions as threads");
+}
+
+/**********************************************************************
+ * Table actions.
+ **********************************************************************/
+
+static void
+bench_store(const char *key, uint16_t key_len, const char *value)
+{
+	struct mc_action_storage action;
+	mc_action_set_key(&action.base, key, key_len);
+	mc_action_create(&action, g_value_len);
+	mc_entry_setkey(action.new_entry, key);
+	mc_entry_setflags(action.new_entry, 0);
+	action.new_entry->exp_time = 0;
+	mc_entry_setvalue(action.new_entry, 0, value, g_value_len);
+	mc_action_upsert(&action);
+	mc_action_cleanup(&action.base);
+}
+
+static void
+bench_lookup(const char *key, uint16_t key_len)
+{
+	struct mc_action action;
+	mc_action_set_key(&action, key, key_len);
+	if (g_locked_lookups) {
+		mc_action_lookup(&action);
+		if (action.old_entry != NULL)
+			mc_action_finish(&action);
+	} else {
+		mc_action_peek(&action);
+		if (action.old_entry != NULL) {
+			if (action.entry_pinned)
+				mc_action_unpin(&action);
+			else
+				mc_action_finish(&action);
+		}
+	}
+	mc_action_cleanup(&action);
+}
+
+static void
+bench_delete(const char *key, uint16_t key_len)
+{
+	struct mc_action action;
+	mc_action_set_key(&action, key, key_len);
+	mc_action_delete(&action);
+	mc_action_cleanup(&action);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t
+bench_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Find the keys of the partitions that the delegate access method binds
+   to the given thread. */
+static unsigned long *
+bench_steered_keys(mm_value_t thread, unsigned long *nkeys)
+{
+	char key[32];
+	unsigned long *keys = mm_memory_xcalloc(g_nkeys, sizeof(unsigned long));
+	*nkeys = 0;
+	for (unsigned long i = 0; i < g_nkeys; i++) {
+		struct mc_action action;
+		int key_len = snprintf(key, 32, "key%lu", i);
+		mc_action_set_key(&action, key, key_len);
+		if ((unsigned long) (action.part - mc_table.parts) % g_threads == thread)
+			keys[(*nkeys)++] = i;
+	}
+	return keys;
+}
+
+/* Run a single action of the uniform mix over all the keys or over the
+   given ones. */
+static void
+bench_mixed_action(char *key, const char *value, uint64_t *state,
+		   const unsigned long *keys, unsigned long nkeys)
+{
+	uint64_t random = bench_random(state);
+	unsigned long index = (random >> 8) % nkeys;
+	if (keys != NULL)
+		index = keys[index];
+	int key_len = snprintf(key, 32, "key%lu", index);
+	if ((random & 0xff) * 100 < g_writes * 256)
+		bench_store(key, key_len, value);
+	else
+		bench_lookup(key, key_len);
+}
+
+/* Run a single action of the growth mix. The thread keys from first
+   to last are in the table. */
+static void
+bench_growth_action(char *key, const char *value, uint64_t *state,
+		    mm_value_t thread, unsigned long n,
+		    unsigned long *first, unsigned long *last)
+{
+	uint64_t random = bench_random(state);
+	int key_len;
+	if ((random & 0xff) * 100 < g_writes * 256) {
+		if (n < g_nrequests / 2) {
+			key_len = snprintf(key, 32, "g%lu-%lu", (unsigned long) thread, (*last)++);
+			bench_store(key, key_len, value);
+			return;
+		}
+		if (*first < *last) {
+			key_len = snprintf(key, 32, "g%lu-%lu", (unsigned long) thread, (*first)++);
+			bench_delete(key, key_len);
+			return;
+		}
+	}
+
+	unsigned long count = *last - *first;
+	unsigned long index = *first + (count ? (random >> 8) % count : 0);
+	key_len = snprintf(key, 32, "g%lu-%lu", (unsigned long) thread, index);
+	bench_lookup(key, key_len);
+}
+
+static mm_value_t
+bench_routine(mm_value_t arg)
+{
+	char key[32];
+	char *value = mm_memory_xalloc(g_value_len + 1);
+	memset(value, 'x', g_value_len);
+	uint32_t *latencies = g_latencies ? g_latencies[arg] : NULL;
+	unsigned long first = 0, last = 0;
+	unsigned long nkeys = g_nkeys;
+	unsigned long *keys = NULL;
+	if (g_steering)
+		keys = bench_steered_keys(arg, &nkeys);
+
+	uint64_t random = arg * 0x9e3779b97f4a7c15ull + 1;
+	mm_timeval_t start = mm_clock_gettime_monotonic();
+	for (unsigned long n = 0; n < g_nrequests; n++) {
+		uint64_t action_start = latencies ? bench_nsec() : 0;
+		if (g_growth)
+			bench_growth_action(key, value, &random, arg, n, &first, &last);
+		else
+			bench_mixed_action(key, value, &random, keys, nkeys);
+		if (latencies) {
+			uint64_t latency = bench_nsec() - action_start;
+			latencies[n] = latency < UINT32_MAX ? latency : UINT32_MAX;
+		}
+
+		// Serve the actions sent by other threads now and then as
+		// the delegate access method needs.
+		if ((n % 64) == 63)
+			mm_fiber_yield(mm_context_selfptr());
+	}
+	g_times[arg] = mm_clock_gettime_monotonic() - start;
+
+	if (keys != NULL)
+		mm_memory_free(keys);
+	mm_memory_free(value);
+	return 0;
+}
+
+static void
+bench_complete(mm_value_t arg UNUSED, mm_value_t result UNUSED)
+{
+	if (mm_atomic_uint32_fetch_and_add(&g_done, 1) + 1 == g_threads)
+		mm_stop();
+}
+
+/**********************************************************************
+ * Runtime setup.
+ **********************************************************************/
+
+static void
+bench_table_start(void)
+{
+	struct mm_memcache_config config;
+	memset(&config, 0, sizeof config);
+	config.volume = MC_TABLE_VOLUME_DEFAULT;
+	config.nparts = g_nparts;
+	config.eviction = MC_EVICTION_DEFAULT;
+	config.access = g_access;
+	config.storage = MC_STORAGE_DEFAULT;
+	mc_table_start(&config);
+}
+
+static void
+bench_thread_start(void)
+{
+	MM_TASK(bench_task, bench_routine, bench_complete, mm_task_reassign_off);
+	mm_context_add_task(mm_context_selfptr(), &bench_task, mm_thread_self());
+}
+
+static int
+bench_compare_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report_latency(void)
+{
+	size_t n = g_nrequests * g_threads;
+	uint32_t *all = mm_memory_xalloc(n * sizeof(uint32_t));
+	for (unsigned long i = 0; i < g_threads; i++) {
+		memcpy(all + i * g_nrequests, g_latencies[i], g_nrequests * sizeof(uint32_t));
+		mm_memory_free(g_latencies[i]);
+	}
+	mm_memory_free(g_latencies);
+	g_latencies = NULL;
+
+	qsort(all, n, sizeof(uint32_t), bench_compare_latency);
+	printf("%-10s latency ns: p50: %u p99: %u p99.9: %u p99.99: %u max: %u\n",
+	       g_access, all[n / 2], all[n - n / 100 - 1], all[n - n / 1000 - 1],
+	       all[n - n / 10000 - 1], all[n - 1]);
+
+	mm_memory_free(all);
+}
+
+static void
+bench_run(char *prog_name)
+{
+	char *av[] = { prog_name, NULL };
+	mm_init(1, av, 0, NULL);
+
+	char nthreads[32];
+	snprintf(nthreads, sizeof nthreads, "%lu", g_threads);
+	mm_settings_set("thread-number", nthreads, true);
+
+	g_times = mm_memory_xcalloc(g_threads, sizeof(mm_timeval_t));
+	if (g_latency) {
+		g_latencies = mm_memory_xcalloc(g_threads, sizeof(uint32_t *));
+		for (unsigned long i = 0; i < g_threads; i++)
+			g_latencies[i] = mm_memory_xcalloc(g_nrequests, sizeof(uint32_t));
+	}
+	mm_regular_start_hook_0(bench_table_start);
+	mm_regular_thread_start_hook_0(bench_thread_start);
+	mm_regular_stop_hook_0(mc_table_stop);
+
+	mm_start();
+
+	mm_timeval_t time = 0;
+	for (unsigned long i = 0; i < g_threads; i++) {
+		if (time < g_times[i])
+			time = g_times[i];
+	}
+	unsigned long nrequests = g_nrequests * g_threads;
+	printf("%-10s%s requests: %10lu time: %u.%06u rate: %10.0f/s\n",
+	       g_access, g_steering ? " steered" : "", nrequests,
+	       (unsigned) (time / 1000000), (unsigned) (time % 1000000),
+	       time ? nrequests * 1000000.0 / time : 0.0);
+
+	if (g_latency)
+		bench_report_latency();
+
+	mm_memory_free(g_times);
+}
+
+int
+main(int ac, char **av)
+{
+	set_params(ac, av);
+	if (g_access != NULL) {
+		bench_run(av[0]);
+		return EXIT_SUCCESS;
+	}
+
+	static const char *methods[] = { "locking", "combiner", "delegate" };
+	for (size_t i = 0; i < sizeof methods / sizeof methods[0]; i++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			g_access = methods[i];
+			bench_run(av[0]);
+			return EXIT_SUCCESS;
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s failed\n", methods[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+#include "memcache/entry.h"
+
+#include "base/clock.h"
+#include "base/memory/alloc.h"
+#include "base/memory/cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Measure the entry level cost of counter increments. The reallocation
+ * path does what the table did for every increment: it creates a new
+ * entry for the result and frees the old one. The in-place path reuses
+ * the room left by the previous value. Neither does the table locking
+ * and lookup which are the same for both.
+ */
+
+static unsigned long g_nops = 10000000;
+static unsigned long g_key_len = 16;
+static unsigned long g_start = 0;
+
+static void NORETURN
+usage(char *prog_name, char *message)
+{
+	char *slash = strrchr(prog_name, '/');
+	if (slash != NULL && *(slash + 1))
+		prog_name = slash + 1;
+
+	if (message != NULL)
+		fprintf(stderr, "%s: %s\n", prog_name, message);
+
+	fprintf(stderr,
+		"Usage:\n\t%s"
+		" [-n <increments>]"
+		" [-k <key-length>]"
+		" [-s <start-value>]\n",
+		prog_name);
+
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long
+getnum(char *prog_name, const char *s, int allow_zero)
+{
+	char *end;
+	unsigned long value = strtoul(s, &end, 0);
+	if (*end != 0)
+		usage(prog_name, "invalid value");
+	if (value == 0 && !allow_zero)
+		usage(prog_name, "invalid value");
+	return value;
+}
+
+static void
+set_params(int ac, char **av)
+{
+	int c;
+	while ((c = getopt(ac, av, ":n:k:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			g_nops = getnum(av[0], optarg, 0);
+			break;
+		case 'k':
+			g_key_len = getnum(av[0], optarg, 0);
+			if (g_key_len > UINT8_MAX)
+				usage(av[0], "invalid key length");
+			break;
+		case 's':
+			g_start = getnum(av[0], optarg, 1);
+			break;
+		case ':':
+			usage(av[0], "missing option value");
+		default:
+			usage(av[0], "invalid option");
+		}
+	}
+}
+
+/**********************************************************************
+ * Counter entries.
+ **********************************************************************/
+
+static struct mm_memory_cache g_cache;
+static char g_key[UINT8_MAX];
+
+static void
+create(struct mc_entry *entry)
+{
+	memset(entry, 0, sizeof *entry);
+	entry->key_len = g_key_len;
+	entry->value_len = MC_ENTRY_NUM_LEN_MAX;
+
+#if ENABLE_MEMCACHE_COMPACT
+	char *data = mm_memory_cache_alloc(&g_cache, mc_entry_data_size(entry));
+	// Compact entries address their data relative to a common base.
+	// The few blocks used here are close enough to any of them.
+	if (mc_entry_space == NULL)
+		mc_entry_space = data - MC_ENTRY_SPACE_MAX / 2;
+	mc_entry_setdata(entry, data);
+#else
+	if (mc_entry_is_inline(entry))
+		entry->data = entry->inline_data;
+	else
+		mc_entry_setdata(entry, mm_memory_cache_alloc(&g_cache, mc_entry_data_size(entry)));
+#endif
+	mc_entry_setslack(entry, 0);
+	mc_entry_setkey(entry, g_key);
+}
+
+static void
+destroy(struct mc_entry *entry)
+{
+	char *data = mc_entry_getdata(entry);
+#if !ENABLE_MEMCACHE_COMPACT
+	if (data == entry->inline_data)
+		return;
+#endif
+	mm_memory_cache_local_free(&g_cache, data);
+}
+
+static uint64_t
+bench_realloc(void)
+{
+	struct mc_entry entries[2];
+	struct mc_entry *entry = &entries[0];
+	create(entry);
+	mc_entry_setnum(entry, g_start);
+
+	for (unsigned long i = 0; i < g_nops; i++) {
+		uint64_t value;
+		if (!mc_entry_getnum(entry, &value))
+			abort();
+
+		struct mc_entry *next = entry == &entries[0] ? &entries[1] : &entries[0];
+		create(next);
+		mc_entry_setnum(next, value + 1);
+		mc_entry_setstamp(next, i);
+
+		destroy(entry);
+		entry = next;
+	}
+
+	uint64_t value = 0;
+	mc_entry_getnum(entry, &value);
+	destroy(entry);
+	return value;
+}
+
+static uint64_t
+bench_inplace(void)
+{
+	struct mc_entry entry;
+	create(&entry);
+	mc_entry_setnum(&entry, g_start);
+
+	for (unsigned long i = 0; i < g_nops; i++) {
+		uint64_t value;
+		if (!mc_entry_getnum(&entry, &value))
+			abort();
+		if (mc_entry_numlen(value + 1) > entry.value_len + mc_entry_getslack(&entry))
+			abort();
+
+		mc_entry_setnum(&entry, value + 1);
+		mc_entry_setstamp(&entry, i);
+	}
+
+	uint64_t value = 0;
+	mc_entry_getnum(&entry, &value);
+	destroy(&entry);
+	return value;
+}
+
+static void
+measure(const char *name, uint64_t (*routine)(void))
+{
+	mm_timeval_t start = mm_clock_gettime_monotonic();
+	uint64_t value = routine();
+	mm_timeval_t end = mm_clock_gettime_monotonic();
+
+	if (value != g_start + g_nops) {
+		fprintf(stderr, "%s: wrong result %llu\n", name, (unsigned long long) value);
+		exit(EXIT_FAILURE);
+	}
+
+	double usec = end - start;
+	printf("%-8s increments: %10lu time: %8.3f s rate: %8.2f Mops/s latency: %6.1f ns\n",
+	       name, g_nops, usec / 1000000, g_nops / usec, usec * 1000 / g_nops);
+}
+
+int
+main(int ac, char **av)
+{
+	set_params(ac, av);
+	if (g_start + g_nops < g_start)
+		usage(av[0], "too many increments");
+
+	mm_clock_init();
+	mm_memory_cache_prepare(&g_cache, NULL);
+	memset(g_key, 'k', sizeof g_key);
+
+	printf("entry layout: %s, key: %lu\n",
+	       ENABLE_MEMCACHE_COMPACT ? "compact" : "regular", g_key_len);
+
+	measure("realloc", bench_realloc);
+	measure("inplace", bench_inplace);
+
+	mm_memory_cache_cleanup(&g_cache);
+	return EXIT_SUCCESS;
+}
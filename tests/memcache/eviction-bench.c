@@ -0,0 +1,272 @@
+#include "memcache/evict.h"
+
+#include "base/hash.h"
+#include "base/memory/alloc.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Replay a key access trace against each eviction policy and report the
+ * hit ratio. The cache is simulated with a fixed number of entries that
+ * the policy hand sweeps like the memcache table does. A missed key is
+ * inserted right away like a client would do after a failed get.
+ *
+ * Without a trace file the trace is generated: Zipf-distributed accesses
+ * to a set of hot keys interleaved with periodic scans of cold keys that
+ * are never accessed again.
+ */
+
+static unsigned long g_capacity = 10000;
+static unsigned long g_nkeys = 100000;
+static unsigned long g_nrequests = 2000000;
+static unsigned long g_skew = 90;
+static unsigned long g_scan_length = 20000;
+static unsigned long g_scan_period = 200000;
+static const char *g_trace_file = NULL;
+
+static uint32_t *g_trace;
+static size_t g_trace_size;
+static uint32_t g_key_max;
+
+static void NORETURN
+usage(char *prog_name, char *message)
+{
+	char *slash = strrchr(prog_name, '/');
+	if (slash != NULL && *(slash + 1))
+		prog_name = slash + 1;
+
+	if (message != NULL)
+		fprintf(stderr, "%s: %s\n", prog_name, message);
+
+	fprintf(stderr,
+		"Usage:\n\t%s"
+		" [-c <capacity>]"
+		" [-k <hot-keys>]"
+		" [-n <requests>]"
+		" [-s <zipf-skew-percent>]"
+		" [-l <scan-length>]"
+		" [-p <scan-period>]"
+		" [-f <trace-file>]\n",
+		prog_name);
+
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long
+getnum(char *prog_name, const char *s, int allow_zero)
+{
+	char *end;
+	unsigned long value = strtoul(s, &end, 0);
+	if (*end != 0)
+		usage(prog_name, "invalid value");
+	if (value == 0 && !allow_zero)
+		usage(prog_name, "invalid value");
+	return value;
+}
+
+static void
+set_params(int ac, char **av)
+{
+	int c;
+	while ((c = getopt(ac, av, ":c:k:n:s:l:p:f:")) != -1) {
+		switch (c) {
+		case 'c':
+			g_capacity = getnum(av[0], optarg, 0);
+			break;
+		case 'k':
+			g_nkeys = getnum(av[0], optarg, 0);
+			break;
+		case 'n':
+			g_nrequests = getnum(av[0], optarg, 0);
+			break;
+		case 's':
+			g_skew = getnum(av[0], optarg, 1);
+			break;
+		case 'l':
+			g_scan_length = getnum(av[0], optarg, 1);
+			break;
+		case 'p':
+			g_scan_period = getnum(av[0], optarg, 0);
+			break;
+		case 'f':
+			g_trace_file = optarg;
+			break;
+		case ':':
+			usage(av[0], "missing option value");
+		default:
+			usage(av[0], "invalid option");
+		}
+	}
+}
+
+/**********************************************************************
+ * Trace preparation.
+ **********************************************************************/
+
+static uint64_t g_random = 0x2545f4914f6cdd1dull;
+
+static double
+random_double(void)
+{
+	g_random ^= g_random << 13;
+	g_random ^= g_random >> 7;
+	g_random ^= g_random << 17;
+	return (g_random >> 11) * (1.0 / (1ull << 53));
+}
+
+static void
+trace_append(uint32_t key)
+{
+	static size_t trace_max = 0;
+	if (g_trace_size == trace_max) {
+		trace_max = trace_max ? trace_max * 2 : 1024 * 1024;
+		g_trace = mm_memory_xrealloc(g_trace, trace_max * sizeof(uint32_t));
+	}
+	g_trace[g_trace_size++] = key;
+	if (g_key_max < key)
+		g_key_max = key;
+}
+
+static void
+trace_generate(void)
+{
+	// Build the Zipf distribution function.
+	double *cdf = mm_memory_xalloc(g_nkeys * sizeof(double));
+	double sum = 0;
+	for (unsigned long i = 0; i < g_nkeys; i++) {
+		sum += 1.0 / pow(i + 1, g_skew / 100.0);
+		cdf[i] = sum;
+	}
+
+	uint32_t scan_key = g_nkeys;
+	for (unsigned long n = 0; n < g_nrequests; n++) {
+		if (g_scan_length && n && (n % g_scan_period) == 0) {
+			for (unsigned long i = 0; i < g_scan_length; i++)
+				trace_append(scan_key++);
+		}
+
+		double x = random_double() * sum;
+		unsigned long lo = 0, hi = g_nkeys - 1;
+		while (lo < hi) {
+			unsigned long mid = (lo + hi) / 2;
+			if (cdf[mid] < x)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		trace_append(lo);
+	}
+
+	mm_memory_free(cdf);
+}
+
+static void
+trace_load(const char *name)
+{
+	FILE *file = fopen(name, "r");
+	if (file == NULL) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	// Each line holds a single numeric key.
+	unsigned long key;
+	while (fscanf(file, "%lu", &key) == 1)
+		trace_append(key);
+
+	fclose(file);
+}
+
+/**********************************************************************
+ * Cache simulation.
+ **********************************************************************/
+
+static void
+simulate(const struct mc_evict_vtable *vtable)
+{
+	struct mc_entry *entries = mm_memory_xcalloc(g_capacity, sizeof(struct mc_entry));
+	uint32_t *keys = mm_memory_xcalloc(g_capacity, sizeof(uint32_t));
+	uint32_t *where = mm_memory_xcalloc(g_key_max + 1, sizeof(uint32_t));
+	size_t nused = 0, hand = 0;
+
+#if ENABLE_MEMCACHE_COMPACT
+	// Compact entries keep the policy segment in their data blocks.
+	char *space = mm_memory_xcalloc(g_capacity + 1, sizeof(struct mc_entry_extra));
+	mc_entry_space = space;
+	for (size_t i = 0; i < g_capacity; i++)
+		mc_entry_setdata(&entries[i], space + (i + 1) * sizeof(struct mc_entry_extra));
+#endif
+
+	struct mc_evict evict;
+	mc_evict_prepare(&evict, vtable, g_capacity);
+
+	size_t hits = 0;
+	for (size_t n = 0; n < g_trace_size; n++) {
+		uint32_t key = g_trace[n];
+		uint32_t hash = mm_hash_murmur3_32(&key, sizeof key);
+		mc_evict_record(&evict, hash);
+
+		if (where[key]) {
+			struct mc_entry *entry = &entries[where[key] - 1];
+			if (entry->state < MC_ENTRY_USED_MAX)
+				entry->state++;
+			hits++;
+			continue;
+		}
+
+		struct mc_entry *entry;
+		if (nused < g_capacity) {
+			entry = &entries[nused++];
+		} else {
+			struct mc_entry *victim = NULL;
+			while (victim == NULL) {
+				if (hand == g_capacity)
+					hand = 0;
+				victim = mc_evict_visit(&evict, &entries[hand++]);
+			}
+			mc_evict_remove(&evict, victim);
+			where[keys[victim - entries]] = 0;
+			entry = victim;
+		}
+
+		entry->hash = hash;
+		keys[entry - entries] = key;
+		entry->state = MC_ENTRY_USED_MIN;
+		mc_evict_insert(&evict, entry, NULL);
+		where[key] = entry - entries + 1;
+	}
+
+	printf("%-10s hits: %10zu requests: %10zu hit ratio: %6.2f%%\n",
+	       vtable->name, hits, g_trace_size, 100.0 * hits / g_trace_size);
+
+	mc_evict_cleanup(&evict);
+#if ENABLE_MEMCACHE_COMPACT
+	mm_memory_free(space);
+#endif
+	mm_memory_free(where);
+	mm_memory_free(keys);
+	mm_memory_free(entries);
+}
+
+int
+main(int ac, char **av)
+{
+	set_params(ac, av);
+
+	if (g_trace_file != NULL)
+		trace_load(g_trace_file);
+	else
+		trace_generate();
+	if (g_trace_size == 0)
+		usage(av[0], "empty trace");
+
+	simulate(&mc_evict_clock);
+	simulate(&mc_evict_slru);
+	simulate(&mc_evict_tinylfu);
+
+	return EXIT_SUCCESS;
+}
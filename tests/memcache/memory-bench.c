@@ -0,0 +1,163 @@
+#include "memcache/table.h"
+
+#include "base/memory/alloc.h"
+#include "base/memory/cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Report the memory taken by a table item besides its key and value for
+ * the entry layout the memcache library is built with. The item data is
+ * allocated the same way the table does it. The bucket share is given
+ * for a table at the load that triggers a bucket split.
+ *
+ * The default run also checks that the items with data too long to be
+ * kept inline take no more than a cache line for their entry, that is
+ * the inline space does not make such items much bigger.
+ */
+
+static unsigned long g_nitems = 100000;
+static unsigned long g_key_len = 0;
+static unsigned long g_value_len = 0;
+
+static void NORETURN
+usage(char *prog_name, char *message)
+{
+	char *slash = strrchr(prog_name, '/');
+	if (slash != NULL && *(slash + 1))
+		prog_name = slash + 1;
+
+	if (message != NULL)
+		fprintf(stderr, "%s: %s\n", prog_name, message);
+
+	fprintf(stderr,
+		"Usage:\n\t%s"
+		" [-n <items>]"
+		" [-k <key-length>]"
+		" [-v <value-length>]\n",
+		prog_name);
+
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long
+getnum(char *prog_name, const char *s, int allow_zero)
+{
+	char *end;
+	unsigned long value = strtoul(s, &end, 0);
+	if (*end != 0)
+		usage(prog_name, "invalid value");
+	if (value == 0 && !allow_zero)
+		usage(prog_name, "invalid value");
+	return value;
+}
+
+static void
+set_params(int ac, char **av)
+{
+	int c;
+	while ((c = getopt(ac, av, ":n:k:v:")) != -1) {
+		switch (c) {
+		case 'n':
+			g_nitems = getnum(av[0], optarg, 0);
+			break;
+		case 'k':
+			g_key_len = getnum(av[0], optarg, 0);
+			if (g_key_len > UINT8_MAX)
+				usage(av[0], "invalid key length");
+			break;
+		case 'v':
+			g_value_len = getnum(av[0], optarg, 1);
+			break;
+		case ':':
+			usage(av[0], "missing option value");
+		default:
+			usage(av[0], "invalid option");
+		}
+	}
+}
+
+/**********************************************************************
+ * Item memory measurement.
+ **********************************************************************/
+
+/* Measure the item footprint. Return false if the item is not inline
+   and its entry takes more than a cache line. */
+static bool
+measure(uint32_t key_len, uint32_t value_len)
+{
+	struct mc_entry entry;
+	memset(&entry, 0, sizeof entry);
+	entry.key_len = key_len;
+	entry.value_len = value_len;
+
+	struct mm_memory_cache cache;
+	mm_memory_cache_prepare(&cache, NULL);
+
+	// Allocate the data of all the items at once like a full table has.
+	char **blocks = mm_memory_xcalloc(g_nitems, sizeof(char *));
+	size_t data = 0;
+	for (size_t i = 0; i < g_nitems; i++) {
+		if (mc_entry_is_inline(&entry))
+			continue;
+		blocks[i] = mm_memory_cache_alloc(&cache, mc_entry_data_size(&entry));
+		data += mm_memory_cache_chunk_size(blocks[i]);
+		if (mc_entry_is_chunked(&entry)) {
+			for (uint32_t c = 0; c < mc_entry_nchunks(&entry); c++) {
+				size_t size = mc_entry_chunk_size(&entry, c);
+				char *chunk = mm_memory_cache_alloc(&cache, size);
+				data += mm_memory_cache_chunk_size(chunk);
+				mm_memory_cache_local_free(&cache, chunk);
+			}
+		}
+	}
+	for (size_t i = 0; i < g_nitems; i++) {
+		if (blocks[i] != NULL)
+			mm_memory_cache_local_free(&cache, blocks[i]);
+	}
+	mm_memory_free(blocks);
+	mm_memory_cache_cleanup(&cache);
+
+	double entry_size = sizeof(struct mc_entry);
+	double bucket_size = (double) sizeof(struct mc_bucket) / MC_BUCKET_LOAD;
+	double data_size = (double) data / g_nitems;
+	double total = entry_size + bucket_size + data_size;
+	printf("key: %4u value: %7u entry: %4.0f bucket: %4.1f data: %9.1f total: %9.1f overhead: %6.1f\n",
+	       key_len, value_len, entry_size, bucket_size, data_size, total,
+	       total - key_len - value_len);
+
+	return mc_entry_is_inline(&entry) || sizeof(struct mc_entry) <= MM_CACHELINE;
+}
+
+int
+main(int ac, char **av)
+{
+	set_params(ac, av);
+
+	printf("entry layout: %s, %zu bytes\n",
+	       ENABLE_MEMCACHE_COMPACT ? "compact" : "regular",
+	       sizeof(struct mc_entry));
+
+	if (g_key_len != 0) {
+		measure(g_key_len, g_value_len);
+		return EXIT_SUCCESS;
+	}
+
+	static const uint32_t sizes[][2] = {
+		{ 8, 0 }, { 8, 8 }, { 16, 16 }, { 20, 50 },
+		{ 32, 100 }, { 40, 300 }, { 64, 1000 }, { 100, 20000 },
+	};
+	bool passed = true;
+	for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		if (!measure(sizes[i][0], sizes[i][1])) {
+			fprintf(stderr, "key: %u value: %u is not inline but its entry takes %zu bytes\n",
+				sizes[i][0], sizes[i][1], sizeof(struct mc_entry));
+			passed = false;
+		}
+	}
+
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,195 @@
+#include "memcache/memcache.h"
+#include "memcache/table.h"
+
+#include "base/runtime.h"
+#include "base/settings.h"
+#include "base/memory/span.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * Start the server with a memory limit and keep storing values
+ * of mixed sizes so that the same keys move between size classes and
+ * fragment the entry data space. Then check that the memory the table
+ * really takes stays within the limit.
+ */
+
+#define TEST_PORT	11612
+#define TEST_MEMORY	(128 * 1024 * 1024)
+
+/* The number of distinct keys, their values take several times the
+   memory limit. */
+#define TEST_NKEYS	32768
+/* The number of passes over all the keys. */
+#define TEST_NPASSES	6
+
+static int fail = 0;
+
+static int
+client_connect(void)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// Wait for the server to start listening.
+	for (int i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			break;
+		if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0) {
+			struct timeval tv = { 5, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+			return fd;
+		}
+		close(fd);
+		usleep(50000);
+	}
+	return -1;
+}
+
+static int
+send_all(int fd, const char *data, size_t size)
+{
+	while (size) {
+		ssize_t n = write(fd, data, size);
+		if (n <= 0)
+			return -1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Wait for the reply of the mn command that ends a batch of quiet
+   commands. */
+static int
+sync_reply(int fd)
+{
+	char buffer[64];
+	size_t received = 0;
+	while (received < 4) {
+		ssize_t n = read(fd, buffer + received, 4 - received);
+		if (n <= 0)
+			return -1;
+		received += n;
+	}
+	return memcmp(buffer, "MN\r\n", 4) == 0 ? 0 : -1;
+}
+
+/* The memory taken by the spans of all the thread caches including the
+   entry data and by the table arrays. */
+static size_t
+footprint(void)
+{
+	size_t size = mm_memory_span_footprint();
+	for (mm_thread_t i = 0; i < mc_table.nparts; i++) {
+		struct mc_tpart *part = &mc_table.parts[i];
+		size += mm_memory_load(part->nentries) * sizeof(struct mc_entry);
+		size += mm_memory_load(part->nbuckets) * sizeof(struct mc_bucket);
+	}
+	return size;
+}
+
+static void *
+client_routine(void *arg)
+{
+	(void) arg;
+
+	int fd = client_connect();
+	if (fd < 0) {
+		fail = 1;
+		fprintf(stderr, "failed to connect\n");
+		mm_stop();
+		return NULL;
+	}
+
+	static const uint32_t sizes[] = { 40, 700, 3000, 9000, 30000 };
+	const uint32_t nsizes = sizeof sizes / sizeof sizes[0];
+	char *value = calloc(1, 30000 + 2);
+	memset(value, 'v', 30000);
+
+	size_t peak = 0;
+	for (uint32_t pass = 0; pass < TEST_NPASSES && !fail; pass++) {
+		for (uint32_t i = 0; i < TEST_NKEYS; i++) {
+			uint32_t size = sizes[(i * 7 + pass) % nsizes];
+			char line[64];
+			int len = snprintf(line, sizeof line, "ms key%u %u q\r\n", i, size);
+			memcpy(value + size, "\r\n", 2);
+			if (send_all(fd, line, len) < 0 || send_all(fd, value, size + 2) < 0) {
+				fail = 1;
+				fprintf(stderr, "failed to send the request\n");
+				break;
+			}
+			memset(value + size, 'v', 2);
+
+			// Let the replies of failed commands be seen.
+			if ((i % 256) == 255) {
+				if (send_all(fd, "mn\r\n", 4) < 0 || sync_reply(fd) < 0) {
+					fail = 1;
+					fprintf(stderr, "unexpected reply\n");
+					break;
+				}
+			}
+		}
+
+		// Let the memory governor see the traffic.
+		usleep(250000);
+		size_t size = footprint();
+		if (peak < size)
+			peak = size;
+	}
+
+	// The governor sees a new data span only after it is taken and the
+	// network buffers are not limited at all so allow a little slack.
+	size_t limit = TEST_MEMORY + TEST_MEMORY / 8;
+	printf("memory footprint: peak %zu, limit %zu, overhead %zu\n",
+	       peak, (size_t) TEST_MEMORY, (size_t) mm_memory_load(mc_table.memory_overhead));
+	if (peak > limit) {
+		fail = 1;
+		fprintf(stderr, "memory footprint %zu is over the limit %zu\n", peak, limit);
+	}
+
+	free(value);
+	close(fd);
+	mm_stop();
+	return NULL;
+}
+
+int
+main(int ac, char **av)
+{
+	(void) ac;
+
+	char *args[] = { av[0], NULL };
+	mm_init(1, args, 0, NULL);
+	mm_settings_set("thread-number", "2", true);
+
+	struct mm_memcache_config config;
+	memset(&config, 0, sizeof config);
+	config.port = TEST_PORT;
+	config.volume = TEST_MEMORY;
+	config.nparts = 2;
+	mm_memcache_init(&config);
+
+	pthread_t client;
+	if (pthread_create(&client, NULL, client_routine, NULL) != 0) {
+		perror("pthread_create");
+		return EXIT_FAILURE;
+	}
+
+	mm_start();
+
+	pthread_join(client, NULL);
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include "memcache/memcache.h"
+
+#include "base/runtime.h"
+#include "base/settings.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * Start the server and feed it with pipelined meta commands to check
+ * that rejected commands do not let their data be taken for commands
+ * and that refill leases are handed out to a single client. Also check
+ * that commands split across reads are recognized.
+ */
+
+#define TEST_PORT	11611
+
+static int fail = 0;
+
+static int
+client_connect(void)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// Wait for the server to start listening.
+	for (int i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			break;
+		if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0) {
+			struct timeval tv = { 5, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+			return fd;
+		}
+		close(fd);
+		usleep(50000);
+	}
+	return -1;
+}
+
+/* Send the request in one or more pieces and check the reply. */
+static void
+roundtrip(int fd, const char *title, const char *request, size_t split, const char *reply)
+{
+	size_t size = strlen(request);
+	if (split == 0 || split > size)
+		split = size;
+	if (write(fd, request, split) != (ssize_t) split
+	    || (usleep(100000), write(fd, request + split, size - split) != (ssize_t) (size - split))) {
+		fail = 1;
+		fprintf(stderr, "%s: failed to send the request\n", title);
+		return;
+	}
+
+	char buffer[1024];
+	size_t expected = strlen(reply), received = 0;
+	while (received < expected) {
+		ssize_t n = read(fd, buffer + received, expected - received);
+		if (n <= 0)
+			break;
+		received += n;
+	}
+	if (received != expected || memcmp(buffer, reply, expected) != 0) {
+		fail = 1;
+		fprintf(stderr, "%s: unexpected reply: '%.*s'\n", title, (int) received, buffer);
+	}
+}
+
+static void *
+client_routine(void *arg)
+{
+	(void) arg;
+
+	int fd = client_connect();
+	if (fd < 0) {
+		fail = 1;
+		fprintf(stderr, "failed to connect\n");
+		mm_stop();
+		return NULL;
+	}
+
+	printf("ignored flags\n");
+	roundtrip(fd, "ms with ignored flags",
+		  "ms k 9 I S9\r\nflush_all\r\nmg k v\r\n", 0,
+		  "HD\r\nVA 9\r\nflush_all\r\n");
+	roundtrip(fd, "mg with ignored flags",
+		  "mg k v E1 u\r\n", 0,
+		  "VA 9\r\nflush_all\r\n");
+
+	printf("rejected commands\n");
+	roundtrip(fd, "bad ms flag",
+		  "ms k 9 X\r\nflush_all\r\nmg k v\r\n", 0,
+		  "CLIENT_ERROR bad command line format\r\nVA 9\r\nflush_all\r\n");
+	roundtrip(fd, "bad ms flag with split data",
+		  "ms k 9 X\r\nflush_all\r\nmn\r\n", 14,
+		  "CLIENT_ERROR bad command line format\r\nMN\r\n");
+	roundtrip(fd, "bad ms flag after ignored ones",
+		  "ms k 9 E1 T0 Z\r\nflush_all\r\nmn\r\n", 0,
+		  "CLIENT_ERROR bad command line format\r\nMN\r\n");
+	roundtrip(fd, "bad mg flag",
+		  "mg k X\r\nmn\r\n", 0,
+		  "CLIENT_ERROR bad command line format\r\nMN\r\n");
+	roundtrip(fd, "base64 key",
+		  "ms aw== 1 b\r\nx\r\nmg aw== v b\r\nmg aw== v\r\nmg k v\r\n", 0,
+		  "CLIENT_ERROR bad command line format\r\nCLIENT_ERROR bad command line format\r\n"
+		  "EN\r\nVA 9\r\nflush_all\r\n");
+	char request[512];
+	memset(request, 'k', sizeof request);
+	memcpy(request, "ms ", 3);
+	strcpy(request + 300, " 9\r\nflush_all\r\nmn\r\n");
+	roundtrip(fd, "too long ms key", request, 0,
+		  "CLIENT_ERROR bad command line format\r\nMN\r\n");
+	roundtrip(fd, "bad ms data chunk",
+		  "ms k 3\r\nflush_all\r\nmg k v\r\n", 0,
+		  "CLIENT_ERROR bad data chunk\r\nERROR\r\nVA 9\r\nflush_all\r\n");
+
+	printf("leases\n");
+	int fd2 = client_connect();
+	if (fd2 < 0) {
+		fail = 1;
+		fprintf(stderr, "failed to connect the second client\n");
+	} else {
+		roundtrip(fd, "first miss wins the lease",
+			  "mg a v N30\r\n", 0,
+			  "VA 0 W\r\n\r\n");
+		roundtrip(fd2, "second client holds on",
+			  "mg a v N30\r\n", 0,
+			  "VA 0 Z\r\n\r\n");
+		roundtrip(fd, "lease winner fills the entry",
+			  "ms a 1\r\nx\r\n", 0,
+			  "HD\r\n");
+		roundtrip(fd2, "filled entry has no lease",
+			  "mg a v N30\r\n", 0,
+			  "VA 1\r\nx\r\n");
+		roundtrip(fd, "invalidate",
+			  "md a I\r\n", 0,
+			  "HD\r\n");
+		roundtrip(fd, "stale entry wins the lease",
+			  "mg a v\r\n", 0,
+			  "VA 1 W X\r\nx\r\n");
+		roundtrip(fd2, "stale entry for the second client",
+			  "mg a v\r\n", 0,
+			  "VA 1 X Z\r\nx\r\n");
+		close(fd2);
+	}
+
+	printf("pipelined leases\n");
+	roundtrip(fd, "pipelined first miss before a store",
+		  "mg p v N30\r\nms p 1\r\ny\r\nmg p v\r\n", 0,
+		  "VA 0 W\r\n\r\nHD\r\nVA 1\r\ny\r\n");
+	roundtrip(fd, "pipelined first and second miss",
+		  "mg q v N30\r\nmg q v N30\r\n", 0,
+		  "VA 0 W\r\n\r\nVA 0 Z\r\n\r\n");
+	roundtrip(fd, "pipelined invalidate",
+		  "ms r 1\r\nz\r\nmd r I\r\nmg r v\r\nmg r v\r\n", 0,
+		  "HD\r\nHD\r\nVA 1 W X\r\nz\r\nVA 1 X Z\r\nz\r\n");
+
+	printf("split flush commands\n");
+	roundtrip(fd, "flush_namespace split in the name",
+		  "ms n:a 1\r\n1\r\nms m:a 1\r\n2\r\nflush_namespace n\r\nmg n:a v\r\nmg m:a v\r\n", 31,
+		  "HD\r\nHD\r\nOK\r\nEN\r\nVA 1\r\n2\r\n");
+	roundtrip(fd, "flush_namespace split after the underscore",
+		  "ms n:b 1\r\n1\r\nflush_namespace n\r\nmg n:b v\r\nmg m:a v\r\n", 19,
+		  "HD\r\nOK\r\nEN\r\nVA 1\r\n2\r\n");
+	roundtrip(fd, "flush_all split after the underscore",
+		  "flush_all\r\nmg m:a v\r\n", 6,
+		  "OK\r\nEN\r\n");
+
+	close(fd);
+	mm_stop();
+	return NULL;
+}
+
+int
+main(int ac, char **av)
+{
+	(void) ac;
+
+	char *args[] = { av[0], NULL };
+	mm_init(1, args, 0, NULL);
+	mm_settings_set("thread-number", "2", true);
+
+	struct mm_memcache_config config;
+	memset(&config, 0, sizeof config);
+	config.port = TEST_PORT;
+	config.volume = 8 * 1024 * 1024;
+	config.nparts = 2;
+	config.namespace_delimiter = ':';
+	mm_memcache_init(&config);
+
+	pthread_t client;
+	if (pthread_create(&client, NULL, client_routine, NULL) != 0) {
+		perror("pthread_create");
+		return EXIT_FAILURE;
+	}
+
+	mm_start();
+
+	pthread_join(client, NULL);
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base/compress.h"
+
+static int fail = 0;
+
+static struct mm_compress_table table;
+
+/* Compress and decompress the data and check that it survives. Returns
+   the compressed size. */
+size_t
+roundtrip(const char *title, const char *data, size_t size)
+{
+	size_t bound = mm_compress_bound(size);
+	char *packed = malloc(bound);
+	char *unpacked = malloc(size + 1);
+
+	size_t packed_size = mm_compress(packed, bound, data, size, &table);
+	if (packed_size == 0) {
+		fail = 1;
+		fprintf(stderr, "%s: failed to compress %zu bytes\n", title, size);
+	} else if (!mm_decompress(unpacked, size, packed, packed_size)) {
+		fail = 1;
+		fprintf(stderr, "%s: failed to decompress %zu bytes\n", title, packed_size);
+	} else if (memcmp(data, unpacked, size) != 0) {
+		fail = 1;
+		fprintf(stderr, "%s: data mismatch\n", title);
+	}
+
+	// A wrong size is not accepted.
+	if (packed_size != 0 && mm_decompress(unpacked, size + 1, packed, packed_size)) {
+		fail = 1;
+		fprintf(stderr, "%s: decompressed to a wrong size\n", title);
+	}
+
+	free(packed);
+	free(unpacked);
+	return packed_size;
+}
+
+void
+test_trivial(void)
+{
+	printf("trivial case\n");
+
+	roundtrip("empty", "", 0);
+	roundtrip("single byte", "x", 1);
+	roundtrip("short", "abcabcabcabc", 12);
+}
+
+void
+test_repeat(void)
+{
+	printf("repeat case\n");
+
+	size_t size = 100000;
+	char *data = malloc(size);
+	memset(data, 'a', size);
+	size_t packed_size = roundtrip("same byte", data, size);
+	if (packed_size > size / 100) {
+		fail = 1;
+		fprintf(stderr, "same byte: poor compression: %zu bytes\n", packed_size);
+	}
+
+	for (size_t i = 0; i < size; i++)
+		data[i] = "{\"key\": \"value\", \"id\": 12345}"[i % 31];
+	packed_size = roundtrip("text", data, size);
+	if (packed_size > size / 10) {
+		fail = 1;
+		fprintf(stderr, "text: poor compression: %zu bytes\n", packed_size);
+	}
+
+	free(data);
+}
+
+void
+test_random(void)
+{
+	printf("random case\n");
+
+	size_t size = 100000;
+	char *data = malloc(size);
+	uint32_t x = 1;
+	for (size_t i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = x;
+	}
+	roundtrip("random", data, size);
+
+	// Random data does not fit a smaller room.
+	char *packed = malloc(size);
+	if (mm_compress(packed, size - size / 8, data, size, &table) != 0) {
+		fail = 1;
+		fprintf(stderr, "random: compressed into a small room\n");
+	}
+
+	free(packed);
+	free(data);
+}
+
+void
+test_corrupt(void)
+{
+	printf("corrupt case\n");
+
+	char data[1000];
+	for (size_t i = 0; i < sizeof data; i++)
+		data[i] = "abcdefgh"[i % 8] + (i / 100);
+	char packed[2000];
+	size_t packed_size = mm_compress(packed, sizeof packed, data, sizeof data, &table);
+
+	// Any truncation of the compressed data must be caught.
+	char unpacked[1000];
+	for (size_t n = 0; n < packed_size; n++) {
+		if (mm_decompress(unpacked, sizeof unpacked, packed, n)) {
+			fail = 1;
+			fprintf(stderr, "truncated to %zu bytes: decompressed\n", n);
+		}
+	}
+}
+
+int
+main()
+{
+	test_trivial();
+	test_repeat();
+	test_random();
+	test_corrupt();
+
+	printf("finished\n");
+
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
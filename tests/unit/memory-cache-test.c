@@ -75,6 +75,92 @@ test_alloc_2(const char *title, const size_t size)
 	mm_memory_cache_cleanup(&cache);
 }
 
+void
+test_round_size(const char *title)
+{
+	printf("%s\n", title);
+
+	struct mm_memory_cache cache;
+	mm_memory_cache_prepare(&cache, NULL);
+
+	static const size_t sizes[] = { 1, 8, 9, 100, 1000, 5000, 70000, 1000000, 3000000 };
+	for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		void *data = allocate(&cache, sizes[i]);
+		size_t size = mm_memory_cache_chunk_size(data);
+		if (size != mm_memory_cache_round_size(sizes[i])) {
+			fail = 1;
+			fprintf(stderr, "wrong rounded size for %zu: %zu vs %zu\n",
+				sizes[i], mm_memory_cache_round_size(sizes[i]), size);
+		}
+		mm_memory_cache_local_free(&cache, data);
+	}
+
+	mm_memory_cache_cleanup(&cache);
+}
+
+void
+test_footprint(const char *title)
+{
+	printf("%s\n", title);
+
+	struct mm_memory_cache cache;
+	mm_memory_cache_prepare(&cache, NULL);
+
+	size_t footprint = mm_memory_cache_footprint(&cache);
+	void *data = allocate(&cache, 8 * 1024 * 1024);
+	if (mm_memory_cache_footprint(&cache) < footprint + 8 * 1024 * 1024) {
+		fail = 1;
+		fprintf(stderr, "huge chunk is not counted\n");
+	}
+	mm_memory_cache_local_free(&cache, data);
+	if (mm_memory_cache_footprint(&cache) != footprint) {
+		fail = 1;
+		fprintf(stderr, "huge chunk is not discounted\n");
+	}
+
+	mm_memory_cache_cleanup(&cache);
+}
+
+void
+test_mixed_reuse(const char *title)
+{
+	printf("%s\n", title);
+
+	struct mm_memory_cache cache;
+	mm_memory_cache_prepare(&cache, NULL);
+
+	// Keep replacing random chunks of mixed sizes. The chunks freed in
+	// inactive spans must be used again so the footprint levels off.
+	static const size_t sizes[] = { 40, 700, 3000, 9000, 14000 };
+	const size_t nsizes = sizeof sizes / sizeof sizes[0];
+	const size_t count = 4096;
+	void **data = calloc(count, sizeof(void *));
+	unsigned int seed = 1;
+	size_t footprint = 0;
+	for (size_t round = 0; round < 20; round++) {
+		for (size_t i = 0; i < count; i++) {
+			size_t k = rand_r(&seed) % count;
+			if (data[k] != NULL)
+				mm_memory_cache_local_free(&cache, data[k]);
+			data[k] = allocate(&cache, sizes[rand_r(&seed) % nsizes]);
+		}
+		if (round == 4)
+			footprint = mm_memory_cache_footprint(&cache);
+	}
+	if (mm_memory_cache_footprint(&cache) > footprint + footprint / 2) {
+		fail = 1;
+		fprintf(stderr, "freed chunks are not reused: footprint %zu vs %zu\n",
+			mm_memory_cache_footprint(&cache), footprint);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (data[i] != NULL)
+			mm_memory_cache_local_free(&cache, data[i]);
+	}
+	free(data);
+
+	mm_memory_cache_cleanup(&cache);
+}
+
 int
 main()
 {
@@ -92,6 +178,10 @@ main()
 	test_alloc("small allocation case", 16);
 	test_alloc_2("small allocation case 2", 16);
 
+	test_round_size("size rounding case");
+	test_footprint("footprint case");
+	test_mixed_reuse("mixed chunk reuse case");
+
 	printf("finished\n");
 
 	return fail ? EXIT_FAILURE : EXIT_SUCCESS;